@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete with versions that count the heap allocations of the process, and the bytes they ask for.
+// It defines the replacements, so include it in exactly one translation unit of a benchmark. Over-aligned allocations are not counted.
+
+#if defined(_MSC_VER)
+#define ALLOCATION_COUNTER_NOINLINE __declspec(noinline)
+#else
+#define ALLOCATION_COUNTER_NOINLINE __attribute__((noinline))
+#endif
+
+namespace
+{
+	std::atomic<size_t> allocationCount(0);
+	std::atomic<size_t> allocatedBytes(0);
+}
+
+void *operator new(size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	void *p = std::malloc(size > 0 ? size : 1);
+	if (p == nullptr)
+		throw std::bad_alloc();
+	return p;
+}
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	return std::malloc(size > 0 ? size : 1);
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+
+// The compiler knows what operator new returns, but not that it comes from malloc. If a delete was inlined into its caller, the call to free would look
+// like it frees memory from operator new, and -Wmismatched-new-delete would complain.
+ALLOCATION_COUNTER_NOINLINE void operator delete(void *p) noexcept { std::free(p); }
+ALLOCATION_COUNTER_NOINLINE void operator delete(void *p, size_t) noexcept { std::free(p); }
+ALLOCATION_COUNTER_NOINLINE void operator delete(void *p, const std::nothrow_t&) noexcept { std::free(p); }
+ALLOCATION_COUNTER_NOINLINE void operator delete[](void *p) noexcept { std::free(p); }
+ALLOCATION_COUNTER_NOINLINE void operator delete[](void *p, size_t) noexcept { std::free(p); }
+ALLOCATION_COUNTER_NOINLINE void operator delete[](void *p, const std::nothrow_t&) noexcept { std::free(p); }
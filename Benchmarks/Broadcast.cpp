@@ -0,0 +1,305 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketServer.h"
+#include "../src/CWebSocketGroup.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+// Measures fanning a message out from a CWebSocketServer to 100 to 10000 subscribers, in nanoseconds and heap allocations per subscriber, three ways:
+// SendBinary with a copy for every subscriber, SendBinary with a CWebSocketSharedBuffer referenced by every subscriber, which each frame themselves,
+// and CWebSocketGroup::BroadcastBinary, which frames the message once and has every subscriber write the same frame.
+// The time runs from the first send until every subscriber has received the message. The receiving clients run in a child process, forked before any
+// thread starts, so that each process only needs one descriptor per subscriber; subscriber counts beyond the descriptor limit are skipped. The allocations
+// are counted in each process: the server process only sends while measuring, so its allocations are those of the sending side, and the client process's
+// those of receiving. The clients spread over several loopback addresses, so that the ephemeral ports don't run out.
+
+namespace
+{
+	const size_t SubscriberCounts[] = { 100, 1000, 10000 };
+	const size_t ConnectionsPerAddress = 20000;
+	const size_t MessageLength = 1024;
+	const size_t Rounds = 20;
+
+	// The server process drives the client process with commands over a socket pair. Every command and reply is a few uint64_t values.
+	const uint64_t CommandOpen = 1; // { CommandOpen, count }: connect count clients. Replied with { opened, failed }.
+	const uint64_t CommandClose = 2; // { CommandClose, 0 }: close the clients. Replied with { closed, 0 } once they all have.
+	// Every time the clients have received another message each, the client process sends { received, allocations }, the number of messages
+	// received so far by all clients, and its allocation count.
+
+	bool WriteValues(int fd, const uint64_t *values, size_t count)
+	{
+		const BYTE *data = (const BYTE*)values;
+		size_t length = count * sizeof(uint64_t);
+		while (length > 0)
+		{
+			const ssize_t r = write(fd, data, length);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return false;
+			data += r;
+			length -= r;
+		}
+		return true;
+	}
+
+	bool ReadValues(int fd, uint64_t *values, size_t count, chrono::seconds timeout)
+	{
+		BYTE *data = (BYTE*)values;
+		size_t length = count * sizeof(uint64_t);
+		const auto deadline = chrono::steady_clock::now() + timeout;
+		while (length > 0)
+		{
+			const auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+			pollfd p = { fd, POLLIN, 0 };
+			if (left <= 0 || poll(&p, 1, (int)left) == 0)
+				return false;
+			const ssize_t r = read(fd, data, length);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return false;
+			data += r;
+			length -= r;
+		}
+		return true;
+	}
+
+	bool WaitFor(const atomic<size_t> &counter, size_t count, chrono::seconds timeout)
+	{
+		const auto deadline = chrono::steady_clock::now() + timeout;
+		while (counter.load(memory_order_acquire) < count)
+		{
+			if (chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::yield();
+		}
+		return true;
+	}
+
+	// The client process. Reads the port of the server from fd, and then runs the commands of the server process until it closes fd.
+	int RunClients(int fd, size_t loopCount)
+	{
+		uint64_t port;
+		if (ReadValues(fd, &port, 1, chrono::seconds(60)) == false)
+			return 1;
+		CWebSocketReactor clientReactor;
+		if (clientReactor.Initialize(loopCount) == false)
+			return 1;
+		atomic<size_t> opened(0), failed(0), received(0), closed(0);
+		atomic<size_t> subscriberCount(1);
+		vector<CWebSocket*> clients;
+		for (;;)
+		{
+			uint64_t command[2];
+			if (ReadValues(fd, command, 2, chrono::seconds(3600)) == false)
+				break;
+			if (command[0] == CommandOpen)
+			{
+				const size_t count = (size_t)command[1];
+				opened = 0;
+				failed = 0;
+				received = 0;
+				closed = 0;
+				subscriberCount = count;
+				for (size_t i = 0; i < count; i++)
+				{
+					CWebSocket *ws = new CWebSocket();
+					const wstring address = L"127.0.0." + to_wstring(1 + i / ConnectionsPerAddress);
+					ws->Initialize(address.c_str(), (INTERNET_PORT)port, L"/", false, &clientReactor);
+					ws->SetReceiveBuffer({ 4096, true, 1048576 });
+					ws->onOpen([&opened]() { opened.fetch_add(1, memory_order_release); })
+						.onBinaryMessage([&received, &subscriberCount, fd](const BYTE*, size_t) {
+							const size_t total = received.fetch_add(1, memory_order_acq_rel) + 1;
+							if (total % subscriberCount.load(memory_order_relaxed) == 0)
+							{
+								const uint64_t reply[2] = { total, allocationCount.load(memory_order_relaxed) };
+								WriteValues(fd, reply, 2);
+							}
+						})
+						.onClosed([&closed]() { closed.fetch_add(1, memory_order_release); })
+						.onError([&failed, &closed]() { failed.fetch_add(1, memory_order_relaxed); closed.fetch_add(1, memory_order_release); })
+						.Connect();
+					clients.push_back(ws);
+				}
+				WaitFor(opened, count, chrono::seconds(120));
+				const uint64_t reply[2] = { opened.load(), failed.load() };
+				WriteValues(fd, reply, 2);
+			}
+			else if (command[0] == CommandClose)
+			{
+				for (auto ws : clients)
+					ws->Close();
+				WaitFor(closed, clients.size(), chrono::seconds(60));
+				for (auto ws : clients)
+					delete ws;
+				clients.clear();
+				const uint64_t reply[2] = { closed.load(), 0 };
+				WriteValues(fd, reply, 2);
+			}
+		}
+		return 0;
+	}
+
+	// The server process. Serves the clients of the client process at the other end of fd.
+	int RunServer(int fd, size_t loopCount, size_t maxConnections, const rlimit &limit)
+	{
+		CWebSocketReactor serverReactor;
+		if (serverReactor.Initialize(loopCount) == false)
+			return 1;
+
+		CWebSocketGroup group;
+		mutex subscribersMutex;
+		vector<CWebSocket*> subscribers; // The server ends, in the same order as the group.
+		atomic<size_t> serverClosed(0);
+		const auto unsubscribe = [&](CWebSocket *ws) {
+			{
+				lock_guard<mutex> lock(subscribersMutex);
+				subscribers.erase(remove(subscribers.begin(), subscribers.end(), ws), subscribers.end());
+			}
+			group.Remove(ws);
+			serverClosed.fetch_add(1, memory_order_release);
+			CWebSocketServer::Release(ws);
+		};
+		CWebSocketServer server;
+		const bool initialized = server.Initialize(0, &serverReactor, [&](CWebSocket *ws) {
+			ws->onOpen([&, ws]() {
+				lock_guard<mutex> lock(subscribersMutex);
+				subscribers.push_back(ws);
+				group.Add(ws);
+			})
+				.onClosed([&unsubscribe, ws]() { unsubscribe(ws); })
+				.onError([&unsubscribe, ws]() { unsubscribe(ws); });
+			return true;
+		});
+		const uint64_t port = initialized ? server.Port() : 0;
+		if (initialized == false || WriteValues(fd, &port, 1) == false)
+			return 1;
+
+		cout << setw(8) << "subs" << setw(28) << "" << setw(16) << "ns/subscriber" << setw(20) << "sender allocs/sub" << setw(22) << "receiver allocs/sub" << endl;
+		const vector<BYTE> payload(MessageLength, 'a');
+		size_t closedSoFar = 0;
+		for (const size_t count : SubscriberCounts)
+		{
+			if (count > maxConnections)
+			{
+				cout << setw(8) << count << "  skipped: the descriptor limit is " << limit.rlim_cur << endl;
+				continue;
+			}
+			const uint64_t open[2] = { CommandOpen, count };
+			uint64_t openReply[2] = { 0, 0 };
+			if (WriteValues(fd, open, 2) == false || ReadValues(fd, openReply, 2, chrono::seconds(180)) == false)
+				return 1;
+			const auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+			while (group.Size() < count && chrono::steady_clock::now() < deadline)
+				this_thread::sleep_for(chrono::milliseconds(1));
+			if (openReply[0] < count || group.Size() < count)
+				cout << setw(8) << count << "  only " << openReply[0] << " connections opened, " << openReply[1] << " failed" << endl;
+			else
+			{
+				vector<CWebSocket*> servers;
+				{
+					lock_guard<mutex> lock(subscribersMutex);
+					servers = subscribers;
+				}
+				const CWebSocketSharedBuffer shared(CWebSocketBufferPool::Default()->Copy(payload.data(), payload.size()));
+				// Runs send Rounds times after an untimed round, waiting for every subscriber to receive each message, and prints the time per subscriber, and the
+				// allocations per subscriber of each process.
+				const auto measure = [&](const char *name, const function<void()> &send) {
+					uint64_t before[2], after[2];
+					send();
+					if (ReadValues(fd, before, 2, chrono::seconds(60)) == false)
+						return false;
+					const size_t allocations = allocationCount.load(memory_order_relaxed);
+					const auto start = chrono::steady_clock::now();
+					for (size_t round = 0; round < Rounds; round++)
+					{
+						send();
+						if (ReadValues(fd, after, 2, chrono::seconds(60)) == false)
+							return false;
+					}
+					const double ns = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+					const double sent = (double)(allocationCount.load(memory_order_relaxed) - allocations);
+					const double received = (double)(after[1] - before[1]);
+					cout << setw(8) << count << "  " << setw(26) << left << name << right << setw(16) << fixed << setprecision(1) << ns / (Rounds * count)
+						<< setw(20) << setprecision(2) << sent / (Rounds * count) << setw(22) << received / (Rounds * count) << endl;
+					return true;
+				};
+				const bool measured =
+					measure("SendBinary, copy", [&]() {
+						for (auto ws : servers)
+							ws->SendBinary(payload.data(), payload.size());
+					}) &&
+					measure("SendBinary, shared buffer", [&]() {
+						for (auto ws : servers)
+							ws->SendBinary(shared);
+					}) &&
+					measure("group broadcast", [&]() { group.BroadcastBinary(payload.data(), payload.size()); });
+				if (measured == false)
+				{
+					cout << setw(8) << count << "  timed out waiting for the subscribers to receive" << endl;
+					return 1;
+				}
+			}
+			const uint64_t close[2] = { CommandClose, 0 };
+			uint64_t closeReply[2];
+			if (WriteValues(fd, close, 2) == false || ReadValues(fd, closeReply, 2, chrono::seconds(120)) == false)
+				return 1;
+			closedSoFar += count;
+			WaitFor(serverClosed, closedSoFar, chrono::seconds(10));
+		}
+		return 0;
+	}
+}
+
+int main()
+{
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	const size_t maxConnections = (limit.rlim_cur > 256) ? (size_t)(limit.rlim_cur - 256) : 0;
+	const size_t loopCount = max<size_t>(1, thread::hardware_concurrency() / 2);
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+		return 1;
+	const pid_t child = fork();
+	if (child < 0)
+		return 1;
+	if (child == 0)
+	{
+		close(fds[0]);
+		const int result = RunClients(fds[1], loopCount);
+		close(fds[1]);
+		return result;
+	}
+	close(fds[1]);
+	const int result = RunServer(fds[0], loopCount, maxConnections, limit);
+	close(fds[0]); // Lets the client process finish.
+	int status = 0;
+	waitpid(child, &status, 0);
+	return (result != 0) ? result : ((WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1);
+}
+
+#endif
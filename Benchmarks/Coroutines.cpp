@@ -0,0 +1,178 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <coroutine>
+#include <cstdlib>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketServer.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+// Compares the callbacks with the coroutine operations of CWebSocket, on 100 websockets pinned to a reactor that each do a number of round trips to an
+// echo server in the same process, one at a time: the callback version sends the next message from onBinaryMessage, and the coroutine version loops over
+// co_await Send and co_await Receive. The benchmark reports the round trips per second, and the heap allocations per round trip of the whole process,
+// which includes the echo server. Needs C++20.
+
+namespace
+{
+	const size_t ConnectionCount = 100;
+	const size_t MessageLength = 64;
+	const size_t RoundTrips = 2000; // Per connection.
+
+	// A coroutine that starts right away and destroys itself when it returns.
+	struct Task
+	{
+		struct promise_type
+		{
+			Task get_return_object() { return Task(); }
+			suspend_never initial_suspend() { return suspend_never(); }
+			suspend_never final_suspend() noexcept { return suspend_never(); }
+			void return_void() {}
+			void unhandled_exception() { abort(); }
+		};
+	};
+
+	bool WaitFor(const atomic<size_t> &counter, size_t count, chrono::seconds timeout)
+	{
+		const auto deadline = chrono::steady_clock::now() + timeout;
+		while (counter.load(memory_order_acquire) < count)
+		{
+			if (chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::sleep_for(chrono::microseconds(100));
+		}
+		return true;
+	}
+
+	// Suspends the coroutine once its connection has opened, until the main thread resumes it to start the measurement.
+	struct Park
+	{
+		coroutine_handle<> *slot;
+		atomic<size_t> *parked;
+		bool await_ready() { return false; }
+		void await_suspend(coroutine_handle<> handle)
+		{
+			*slot = handle;
+			parked->fetch_add(1, memory_order_release);
+		}
+		void await_resume() {}
+	};
+
+	// Does the round trips of one websocket, and counts the websocket into done once they are over.
+	Task RoundTripsOf(CWebSocket *ws, const CWebSocketSharedBuffer &payload, coroutine_handle<> *slot, atomic<size_t> &parked, atomic<size_t> &done)
+	{
+		if (co_await ws->Connect() == false)
+			co_return;
+		co_await Park{ slot, &parked };
+		for (size_t i = 0; i < RoundTrips; i++)
+		{
+			if (co_await ws->Send(payload) == false)
+				co_return;
+			if ((co_await ws->Receive()).closed)
+				co_return;
+		}
+		done.fetch_add(1, memory_order_release);
+	}
+
+	void Print(const char *name, double seconds, size_t allocations)
+	{
+		const double roundTrips = (double)(ConnectionCount * RoundTrips);
+		cout << setw(12) << name << setw(16) << fixed << setprecision(0) << roundTrips / seconds << setw(18) << setprecision(3) << allocations / roundTrips << endl;
+	}
+}
+
+int main()
+{
+	const size_t loopCount = max<size_t>(1, thread::hardware_concurrency() / 2);
+	CWebSocketReactor serverReactor;
+	CWebSocketReactor clientReactor;
+	if (serverReactor.Initialize(loopCount) == false || clientReactor.Initialize(loopCount) == false)
+		return 1;
+	CWebSocketServer server;
+	const bool initialized = server.Initialize(0, &serverReactor, [](CWebSocket *ws) {
+		ws->onBinaryMessage([ws](const BYTE *message, size_t length) { ws->SendBinary(message, length); })
+			.onClosed([ws]() { CWebSocketServer::Release(ws); })
+			.onError([ws]() { CWebSocketServer::Release(ws); });
+		return true;
+	});
+	if (initialized == false)
+		return 1;
+
+	const vector<BYTE> bytes(MessageLength, 'a');
+	const CWebSocketSharedBuffer payload(CWebSocketBufferPool::Default()->Copy(bytes.data(), bytes.size()));
+	cout << setw(12) << "" << setw(16) << "round trips/s" << setw(18) << "allocs/round trip" << endl;
+
+	{
+		atomic<size_t> opened(0), done(0), closed(0);
+		vector<CWebSocket*> clients;
+		vector<size_t> remaining(ConnectionCount, RoundTrips);
+		for (size_t i = 0; i < ConnectionCount; i++)
+		{
+			CWebSocket *ws = new CWebSocket();
+			ws->Initialize(L"127.0.0.1", server.Port(), L"/", false, &clientReactor);
+			ws->onOpen([&opened]() { opened.fetch_add(1, memory_order_release); })
+				.onBinaryMessage([ws, &payload, &remaining, &done, i](const BYTE*, size_t) {
+					if (--remaining[i] == 0)
+						done.fetch_add(1, memory_order_release);
+					else
+						ws->SendBinary(payload);
+				})
+				.onClosed([&closed]() { closed.fetch_add(1, memory_order_release); })
+				.onError([&closed]() { closed.fetch_add(1, memory_order_release); })
+				.Connect();
+			clients.push_back(ws);
+		}
+		if (WaitFor(opened, ConnectionCount, chrono::seconds(30)) == false)
+			return 1;
+		const size_t allocations = allocationCount.load(memory_order_relaxed);
+		const auto start = chrono::steady_clock::now();
+		for (auto ws : clients)
+			ws->SendBinary(payload);
+		WaitFor(done, ConnectionCount, chrono::seconds(120));
+		Print("callbacks", chrono::duration<double>(chrono::steady_clock::now() - start).count(), allocationCount.load(memory_order_relaxed) - allocations);
+		for (auto ws : clients)
+			ws->Close();
+		WaitFor(closed, ConnectionCount, chrono::seconds(30));
+		for (auto ws : clients)
+			delete ws;
+	}
+
+	{
+		atomic<size_t> parked(0), done(0), closed(0);
+		vector<coroutine_handle<>> slots(ConnectionCount);
+		vector<CWebSocket*> clients;
+		for (size_t i = 0; i < ConnectionCount; i++)
+		{
+			CWebSocket *ws = new CWebSocket();
+			ws->Initialize(L"127.0.0.1", server.Port(), L"/", false, &clientReactor);
+			ws->onClosed([&closed]() { closed.fetch_add(1, memory_order_release); })
+				.onError([&closed]() { closed.fetch_add(1, memory_order_release); });
+			RoundTripsOf(ws, payload, &slots[i], parked, done);
+			clients.push_back(ws);
+		}
+		if (WaitFor(parked, ConnectionCount, chrono::seconds(30)) == false)
+			return 1;
+		const size_t allocations = allocationCount.load(memory_order_relaxed);
+		const auto start = chrono::steady_clock::now();
+		for (auto slot : slots)
+			slot.resume(); // Runs until the first Send suspends. The coroutines are resumed on the loops from then on.
+		WaitFor(done, ConnectionCount, chrono::seconds(120));
+		Print("coroutines", chrono::duration<double>(chrono::steady_clock::now() - start).count(), allocationCount.load(memory_order_relaxed) - allocations);
+		for (auto ws : clients)
+			ws->Close();
+		WaitFor(closed, ConnectionCount, chrono::seconds(30));
+		for (auto ws : clients)
+			delete ws;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "../src/CWebSocketEncodingHelpers.h"
+
+using namespace std;
+using namespace cwebsocketinternal;
+
+// Measures UTF8ToUnicode and UnicodeToUTF8 on JSON payloads that are mostly ASCII, and on JSON payloads that are mostly CJK text.
+
+namespace
+{
+	// Builds a JSON array of records of about length bytes, whose string values are made of the given characters.
+	wstring MakeJSON(size_t length, const wstring &text)
+	{
+		wstring json = L"[";
+		for (int id = 0; json.size() < length; id++)
+		{
+			if (id > 0)
+				json += L",";
+			json += L"{\"id\":" + to_wstring(id) + L",\"name\":\"" + text + L"\",\"active\":true,\"tags\":[\"" + text.substr(0, 4) + L"\",\"x\"]}";
+		}
+		return json + L"]";
+	}
+
+	void Measure(const char *name, const wstring &json)
+	{
+		vector<BYTE> UTF8String;
+		UnicodeToUTF8(json.c_str(), UTF8String);
+		const size_t iterations = max<size_t>(1, (256 * 1024 * 1024) / UTF8String.size());
+
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++)
+		{
+			PWSTR unicodeString = UTF8ToUnicode(UTF8String.data(), UTF8String.size());
+			delete[] unicodeString;
+		}
+		const chrono::duration<double> decode = chrono::steady_clock::now() - start;
+
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < iterations; i++)
+			UnicodeToUTF8(json.c_str(), UTF8String);
+		const chrono::duration<double> encode = chrono::steady_clock::now() - start;
+
+		const double megabytes = (double)(iterations * UTF8String.size()) / 1e6;
+		cout << setw(12) << name << setw(10) << UTF8String.size()
+			<< setw(16) << fixed << setprecision(0) << megabytes / decode.count()
+			<< setw(16) << megabytes / encode.count() << endl;
+	}
+}
+
+int main()
+{
+	const wstring ascii = L"The quick brown fox jumps over the lazy dog";
+	const wstring cjk = L"東京都渋谷区神南一丁目テストユーザー한국어";
+
+	cout << setw(12) << "payload" << setw(10) << "bytes" << setw(16) << "UTF8ToUnicode" << setw(16) << "UnicodeToUTF8" << "   (MB/s of UTF-8)" << endl;
+	const size_t sizes[] = { 256, 4096, 65536, 1048576 };
+	for (size_t size : sizes)
+	{
+		Measure("ascii-json", MakeJSON(size, ascii));
+		Measure("cjk-json", MakeJSON(size / 2, cjk));
+	}
+	return 0;
+}
+
+#endif
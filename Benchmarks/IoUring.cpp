@@ -0,0 +1,157 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/resource.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketServer.h"
+
+using namespace std;
+
+// Compares the reactor backends: epoll, io_uring, and io_uring with a kernel thread polling the submission queue. For 1000 and 10000 connections,
+// websockets on a client reactor connect to an echo server in the same process, both using the backend measured, and every connection sends a 64 byte
+// message and waits for its echo, for a number of rounds. The benchmark reports the echoes per second and the CPU time per echo, user and system together,
+// which covers both ends and, with sqpoll, the polling threads. Both ends of every connection are in this process, so connection counts beyond half
+// the descriptor limit are skipped. The clients spread over several loopback addresses, so that the ephemeral ports don't run out.
+
+namespace
+{
+	const size_t ConnectionCounts[] = { 1000, 10000 };
+	const size_t ConnectionsPerAddress = 20000;
+	const size_t MessageLength = 64;
+	const size_t Rounds = 20;
+
+	struct Backend
+	{
+		const char *name;
+		CWebSocketReactorBackend backend;
+		bool sqpoll;
+	};
+
+	const Backend Backends[] = {
+		{ "epoll", CWebSocketReactorBackend::Epoll, false },
+		{ "io_uring", CWebSocketReactorBackend::IoUring, false },
+		{ "io_uring+sqpoll", CWebSocketReactorBackend::IoUring, true },
+	};
+
+	bool WaitFor(const atomic<size_t> &counter, size_t count, chrono::seconds timeout)
+	{
+		const auto deadline = chrono::steady_clock::now() + timeout;
+		while (counter.load(memory_order_acquire) < count)
+		{
+			if (chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::sleep_for(chrono::microseconds(100));
+		}
+		return true;
+	}
+
+	double CpuSeconds()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	}
+}
+
+int main()
+{
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	const size_t maxConnections = (limit.rlim_cur > 256) ? (size_t)(limit.rlim_cur - 256) / 2 : 0;
+
+	cout << setw(8) << "conns" << setw(18) << "backend" << setw(14) << "echoes/s" << setw(14) << "CPU us/echo" << endl;
+	const vector<BYTE> payload(MessageLength, 'a');
+	for (const size_t count : ConnectionCounts)
+	{
+		if (count > maxConnections)
+		{
+			cout << setw(8) << count << "  skipped: the descriptor limit is " << limit.rlim_cur << endl;
+			continue;
+		}
+		for (const Backend &backend : Backends)
+		{
+			CWebSocketReactorOptions options;
+			options.loopCount = max<size_t>(1, thread::hardware_concurrency() / 2);
+			options.backend = backend.backend;
+			options.sqpoll = backend.sqpoll;
+			CWebSocketReactor serverReactor;
+			CWebSocketReactor clientReactor;
+			if (serverReactor.Initialize(options) == false || clientReactor.Initialize(options) == false)
+				return 1;
+			if (serverReactor.Backend() != backend.backend || clientReactor.Backend() != backend.backend)
+			{
+				cout << setw(8) << count << setw(18) << backend.name << "  skipped: io_uring is unavailable" << endl;
+				continue;
+			}
+
+			atomic<size_t> serverClosed(0);
+			CWebSocketServer server;
+			const bool initialized = server.Initialize(0, &serverReactor, [&serverClosed](CWebSocket *ws) {
+				ws->onBinaryMessage([ws](const BYTE *message, size_t length) { ws->SendBinary(message, length); })
+					.onClosed([ws, &serverClosed]() { serverClosed.fetch_add(1, memory_order_release); CWebSocketServer::Release(ws); })
+					.onError([ws, &serverClosed]() { serverClosed.fetch_add(1, memory_order_release); CWebSocketServer::Release(ws); });
+				return true;
+			});
+			if (initialized == false)
+				return 1;
+
+			atomic<size_t> opened(0), failed(0), echoed(0), closed(0);
+			vector<CWebSocket*> clients;
+			for (size_t i = 0; i < count; i++)
+			{
+				CWebSocket *ws = new CWebSocket();
+				const wstring address = L"127.0.0." + to_wstring(1 + i / ConnectionsPerAddress);
+				ws->Initialize(address.c_str(), server.Port(), L"/", false, &clientReactor);
+				ws->onOpen([&opened]() { opened.fetch_add(1, memory_order_release); })
+					.onBinaryMessage([&echoed](const BYTE*, size_t) { echoed.fetch_add(1, memory_order_release); })
+					.onClosed([&closed]() { closed.fetch_add(1, memory_order_release); })
+					.onError([&failed, &closed]() { failed.fetch_add(1, memory_order_relaxed); closed.fetch_add(1, memory_order_release); })
+					.Connect();
+				clients.push_back(ws);
+			}
+			if (WaitFor(opened, count, chrono::seconds(120)) == false)
+				cout << setw(8) << count << setw(18) << backend.name << "  only " << opened.load() << " connections opened, " << failed.load() << " failed" << endl;
+			else
+			{
+				// An untimed round first, so that every connection has its buffers.
+				for (auto ws : clients)
+					ws->SendBinary(payload.data(), payload.size());
+				WaitFor(echoed, count, chrono::seconds(60));
+				const double cpuStart = CpuSeconds();
+				const auto start = chrono::steady_clock::now();
+				for (size_t round = 1; round <= Rounds; round++)
+				{
+					for (auto ws : clients)
+						ws->SendBinary(payload.data(), payload.size());
+					WaitFor(echoed, (round + 1) * count, chrono::seconds(60));
+				}
+				const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+				const double cpu = CpuSeconds() - cpuStart;
+				const double echoes = (double)(echoed.load() - count);
+				cout << setw(8) << count << setw(18) << backend.name << setw(14) << fixed << setprecision(0) << echoes / seconds
+					<< setw(14) << setprecision(2) << cpu * 1e6 / echoes << endl;
+			}
+			for (auto ws : clients)
+				ws->Close();
+			WaitFor(closed, count, chrono::seconds(60));
+			for (auto ws : clients)
+				delete ws;
+			WaitFor(serverClosed, count, chrono::seconds(10));
+		}
+	}
+	return 0;
+}
+
+#endif
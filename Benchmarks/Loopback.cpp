@@ -0,0 +1,467 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketFrameCodec.h"
+#include "../src/CWebSocketHandshakeHelpers.h"
+
+using namespace std;
+using namespace cwebsocketinternal;
+
+// Measures CWebSocket end to end over loopback, against a server that runs in this process on epoll threads of its own.
+// latency: one connection sends a message, waits for the server to echo it back, and sends the next one, for binary and text messages of 16 B to 16 MB.
+// throughput: one connection keeps up to WindowMessages messages (and no more than WindowBytes bytes) in flight to a sink, which acknowledges
+// every message with an empty one, for the same sizes.
+// connections: 1 to 10000 connections on a CWebSocketReactor each keep one 64 byte binary message in flight to the echo server.
+// Every run reports messages per second, MB/s of payload sent, and the p50, p99 and p99.9 times from sending a message until its echo or acknowledgement arrived.
+// A JSON object per run is printed on stdout, so that results can be compared between releases; a table is printed on stderr.
+// Pass --quick for shorter runs. Both ends of every connection are in this process, so connection counts beyond half the descriptor limit are skipped.
+
+namespace
+{
+	const size_t MessageSizes[] = { 16, 256, 4096, 65536, 1048576, 16777216 };
+	const size_t ConnectionCounts[] = { 1, 10, 100, 1000, 10000 };
+	const size_t ConnectionsMessageSize = 64;
+	const size_t WindowMessages = 64;
+	const size_t WindowBytes = 32 * 1048576;
+	const size_t MinMessagesPerRun = 4;
+	const size_t ServerReadLength = 262144;
+	const size_t ServerBacklogLimit = 4 * 1048576; // The server stops reading from a connection while this many bytes wait to be written to it.
+
+	// A websocket server with one epoll loop per thread. Connections to /echo get every message echoed back, frame by frame.
+	// Connections to /sink get every message acknowledged with an empty message of the same type once it has arrived completely.
+	class LoopbackServer
+	{
+	private:
+		struct Connection
+		{
+			int fd;
+			bool upgraded;
+			bool sink;
+			bool closing; // The close frame has been echoed. The connection closes once everything has been written.
+			string request;
+			CWebSocketFrameParser parser;
+			vector<BYTE> out;
+			size_t outOffset;
+			Connection(int fd) : fd(fd), upgraded(false), sink(false), closing(false), parser(true), outOffset(0) {}
+		};
+
+		int _listener;
+		int _stop; // An eventfd that wakes all loops up when the server is destructed.
+		vector<thread> _threads;
+	public:
+		INTERNET_PORT port;
+	private:
+		static void _AppendFrame(Connection &c, bool fin, BYTE opcode, const BYTE *payload, size_t length)
+		{
+			BYTE header[MaxFrameHeaderLength];
+			const size_t headerLength = WriteFrameHeader(header, fin, opcode, length, nullptr);
+			c.out.insert(c.out.end(), header, header + headerLength);
+			c.out.insert(c.out.end(), payload, payload + length);
+		}
+
+		// Returns false if the connection is to be closed.
+		static bool _Process(Connection &c, BYTE *data, size_t length)
+		{
+			if (c.upgraded == false)
+			{
+				c.request.append((const char*)data, length);
+				const size_t end = c.request.find("\r\n\r\n");
+				if (end == string::npos)
+					return c.request.size() < 16384;
+				const size_t keyBegin = c.request.find("Sec-WebSocket-Key: ");
+				if (keyBegin == string::npos)
+					return false;
+				const string key = c.request.substr(keyBegin + 19, c.request.find("\r\n", keyBegin) - keyBegin - 19);
+				const string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ComputeWebSocketAccept(key) + "\r\n\r\n";
+				c.out.insert(c.out.end(), response.begin(), response.end());
+				c.upgraded = true;
+				c.sink = c.request.compare(0, 10, "GET /sink ") == 0;
+				vector<BYTE> rest(c.request.begin() + end + 4, c.request.end());
+				c.request.clear();
+				return rest.size() == 0 || _Process(c, rest.data(), rest.size());
+			}
+			size_t offset = 0;
+			while (offset < length && c.closing == false)
+			{
+				CWebSocketFrameChunk chunk;
+				offset += c.parser.Parse(data + offset, length - offset, SIZE_MAX, chunk);
+				if (chunk.type == CWebSocketFrameChunkType::Data)
+				{
+					if (c.sink == false)
+						_AppendFrame(c, chunk.messageEnd, chunk.messageStart ? chunk.opcode : OpcodeContinuation, chunk.payload, chunk.length);
+					else if (chunk.messageEnd)
+						_AppendFrame(c, true, chunk.opcode, nullptr, 0);
+				}
+				else if (chunk.type == CWebSocketFrameChunkType::Control)
+				{
+					if (chunk.opcode == OpcodeClose)
+					{
+						_AppendFrame(c, true, OpcodeClose, chunk.payload, min<size_t>(chunk.length, 2));
+						c.closing = true;
+					}
+					else if (chunk.opcode == OpcodePing)
+						_AppendFrame(c, true, OpcodePong, chunk.payload, chunk.length);
+				}
+				else if (chunk.type == CWebSocketFrameChunkType::Error)
+					return false;
+			}
+			return true;
+		}
+
+		// Writes as much of the output as the socket takes. Returns false if the connection is to be closed.
+		static bool _Flush(Connection &c)
+		{
+			while (c.outOffset < c.out.size())
+			{
+				const ssize_t written = send(c.fd, c.out.data() + c.outOffset, c.out.size() - c.outOffset, MSG_NOSIGNAL);
+				if (written < 0)
+					return errno == EAGAIN || errno == EWOULDBLOCK;
+				c.outOffset += written;
+			}
+			c.out.clear();
+			c.outOffset = 0;
+			return c.closing == false;
+		}
+
+		// Reads and writes until the socket would block, or the output backlog is too long to read more. Returns false if the connection is to be closed.
+		static bool _Service(Connection &c, vector<BYTE> &buffer)
+		{
+			for (;;)
+			{
+				if (_Flush(c) == false)
+					return false;
+				if (c.out.size() - c.outOffset > ServerBacklogLimit)
+					return true; // Resumes reading on EPOLLOUT.
+				const ssize_t r = recv(c.fd, buffer.data(), buffer.size(), 0);
+				if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+					return false;
+				if (r < 0)
+					return true;
+				if (_Process(c, buffer.data(), r) == false)
+					return false;
+			}
+		}
+
+		void _Run()
+		{
+			const int epoll = epoll_create1(EPOLL_CLOEXEC);
+			epoll_event e;
+			e.events = EPOLLIN | EPOLLEXCLUSIVE;
+			e.data.ptr = &_listener;
+			epoll_ctl(epoll, EPOLL_CTL_ADD, _listener, &e);
+			e.events = EPOLLIN;
+			e.data.ptr = &_stop;
+			epoll_ctl(epoll, EPOLL_CTL_ADD, _stop, &e);
+			unordered_set<Connection*> connections;
+			vector<BYTE> buffer(ServerReadLength);
+			epoll_event events[256];
+			for (bool stopping = false; stopping == false;)
+			{
+				const int count = epoll_wait(epoll, events, 256, -1);
+				for (int i = 0; i < count; i++)
+				{
+					if (events[i].data.ptr == &_stop)
+						stopping = true;
+					else if (events[i].data.ptr == &_listener)
+					{
+						for (;;)
+						{
+							const int fd = accept4(_listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+							if (fd == -1)
+								break;
+							int one = 1;
+							setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+							Connection *c = new Connection(fd);
+							connections.insert(c);
+							e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+							e.data.ptr = c;
+							epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &e);
+						}
+					}
+					else
+					{
+						Connection *c = (Connection*)events[i].data.ptr;
+						if (_Service(*c, buffer) == false)
+						{
+							close(c->fd);
+							connections.erase(c);
+							delete c;
+						}
+					}
+				}
+			}
+			for (Connection *c : connections)
+			{
+				close(c->fd);
+				delete c;
+			}
+			close(epoll);
+		}
+
+	public:
+		explicit LoopbackServer(size_t threadCount)
+		{
+			_listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			_stop = eventfd(0, EFD_CLOEXEC);
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t addressLength = sizeof(address);
+			bind(_listener, (sockaddr*)&address, sizeof(address));
+			listen(_listener, SOMAXCONN);
+			getsockname(_listener, (sockaddr*)&address, &addressLength);
+			port = ntohs(address.sin_port);
+			for (size_t i = 0; i < threadCount; i++)
+				_threads.push_back(thread(&LoopbackServer::_Run, this));
+		}
+		~LoopbackServer()
+		{
+			const uint64_t one = 1;
+			if (write(_stop, &one, sizeof(one)) < 0)
+				abort();
+			for (auto &t : _threads)
+				t.join();
+			close(_listener);
+			close(_stop);
+		}
+	};
+
+	struct RunOptions
+	{
+		const char *benchmark;
+		const WCHAR *path;
+		bool text;
+		size_t messageSize;
+		size_t connectionCount;
+		size_t window; // Messages kept in flight per connection.
+		double seconds;
+	};
+
+	struct RunResult
+	{
+		bool ok;
+		size_t messages;
+		double seconds;
+		vector<float> roundTripsus;
+	};
+
+	// The state shared by the connections of a run.
+	struct Run
+	{
+		const RunOptions &options;
+		vector<BYTE> payload;
+		atomic<bool> stopping;
+		atomic<size_t> opened;
+		atomic<size_t> failed;
+		atomic<size_t> completed;
+		atomic<size_t> outstanding;
+		Run(const RunOptions &options) : options(options), payload(options.messageSize, 'a'), stopping(false), opened(0), failed(0), completed(0), outstanding(0) {}
+	};
+
+	// A connection of a run. Its callbacks only run one at a time, so the samples need no lock; the send times are also pushed by the main thread.
+	class Client
+	{
+	private:
+		Run &_run;
+		mutex _mutex;
+		deque<chrono::steady_clock::time_point> _sentAt;
+	public:
+		CWebSocket ws;
+		vector<float> roundTripsus;
+	private:
+		void _OnMessage()
+		{
+			chrono::steady_clock::time_point sentAt;
+			{
+				lock_guard<mutex> lock(_mutex);
+				sentAt = _sentAt.front();
+				_sentAt.pop_front();
+			}
+			roundTripsus.push_back(chrono::duration<float, micro>(chrono::steady_clock::now() - sentAt).count());
+			_run.completed.fetch_add(1, memory_order_relaxed);
+			if (_run.stopping.load(memory_order_relaxed) == false)
+				Send();
+			else
+				_run.outstanding.fetch_sub(1, memory_order_release);
+		}
+	public:
+		Client(Run &run) : _run(run) {}
+		bool Initialize(INTERNET_PORT port, CWebSocketReactor *reactor)
+		{
+			const bool initialized = (reactor != nullptr) ? ws.Initialize(L"127.0.0.1", port, _run.options.path, false, reactor) : ws.Initialize(L"127.0.0.1", port, _run.options.path, false);
+			if (initialized == false)
+				return false;
+			ws.onOpen([this]() { _run.opened.fetch_add(1, memory_order_release); })
+				.onError([this]() { _run.failed.fetch_add(1, memory_order_release); })
+				.onBinaryMessage([this](const BYTE*, size_t) { _OnMessage(); })
+				.onUTF8MessageView([this](const BYTE*, size_t) { _OnMessage(); });
+			ws.Connect();
+			return true;
+		}
+		void Send()
+		{
+			{
+				lock_guard<mutex> lock(_mutex);
+				_sentAt.push_back(chrono::steady_clock::now());
+			}
+			if (_run.options.text)
+				ws.SendUTF8String(_run.payload.data(), _run.payload.size());
+			else
+				ws.SendBinary(_run.payload.data(), _run.payload.size());
+		}
+	};
+
+	bool WaitFor(const atomic<size_t> &counter, size_t target, const atomic<size_t> &failed, double timeoutSeconds)
+	{
+		const auto deadline = chrono::steady_clock::now() + chrono::duration<double>(timeoutSeconds);
+		while (counter.load(memory_order_acquire) < target)
+		{
+			if (failed.load(memory_order_acquire) > 0 || chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		return true;
+	}
+
+	RunResult Measure(const RunOptions &options, INTERNET_PORT port, CWebSocketReactor *reactor)
+	{
+		RunResult result;
+		result.ok = false;
+		result.messages = 0;
+		result.seconds = 0;
+		Run run(options);
+		vector<Client*> clients;
+		for (size_t i = 0; i < options.connectionCount; i++)
+		{
+			clients.push_back(new Client(run));
+			if (clients.back()->Initialize(port, reactor) == false)
+				run.failed++;
+		}
+		if (WaitFor(run.opened, options.connectionCount, run.failed, 60))
+		{
+			const auto start = chrono::steady_clock::now();
+			run.outstanding = options.connectionCount * options.window;
+			for (size_t i = 0; i < options.window; i++)
+				for (Client *client : clients)
+					client->Send();
+			const size_t minMessages = max(MinMessagesPerRun, options.connectionCount);
+			while (chrono::duration<double>(chrono::steady_clock::now() - start).count() < options.seconds || run.completed.load(memory_order_relaxed) < minMessages)
+			{
+				if (run.failed.load(memory_order_relaxed) > 0)
+					break;
+				this_thread::sleep_for(chrono::milliseconds(1));
+			}
+			run.stopping = true;
+			while (run.outstanding.load(memory_order_acquire) > 0 && run.failed.load(memory_order_relaxed) == 0)
+				this_thread::sleep_for(chrono::milliseconds(1));
+			result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			result.messages = run.completed.load();
+			result.ok = run.failed.load() == 0;
+		}
+		for (Client *client : clients)
+		{
+			result.roundTripsus.insert(result.roundTripsus.end(), client->roundTripsus.begin(), client->roundTripsus.end());
+			delete client;
+		}
+		return result;
+	}
+
+	double Percentile(const vector<float> &sorted, double percentile)
+	{
+		if (sorted.size() == 0)
+			return 0;
+		return sorted[min(sorted.size() - 1, (size_t)(sorted.size() * percentile / 100))];
+	}
+
+	void Report(const RunOptions &options, RunResult &result)
+	{
+		sort(result.roundTripsus.begin(), result.roundTripsus.end());
+		const double messagesPerSecond = result.messages / result.seconds;
+		const double MBPerSecond = messagesPerSecond * options.messageSize / 1048576;
+		cout << fixed << setprecision(1)
+			<< "{\"benchmark\":\"" << options.benchmark << "\",\"type\":\"" << (options.text ? "text" : "binary") << "\""
+			<< ",\"messageSize\":" << options.messageSize << ",\"connections\":" << options.connectionCount << ",\"window\":" << options.window
+			<< ",\"ok\":" << (result.ok ? "true" : "false") << ",\"messages\":" << result.messages << setprecision(3) << ",\"seconds\":" << result.seconds
+			<< ",\"messagesPerSecond\":" << messagesPerSecond << ",\"MBPerSecond\":" << MBPerSecond << setprecision(1)
+			<< ",\"p50us\":" << Percentile(result.roundTripsus, 50) << ",\"p99us\":" << Percentile(result.roundTripsus, 99) << ",\"p999us\":" << Percentile(result.roundTripsus, 99.9)
+			<< "}" << endl;
+		cerr << fixed << setw(12) << options.benchmark << setw(8) << (options.text ? "text" : "binary") << setw(10) << options.messageSize << setw(7) << options.connectionCount
+			<< setw(13) << setprecision(0) << messagesPerSecond << setw(10) << setprecision(1) << MBPerSecond
+			<< setw(10) << Percentile(result.roundTripsus, 50) << setw(10) << Percentile(result.roundTripsus, 99) << setw(10) << Percentile(result.roundTripsus, 99.9)
+			<< (result.ok ? "" : "  (failed)") << endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+	const double seconds = quick ? 0.2 : 2;
+
+	// Both ends of every connection are in this process.
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	const size_t maxConnections = (limit.rlim_cur > 256) ? (size_t)(limit.rlim_cur - 256) / 2 : 0;
+
+	const size_t threadCount = max<size_t>(1, thread::hardware_concurrency() / 2);
+	LoopbackServer server(threadCount);
+	cerr << setw(12) << "benchmark" << setw(8) << "type" << setw(10) << "bytes" << setw(7) << "conns"
+		<< setw(13) << "messages/s" << setw(10) << "MB/s" << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p99.9 us" << endl;
+
+	for (const char *benchmark : { "latency", "throughput" })
+	{
+		const bool throughput = strcmp(benchmark, "throughput") == 0;
+		for (bool text : { false, true })
+			for (size_t size : MessageSizes)
+			{
+				const RunOptions options = { benchmark, throughput ? L"/sink" : L"/echo", text, size, 1, throughput ? max<size_t>(1, min(WindowMessages, WindowBytes / size)) : 1, seconds };
+				RunResult result = Measure(options, server.port, nullptr);
+				Report(options, result);
+			}
+	}
+
+	CWebSocketReactor reactor;
+	if (reactor.Initialize(threadCount) == false)
+		return 1;
+	for (size_t count : ConnectionCounts)
+	{
+		if (count > maxConnections)
+		{
+			cerr << "skipped " << count << " connections, raise the descriptor limit to run them" << endl;
+			continue;
+		}
+		const RunOptions options = { "connections", L"/echo", false, ConnectionsMessageSize, count, 1, seconds };
+		RunResult result = Measure(options, server.port, &reactor);
+		Report(options, result);
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+
+#include "../src/CWebSocketFrameCodec.h"
+
+using namespace std;
+using namespace cwebsocketinternal;
+
+// Measures the throughput of every masking kernel the CPU supports, masking buffers in place, for payloads from 16 B to 16 MB.
+
+int main()
+{
+	const CWebSocketMaskingKernel kernels[] = { CWebSocketMaskingKernel::Scalar, CWebSocketMaskingKernel::SSE2, CWebSocketMaskingKernel::AVX2, CWebSocketMaskingKernel::AVX512 };
+	const CWebSocketMaskingKernel defaultKernel = GetMaskingKernel();
+	const BYTE mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	const size_t bytesPerRun = 1 << 30; // Mask this many bytes for every size, so that small sizes get enough iterations.
+
+	cout << "Default kernel: " << MaskingKernelName(defaultKernel) << endl;
+	cout << setw(10) << "size";
+	for (auto kernel : kernels)
+		cout << setw(10) << MaskingKernelName(kernel);
+	cout << "   (GB/s)" << endl;
+
+	for (size_t size = 16; size <= 16 * 1024 * 1024; size *= 4)
+	{
+		vector<BYTE> buffer(size);
+		for (size_t i = 0; i < size; i++)
+			buffer[i] = (BYTE)i;
+		cout << setw(10) << size;
+		for (auto kernel : kernels)
+		{
+			if (SetMaskingKernel(kernel) == false)
+			{
+				cout << setw(10) << "-";
+				continue;
+			}
+			const size_t iterations = bytesPerRun / size;
+			MaskPayload(buffer.data(), size, mask); // Warm up the cache.
+			const auto start = chrono::steady_clock::now();
+			for (size_t i = 0; i < iterations; i++)
+				MaskPayload(buffer.data(), size, mask, i);
+			const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+			cout << setw(10) << fixed << setprecision(2) << (double)(iterations * size) / elapsed.count() / 1e9;
+		}
+		cout << endl;
+	}
+	SetMaskingKernel(defaultKernel);
+	return 0;
+}
+
+#endif
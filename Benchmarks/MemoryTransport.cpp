@@ -0,0 +1,194 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <new>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketMemoryTransport.h"
+#include "../src/MutexHelper.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+// Measures the per-message overhead of CWebSocket itself, in nanoseconds and heap allocations per message, over a CWebSocketMemoryTransport,
+// which hands messages to and from an in-process peer without any system calls, framing or copies of its own.
+// The first rows time the building blocks a message goes through on its own: calling a std::function, taking the mutex of a websocket the way
+// transport events do, copying a message into the buffer pool, and a hop through a SeqAsyncQueue, which every call to a Send function makes.
+// The other rows time whole paths through a websocket, with messages of MessageLength bytes:
+// send: SendBinary is called in a loop, and each message goes through the SAQ hop and the send queue to the peer.
+// receive: the peer sends in a loop, and each message is reported in place to the callback on the calling thread, without a SAQ hop.
+// round trip: the peer echoes every message, and the next one is sent once the echo has been received.
+
+namespace
+{
+	const size_t MessageLength = 64;
+	const size_t Iterations = 1000000;
+	const size_t WebSocketIterations = 200000;
+	const size_t RoundTrips = 50000;
+
+	// Counts or echoes the messages of the websocket.
+	class Peer : public CWebSocketMemoryPeer
+	{
+	public:
+		atomic<size_t> received;
+		bool echo;
+		CWebSocketMemoryTransport *transport;
+	public:
+		Peer() : received(0), echo(false), transport(nullptr) {}
+
+		void OnMessage(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) override
+		{
+			if (echo)
+				transport->PeerSend(bufferType, message, length);
+			received.fetch_add(1, memory_order_release);
+		}
+	};
+
+	// A websocket connected to a Peer.
+	struct Connection
+	{
+		Peer peer;
+		CWebSocket ws;
+		CWebSocketMemoryTransport *transport; // Owned by ws.
+		atomic<size_t> received;
+		atomic<bool> opened;
+
+		Connection() : transport(nullptr), received(0), opened(false) {}
+
+		bool Open()
+		{
+			transport = new(nothrow) CWebSocketMemoryTransport(&peer);
+			peer.transport = transport;
+			if (transport == nullptr || ws.Initialize(L"memory", 0, L"/", false, transport) == false)
+				return false;
+			ws.onOpen([this]() { opened.store(true, memory_order_release); })
+				.onBinaryMessage([this](const BYTE*, size_t) { received.fetch_add(1, memory_order_release); })
+				.onUTF8MessageView([this](const BYTE*, size_t) { received.fetch_add(1, memory_order_release); });
+			ws.Connect();
+			while (opened.load(memory_order_acquire) == false)
+				this_thread::yield();
+			return true;
+		}
+	};
+
+	void WaitFor(const atomic<size_t> &counter, size_t count)
+	{
+		while (counter.load(memory_order_acquire) < count)
+			this_thread::yield();
+	}
+
+	// Runs f count times, and prints the time and the allocations per run. An untimed call with the same count comes first, so that caches sized by the
+	// deepest burst, like the work cache of a SeqAsyncQueue, have grown before allocations are counted.
+	template <typename F>
+	void Measure(const char *name, size_t count, F f)
+	{
+		f(count);
+		const size_t allocations = allocationCount.load(memory_order_relaxed);
+		const auto start = chrono::steady_clock::now();
+		f(count);
+		const double ns = (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+		const double allocated = (double)(allocationCount.load(memory_order_relaxed) - allocations);
+		cout << setw(28) << left << name << right << setw(14) << fixed << setprecision(1) << ns / count << setw(16) << setprecision(2) << allocated / count << endl;
+	}
+}
+
+int main()
+{
+	vector<BYTE> payload(MessageLength, 'a');
+	cout << setw(28) << left << "" << right << setw(14) << "ns/message" << setw(16) << "allocs/message" << endl;
+
+	volatile size_t sink = 0;
+	std::function<void(const BYTE*, size_t)> callback = [&sink](const BYTE*, size_t length) { sink = sink + length; };
+	Measure("std::function call", Iterations, [&](size_t count) {
+		for (size_t i = 0; i < count; i++)
+			callback(payload.data(), payload.size());
+	});
+
+	HANDLE mutex = CreateMutex(NULL, FALSE, NULL);
+	HANDLE drain = CreateEvent(NULL, TRUE, FALSE, NULL);
+	atomic<bool> drainFlag(false);
+	Measure("mutex of a websocket", Iterations, [&](size_t count) {
+		for (size_t i = 0; i < count; i++)
+		{
+			MutexHelper holder(mutex, drain, drainFlag);
+		}
+	});
+	CloseHandle(drain);
+	CloseHandle(mutex);
+
+	Measure("pool copy", Iterations, [&](size_t count) {
+		for (size_t i = 0; i < count; i++)
+			CWebSocketBufferPool::Default()->Copy(payload.data(), payload.size());
+	});
+
+	{
+		SeqAsyncQueue saq;
+		saq.Initialize();
+		atomic<size_t> executed(0);
+		size_t queued = 0;
+		// The works are queued faster than they are executed, so the queue gets as deep as the scheduler lets it. The few allocations left come from the
+		// work cache growing past the deepest backlog of the untimed run.
+		Measure("SAQ hop", Iterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				saq.QueueAsyncWork([&executed]() { executed.fetch_add(1, memory_order_release); });
+			queued += count;
+			WaitFor(executed, queued);
+		});
+	}
+
+	{
+		Connection c;
+		if (c.Open() == false)
+			return 1;
+		size_t sent = 0;
+		Measure("send, copy", WebSocketIterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				c.ws.SendBinary(payload.data(), payload.size());
+			sent += count;
+			WaitFor(c.peer.received, sent);
+		});
+		const CWebSocketSharedBuffer shared(CWebSocketBufferPool::Default()->Copy(payload.data(), payload.size()));
+		Measure("send, shared buffer", WebSocketIterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				c.ws.SendBinary(shared);
+			sent += count;
+			WaitFor(c.peer.received, sent);
+		});
+
+		Measure("receive, binary", WebSocketIterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				c.transport->PeerSend(WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, payload.data(), payload.size());
+		});
+		Measure("receive, UTF8 view", WebSocketIterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				c.transport->PeerSend(WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, payload.data(), payload.size());
+		});
+		c.ws.onUTF8MessageView(nullptr)
+			.onUTF8Message([&c](const WCHAR*) { c.received.fetch_add(1, memory_order_release); });
+		this_thread::sleep_for(chrono::milliseconds(100)); // Callbacks are changed lazily.
+		Measure("receive, UTF8 to WCHAR", WebSocketIterations, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+				c.transport->PeerSend(WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, payload.data(), payload.size());
+		});
+
+		c.peer.echo = true;
+		Measure("round trip", RoundTrips, [&](size_t count) {
+			for (size_t i = 0; i < count; i++)
+			{
+				const size_t received = c.received.load(memory_order_acquire);
+				c.ws.SendBinary(payload.data(), payload.size());
+				WaitFor(c.received, received + 1);
+			}
+		});
+	}
+	return (int)(sink & 0);
+}
+
+#endif
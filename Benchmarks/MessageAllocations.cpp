@@ -0,0 +1,177 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketFrameCodec.h"
+#include "../src/CWebSocketHandshakeHelpers.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+using namespace cwebsocketinternal;
+
+// Counts the heap allocations per message in steady state, for binary messages of 100 bytes to 64 KB sent with SendBinary(const BYTE*, size_t)
+// and echoed back over loopback. The server echoes every message as two fragments, so that the websocket has to assemble them.
+// Messages go out in bursts of BurstSize, and each burst is sent once the previous one has been echoed back completely.
+// The first bursts warm up the buffer pool and the caches, and are not counted. The statistics of the pool are shown for the counted bursts.
+
+namespace
+{
+	const size_t BurstSize = 16;
+	const size_t WarmUpBursts = 200;
+	const size_t CountedBursts = 2000;
+
+	// Accepts a single websocket connection and echoes every data message it receives as two fragments, until a close frame arrives.
+	class EchoServer
+	{
+	private:
+		int _listener;
+		thread _thread;
+	public:
+		INTERNET_PORT port;
+	private:
+		void _Run()
+		{
+			const int fd = accept(_listener, nullptr, nullptr);
+			string request;
+			char c;
+			while (request.find("\r\n\r\n") == string::npos && read(fd, &c, 1) == 1)
+				request += c;
+			const size_t keyBegin = request.find("Sec-WebSocket-Key: ") + 19;
+			const string key = request.substr(keyBegin, request.find("\r\n", keyBegin) - keyBegin);
+			const string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ComputeWebSocketAccept(key) + "\r\n\r\n";
+			if (write(fd, response.data(), response.size()) < 0)
+				return;
+
+			CWebSocketFrameParser parser(true);
+			vector<BYTE> buffer(262144);
+			vector<BYTE> message;
+			vector<BYTE> out;
+			bool closed = false;
+			while (closed == false)
+			{
+				const ssize_t r = recv(fd, buffer.data(), buffer.size(), 0);
+				if (r <= 0)
+					break;
+				size_t offset = 0;
+				out.clear();
+				while (offset < (size_t)r)
+				{
+					CWebSocketFrameChunk chunk;
+					offset += parser.Parse(buffer.data() + offset, r - offset, SIZE_MAX, chunk);
+					if (chunk.type == CWebSocketFrameChunkType::Data)
+					{
+						message.insert(message.end(), chunk.payload, chunk.payload + chunk.length);
+						if (chunk.messageEnd)
+						{
+							const size_t half = message.size() / 2;
+							AppendFrame(out, false, OpcodeBinary, message.data(), half, nullptr);
+							AppendFrame(out, true, OpcodeContinuation, message.data() + half, message.size() - half, nullptr);
+							message.clear();
+						}
+					}
+					else if (chunk.type == CWebSocketFrameChunkType::Control && chunk.opcode == OpcodeClose)
+					{
+						const BYTE status[2] = { 0x03, 0xE8 };
+						AppendFrame(out, true, OpcodeClose, status, 2, nullptr);
+						closed = true;
+					}
+				}
+				if (out.size() > 0 && write(fd, out.data(), out.size()) < 0)
+					break;
+			}
+			close(fd);
+		}
+	public:
+		EchoServer()
+		{
+			_listener = socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t addressLength = sizeof(address);
+			bind(_listener, (sockaddr*)&address, sizeof(address));
+			listen(_listener, 1);
+			getsockname(_listener, (sockaddr*)&address, &addressLength);
+			port = ntohs(address.sin_port);
+			_thread = thread(&EchoServer::_Run, this);
+		}
+		~EchoServer()
+		{
+			_thread.join();
+			close(_listener);
+		}
+	};
+
+	void Measure(size_t messageLength)
+	{
+		EchoServer server;
+		CWebSocketBufferPool pool;
+		CWebSocket ws;
+		atomic<size_t> received(0);
+		HANDLE opened = CreateEvent(NULL, TRUE, FALSE, NULL);
+		HANDLE closed = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (ws.Initialize(L"127.0.0.1", server.port, L"/", false) == false)
+			return;
+		ws.SetBufferPool(&pool);
+		ws.onOpen([opened]() { SetEvent(opened); })
+			.onBinaryMessage([&received](const BYTE*, size_t) { received.fetch_add(1, memory_order_release); })
+			.onClose([closed](USHORT, PCWSTR, bool) { SetEvent(closed); })
+			.onError([closed]() { SetEvent(closed); });
+		ws.Connect();
+		WaitForSingleObject(opened, INFINITE);
+
+		const vector<BYTE> message(messageLength, 0x5A);
+		size_t expected = 0;
+		size_t allocationsBefore = 0;
+		CWebSocketBufferPoolStats statsBefore;
+		for (size_t burst = 0; burst < WarmUpBursts + CountedBursts; burst++)
+		{
+			if (burst == WarmUpBursts)
+			{
+				allocationsBefore = allocationCount.load();
+				statsBefore = pool.GetStats();
+			}
+			for (size_t i = 0; i < BurstSize; i++)
+				ws.SendBinary(message.data(), message.size());
+			expected += BurstSize;
+			while (received.load(memory_order_acquire) < expected)
+				this_thread::yield();
+		}
+		const double allocations = (double)(allocationCount.load() - allocationsBefore) / (CountedBursts * BurstSize);
+		const CWebSocketBufferPoolStats stats = pool.GetStats();
+
+		cout << setw(10) << messageLength << fixed << setprecision(3) << setw(14) << allocations
+			<< setw(12) << stats.acquired - statsBefore.acquired << setw(12) << stats.reused - statsBefore.reused
+			<< setw(12) << stats.allocated - statsBefore.allocated << setw(14) << stats.cachedBytes << endl;
+		ws.Close();
+		WaitForSingleObject(closed, INFINITE);
+		CloseHandle(opened);
+		CloseHandle(closed);
+	}
+}
+
+int main()
+{
+	cout << setw(10) << "bytes" << setw(14) << "allocs/msg" << setw(12) << "acquired" << setw(12) << "reused" << setw(12) << "allocated" << setw(14) << "cached bytes" << endl;
+	const size_t lengths[] = { 100, 4096, 65536 };
+	for (size_t length : lengths)
+		Measure(length);
+	return 0;
+}
+
+#endif
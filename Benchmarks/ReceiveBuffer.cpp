@@ -0,0 +1,206 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <string.h>
+
+#include "../src/CWebSocket.h"
+
+using namespace std;
+
+// Counts the receive completions per MB of binary messages of 1 KB to 4 MB, for a fixed 1 KB receive buffer (the default, and the only option before),
+// a fixed 64 KB buffer, and an adaptive buffer between 1 KB and 1 MB. Also shows the size of the buffer left pending after the large messages
+// have been followed by a trickle of 100 byte messages, which is the memory an idle websocket keeps.
+// FeedTransport receives into the buffer passed to Receive, like WinHttp does, and completes every receive right away on a thread of its own.
+
+namespace
+{
+	const size_t BytesPerRun = 64 * 1048576;
+	const size_t TrickleMessageLength = 100;
+	const size_t TrickleMessageCount = 16;
+
+	class FeedTransport : public CWebSocketTransport
+	{
+	private:
+		CWebSocketTransportCallback _callback;
+		mutex _mutex;
+		condition_variable _cv;
+		deque<CWebSocketTransportEvent> _events;
+		bool _busy;
+		bool _stop;
+		thread _thread;
+		vector<BYTE> _payload;
+		vector<size_t> _messages; // The lengths of the messages still to be received.
+		size_t _messageOffset;
+		BYTE *_rxBuffer;
+		DWORD _rxLength;
+	public:
+		size_t completions;
+		atomic<DWORD> pendingLength; // The length of the last call to Receive.
+	private:
+		void _Run()
+		{
+			unique_lock<mutex> lock(_mutex);
+			for (;;)
+			{
+				_cv.wait(lock, [this]() { return _stop || _events.size() > 0; });
+				if (_stop)
+					return;
+				const CWebSocketTransportEvent event = _events.front();
+				_events.pop_front();
+				WINHTTP_WEB_SOCKET_STATUS status;
+				const BYTE *data = nullptr;
+				if (event == CWebSocketTransportEvent::ReadComplete)
+				{
+					const size_t length = min<size_t>(_rxLength, _messages.front() - _messageOffset);
+					memcpy(_rxBuffer, _payload.data() + _messageOffset, length);
+					_messageOffset += length;
+					const bool messageEnd = (_messageOffset == _messages.front());
+					if (messageEnd)
+					{
+						_messages.erase(_messages.begin());
+						_messageOffset = 0;
+					}
+					status.dwBytesTransferred = (DWORD)length;
+					status.eBufferType = messageEnd ? WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+					data = _rxBuffer;
+					completions++;
+				}
+				_busy = true;
+				lock.unlock();
+				_callback(event, (event == CWebSocketTransportEvent::ReadComplete) ? &status : nullptr, data);
+				lock.lock();
+				_busy = false;
+				_cv.notify_all();
+			}
+		}
+		void _Post(CWebSocketTransportEvent event)
+		{
+			_events.push_back(event);
+			_cv.notify_all();
+		}
+	public:
+		FeedTransport() : _busy(false), _stop(false), _messageOffset(0), _rxBuffer(nullptr), _rxLength(0), completions(0), pendingLength(0) {}
+		~FeedTransport()
+		{
+			{
+				lock_guard<mutex> lock(_mutex);
+				_stop = true;
+				_cv.notify_all();
+			}
+			if (_thread.joinable())
+				_thread.join();
+		}
+		// Queues messages of the given lengths, to be received once the websocket has opened.
+		void Feed(const vector<size_t> &messages)
+		{
+			lock_guard<mutex> lock(_mutex);
+			_messages = messages;
+			size_t longest = 0;
+			for (size_t length : messages)
+				longest = max(longest, length);
+			_payload.assign(longest, 0x5A);
+		}
+		bool Initialize(const WCHAR*, INTERNET_PORT, const WCHAR*, bool, CWebSocketTransportCallback callback) override
+		{
+			_callback = callback;
+			_thread = thread(&FeedTransport::_Run, this);
+			return true;
+		}
+		bool SendUpgradeRequest() override { lock_guard<mutex> lock(_mutex); _Post(CWebSocketTransportEvent::SendRequestComplete); return true; }
+		bool ReceiveResponse() override { lock_guard<mutex> lock(_mutex); _Post(CWebSocketTransportEvent::HeadersAvailable); return true; }
+		bool CompleteUpgrade() override { return true; }
+		bool Receive(BYTE *buffer, DWORD length) override
+		{
+			lock_guard<mutex> lock(_mutex);
+			_rxBuffer = buffer;
+			_rxLength = length;
+			pendingLength = length;
+			if (_messages.size() > 0) // Otherwise the receive stays pending, like it would on an idle connection.
+				_Post(CWebSocketTransportEvent::ReadComplete);
+			return true;
+		}
+		bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE, const BYTE*, size_t) override { lock_guard<mutex> lock(_mutex); _Post(CWebSocketTransportEvent::WriteComplete); return true; }
+		bool Close(USHORT, const BYTE*, size_t) override { lock_guard<mutex> lock(_mutex); _Post(CWebSocketTransportEvent::CloseComplete); return true; }
+		bool QueryCloseStatus(USHORT *status, BYTE*, DWORD, DWORD *reasonLengthConsumed) override
+		{
+			*status = WINHTTP_WEB_SOCKET_SUCCESS_CLOSE_STATUS;
+			*reasonLengthConsumed = 0;
+			return true;
+		}
+		void Abort() override
+		{
+			unique_lock<mutex> lock(_mutex);
+			_events.clear();
+			_cv.wait(lock, [this]() { return _busy == false; });
+		}
+	};
+
+	void Measure(const char *name, const CWebSocketReceiveBufferOptions &options, size_t messageLength)
+	{
+		const size_t messageCount = BytesPerRun / messageLength;
+		vector<size_t> messages(messageCount, messageLength);
+		messages.insert(messages.end(), TrickleMessageCount, TrickleMessageLength);
+
+		FeedTransport *transport = new FeedTransport();
+		transport->Feed(messages);
+		CWebSocket ws;
+		atomic<size_t> received(0);
+		HANDLE done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		ws.Initialize(L"localhost", 80, L"/", false, transport);
+		ws.SetReceiveBuffer(options);
+		auto start = chrono::steady_clock::now();
+		chrono::duration<double> elapsed(0);
+		size_t completions = 0;
+		ws.onOpen([&start]() { start = chrono::steady_clock::now(); })
+			.onBinaryMessage([&](const BYTE*, size_t) {
+				const size_t count = ++received;
+				if (count == messageCount)
+				{
+					elapsed = chrono::steady_clock::now() - start;
+					completions = transport->completions;
+				}
+				else if (count == messages.size())
+					SetEvent(done);
+			});
+		ws.Connect();
+		WaitForSingleObject(done, INFINITE);
+
+		cout << setw(10) << messageLength << setw(12) << name << fixed
+			<< setw(16) << setprecision(1) << (double)completions / (BytesPerRun / 1048576)
+			<< setw(12) << setprecision(0) << (double)BytesPerRun / 1048576 / elapsed.count()
+			<< setw(16) << transport->pendingLength.load() << endl;
+		CloseHandle(done);
+	}
+}
+
+int main()
+{
+	CWebSocketReceiveBufferOptions fixed1K;
+	fixed1K.length = 1024;
+	CWebSocketReceiveBufferOptions fixed64K;
+	fixed64K.length = 65536;
+	CWebSocketReceiveBufferOptions adaptive;
+	adaptive.length = 1024;
+	adaptive.adaptive = true;
+	adaptive.maxLength = 1048576;
+
+	cout << setw(10) << "bytes" << setw(12) << "buffer" << setw(16) << "completions/MB" << setw(12) << "MB/s" << setw(16) << "idle buffer" << endl;
+	const size_t lengths[] = { 1024, 65536, 1048576, 4194304 };
+	for (size_t length : lengths)
+	{
+		Measure("1 KB", fixed1K, length);
+		Measure("64 KB", fixed64K, length);
+		Measure("adaptive", adaptive, length);
+	}
+	return 0;
+}
+
+#endif
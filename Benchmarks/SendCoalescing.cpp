@@ -0,0 +1,169 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketFrameCodec.h"
+#include "../src/CWebSocketHandshakeHelpers.h"
+
+using namespace std;
+using namespace cwebsocketinternal;
+
+// Measures the throughput of 50 byte binary messages sent in bursts of 1 to 1000 messages over loopback, and counts the system calls spent writing them.
+// The server runs on a thread of its own and only counts the messages it receives. Each burst is sent once the previous one has been received completely.
+// send and sendmsg are interposed below, so that writes are counted however the transport makes them.
+
+namespace
+{
+	atomic<size_t> writeCount(0);
+}
+
+extern "C" ssize_t send(int fd, const void *buffer, size_t length, int flags)
+{
+	writeCount.fetch_add(1, memory_order_relaxed);
+	return syscall(SYS_sendto, fd, buffer, length, flags, nullptr, 0);
+}
+
+extern "C" ssize_t sendmsg(int fd, const struct msghdr *message, int flags)
+{
+	writeCount.fetch_add(1, memory_order_relaxed);
+	return syscall(SYS_sendmsg, fd, message, flags);
+}
+
+namespace
+{
+	const size_t MessageLength = 50;
+	const size_t MessagesPerBurstSize = 200000;
+
+	// Accepts a single websocket connection and counts the messages that arrive on it, until a close frame arrives.
+	class CountingServer
+	{
+	private:
+		int _listener;
+		thread _thread;
+	public:
+		atomic<size_t> received;
+		INTERNET_PORT port;
+	private:
+		void _Run()
+		{
+			const int fd = accept(_listener, nullptr, nullptr);
+			string request;
+			char c;
+			while (request.find("\r\n\r\n") == string::npos && read(fd, &c, 1) == 1)
+				request += c;
+			const size_t keyBegin = request.find("Sec-WebSocket-Key: ") + 19;
+			const string key = request.substr(keyBegin, request.find("\r\n", keyBegin) - keyBegin);
+			const string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + ComputeWebSocketAccept(key) + "\r\n\r\n";
+			if (write(fd, response.data(), response.size()) < 0)
+				return;
+
+			CWebSocketFrameParser parser(true);
+			vector<BYTE> buffer(262144);
+			for (;;)
+			{
+				const ssize_t r = recv(fd, buffer.data(), buffer.size(), 0);
+				if (r <= 0)
+					break;
+				size_t offset = 0;
+				bool closed = false;
+				while (offset < (size_t)r)
+				{
+					CWebSocketFrameChunk chunk;
+					offset += parser.Parse(buffer.data() + offset, r - offset, SIZE_MAX, chunk);
+					if (chunk.type == CWebSocketFrameChunkType::Data && chunk.messageEnd)
+						received.fetch_add(1, memory_order_release);
+					else if (chunk.type == CWebSocketFrameChunkType::Control && chunk.opcode == OpcodeClose)
+						closed = true;
+				}
+				if (closed)
+				{
+					vector<BYTE> frame;
+					const BYTE status[2] = { 0x03, 0xE8 };
+					AppendFrame(frame, true, OpcodeClose, status, 2, nullptr);
+					if (write(fd, frame.data(), frame.size()) < 0)
+						break;
+				}
+			}
+			close(fd);
+		}
+	public:
+		CountingServer() : received(0)
+		{
+			_listener = socket(AF_INET, SOCK_STREAM, 0);
+			sockaddr_in address;
+			memset(&address, 0, sizeof(address));
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+			socklen_t addressLength = sizeof(address);
+			bind(_listener, (sockaddr*)&address, sizeof(address));
+			listen(_listener, 1);
+			getsockname(_listener, (sockaddr*)&address, &addressLength);
+			port = ntohs(address.sin_port);
+			_thread = thread(&CountingServer::_Run, this);
+		}
+		~CountingServer()
+		{
+			_thread.join();
+			close(_listener);
+		}
+	};
+}
+
+int main()
+{
+	CountingServer server;
+	CWebSocket ws;
+	HANDLE opened = CreateEvent(NULL, TRUE, FALSE, NULL);
+	HANDLE closed = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ws.Initialize(L"127.0.0.1", server.port, L"/", false) == false)
+		return 1;
+	ws.onOpen([opened]() { SetEvent(opened); })
+		.onClose([closed](USHORT, PCWSTR, bool) { SetEvent(closed); })
+		.onError([closed]() { SetEvent(closed); });
+	ws.Connect();
+	WaitForSingleObject(opened, INFINITE);
+
+	const vector<BYTE> message(MessageLength, 0x5A);
+	size_t expected = 0;
+	cout << setw(8) << "burst" << setw(14) << "messages/s" << setw(16) << "writes/message" << endl;
+	const size_t burstSizes[] = { 1, 10, 100, 1000 };
+	for (size_t burstSize : burstSizes)
+	{
+		const size_t writesBefore = writeCount.load();
+		const auto start = chrono::steady_clock::now();
+		for (size_t sent = 0; sent < MessagesPerBurstSize; sent += burstSize)
+		{
+			for (size_t i = 0; i < burstSize; i++)
+				ws.SendBinary(message.data(), message.size());
+			expected += burstSize;
+			while (server.received.load(memory_order_acquire) < expected)
+				this_thread::yield();
+		}
+		const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		cout << setw(8) << burstSize << fixed << setprecision(0) << setw(14) << MessagesPerBurstSize / elapsed.count()
+			<< setprecision(3) << setw(16) << (double)(writeCount.load() - writesBefore) / MessagesPerBurstSize << endl;
+	}
+
+	ws.Close();
+	WaitForSingleObject(closed, INFINITE);
+	CloseHandle(opened);
+	CloseHandle(closed);
+	return 0;
+}
+
+#endif
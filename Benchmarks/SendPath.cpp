@@ -0,0 +1,185 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include "../src/CWebSocket.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+// Counts the heap allocations and the bytes allocated per message sent with each SendBinary overload, for messages of 1 KB to 4 MB,
+// and checks whether the transport is handed the caller's bytes or a copy of them. Copies of the payload show up as allocations of its size.
+// NullTransport completes every operation right away on a thread of its own, so that only the cost of CWebSocket itself is measured.
+
+namespace
+{
+	class NullTransport : public CWebSocketTransport
+	{
+	private:
+		CWebSocketTransportCallback _callback;
+		mutex _mutex;
+		condition_variable _cv;
+		deque<CWebSocketTransportEvent> _events;
+		bool _busy;
+		bool _stop;
+		thread _thread;
+	public:
+		atomic<size_t> sendCount;
+		atomic<const BYTE*> lastSent;
+	private:
+		void _Run()
+		{
+			unique_lock<mutex> lock(_mutex);
+			for (;;)
+			{
+				_cv.wait(lock, [this]() { return _stop || _events.size() > 0; });
+				if (_stop)
+					return;
+				const CWebSocketTransportEvent event = _events.front();
+				_events.pop_front();
+				_busy = true;
+				lock.unlock();
+				_callback(event, nullptr, nullptr);
+				lock.lock();
+				_busy = false;
+				_cv.notify_all();
+			}
+		}
+		void _Post(CWebSocketTransportEvent event)
+		{
+			lock_guard<mutex> lock(_mutex);
+			_events.push_back(event);
+			_cv.notify_all();
+		}
+	public:
+		NullTransport() : _busy(false), _stop(false), sendCount(0), lastSent(nullptr) {}
+		~NullTransport()
+		{
+			{
+				lock_guard<mutex> lock(_mutex);
+				_stop = true;
+				_cv.notify_all();
+			}
+			if (_thread.joinable())
+				_thread.join();
+		}
+		bool Initialize(const WCHAR*, INTERNET_PORT, const WCHAR*, bool, CWebSocketTransportCallback callback) override
+		{
+			_callback = callback;
+			_thread = thread(&NullTransport::_Run, this);
+			return true;
+		}
+		bool SendUpgradeRequest() override { _Post(CWebSocketTransportEvent::SendRequestComplete); return true; }
+		bool ReceiveResponse() override { _Post(CWebSocketTransportEvent::HeadersAvailable); return true; }
+		bool CompleteUpgrade() override { return true; }
+		bool Receive(BYTE*, DWORD) override { return true; } // Nothing ever arrives.
+		bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE, const BYTE *message, size_t) override
+		{
+			lastSent = message;
+			sendCount++;
+			_Post(CWebSocketTransportEvent::WriteComplete);
+			return true;
+		}
+		bool Close(USHORT, const BYTE*, size_t) override { _Post(CWebSocketTransportEvent::CloseComplete); return true; }
+		bool QueryCloseStatus(USHORT *status, BYTE*, DWORD, DWORD *reasonLengthConsumed) override
+		{
+			*status = WINHTTP_WEB_SOCKET_SUCCESS_CLOSE_STATUS;
+			*reasonLengthConsumed = 0;
+			return true;
+		}
+		void Abort() override
+		{
+			unique_lock<mutex> lock(_mutex);
+			_events.clear();
+			_cv.wait(lock, [this]() { return _busy == false; });
+		}
+	};
+
+	enum class Overload
+	{
+		Copy, // SendBinary(const BYTE*, size_t)
+		Move, // SendBinary(std::vector<BYTE>&&)
+		Shared // SendBinary(const CWebSocketSharedBuffer&)
+	};
+
+	const char *OverloadName(Overload overload)
+	{
+		switch (overload)
+		{
+		case Overload::Copy: return "pointer";
+		case Overload::Move: return "vector&&";
+		default: return "shared";
+		}
+	}
+
+	void Measure(Overload overload, size_t messageLength, size_t messageCount)
+	{
+		NullTransport *transport = new NullTransport();
+		CWebSocket ws;
+		HANDLE opened = CreateEvent(NULL, TRUE, FALSE, NULL);
+		ws.Initialize(L"localhost", 80, L"/", false, transport);
+		ws.onOpen([opened]() { SetEvent(opened); });
+		ws.Connect();
+		WaitForSingleObject(opened, INFINITE);
+
+		// The payloads are prepared up front, so that only what SendBinary does with them is counted.
+		vector<vector<BYTE>> payloads(messageCount, vector<BYTE>(messageLength, 0x5A));
+		vector<CWebSocketSharedBuffer> shared;
+		atomic<size_t> released(0);
+		if (overload == Overload::Shared)
+			for (auto &payload : payloads)
+				shared.push_back(CWebSocketSharedBuffer(payload.data(), payload.size(), [&released]() { released++; }));
+		const BYTE *lastPayload = payloads.back().data();
+
+		const size_t countBefore = allocationCount.load();
+		const size_t bytesBefore = allocatedBytes.load();
+		const auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < messageCount; i++)
+		{
+			if (overload == Overload::Copy)
+				ws.SendBinary(payloads[i].data(), payloads[i].size());
+			else if (overload == Overload::Move)
+				ws.SendBinary(move(payloads[i]));
+			else
+				ws.SendBinary(shared[i]);
+		}
+		while (transport->sendCount.load() < messageCount)
+			this_thread::yield();
+		const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		const double allocations = (double)(allocationCount.load() - countBefore) / messageCount;
+		const double bytes = (double)(allocatedBytes.load() - bytesBefore) / messageCount;
+		const bool inPlace = transport->lastSent.load() == lastPayload;
+
+		cout << setw(10) << messageLength << setw(10) << OverloadName(overload) << fixed
+			<< setw(14) << setprecision(1) << allocations
+			<< setw(18) << setprecision(2) << bytes / messageLength
+			<< setw(12) << (inPlace ? "yes" : "no")
+			<< setw(14) << setprecision(0) << (double)messageLength * messageCount / elapsed.count() / 1048576 << endl;
+		shared.clear();
+		CloseHandle(opened);
+	}
+}
+
+int main()
+{
+	cout << setw(10) << "bytes" << setw(10) << "overload" << setw(14) << "allocs/msg" << setw(18) << "alloc bytes/size" << setw(12) << "in place" << setw(14) << "MB/s" << endl;
+	const size_t lengths[] = { 1024, 65536, 4194304 };
+	for (size_t length : lengths)
+	{
+		const size_t count = (length >= 1048576) ? 64 : 4096;
+		Measure(Overload::Copy, length, count);
+		Measure(Overload::Move, length, count);
+		Measure(Overload::Shared, length, count);
+	}
+	return 0;
+}
+
+#endif
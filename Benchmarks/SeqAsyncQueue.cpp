@@ -0,0 +1,122 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "../src/SeqAsyncQueue.h"
+
+using namespace std;
+
+// Measures how many works per second producer threads can push through a SeqAsyncQueue, for 1 to 64 producers.
+// For comparison, LockedQueue is the previous implementation: a kernel mutex and an event around a std::queue of std::function.
+
+namespace
+{
+	class LockedQueue
+	{
+	private:
+		HANDLE _mMutex;
+		HANDLE _eQueueEmpty;
+		std::queue<std::function<void()>> _q;
+		PTP_WORK _work;
+	private:
+		static VOID CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE, PVOID context, PTP_WORK)
+		{
+			LockedQueue *self = (LockedQueue*)context;
+			WaitForSingleObject(self->_mMutex, INFINITE);
+			std::function<void()> callback = self->_q.front();
+			ReleaseMutex(self->_mMutex);
+			callback();
+			WaitForSingleObject(self->_mMutex, INFINITE);
+			self->_q.pop();
+			if (self->_q.size() == 0)
+				SetEvent(self->_eQueueEmpty);
+			else
+				SubmitThreadpoolWork(self->_work);
+			ReleaseMutex(self->_mMutex);
+		}
+	public:
+		bool Initialize()
+		{
+			_mMutex = CreateMutex(NULL, FALSE, NULL);
+			_eQueueEmpty = CreateEvent(NULL, TRUE, TRUE, NULL);
+			_work = CreateThreadpoolWork(WorkCallback, this, NULL);
+			return _mMutex != nullptr && _eQueueEmpty != nullptr && _work != nullptr;
+		}
+		~LockedQueue()
+		{
+			// The last work sets the event before releasing the mutex, so wait for the mutex too, before closing it.
+			WaitTheQueue();
+			WaitForSingleObject(_mMutex, INFINITE);
+			ReleaseMutex(_mMutex);
+			CloseThreadpoolWork(_work);
+			CloseHandle(_mMutex);
+			CloseHandle(_eQueueEmpty);
+		}
+		void QueueAsyncWork(std::function<void()> callback)
+		{
+			WaitForSingleObject(_mMutex, INFINITE);
+			_q.push(callback);
+			ResetEvent(_eQueueEmpty);
+			if (_q.size() == 1)
+				SubmitThreadpoolWork(_work);
+			ReleaseMutex(_mMutex);
+		}
+		void WaitTheQueue()
+		{
+			WaitForSingleObject(_eQueueEmpty, INFINITE);
+		}
+	};
+
+	// Every producer queues worksPerProducer works capturing a small payload, like CWebSocket's Send functions do.
+	// Returns works per second, or 0 if the works of some producer were executed out of order.
+	template <typename Queue>
+	double Measure(size_t producerCount, size_t worksPerProducer)
+	{
+		Queue queue;
+		if (queue.Initialize() == false)
+			return 0;
+		vector<size_t> next(producerCount, 0); // Only touched by the works, which run sequentially.
+		bool inOrder = true;
+		const auto start = chrono::steady_clock::now();
+		vector<thread> producers;
+		for (size_t p = 0; p < producerCount; p++)
+			producers.emplace_back([&, p]() {
+				for (size_t i = 0; i < worksPerProducer; i++)
+				{
+					const size_t payload[3] = { p, i, 0 };
+					queue.QueueAsyncWork([&next, &inOrder, payload]() {
+						if (next[payload[0]]++ != payload[1])
+							inOrder = false;
+					});
+				}
+			});
+		for (auto &producer : producers)
+			producer.join();
+		queue.WaitTheQueue();
+		const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		return inOrder ? (double)(producerCount * worksPerProducer) / elapsed.count() : 0;
+	}
+}
+
+int main()
+{
+	const size_t totalWorks = 1 << 20;
+	cout << setw(10) << "producers" << setw(16) << "SeqAsyncQueue" << setw(16) << "LockedQueue" << "   (works/s)" << endl;
+	for (size_t producerCount = 1; producerCount <= 64; producerCount *= 2)
+	{
+		const size_t worksPerProducer = totalWorks / producerCount;
+		cout << setw(10) << producerCount
+			<< setw(16) << fixed << setprecision(0) << Measure<SeqAsyncQueue>(producerCount, worksPerProducer)
+			<< setw(16) << Measure<LockedQueue>(producerCount, worksPerProducer / 8) << endl; // The locked queue is much slower, give it fewer works.
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,132 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "../src/CWebSocket.h"
+#include "../src/CWebSocketServer.h"
+
+using namespace std;
+
+// Measures how many concurrent connections a CWebSocketServer holds, and what they cost. For 1000 to 50000 connections, websockets on a client reactor
+// connect to an echo server in the same process, and the benchmark reports how fast the connections opened, how much memory each added (both ends together,
+// since both are in this process), and how fast a round of one 64 byte message per connection was echoed back. The connections are closed between runs.
+// Both ends of every connection are in this process, so connection counts beyond half the descriptor limit are skipped. The clients spread over several
+// loopback addresses, so that the ephemeral ports don't run out.
+
+namespace
+{
+	const size_t ConnectionCounts[] = { 1000, 5000, 10000, 50000 };
+	const size_t ConnectionsPerAddress = 20000;
+	const size_t MessageLength = 64;
+
+	size_t ResidentBytes()
+	{
+		ifstream statm("/proc/self/statm");
+		size_t size = 0, resident = 0;
+		statm >> size >> resident;
+		return resident * (size_t)sysconf(_SC_PAGESIZE);
+	}
+
+	bool WaitFor(const atomic<size_t> &counter, size_t count, chrono::seconds timeout)
+	{
+		const auto deadline = chrono::steady_clock::now() + timeout;
+		while (counter.load(memory_order_acquire) < count)
+		{
+			if (chrono::steady_clock::now() > deadline)
+				return false;
+			this_thread::sleep_for(chrono::milliseconds(1));
+		}
+		return true;
+	}
+}
+
+int main()
+{
+	rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+	getrlimit(RLIMIT_NOFILE, &limit);
+	const size_t maxConnections = (limit.rlim_cur > 256) ? (size_t)(limit.rlim_cur - 256) / 2 : 0;
+
+	const size_t loopCount = max<size_t>(1, thread::hardware_concurrency() / 2);
+	CWebSocketReactor serverReactor;
+	CWebSocketReactor clientReactor;
+	if (serverReactor.Initialize(loopCount) == false || clientReactor.Initialize(loopCount) == false)
+		return 1;
+
+	atomic<size_t> serverClosed(0);
+	CWebSocketServer server;
+	const bool initialized = server.Initialize(0, &serverReactor, [&serverClosed](CWebSocket *ws) {
+		ws->onBinaryMessage([ws](const BYTE *message, size_t length) { ws->SendBinary(message, length); })
+			.onClosed([ws, &serverClosed]() { serverClosed.fetch_add(1, memory_order_release); CWebSocketServer::Release(ws); })
+			.onError([ws, &serverClosed]() { serverClosed.fetch_add(1, memory_order_release); CWebSocketServer::Release(ws); });
+		return true;
+	});
+	if (initialized == false)
+		return 1;
+
+	cout << setw(8) << "conns" << setw(14) << "opened/s" << setw(14) << "KB/conn" << setw(14) << "echoes/s" << endl;
+	const vector<BYTE> payload(MessageLength, 'a');
+	size_t closedSoFar = 0;
+	for (const size_t count : ConnectionCounts)
+	{
+		if (count > maxConnections)
+		{
+			cout << setw(8) << count << "  skipped: the descriptor limit is " << limit.rlim_cur << endl;
+			continue;
+		}
+		atomic<size_t> opened(0), failed(0), echoed(0), closed(0);
+		const size_t residentBefore = ResidentBytes();
+		const auto start = chrono::steady_clock::now();
+		vector<CWebSocket*> clients;
+		for (size_t i = 0; i < count; i++)
+		{
+			CWebSocket *ws = new CWebSocket();
+			const wstring address = L"127.0.0." + to_wstring(1 + i / ConnectionsPerAddress);
+			ws->Initialize(address.c_str(), server.Port(), L"/", false, &clientReactor);
+			ws->SetReceiveBuffer({ 4096, true, 1048576 });
+			ws->onOpen([&opened]() { opened.fetch_add(1, memory_order_release); })
+				.onBinaryMessage([&echoed](const BYTE*, size_t) { echoed.fetch_add(1, memory_order_release); })
+				.onClosed([&closed]() { closed.fetch_add(1, memory_order_release); })
+				.onError([&failed, &closed]() { failed.fetch_add(1, memory_order_relaxed); closed.fetch_add(1, memory_order_release); })
+				.Connect();
+			clients.push_back(ws);
+		}
+		if (WaitFor(opened, count, chrono::seconds(120)) == false)
+			cout << setw(8) << count << "  only " << opened.load() << " connections opened, " << failed.load() << " failed" << endl;
+		else
+		{
+			const double openSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			const double kbPerConnection = (double)(ResidentBytes() - min(residentBefore, ResidentBytes())) / 1024 / count;
+			const auto echoStart = chrono::steady_clock::now();
+			for (auto ws : clients)
+				ws->SendBinary(payload.data(), payload.size());
+			WaitFor(echoed, count, chrono::seconds(120));
+			const double echoSeconds = chrono::duration<double>(chrono::steady_clock::now() - echoStart).count();
+			cout << setw(8) << count << setw(14) << fixed << setprecision(0) << count / openSeconds << setw(14) << setprecision(1) << kbPerConnection
+				<< setw(14) << setprecision(0) << echoed.load() / echoSeconds << endl;
+		}
+		for (auto ws : clients)
+			ws->Close();
+		WaitFor(closed, count, chrono::seconds(60));
+		for (auto ws : clients)
+			delete ws;
+		closedSoFar += count;
+		WaitFor(serverClosed, closedSoFar, chrono::seconds(10));
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#if 1
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <set>
+#include <random>
+#include <chrono>
+#include <utility>
+
+#include "../src/TimingWheel.h"
+
+using namespace std;
+
+// Measures how many timers per second can be armed, re-armed, cancelled and fired with 1M timers pending, at a tick of one millisecond.
+// For comparison, SortedTimers keeps timers in a std::set ordered by expiry, like the previous timer queue thread did.
+
+namespace
+{
+	const size_t TimerCount = 1000000;
+
+	class SortedTimers
+	{
+	private:
+		std::set<std::pair<uint64_t, size_t>> _timers;
+		std::vector<uint64_t> _expiry; // 0 if the timer is not scheduled.
+		std::vector<std::function<void()>> _callbacks;
+	public:
+		explicit SortedTimers(size_t count) : _expiry(count, 0), _callbacks(count) {}
+		void Schedule(size_t timer, uint64_t expiry, std::function<void()> callback)
+		{
+			Cancel(timer);
+			_expiry[timer] = expiry;
+			_callbacks[timer] = callback;
+			_timers.insert(std::make_pair(expiry, timer));
+		}
+		void Cancel(size_t timer)
+		{
+			if (_expiry[timer] == 0)
+				return;
+			_timers.erase(std::make_pair(_expiry[timer], timer));
+			_expiry[timer] = 0;
+		}
+		size_t Advance(uint64_t now)
+		{
+			size_t fired = 0;
+			while (_timers.size() > 0 && _timers.begin()->first <= now)
+			{
+				const size_t timer = _timers.begin()->second;
+				_timers.erase(_timers.begin());
+				_expiry[timer] = 0;
+				_callbacks[timer]();
+				fired++;
+			}
+			return fired;
+		}
+	};
+
+	struct Rates
+	{
+		double arm, rearm, cancel, fire;
+	};
+
+	double PerSecond(size_t count, chrono::steady_clock::time_point start)
+	{
+		const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		return (double)count / elapsed.count();
+	}
+
+	// Arms every timer with a delay of up to a minute, re-arms every timer, cancels every timer,
+	// then arms every timer with a delay of up to a second and advances time a tick at a time until all have fired.
+	// The callbacks capture a pointer, like those of CWebSocket do.
+	Rates MeasureTimingWheel(const vector<uint64_t> &longDelays, const vector<uint64_t> &shortDelays)
+	{
+		Rates rates;
+		size_t fired = 0;
+		vector<TimingWheel::Timer> timers(TimerCount);
+		TimingWheel wheel(1000);
+
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+		{
+			timers[i].callback = [&fired]() { fired++; };
+			wheel.Schedule(&timers[i], wheel.Now() + longDelays[i]);
+		}
+		rates.arm = PerSecond(TimerCount, start);
+
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+			wheel.Schedule(&timers[i], wheel.Now() + longDelays[TimerCount - 1 - i]);
+		rates.rearm = PerSecond(TimerCount, start);
+
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+			wheel.Cancel(&timers[i]);
+		rates.cancel = PerSecond(TimerCount, start);
+
+		for (size_t i = 0; i < TimerCount; i++)
+			wheel.Schedule(&timers[i], wheel.Now() + shortDelays[i]);
+		const uint64_t end = wheel.Now() + 1000;
+		start = chrono::steady_clock::now();
+		while (wheel.Now() < end)
+			wheel.Advance(wheel.Now() + 1);
+		rates.fire = (fired == TimerCount) ? PerSecond(TimerCount, start) : 0;
+		return rates;
+	}
+
+	Rates MeasureSortedTimers(const vector<uint64_t> &longDelays, const vector<uint64_t> &shortDelays)
+	{
+		Rates rates;
+		size_t fired = 0;
+		SortedTimers timers(TimerCount);
+		uint64_t now = 1000;
+
+		auto start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+			timers.Schedule(i, now + longDelays[i], [&fired]() { fired++; });
+		rates.arm = PerSecond(TimerCount, start);
+
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+			timers.Schedule(i, now + longDelays[TimerCount - 1 - i], [&fired]() { fired++; });
+		rates.rearm = PerSecond(TimerCount, start);
+
+		start = chrono::steady_clock::now();
+		for (size_t i = 0; i < TimerCount; i++)
+			timers.Cancel(i);
+		rates.cancel = PerSecond(TimerCount, start);
+
+		for (size_t i = 0; i < TimerCount; i++)
+			timers.Schedule(i, now + shortDelays[i], [&fired]() { fired++; });
+		const uint64_t end = now + 1000;
+		start = chrono::steady_clock::now();
+		while (now < end)
+			timers.Advance(++now);
+		rates.fire = (fired == TimerCount) ? PerSecond(TimerCount, start) : 0;
+		return rates;
+	}
+
+	void Print(const char *name, const Rates &rates)
+	{
+		cout << setw(14) << name << fixed << setprecision(0)
+			<< setw(14) << rates.arm << setw(14) << rates.rearm << setw(14) << rates.cancel << setw(14) << rates.fire << endl;
+	}
+}
+
+int main()
+{
+	mt19937 rng(42);
+	vector<uint64_t> longDelays(TimerCount);
+	vector<uint64_t> shortDelays(TimerCount);
+	for (size_t i = 0; i < TimerCount; i++)
+	{
+		longDelays[i] = 1 + rng() % 60000;
+		shortDelays[i] = 1 + rng() % 1000;
+	}
+
+	cout << TimerCount << " timers pending" << endl;
+	cout << setw(14) << "" << setw(14) << "arm/s" << setw(14) << "rearm/s" << setw(14) << "cancel/s" << setw(14) << "fire/s" << endl;
+	Print("TimingWheel", MeasureTimingWheel(longDelays, shortDelays));
+	Print("SortedTimers", MeasureSortedTimers(longDelays, shortDelays));
+	return 0;
+}
+
+#endif
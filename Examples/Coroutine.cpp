@@ -0,0 +1,71 @@
+#if 1
+
+#include <iostream>
+#include <coroutine>
+#include <windows.h>
+
+#include "..\src\CWebSocket.h"
+
+using namespace std;
+
+// The echo example, written as a C++20 coroutine instead of callbacks.
+
+HANDLE hEventDone;
+const char helloWorldMessage[] = "Hello world!";
+
+// A coroutine that starts right away and destroys itself when it returns.
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() { return Task(); }
+		suspend_never initial_suspend() { return suspend_never(); }
+		suspend_never final_suspend() noexcept { return suspend_never(); }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+};
+
+Task Echo(CWebSocket &cws)
+{
+	if (co_await cws.Connect() == false)
+	{
+		wcout << L"Failed to connect. Terminating..." << endl;
+		SetEvent(hEventDone);
+		co_return;
+	}
+	wcout << L"Websocket is now open! Sending \"" << helloWorldMessage << L"\" ..." << endl;
+	if (co_await cws.SendUTF8((const BYTE*)helloWorldMessage, sizeof(helloWorldMessage) - 1))
+	{
+		CWebSocketMessageView message = co_await cws.Receive();
+		if (message.closed == false)
+			wcout << L"Server responded: \"" << string((const char*)message.data, message.length).c_str() << L"\"" << endl;
+	}
+	wcout << L"Closing connection..." << endl;
+	cws.Close();
+	while ((co_await cws.Receive()).closed == false)
+		; // Messages that arrive during the closing handshake.
+	wcout << L"Websocket is now closed. Terminating..." << endl;
+	SetEvent(hEventDone);
+}
+
+int main()
+{
+	CWebSocket cws;
+
+	if (cws.Initialize(L"echo.websocket.org", 443, L"/", true) == false)
+	{
+		wcout << L"Failed to initialize CWebSocket!" << endl;
+		return 1;
+	}
+
+	hEventDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	Echo(cws);
+
+	WaitForSingleObject(hEventDone, INFINITE);
+	system("PAUSE");
+	return 0;
+}
+
+#endif
\ No newline at end of file
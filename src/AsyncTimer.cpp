@@ -1,40 +1,147 @@
-#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <new>
 
 #include "AsyncTimer.h"
 
+namespace
+{
+	// The default queue. A single thread fires the timers of every AsyncTimer that is not attached to another queue.
+	class DefaultAsyncTimerQueue final : public AsyncTimerQueue
+	{
+	private:
+		std::mutex _mutex;
+		std::condition_variable _cvWakeup; // Signalled when a timer expiring before _wakeup is set.
+		std::condition_variable _cvCallbackDone;
+		TimingWheel _wheel;
+		uint64_t _wakeup; // The time the thread is sleeping until.
+		TimingWheel::Timer *_running; // The timer whose callback is running, if any.
+		std::thread::id _threadId;
+	private:
+		void _Run();
+		void _WaitForCallback(std::unique_lock<std::mutex> &lock, TimingWheel::Timer *timer);
+	public:
+		DefaultAsyncTimerQueue() :
+			_wheel(Now()),
+			_wakeup(UINT64_MAX),
+			_running(nullptr)
+		{
+		}
+		bool Initialize();
+		void Set(TimingWheel::Timer *timer, DWORD delayms, std::function<void()> callback) override;
+		void Cancel(TimingWheel::Timer *timer) override;
+	};
+
+	bool DefaultAsyncTimerQueue::Initialize()
+	{
+		std::thread thread(&DefaultAsyncTimerQueue::_Run, this);
+		_threadId = thread.get_id();
+		thread.detach();
+		return true;
+	}
+
+	void DefaultAsyncTimerQueue::_Run()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		for (;;)
+		{
+			TimingWheel::Timer *timer = _wheel.PopExpired(Now());
+			if (timer != nullptr)
+			{
+				const std::function<void()> callback = timer->callback; // Set may replace the callback of the timer as soon as the lock is released.
+				_running = timer;
+				lock.unlock();
+				callback();
+				lock.lock();
+				_running = nullptr;
+				_cvCallbackDone.notify_all();
+				continue;
+			}
+			_wakeup = _wheel.NextWakeup();
+			if (_wakeup == UINT64_MAX)
+				_cvWakeup.wait(lock);
+			else
+				_cvWakeup.wait_for(lock, std::chrono::milliseconds(_wakeup - _wheel.Now()));
+			_wakeup = 0; // Awake. Set needn't signal until the thread goes back to sleep.
+		}
+	}
+
+	// Waits until the callback of timer is not running, unless it's running on this very thread. Called with _mutex held.
+	void DefaultAsyncTimerQueue::_WaitForCallback(std::unique_lock<std::mutex> &lock, TimingWheel::Timer *timer)
+	{
+		if (std::this_thread::get_id() == _threadId)
+			return;
+		_cvCallbackDone.wait(lock, [=]() { return _running != timer; });
+	}
+
+	void DefaultAsyncTimerQueue::Set(TimingWheel::Timer *timer, DWORD delayms, std::function<void()> callback)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_WaitForCallback(lock, timer);
+		timer->callback = std::move(callback);
+		const uint64_t expiry = Now() + delayms;
+		_wheel.Schedule(timer, expiry);
+		if (expiry < _wakeup)
+			_cvWakeup.notify_one();
+	}
+
+	void DefaultAsyncTimerQueue::Cancel(TimingWheel::Timer *timer)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wheel.Cancel(timer);
+		_WaitForCallback(lock, timer);
+	}
+}
+
+AsyncTimerQueue* AsyncTimerQueue::Default()
+{
+	// The default queue is never destructed, so that its thread can safely outlive static destructors.
+	static AsyncTimerQueue *queue = []() -> AsyncTimerQueue* {
+		DefaultAsyncTimerQueue *q = new(std::nothrow) DefaultAsyncTimerQueue();
+		if (q != nullptr && q->Initialize() == false)
+		{
+			delete q;
+			q = nullptr;
+		}
+		return q;
+	}();
+	return queue;
+}
+
+uint64_t AsyncTimerQueue::Now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 AsyncTimer::AsyncTimer() :
-	_tTimer(nullptr)
+	_queue(nullptr)
 {
 }
 
 AsyncTimer::~AsyncTimer()
 {
-	DeleteTimerQueueTimer(NULL, _tTimer, INVALID_HANDLE_VALUE); // Cancel the pending callback, if exists. Wait for the pending callback, if exists.
+	Cancel(); // Cancel the pending callback, if exists. Wait for the pending callback, if exists.
 }
 
-void CALLBACK AsyncTimer::TimerCallback(PVOID _callback, BOOLEAN)
+void AsyncTimer::Attach(AsyncTimerQueue *queue)
 {
-	auto callback = (std::function<void()>*)(_callback);
-	(*callback)();
-	delete callback;
+	_queue = queue;
 }
 
 bool AsyncTimer::Set(DWORD delayms, std::function<void()> callback)
 {
-	auto clbkcpy = new(std::nothrow) std::function<void()>(callback);
-	if (clbkcpy != nullptr)
-	{
-		DeleteTimerQueueTimer(NULL, _tTimer, INVALID_HANDLE_VALUE);
-		_tTimer = nullptr;
-		if (TRUE == CreateTimerQueueTimer(&_tTimer, NULL, TimerCallback, clbkcpy, delayms, 0, 0))
-			return true;
-		delete clbkcpy;
-	}
-	return false;
+	if (_queue == nullptr)
+		_queue = AsyncTimerQueue::Default();
+	if (_queue == nullptr)
+		return false;
+	_queue->Set(&_timer, delayms, std::move(callback));
+	return true;
 }
 
 void AsyncTimer::Cancel()
 {
-	DeleteTimerQueueTimer(NULL, _tTimer, INVALID_HANDLE_VALUE);
-	_tTimer = nullptr;
+	if (_queue != nullptr)
+		_queue->Cancel(&_timer);
 }
\ No newline at end of file
@@ -1,20 +1,45 @@
 #pragma once
 
-#include <windows.h>
+#include "Win32Compat.h"
 #include <functional>
 #include <stdint.h>
 
+#include "TimingWheel.h"
+
+// AsyncTimerQueue is a thread that fires timers, kept in a TimingWheel with a tick of one millisecond.
+// Setting and cancelling a timer take O(1) time, no matter how many timers are pending.
+class AsyncTimerQueue
+{
+public:
+	// Schedules timer to call callback on the queue thread after delayms milliseconds. If timer is already scheduled, reschedules it.
+	// If the callback of timer is running on another thread, waits for it to return first.
+	virtual void Set(TimingWheel::Timer *timer, DWORD delayms, std::function<void()> callback) = 0;
+
+	// Cancels timer. Does nothing if timer is not scheduled.
+	// Once this returns, the callback is not running and will not be called, unless Cancel is called from the callback itself.
+	virtual void Cancel(TimingWheel::Timer *timer) = 0;
+
+	// Returns the queue used by AsyncTimers that are not attached to another queue. It runs a thread of its own, which is started on first use.
+	// Returns nullptr if the queue could not be created.
+	static AsyncTimerQueue* Default();
+
+	// Returns the current time on a monotonic clock, in milliseconds. Timing wheels of all queues use this clock.
+	static uint64_t Now();
+protected:
+	~AsyncTimerQueue() {}
+};
+
 // AsyncTimer lets you execute a callback function at a particular point in the future, similar to javascript's setTimeout.
 class AsyncTimer
 {
 private:
-	HANDLE _tTimer; // AsyncTimer does not synchronize calls made to its member functions.
-	std::function<void()> _callback;
-private:
-	static void CALLBACK TimerCallback(PVOID _callback, BOOLEAN);
+	TimingWheel::Timer _timer; // AsyncTimer does not synchronize calls made to its member functions.
+	AsyncTimerQueue *_queue;
 public:
 	AsyncTimer();
+	AsyncTimer(const AsyncTimer&) = delete;
 	~AsyncTimer();
+	void Attach(AsyncTimerQueue *queue); // Fires the timer on queue instead of the default queue. Call it before Set.
 	bool Set(DWORD delayms, std::function<void()> callback); // If a callback is pending, cancels it. If the previous callback is executing, waits for it.
 	void Cancel(); // If the previous callback is executing, waits for it. If no callback is set, does nothing.
 };
\ No newline at end of file
@@ -1,18 +1,25 @@
 #pragma once
 
-#include <windows.h>
-#include <WinHttp.h>
 #include <vector>
-#include <queue>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 #include <assert.h>
 
+#include "Win32Compat.h"
 #include "CWebSocketCallbackList.h"
+#include "CWebSocketEncodingHelpers.h"
+#include "CWebSocketTransport.h"
+#include "CWebSocketReactor.h"
+#include "CWebSocketSharedBuffer.h"
+#include "CWebSocketPreparedMessage.h"
+#include "CWebSocketReceiveSizer.h"
+#include "CWebSocketBufferPool.h"
+#include "CWebSocketRingQueue.h"
+#include "CWebSocketMetrics.h"
 #include "SeqAsyncQueue.h"
 #include "AsyncTimer.h"
 
-#pragma comment (lib, "winhttp.lib")
-#pragma comment (lib, "Shlwapi.lib")
-
 enum class CWebSocketState
 {
 	NoTcpConnection, // CWebSocket is created in this state, stays in this state until the first call to Connect, and falls back to this state whenever Abort is called.
@@ -28,63 +35,323 @@ enum class CWebSocketState
 	Done,
 	Error
 };
+static_assert((size_t)CWebSocketState::Error + 1 == CWebSocketStateCount, "CWebSocketStateCount must match CWebSocketState");
+
+// Round trip times measured with keepalive pings, in milliseconds. See CWebSocket::KeepAlive.
+struct CWebSocketRoundTripTime
+{
+	double lastms; // The round trip time of the most recent ping.
+	double smoothedms; // A moving average that gives each new sample a weight of 1/8, like TCP's smoothed round trip time.
+	double minms; // The shortest round trip time measured on the connection.
+	size_t sampleCount; // The number of pongs received on the connection.
+};
+
+// The lane a message is sent in. See CWebSocket::SendBinary.
+enum class CWebSocketSendPriority
+{
+	Normal, // Sent in the order of the Send calls.
+	Urgent // Sent ahead of the normal messages that haven't started going out yet, in the order of the Send calls among urgent messages.
+};
+
+// What happens to a message sent while the send buffer is full. See CWebSocketSendBufferOptions.
+enum class CWebSocketSendLimitPolicy
+{
+	Fail, // The message is refused: the Send function returns false, and the message is not sent.
+	DropOldest // The message is queued, and the oldest messages that haven't been handed to the transport yet are dropped to make room for it.
+	           // Since messages are dropped once they reach the send queue, the send buffer may briefly exceed the limit while a burst is on its way there.
+};
+
+// Bounds on the send buffer, which holds the messages passed to the Send functions until they have been sent. See CWebSocket::SetSendBufferOptions.
+struct CWebSocketSendBufferOptions
+{
+	size_t highWatermark = 0; // onHighWatermark is called when the buffered amount reaches this many bytes. 0 disables the watermarks, which is the default.
+	size_t lowWatermark = 0; // Once the high watermark has been reached, onDrain is called when the buffered amount falls to this many bytes or fewer.
+	size_t limit = 0; // The most bytes the send buffer may hold. 0 means no limit, which is the default.
+	CWebSocketSendLimitPolicy policy = CWebSocketSendLimitPolicy::Fail; // What happens to messages that would take the send buffer past limit.
+};
+
+// The state of the send buffer. See CWebSocket::GetSendBufferStats.
+struct CWebSocketSendBufferStats
+{
+	size_t bufferedAmount; // Bytes passed to the Send functions and not sent yet, like the bufferedAmount of browser websockets.
+	size_t bufferedMessages;
+	size_t refusedMessages; // Messages refused because the send buffer was full, since the websocket was created.
+	size_t droppedMessages; // Messages dropped to make room for newer ones, since the websocket was created.
+};
+
+class CWebSocket;
+
+namespace cwebsocketinternal
+{
+	// The part of an operation awaited by a coroutine that the websocket resumes. The coroutine handle is kept as an address, along with a function that
+	// resumes it, so that the classes look the same to C++17 code, which can't await them but may still call the functions that return them.
+	class CWebSocketAwaiter
+	{
+	private:
+		void *_coroutine;
+		void (*_resume)(void *coroutine);
+	protected:
+		template <typename Handle>
+		static void _ResumeHandle(void *coroutine) { Handle::from_address(coroutine).resume(); }
+		template <typename Handle>
+		void _SetHandle(Handle handle)
+		{
+			_coroutine = handle.address();
+			_resume = &_ResumeHandle<Handle>;
+		}
+	public:
+		void Resume() { _resume(_coroutine); }
+	};
+}
+
+// Completes a co_await on CWebSocket::Connect with true once the connection has opened, or with false if it failed, or was superseded by another Connect.
+// Only one coroutine may await a Connect of a websocket at a time.
+// The coroutine is resumed on the thread the websocket reports events on, right after onOpen or onError. Nothing is allocated for it.
+// Awaiting it also makes the websocket hand incoming messages to CWebSocket::Receive, so that none of them can arrive before the coroutine is ready,
+// unless a message callback is set. See CWebSocket::Receive.
+// Discarding it, as callers using the callbacks do, leaves the connection attempt alone.
+class CWebSocketConnectOperation : public cwebsocketinternal::CWebSocketAwaiter
+{
+	friend class CWebSocket;
+private:
+	CWebSocket *_webSocket;
+	size_t _generation; // Identifies the call to Connect that returned the operation.
+	bool _awaited;
+	bool _opened;
+private:
+	CWebSocketConnectOperation(CWebSocket *webSocket, size_t generation);
+	bool _Suspend();
+public:
+	CWebSocketConnectOperation(const CWebSocketConnectOperation&) = delete;
+	~CWebSocketConnectOperation();
+	bool await_ready() { return false; }
+	template <typename Handle>
+	bool await_suspend(Handle handle)
+	{
+		_SetHandle(handle);
+		return _Suspend();
+	}
+	bool await_resume() const { return _opened; }
+};
+
+// The message a co_await on CWebSocket::Receive completes with.
+// data is valid until the coroutine suspends again; to keep the message longer, copy it.
+struct CWebSocketMessageView
+{
+	const BYTE *data;
+	size_t length;
+	bool isUTF8; // data is valid UTF8, and not null-terminated.
+	bool closed; // The connection has ended, gracefully or not, and no more messages follow. data is nullptr.
+};
+
+// Completes a co_await on CWebSocket::Receive with the next message. Only one coroutine may await a message of a websocket at a time.
+// The coroutine is resumed on the thread the websocket reports events on, while the message is still in the buffer it was received into. Nothing is allocated for it.
+class CWebSocketReceiveOperation : public cwebsocketinternal::CWebSocketAwaiter
+{
+	friend class CWebSocket;
+private:
+	CWebSocket *_webSocket;
+	CWebSocketMessageView _message;
+private:
+	explicit CWebSocketReceiveOperation(CWebSocket *webSocket);
+	bool _Suspend();
+public:
+	CWebSocketReceiveOperation(const CWebSocketReceiveOperation&) = delete;
+	bool await_ready() { return false; }
+	template <typename Handle>
+	bool await_suspend(Handle handle)
+	{
+		_SetHandle(handle);
+		return _Suspend();
+	}
+	CWebSocketMessageView await_resume() const { return _message; }
+};
+
+// Queues a message when a coroutine co_awaits it, and completes with true once the transport has written all of it, or with false if it was refused
+// because the send buffer was full, dropped to make room for newer messages, or the connection ended before it was written.
+// The coroutine is resumed on the thread the websocket reports events on. Nothing is allocated for it, besides the copy made by the overloads that copy.
+// Nothing is sent unless the operation is awaited.
+class CWebSocketSendOperation : public cwebsocketinternal::CWebSocketAwaiter
+{
+	friend class CWebSocket;
+private:
+	CWebSocket *_webSocket;
+	CWebSocketSharedBuffer _message;
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE _bufferType;
+	CWebSocketSendPriority _priority;
+	bool _refused; // The message couldn't be copied, and won't be sent.
+	bool _written;
+	CWebSocketSendOperation *_next; // The next operation to resume, once the message is done with.
+private:
+	CWebSocketSendOperation(CWebSocket *webSocket, const CWebSocketSharedBuffer &message, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, CWebSocketSendPriority priority, bool refused);
+	bool _Suspend();
+public:
+	CWebSocketSendOperation(const CWebSocketSendOperation&) = delete;
+	bool await_ready() { return false; }
+	template <typename Handle>
+	bool await_suspend(Handle handle)
+	{
+		_SetHandle(handle);
+		return _Suspend();
+	}
+	bool await_resume() const { return _written; }
+};
 
 class CWebSocket
 {
+	friend class CWebSocketServer;
+	friend class CWebSocketConnectOperation;
+	friend class CWebSocketReceiveOperation;
+	friend class CWebSocketSendOperation;
 private:
-	const static DWORD WinHttpBufferLength = 1024;
+	const static DWORD DefaultReceiveBufferLength = 1024; // See CWebSocketReceiveBufferOptions::length.
 	const static DWORD CloseReasonBufferLength = 123;
+	const static size_t SendBatchBudget = 262144; // Stop adding queued messages to a batch once it has this many bytes. See CWebSocketTransport::SendBatch.
+	// The bits of _messageCallbacks.
+	const static unsigned BinaryMessageCallback = 1;
+	const static unsigned UTF8MessageCallback = 2;
+	const static unsigned UTF8MessageViewCallback = 4;
+	const static unsigned MessageBeginCallback = 8;
+	const static unsigned MessageChunkCallback = 16;
+	const static unsigned MessageEndCallback = 32;
 private:
-	HINTERNET _hSession;
-	HINTERNET _hConnection;
-	HINTERNET _hWebSocket;
-	HINTERNET _hRequest;
-	LPWSTR _serverName;
-	INTERNET_PORT _port;
-	LPWSTR _path;
+	CWebSocketTransport *_transport; // Does the actual networking. Owned by CWebSocket.
 	SeqAsyncQueue _saq; // Calls to all public member functions get queued and are executed in a worker thread sequentially.
 	AsyncTimer _at; // The timer that is set when Connect is called with delayms != 0.
+	AsyncTimer _kt; // The keepalive timer. Waits for either the time to send the next ping, or the deadline of the pong to the last one.
 	cwebsocketinternal::CWebSocketCallbackList _callbackList;
-	BYTE _winHttpBuffer[WinHttpBufferLength];
-	std::vector<BYTE> _receiveBuffer;
-	std::queue< std::pair<std::vector<BYTE>, WINHTTP_WEB_SOCKET_BUFFER_TYPE> > _sendBuffer;
+	std::vector<BYTE> _transportBuffer; // Receives data from transports that can't report it in place.
+	cwebsocketinternal::CWebSocketReceiveSizer _receiveSizer; // Sizes _transportBuffer.
+	cwebsocketinternal::CWebSocketPooledBytes _receiveBuffer; // Assembles fragmented messages. Empty between messages, so that idle websockets hold no memory.
+	std::atomic<CWebSocketBufferPool*> _bufferPool; // Read by the Send functions on the caller's thread.
+	bool _receivingMessage; // Some, but not all fragments of the current message have arrived.
+	size_t _receivedMessageLength; // The length of the fragments of the current message that have arrived so far.
+	size_t _maxMessageSize; // 0 if messages may be of any size.
+	cwebsocketinternal::CWebSocketUTF8Validator _UTF8Validator; // Validates the incoming UTF8 message as its fragments arrive.
+	// A message in a send queue. Prepared messages keep the header of their frame in the headerLength bytes before the payload, see CWebSocketPreparedMessage.
+	struct QueuedMessage
+	{
+		CWebSocketSharedBuffer payload;
+		WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType;
+		size_t headerLength; // 0 if the message isn't prepared.
+		CWebSocketSendOperation *waiter; // Resumed once the message has been written or dropped. nullptr if no coroutine awaits it.
+	};
+	typedef cwebsocketinternal::CWebSocketRingQueue<QueuedMessage> SendQueue;
+	SendQueue _sendBuffer; // The normal lane. The first _sendsInFlight messages are being sent. The transport may use their bytes until WriteComplete.
+	SendQueue _urgentBuffer; // The urgent lane. The first _urgentsInFlight messages are being sent.
+	size_t _sendsInFlight; // The number of normal messages whose last piece was handed to the transport with the last Send or SendBatch.
+	size_t _urgentsInFlight;
+	size_t _sendOffset; // The number of bytes of the normal message after the ones in flight that have been handed to the transport as fragments. 0 if it hasn't started going out.
+	bool _sendPending; // A Send or SendBatch hasn't completed yet.
+	size_t _fragmentLength; // Normal messages longer than this are sent as fragments of this length. 0 if messages are not fragmented.
+	std::vector<CWebSocketTransportMessage> _sendBatch; // Reused for every batch, to avoid an allocation per batch.
+	std::atomic<size_t> _bufferedAmount; // Counts the messages from the moment they are passed to the Send functions, on the caller's thread, until they have been sent or dropped.
+	std::atomic<size_t> _bufferedMessages;
+	std::atomic<size_t> _refusedMessages;
+	std::atomic<size_t> _droppedMessages;
+	std::atomic<size_t> _sendBufferLimit; // Read by the Send functions on the caller's thread. 0 if there is no limit.
+	std::atomic<CWebSocketSendLimitPolicy> _sendLimitPolicy;
+	size_t _highWatermark; // 0 if the watermarks are disabled.
+	size_t _lowWatermark;
+	bool _aboveHighWatermark; // onHighWatermark has been called, and onDrain hasn't been called since.
 	bool _initialized;
 	CWebSocketState _state;
 	HANDLE _mMutex;
-	HANDLE _eDrainWinHttpCallbacks; // If this event is set, CWebSocketWinHttpCallback will ignore all callbacks from WinHttp except WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING.
+	HANDLE _eDrainTransportCallbacks; // If this event is set, CWebSocketOnTransportEvent will ignore all events from the transport.
 	HANDLE _eDrainSaqAtCallbacks; // If this event is set, asynchronous callbacks from SaqAsyncQueue and AsyncTimer will be ignored.
-	HANDLE _eRequestHandleClosed;
-	HANDLE _eWebSocketHandleClosed;
+	std::atomic<bool> _drainTransportCallbacks; // Used instead of _eDrainTransportCallbacks when the websocket is pinned to a reactor loop.
+	std::atomic<bool> _drainSaqAtCallbacks; // Used instead of _eDrainSaqAtCallbacks when the websocket is pinned to a reactor loop.
+	SeqAsyncExecutor *_executor; // The reactor loop the websocket is pinned to, or nullptr. If not nullptr, _mMutex and the events are not created.
 	USHORT _closeStatus;
 	std::vector<BYTE> _UTF8CloseReason;
-	bool _secure;
 	size_t _reconnectCount; // A counter that increases with every call to Connect.
+	DWORD _pingIntervalms; // 0 if keepalive is disabled.
+	DWORD _pongTimeoutms;
+	size_t _keepAliveGeneration; // Increases every time _kt is set or cancelled, so that stale timer callbacks can be recognized.
+	bool _pongPending; // A ping has been sent and its pong hasn't arrived yet.
+	uint32_t _pingSequence; // The payload of the last ping.
+	std::chrono::steady_clock::time_point _pingSentAt;
+	mutable std::mutex _rttMutex; // Protects _rtt, which is read by GetRoundTripTime on the caller's thread.
+	CWebSocketRoundTripTime _rtt;
+	CWebSocketCompressionOptions _compression; // Passed to the transport whenever a connection is opened.
+	cwebsocketinternal::CWebSocketMetrics _metrics;
+	uint64_t _sendStartedus; // When the last Send or SendBatch was made, for the write latency histogram.
+	uint64_t _connectStartedus; // When the current connection was started.
+	CWebSocketConnectTimings _connectTimings; // The phases of the current connection that have ended so far.
+	// The state shared with the operations awaited by coroutines, which may run on any thread. _awaitMutex protects the fields below, except where noted.
+	std::mutex _awaitMutex;
+	size_t _connectCalls; // The number of calls to Connect. Identifies the operations Connect returned.
+	size_t _connectsResolved; // The operations of the calls to Connect up to this one have been awaited or discarded.
+	size_t _connectGeneration; // The call to Connect the current connection attempt belongs to.
+	size_t _connectsCompleted; // The call to Connect up to which the outcomes are known.
+	bool _connectOpened; // The outcome of the connection attempt of _connectsCompleted.
+	CWebSocketConnectOperation *_connectWaiter;
+	CWebSocketReceiveOperation *_receiveWaiter;
+	std::atomic<bool> _pullMode; // Messages go to Receive instead of the callbacks. Set once Receive or Connect has been awaited. Read without the mutex.
+	unsigned _messageCallbacks; // The message callbacks that are set. Updated on the caller's thread, so that pull mode is checked against them right away.
+	bool _receiveParked; // A receive is due, but the transport has not been asked for one, since no one is awaiting a message.
+	bool _messageParked; // A message arrived while no one was awaiting it. It waits in _receiveBuffer, and receiving is parked until it has been taken.
+	bool _parkedMessageIsUTF8;
+	bool _receiveClosed; // The connection has ended. Receive completes right away with a closed view, until Connect is called.
+	bool _resuming; // An operation is being resumed on the thread that reports events, which checks whether to receive again once it returns.
+	CWebSocketSendOperation *_completedSends; // Send operations to resume, in the order their messages were done with. Only touched on the thread that reports events.
+	CWebSocketSendOperation *_lastCompletedSend;
 
 private:
-	HRESULT _CreateSessionConnectionHandles();
+	bool _InitializeTransport(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool __secure);
+	bool _InitializeAccepted(CWebSocketReactor *reactor, size_t loopIndex, int acceptedFd, const WCHAR *path);
 	bool _SendUpgradeRequest();
-	bool _WinHttpReceive();
+	bool _Receive();
 	bool _QueryCloseStatus(PWSTR *reason, USHORT *status);
-	void _ClientSendBinaryOrUTF8(const BYTE *message, size_t length, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType);
+	bool _QueueSend(const QueuedMessage &message, CWebSocketSendPriority priority);
+	bool _QueueSendCopy(const BYTE *message, size_t length, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, CWebSocketSendPriority priority);
+	bool _ReserveSendBuffer(size_t length);
+	void _ReleaseSendBuffer(size_t messageCount, size_t length);
+	void _DropOldestQueued();
+	void _DropQueued(SendQueue &queue, size_t first, size_t buffered, size_t limit);
+	void _ReleaseSent(SendQueue &queue, size_t count);
+	void _CountSent(const SendQueue &queue, size_t count);
+	void _UpdateWatermarks();
+	bool _SendQueued();
+	static CWebSocketTransportMessage _TransportMessage(const QueuedMessage &queued);
+	void _ClientSendBinaryOrUTF8(const QueuedMessage &message, CWebSocketSendPriority priority);
+	void _StartClosingHandshake(USHORT usStatus, const std::vector<BYTE> &UTF8Reason);
 	void _Abort();
+	void _AbortTransport();
+	void _SetState(CWebSocketState state);
 	void CWebSocketOnOpen();
-	void CWebSocketOnError();
+	void CWebSocketOnError(CWebSocketErrorCause cause);
 	void CWebSocketOnClose();
 	void CWebSocketOnClosing();
 	void CWebSocketOnClosed();
 	void CWebSocketOnSendBufferSent();
 	void CWebSocketOnConnectionReset();
-	void CWebSocketOnMessage(WINHTTP_WEB_SOCKET_STATUS *status);
+	void CWebSocketOnMessage(const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data);
 	void CWebSocketOnWriteComplete();
+	void CWebSocketOnPong(const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data);
+	void CWebSocketOnKeepAliveTimer();
+	void _SetKeepAliveTimer(DWORD delayms);
+	void _StopKeepAlive();
 	void CWebSocketOnSendRequestComplete();
 	void CWebSocketOnReceiveResponseComplete();
-
-	void static CALLBACK CWebSocketCallback(
-		HINTERNET hInternet,
-		DWORD_PTR dwContext,
-		DWORD     dwInternetStatus,
-		LPVOID    lpvStatusInformation,
-		DWORD     dwStatusInformationLength);
+	void CWebSocketOnTransportEvent(CWebSocketTransportEvent event, const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data);
+	bool _SetMessageCallback(unsigned callback, bool set);
+	void _QueueInvalidOperation();
+	bool _AwaitConnect(CWebSocketConnectOperation *operation);
+	void _DiscardConnect(size_t generation);
+	bool _AwaitReceive(CWebSocketReceiveOperation *operation);
+	bool _AwaitSend(CWebSocketSendOperation *operation);
+	bool _StartReceiving();
+	bool _ShouldUnparkReceive() const;
+	void _QueueUnparkReceive();
+	void _UnparkReceive();
+	void _DeliverMessage(const BYTE *message, size_t length, bool isUTF8, bool inPlace);
+	void _CompleteConnect(bool opened);
+	void _CompleteSends(SendQueue &queue, size_t first, size_t count, bool written);
+	void _CompleteSend(CWebSocketSendOperation *operation, bool written);
+	void _ResumeCompletedSends();
+	void _Resume(cwebsocketinternal::CWebSocketAwaiter *awaiter);
+	void _EndAwaiters();
 
 public:
 	CWebSocket();
@@ -100,24 +367,48 @@ public:
 	// Returns true for success, false for failure.
 	// If this function returns false, destruct the object without calling any member functions.
 	// If this function returns true, set pertinent callbacks using on* class of functions and call Connect to connect the websocket.
+	// The websocket uses the default transport for the platform, see CreateDefaultCWebSocketTransport.
 	bool Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool secure);
 
-	// Send the given binary message over the websocket.
-	void SendBinary(const BYTE *message, size_t length);
+	// Same as above, but the websocket uses the given transport. CWebSocket takes ownership of the transport, even if this function fails.
+	bool Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool secure, CWebSocketTransport *transport);
+
+	// Same as above, but the websocket is pinned to one of the loops of the given reactor, along with many other websockets. See CWebSocketReactor.h.
+	// The reactor must outlive the websocket.
+	bool Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool secure, CWebSocketReactor *reactor);
+
+	// Send the given binary message over the websocket. The message is copied into a block of the buffer pool, see SetBufferPool.
+	// Like all Send functions, returns false if the message won't be sent because the send buffer is full (see SetSendBufferOptions), or it couldn't be copied.
+	// Urgent messages overtake the normal messages that haven't started going out yet. A message that has started going out, possibly as fragments
+	// (see SetSendFragmentLength), is always finished first, since websocket messages can't be interleaved.
+	bool SendBinary(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Same as above, but the websocket takes over the bytes of message instead of copying them.
+	bool SendBinary(std::vector<BYTE> &&message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Same as above, but the bytes of message are sent straight from where they are, and stay referenced until they have been sent or dropped.
+	// The same buffer can be sent over many websockets at once. See CWebSocketSharedBuffer.
+	bool SendBinary(const CWebSocketSharedBuffer &message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
 
 	// Send the given unicode message over the websocket as a UTF8 message.
-	void SendWString(const WCHAR *message);
+	bool SendWString(const WCHAR *message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
 
 	// Send the given UTF8 encoded unicode message as a UTF8 message.
-	void SendUTF8String(const BYTE *message, size_t length);
+	bool SendUTF8String(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
 
 	// Send the given unicode message over the websocket as a binary message.
-	void SendWStringAsBinary(const WCHAR *message);
+	bool SendWStringAsBinary(const WCHAR *message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Send a message framed in advance, which is referenced rather than copied, like a CWebSocketSharedBuffer. On the server end of a connection its frame is
+	// written as it is, so the same message goes out over any number of websockets without being framed for each. See CWebSocketGroup.
+	// Sent as fragments like any other message if it is longer than the fragment length, see SetSendFragmentLength. Returns false if message is empty.
+	bool SendPrepared(const CWebSocketPreparedMessage &message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
 
 	// Gracefully closes the underlying websocket. To abort a websocket, call Abort or destruct it.
 	// usStatus defaults to WINHTTP_WEB_SOCKET_SUCCESS_CLOSE_STATUS (1000) and reason defaults to empty string.
 	// CWebSocket encodes the given reason string in UTF8 before sending it.
 	// Note that CWebSocket will not send a close frame right away if there is data waiting to be sent to the server in the send buffer, but will instead wait for the buffer to be completely sent.
+	// No data can follow a close frame, so unlike pings and pongs, it can't overtake the messages in the send buffer. Use Abort to drop them.
 	// Do not call this function while a call to Connect is waiting for the timeout.
 	void Close(USHORT code = WINHTTP_WEB_SOCKET_SUCCESS_CLOSE_STATUS, const WCHAR *reason = L"");
 
@@ -126,18 +417,107 @@ public:
 	// Since all public functions are executed lazily, even after these functions return, a network event may happen in the time it takes to change a callback, which will cause the previous callback to be called.
 	// It's important to note that if a network event happens while a callback is executing, CWebSocket will wait for the callback of the previous event to finish before calling the callback for the new event.
 	CWebSocket& onOpen(CWebSocketOnOpenCallback cb);
+	CWebSocket& onOpenDetails(CWebSocketOnOpenDetailsCallback cb);
 	CWebSocket& onBinaryMessage(CWebSocketOnBinaryMessageCallback cb);
 	CWebSocket& onUTF8Message(CWebSocketOnUTF8MessageCallback cb);
+	CWebSocket& onUTF8MessageView(CWebSocketOnUTF8MessageViewCallback cb);
+	CWebSocket& onMessageBegin(CWebSocketOnMessageBeginCallback cb);
+	CWebSocket& onMessageChunk(CWebSocketOnMessageChunkCallback cb);
+	CWebSocket& onMessageEnd(CWebSocketOnMessageEndCallback cb);
 	CWebSocket& onClose(CWebSocketOnCloseCallback cb);
 	CWebSocket& onClosing(CWebSocketOnClosingCallback cb);
 	CWebSocket& onClosed(CWebSocketOnClosedCallback cb);
 	CWebSocket& onError(CWebSocketOnErrorCallback cb);
+	CWebSocket& onHighWatermark(CWebSocketOnHighWatermarkCallback cb);
+	CWebSocket& onDrain(CWebSocketOnDrainCallback cb);
 
 	// Attempts to connect the websocket to the url specified in the call to Initialize, after waiting for delayms milliseconds.
 	// Do not call Connect while another call to Connect is waiting for the timeout.
 	// Aborts the current connection, if exists.
 	// Expect either onOpen or onError callback to be called as the response.
-	void Connect(DWORD delayms = 0);
+	// Returns an operation that a C++20 coroutine can co_await instead, see CWebSocketConnectOperation. Callers using the callbacks may discard it.
+	CWebSocketConnectOperation Connect(DWORD delayms = 0);
+
+	// The functions below return operations for C++20 coroutines to co_await, as an alternative to the callbacks. Each resumes the coroutine directly on the
+	// thread the websocket reports events on: the reactor loop the websocket is pinned to, or the thread of the transport callback otherwise.
+	// The callbacks keep working alongside, except for the message callbacks: onBinaryMessage, onUTF8Message, onUTF8MessageView and the streaming callbacks.
+	// Awaiting Receive or Connect turns pull mode on for good, in which incoming messages go to Receive, unless a message callback is set at the time, in
+	// which case messages keep going to the callbacks. The two never share the messages: setting a message callback in pull mode, and awaiting Receive while
+	// a message callback is set, are refused and reported to onError as an invalid operation. The refused callback is not set, and the refused Receive
+	// completes with a closed view. Setting a message callback to nullptr is always allowed.
+	// Do not destruct the websocket while an operation is being awaited, nor from the coroutine it resumes.
+
+	// Awaits the next incoming message, see CWebSocketReceiveOperation. Messages are received from the connection only while a coroutine is awaiting one,
+	// so a slow consumer slows the server down instead of making the websocket buffer. Messages that arrive fragmented are reassembled first.
+	// Completes with a closed view once the connection has ended, including after a failed Connect.
+	CWebSocketReceiveOperation Receive();
+
+	// Awaits sending a binary message, which is referenced rather than copied like with SendBinary. See CWebSocketSendOperation.
+	CWebSocketSendOperation Send(const CWebSocketSharedBuffer &message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Same as above, but message is copied into a block of the buffer pool when the operation is created.
+	CWebSocketSendOperation Send(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Same as above, for a UTF8 message. message must be valid UTF8.
+	CWebSocketSendOperation SendUTF8(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal);
+
+	// Limits the size of incoming messages to maxMessageSize bytes. Pass 0 to remove the limit, which is the default.
+	// As soon as a message turns out to be larger, the rest of it is discarded and the websocket starts the closing handshake with status 1009 (message too big),
+	// which is reported with onClose once the server responds. Applies to streamed messages as well.
+	void SetMaxMessageSize(size_t maxMessageSize);
+
+	// Sets how many bytes are received at a time. Transports that can't report received data in place, like WinHttp, receive into a buffer of this size,
+	// and report a message larger than the buffer a piece at a time. The default is 1024 bytes, and the buffer is allocated per websocket.
+	// Transports that receive in place, like the one used on Linux, size their reads from the socket instead. Theirs default to 64 KB.
+	// In adaptive mode, the size grows toward the size of the messages that arrive, up to options.maxLength, and shrinks back as they get smaller,
+	// which saves memory across many mostly idle websockets while still receiving large messages in a few pieces.
+	void SetReceiveBuffer(const CWebSocketReceiveBufferOptions &options);
+
+	// Makes the websocket draw the copies of the messages passed to SendBinary, SendUTF8String and SendWStringAsBinary, the buffers that assemble fragmented
+	// incoming messages, and the frames serialized by transports that do their own framing from pool, which may be shared with any number of websockets.
+	// pool must outlive the websocket, and all copies of CWebSocketSharedBuffer made from it.
+	// Pass nullptr to go back to CWebSocketBufferPool::Default(), which is used unless told otherwise. Takes effect right away.
+	void SetBufferPool(CWebSocketBufferPool *pool);
+
+	// Makes normal messages longer than fragmentLength bytes go out as fragments of fragmentLength bytes. Pings and pongs may be sent between the fragments
+	// of a message, so with transports that do their own framing, they wait for at most one fragment rather than the whole message; keepalive round trip times
+	// stay accurate, and the server's pings get answered in time. Pass 0 to send messages whole, which is the default.
+	// Fragments are sent uncompressed, see SetCompression. Takes effect with the next message that starts going out.
+	void SetSendFragmentLength(size_t fragmentLength);
+
+	// Bounds the send buffer, which holds the messages passed to the Send functions until they have been sent, so that a slow server can't make it grow without limit.
+	// Producers can pace themselves with the watermarks: stop sending on onHighWatermark, and resume on onDrain. Messages that would take the send buffer
+	// past options.limit are refused or make room for themselves, depending on options.policy. A message larger than the limit is never sent.
+	// The limit and the policy take effect right away, the watermarks with the next message sent or sent out.
+	void SetSendBufferOptions(const CWebSocketSendBufferOptions &options);
+
+	// Returns the number of bytes passed to the Send functions and not sent yet, like the bufferedAmount of browser websockets. May be called from any thread.
+	// Messages left unsent when a connection ends are counted until the next connection opens.
+	size_t GetBufferedAmount() const;
+
+	// Returns the state of the send buffer. May be called from any thread.
+	CWebSocketSendBufferStats GetSendBufferStats() const;
+
+	// Makes the websocket offer permessage-deflate compression with the given options when it connects, or stop offering it if options.enabled is false.
+	// Takes effect with the next call to Connect. Whether messages are actually compressed depends on the server, which may decline the offer.
+	// Compression needs a transport that does its own framing; with other transports, including the WinHttp one, the offer is not made.
+	// Invalid options are ignored, and compression stays off. See CWebSocketCompressionOptions for the valid ranges.
+	void SetCompression(const CWebSocketCompressionOptions &options);
+
+	// Makes the websocket send a ping every pingIntervalms milliseconds while the connection is open, and measure the round trip time of the pongs.
+	// If the pong to a ping doesn't arrive within pongTimeoutms milliseconds, the connection is considered dead and gets aborted, which is reported like a connection reset:
+	// onClosing (or onClose) is called with wasClean set to false, followed by onClosed.
+	// Pass 0 as pingIntervalms to disable keepalive, which is the default. Takes effect right away if the connection is open.
+	// Keepalive needs a transport that can send pings. The WinHttp transport can't; WinHttp sends keepalive pings of its own instead.
+	void KeepAlive(DWORD pingIntervalms, DWORD pongTimeoutms);
+
+	// Retrieves the round trip times measured by keepalive pings on the current connection. May be called from any thread.
+	// Returns false if no pong has been received on the connection yet.
+	bool GetRoundTripTime(CWebSocketRoundTripTime *rtt) const;
+
+	// Returns the counters of the websocket since it was created: messages and bytes sent and received, connections, errors by cause, the time spent
+	// in each state, and latency histograms. May be called from any thread. See CWebSocketMetrics.h for the sum over all websockets and for exporting them.
+	CWebSocketMetricsSnapshot GetMetrics() const;
 
 	// Closes the underlying TCP connection without a proper websocket closing handshake.
 	// After this function is called, you may call Connect to open a new connection to the server.
@@ -0,0 +1,305 @@
+#include <new>
+#include <memory>
+#include <algorithm>
+#include <utility>
+#include <string.h>
+
+#include "CWebSocketBufferPool.h"
+
+namespace
+{
+	// Allocates the control blocks of shared_ptrs from a pool.
+	template <typename T>
+	class PoolAllocator
+	{
+	public:
+		typedef T value_type;
+		CWebSocketBufferPool *pool;
+
+		explicit PoolAllocator(CWebSocketBufferPool *p) : pool(p) {}
+		template <typename U>
+		PoolAllocator(const PoolAllocator<U> &other) : pool(other.pool) {}
+
+		T *allocate(size_t n)
+		{
+			BYTE *block = pool->Acquire(n * sizeof(T));
+			if (block == nullptr)
+				throw std::bad_alloc();
+			return reinterpret_cast<T*>(block);
+		}
+		void deallocate(T *p, size_t n)
+		{
+			pool->Release(reinterpret_cast<BYTE*>(p), n * sizeof(T));
+		}
+		template <typename U>
+		bool operator==(const PoolAllocator<U> &other) const { return pool == other.pool; }
+		template <typename U>
+		bool operator!=(const PoolAllocator<U> &other) const { return pool != other.pool; }
+	};
+}
+
+CWebSocketBufferPool::CWebSocketBufferPool(size_t maxCachedBytesPerClass) :
+	_maxCachedBytesPerClass(maxCachedBytesPerClass),
+	_allocated(0),
+	_freed(0),
+	_oversizedAcquired(0),
+	_oversizedReleased(0)
+{
+	for (SizeClass &sizeClass : _classes)
+	{
+		sizeClass.free = nullptr;
+		sizeClass.cachedBlocks = 0;
+		sizeClass.acquired = 0;
+		sizeClass.reused = 0;
+		sizeClass.released = 0;
+	}
+}
+
+CWebSocketBufferPool::~CWebSocketBufferPool()
+{
+	for (SizeClass &sizeClass : _classes)
+	{
+		while (sizeClass.free != nullptr)
+		{
+			FreeBlock *block = sizeClass.free;
+			sizeClass.free = block->next;
+			delete[] reinterpret_cast<BYTE*>(block);
+		}
+	}
+}
+
+// Returns the index of the smallest size class that fits length, or ClassCount if none does.
+size_t CWebSocketBufferPool::_ClassOf(size_t length)
+{
+	size_t index = 0;
+	for (size_t blockLength = MinBlockLength; blockLength < length; blockLength *= 2)
+	{
+		if (++index == ClassCount)
+			break;
+	}
+	return index;
+}
+
+BYTE *CWebSocketBufferPool::Acquire(size_t length, size_t *blockLength)
+{
+	const size_t index = _ClassOf(length);
+	if (index == ClassCount)
+	{
+		BYTE *block = new(std::nothrow) BYTE[length];
+		if (block == nullptr)
+			return nullptr;
+		_oversizedAcquired.fetch_add(1, std::memory_order_relaxed);
+		_allocated.fetch_add(1, std::memory_order_relaxed);
+		if (blockLength != nullptr)
+			*blockLength = length;
+		return block;
+	}
+
+	const size_t classLength = MinBlockLength << index;
+	SizeClass &sizeClass = _classes[index];
+	BYTE *block = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(sizeClass.mutex);
+		if (sizeClass.free != nullptr)
+		{
+			FreeBlock *free = sizeClass.free;
+			sizeClass.free = free->next;
+			sizeClass.cachedBlocks--;
+			sizeClass.reused++;
+			block = reinterpret_cast<BYTE*>(free);
+		}
+		sizeClass.acquired++;
+	}
+	if (block == nullptr)
+	{
+		block = new(std::nothrow) BYTE[classLength];
+		if (block == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(sizeClass.mutex);
+			sizeClass.acquired--;
+			return nullptr;
+		}
+		_allocated.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (blockLength != nullptr)
+		*blockLength = classLength;
+	return block;
+}
+
+void CWebSocketBufferPool::Release(BYTE *block, size_t length)
+{
+	const size_t index = _ClassOf(length);
+	if (index == ClassCount)
+	{
+		delete[] block;
+		_oversizedReleased.fetch_add(1, std::memory_order_relaxed);
+		_freed.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const size_t classLength = MinBlockLength << index;
+	SizeClass &sizeClass = _classes[index];
+	{
+		std::lock_guard<std::mutex> lock(sizeClass.mutex);
+		sizeClass.released++;
+		if ((sizeClass.cachedBlocks + 1) * classLength <= _maxCachedBytesPerClass)
+		{
+			FreeBlock *free = reinterpret_cast<FreeBlock*>(block);
+			free->next = sizeClass.free;
+			sizeClass.free = free;
+			sizeClass.cachedBlocks++;
+			return;
+		}
+	}
+	delete[] block;
+	_freed.fetch_add(1, std::memory_order_relaxed);
+}
+
+CWebSocketSharedBuffer CWebSocketBufferPool::Copy(const BYTE *data, size_t length)
+{
+	return Copy(nullptr, 0, data, length);
+}
+
+CWebSocketSharedBuffer CWebSocketBufferPool::Copy(const BYTE *prefix, size_t prefixLength, const BYTE *data, size_t length)
+{
+	const size_t total = prefixLength + length;
+	BYTE *block = Acquire(total);
+	if (block == nullptr)
+		return CWebSocketSharedBuffer();
+	if (prefixLength > 0)
+		memcpy(block, prefix, prefixLength);
+	if (length > 0)
+		memcpy(block + prefixLength, data, length);
+	try
+	{
+		std::shared_ptr<const BYTE> shared(block, [this, total](const BYTE *p) { Release(const_cast<BYTE*>(p), total); }, PoolAllocator<BYTE>(this));
+		return CWebSocketSharedBuffer(std::move(shared), total);
+	}
+	catch (const std::bad_alloc&) // shared_ptr has released the block already.
+	{
+		return CWebSocketSharedBuffer();
+	}
+}
+
+CWebSocketBufferPoolStats CWebSocketBufferPool::GetStats()
+{
+	CWebSocketBufferPoolStats stats;
+	memset(&stats, 0, sizeof(stats));
+	for (size_t i = 0; i < ClassCount; i++)
+	{
+		std::lock_guard<std::mutex> lock(_classes[i].mutex);
+		stats.acquired += _classes[i].acquired;
+		stats.reused += _classes[i].reused;
+		stats.released += _classes[i].released;
+		stats.cachedBlocks += _classes[i].cachedBlocks;
+		stats.cachedBytes += _classes[i].cachedBlocks * (MinBlockLength << i);
+	}
+	stats.acquired += _oversizedAcquired.load(std::memory_order_relaxed);
+	stats.released += _oversizedReleased.load(std::memory_order_relaxed);
+	stats.allocated = _allocated.load(std::memory_order_relaxed);
+	stats.freed = _freed.load(std::memory_order_relaxed);
+	stats.outstanding = stats.acquired - stats.released;
+	return stats;
+}
+
+CWebSocketBufferPool *CWebSocketBufferPool::Default()
+{
+	// Constructed in static storage and never destructed, since blocks may be released during static destruction.
+	alignas(CWebSocketBufferPool) static unsigned char storage[sizeof(CWebSocketBufferPool)];
+	static CWebSocketBufferPool *pool = new (storage) CWebSocketBufferPool();
+	return pool;
+}
+
+namespace cwebsocketinternal
+{
+	CWebSocketPooledBytes::CWebSocketPooledBytes() :
+		_pool(nullptr),
+		_data(nullptr),
+		_size(0),
+		_capacity(0)
+	{
+	}
+
+	CWebSocketPooledBytes::~CWebSocketPooledBytes()
+	{
+		Clear();
+	}
+
+	CWebSocketPooledBytes::CWebSocketPooledBytes(CWebSocketPooledBytes &&other) noexcept :
+		_pool(other._pool),
+		_data(other._data),
+		_size(other._size),
+		_capacity(other._capacity)
+	{
+		other._pool = nullptr;
+		other._data = nullptr;
+		other._size = 0;
+		other._capacity = 0;
+	}
+
+	CWebSocketPooledBytes &CWebSocketPooledBytes::operator=(CWebSocketPooledBytes &&other) noexcept
+	{
+		if (this != &other)
+		{
+			Clear();
+			std::swap(_pool, other._pool);
+			std::swap(_data, other._data);
+			std::swap(_size, other._size);
+			std::swap(_capacity, other._capacity);
+		}
+		return *this;
+	}
+
+	bool CWebSocketPooledBytes::Append(CWebSocketBufferPool *pool, const BYTE *data, size_t length)
+	{
+		if (length == 0)
+			return true;
+		BYTE *p = Extend(pool, length);
+		if (p == nullptr)
+			return false;
+		memcpy(p, data, length);
+		return true;
+	}
+
+	BYTE *CWebSocketPooledBytes::Extend(CWebSocketBufferPool *pool, size_t length)
+	{
+		if (_capacity - _size < length && _Grow(pool, std::max(_size + length, _capacity * 2)) == false)
+			return nullptr;
+		BYTE *p = _data + _size;
+		_size += length;
+		return p;
+	}
+
+	bool CWebSocketPooledBytes::Reserve(CWebSocketBufferPool *pool, size_t capacity)
+	{
+		return capacity <= _capacity || _Grow(pool, capacity);
+	}
+
+	// Moves the bytes into a block of at least capacity bytes.
+	bool CWebSocketPooledBytes::_Grow(CWebSocketBufferPool *pool, size_t capacity)
+	{
+		CWebSocketBufferPool *newPool = (_pool != nullptr) ? _pool : pool; // Stay with the pool the current block came from.
+		size_t newCapacity;
+		BYTE *newData = newPool->Acquire(capacity, &newCapacity);
+		if (newData == nullptr)
+			return false;
+		if (_size > 0)
+			memcpy(newData, _data, _size);
+		if (_data != nullptr)
+			_pool->Release(_data, _capacity);
+		_pool = newPool;
+		_data = newData;
+		_capacity = newCapacity;
+		return true;
+	}
+
+	void CWebSocketPooledBytes::Clear()
+	{
+		if (_data != nullptr)
+			_pool->Release(_data, _capacity);
+		_pool = nullptr;
+		_data = nullptr;
+		_size = 0;
+		_capacity = 0;
+	}
+};
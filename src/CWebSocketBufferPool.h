@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+
+#include "Win32Compat.h"
+#include "CWebSocketSharedBuffer.h"
+
+// Statistics of a CWebSocketBufferPool, as returned by CWebSocketBufferPool::GetStats.
+struct CWebSocketBufferPoolStats
+{
+	size_t acquired; // Blocks handed out.
+	size_t reused; // Blocks handed out from the cache, without allocating from the heap.
+	size_t allocated; // Blocks allocated from the heap, because the cache had none of the right size, or they were too large to be cached.
+	size_t released; // Blocks given back.
+	size_t freed; // Blocks freed to the heap, because the cache was full or they were too large to be cached.
+	size_t outstanding; // Blocks handed out and not given back yet.
+	size_t cachedBlocks; // Blocks waiting in the cache.
+	size_t cachedBytes;
+};
+
+// A pool of memory blocks in size classes, which CWebSocket draws the buffers of its messages from, so that sending and receiving messages
+// doesn't allocate from the heap in steady state. Any number of websockets can share a pool, and the pool may be used from any number of threads.
+// Block lengths are powers of 2 from MinBlockLength to MaxBlockLength. Released blocks are cached for reuse, up to maxCachedBytesPerClass bytes per size class.
+// Longer blocks come straight from the heap.
+class CWebSocketBufferPool
+{
+public:
+	const static size_t MinBlockLength = 64;
+	const static size_t MaxBlockLength = 1048576;
+private:
+	const static size_t ClassCount = 15; // MinBlockLength << (ClassCount - 1) == MaxBlockLength
+
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	struct SizeClass
+	{
+		std::mutex mutex; // Protects everything below.
+		FreeBlock *free;
+		size_t cachedBlocks;
+		size_t acquired;
+		size_t reused;
+		size_t released;
+	};
+
+private:
+	SizeClass _classes[ClassCount];
+	size_t _maxCachedBytesPerClass;
+	std::atomic<size_t> _allocated;
+	std::atomic<size_t> _freed;
+	std::atomic<size_t> _oversizedAcquired; // Blocks longer than MaxBlockLength.
+	std::atomic<size_t> _oversizedReleased;
+private:
+	static size_t _ClassOf(size_t length);
+public:
+	explicit CWebSocketBufferPool(size_t maxCachedBytesPerClass = 4194304);
+	CWebSocketBufferPool(const CWebSocketBufferPool&) = delete;
+
+	// Frees the cached blocks. All blocks must have been released.
+	~CWebSocketBufferPool();
+
+	// Returns a block of at least length bytes, and stores its actual length in blockLength, if not nullptr. Returns nullptr if out of memory.
+	BYTE *Acquire(size_t length, size_t *blockLength = nullptr);
+
+	// Gives back a block returned by Acquire. length may be the length passed to Acquire, or the block length it returned.
+	void Release(BYTE *block, size_t length);
+
+	// Returns a copy of length bytes at data in a block of the pool, which goes back to the pool once the last reference to it is gone.
+	// The reference count is kept in a block of the pool too, so no heap allocation is needed in steady state.
+	// Returns an empty buffer, whose Data() is nullptr, if out of memory.
+	CWebSocketSharedBuffer Copy(const BYTE *data, size_t length);
+
+	// Same as above, but the copy is of prefixLength bytes at prefix, followed by length bytes at data.
+	CWebSocketSharedBuffer Copy(const BYTE *prefix, size_t prefixLength, const BYTE *data, size_t length);
+
+	CWebSocketBufferPoolStats GetStats();
+
+	// The pool websockets use unless told otherwise. See CWebSocket::SetBufferPool. Never destructed.
+	static CWebSocketBufferPool *Default();
+};
+
+namespace cwebsocketinternal
+{
+	// A growable byte buffer whose memory comes from a CWebSocketBufferPool. Clear gives the memory back.
+	class CWebSocketPooledBytes
+	{
+	private:
+		CWebSocketBufferPool *_pool; // The pool the block came from.
+		BYTE *_data;
+		size_t _size;
+		size_t _capacity;
+	private:
+		bool _Grow(CWebSocketBufferPool *pool, size_t capacity);
+	public:
+		CWebSocketPooledBytes();
+		CWebSocketPooledBytes(const CWebSocketPooledBytes&) = delete;
+		CWebSocketPooledBytes(CWebSocketPooledBytes &&other) noexcept;
+		~CWebSocketPooledBytes();
+		CWebSocketPooledBytes &operator=(CWebSocketPooledBytes &&other) noexcept;
+
+		// Appends length bytes at data. If the block is full, moves the bytes into a larger block of pool. Returns false if out of memory.
+		bool Append(CWebSocketBufferPool *pool, const BYTE *data, size_t length);
+
+		// Grows the buffer by length bytes, like Append, but leaves them for the caller to write. Returns a pointer to them, or nullptr if out of memory.
+		BYTE *Extend(CWebSocketBufferPool *pool, size_t length);
+
+		// Makes room for capacity bytes in total, so that appending up to that many doesn't move the bytes. Returns false if out of memory.
+		bool Reserve(CWebSocketBufferPool *pool, size_t capacity);
+
+		// Empties the buffer and gives its block back to its pool.
+		void Clear();
+
+		const BYTE *Data() const { return _data; }
+		size_t Size() const { return _size; }
+	};
+};
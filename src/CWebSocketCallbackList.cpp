@@ -7,9 +7,13 @@ namespace cwebsocketinternal
 		onOpen = []() {};
 		onBinaryMessage = [](const BYTE *message, size_t length) {};
 		onUTF8Message = [](PCWSTR message) {};
+		onMessageBegin = [](bool isUTF8) {};
+		onMessageEnd = []() {};
 		onClose = [](USHORT code, PCWSTR reason, bool wasClean) {};
 		onClosing = [](USHORT code, PCWSTR reason, bool wasClean) {};
 		onClosed = []() {};
 		onError = []() {};
+		onHighWatermark = [](size_t bufferedAmount) {};
+		onDrain = []() {};
 	}
 };
\ No newline at end of file
@@ -1,11 +1,23 @@
 #pragma once
 
-#include <windows.h>
+#include "Win32Compat.h"
+#include "CWebSocketTransport.h"
 #include <functional>
 
 // A callback function to be called when the connection opens.
 typedef std::function<void()> CWebSocketOnOpenCallback;
 
+// Describes how a connection was opened. See CWebSocketOnOpenDetailsCallback.
+struct CWebSocketOpenDetails
+{
+	CWebSocketConnectTimings timings; // How long each phase of opening the connection took. The phases are timed from the moment Connect starts connecting, after its delay.
+	bool reconnected; // The websocket has opened a connection before.
+};
+
+// A callback function to be called when the connection opens, with details on how it was opened.
+// If this callback is set, it is called instead of CWebSocketOnOpenCallback.
+typedef std::function<void(const CWebSocketOpenDetails &details)> CWebSocketOnOpenDetailsCallback;
+
 // A callback function to be called when a binary message arrives at the websocket.
 typedef std::function<void(const BYTE* message, size_t length)> CWebSocketOnBinaryMessageCallback;
 
@@ -14,6 +26,25 @@ typedef std::function<void(const BYTE* message, size_t length)> CWebSocketOnBina
 // If the received UTF8 string is invalid, OnErrorCallback will be called.
 typedef std::function<void(PCWSTR message)> CWebSocketOnUTF8MessageCallback;
 
+// A callback function to be called when a UTF8 string arrives at the websocket, with the string as it was received.
+// message is valid UTF8, is not null-terminated, and is only valid until the callback returns. It is validated while it arrives, so invalid strings cause onError to be called without waiting for the rest of the message.
+// If this callback is set, it is called instead of CWebSocketOnUTF8MessageCallback, and no conversion or allocation takes place.
+typedef std::function<void(const BYTE* message, size_t length)> CWebSocketOnUTF8MessageViewCallback;
+
+// A callback function to be called when the first piece of a message arrives, if messages are streamed. See CWebSocketOnMessageChunkCallback.
+// isUTF8 is true for UTF8 messages and false for binary messages.
+typedef std::function<void(bool isUTF8)> CWebSocketOnMessageBeginCallback;
+
+// A callback function to be called with every piece of a message as it arrives, which lets messages of any size be processed in constant memory.
+// If this callback is set, messages are streamed: CWebSocket doesn't buffer them, and onBinaryMessage, onUTF8Message and onUTF8MessageView are not called.
+// Each message is reported with a call to onMessageBegin, any number of calls to onMessageChunk, and a call to onMessageEnd.
+// chunk is only valid until the callback returns. Chunks of UTF8 messages are validated as they arrive, but may end in the middle of a character.
+// If a message turns out to be invalid UTF8, or exceeds the maximum message size, its onMessageEnd is never called. See CWebSocket::SetMaxMessageSize.
+typedef std::function<void(const BYTE* chunk, size_t length)> CWebSocketOnMessageChunkCallback;
+
+// A callback function to be called after the last piece of a streamed message has been reported. See CWebSocketOnMessageChunkCallback.
+typedef std::function<void()> CWebSocketOnMessageEndCallback;
+
 // A callback function to be called when the server initiates the closing handshake.
 // If this callback returns without calling Close, CWebSocket will automatically echo the close status it got from the server.
 // You can do additional Send's inside this callback if wasClean is true. Since the closing handshake will have been started by the server, we won't have sent our close frame.
@@ -38,18 +69,32 @@ typedef std::function<void()> CWebSocketOnClosedCallback;
 // After receiving this callback, the websocket will receive no further callbacks even if another network event happens until Connect is called to create a new connection.
 typedef std::function<void()> CWebSocketOnErrorCallback;
 
+// A callback function to be called when the bytes in the send buffer reach the high watermark. See CWebSocket::SetSendBufferOptions.
+// bufferedAmount is the number of bytes in the send buffer at the time. Producers should stop sending until onDrain is called.
+typedef std::function<void(size_t bufferedAmount)> CWebSocketOnHighWatermarkCallback;
+
+// A callback function to be called when the bytes in the send buffer fall to the low watermark, after having reached the high watermark.
+typedef std::function<void()> CWebSocketOnDrainCallback;
+
 namespace cwebsocketinternal
 {
 	class CWebSocketCallbackList
 	{
 	public:
 		CWebSocketOnOpenCallback onOpen;
+		CWebSocketOnOpenDetailsCallback onOpenDetails; // Empty unless set, see CWebSocketOnOpenDetailsCallback.
 		CWebSocketOnBinaryMessageCallback onBinaryMessage;
 		CWebSocketOnUTF8MessageCallback onUTF8Message;
+		CWebSocketOnUTF8MessageViewCallback onUTF8MessageView; // Empty unless set, see CWebSocketOnUTF8MessageViewCallback.
+		CWebSocketOnMessageBeginCallback onMessageBegin;
+		CWebSocketOnMessageChunkCallback onMessageChunk; // Empty unless set, see CWebSocketOnMessageChunkCallback.
+		CWebSocketOnMessageEndCallback onMessageEnd;
 		CWebSocketOnCloseCallback onClose;
 		CWebSocketOnClosingCallback onClosing;
 		CWebSocketOnClosedCallback onClosed;
 		CWebSocketOnErrorCallback onError;
+		CWebSocketOnHighWatermarkCallback onHighWatermark;
+		CWebSocketOnDrainCallback onDrain;
 	public:
 		CWebSocketCallbackList();
 	};
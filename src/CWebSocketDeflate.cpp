@@ -0,0 +1,294 @@
+#ifdef __linux__
+
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+#include "CWebSocketDeflate.h"
+
+namespace cwebsocketinternal
+{
+	// Every compressed message ends with an empty stored block, whose last 4 bytes are left out on the wire (RFC 7692, section 7.2.1).
+	static const BYTE DeflateTrailer[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+	static std::string TrimParameter(const std::string &s)
+	{
+		const size_t begin = s.find_first_not_of(" \t");
+		if (begin == std::string::npos)
+			return std::string();
+		const size_t end = s.find_last_not_of(" \t");
+		return s.substr(begin, end - begin + 1);
+	}
+
+	// Parses the value of a window bits parameter, which may be quoted. Returns 0 if it's not a number between 8 and 15.
+	static int ParseWindowBits(std::string value)
+	{
+		if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+			value = value.substr(1, value.size() - 2);
+		if (value.size() == 0 || value.size() > 2 || value.find_first_not_of("0123456789") != std::string::npos)
+			return 0;
+		const int bits = std::stoi(value);
+		return (bits >= 8 && bits <= 15) ? bits : 0;
+	}
+
+	bool ValidateCompressionOptions(const CWebSocketCompressionOptions &options)
+	{
+		// zlib can't compress with a window of 8 bits, and would silently use 9 instead, which a server that asked for 8 can't decompress.
+		return options.clientMaxWindowBits >= 9 && options.clientMaxWindowBits <= 15 &&
+			options.serverMaxWindowBits >= 8 && options.serverMaxWindowBits <= 15 &&
+			options.level >= 1 && options.level <= 9;
+	}
+
+	std::string BuildDeflateOffer(const CWebSocketCompressionOptions &options)
+	{
+		std::string offer = "permessage-deflate";
+		if (options.clientNoContextTakeover)
+			offer += "; client_no_context_takeover";
+		if (options.serverNoContextTakeover)
+			offer += "; server_no_context_takeover";
+		if (options.serverMaxWindowBits < 15)
+			offer += "; server_max_window_bits=" + std::to_string(options.serverMaxWindowBits);
+		offer += "; client_max_window_bits"; // Without a value, it tells the server that it may limit our window.
+		if (options.clientMaxWindowBits < 15)
+			offer += "=" + std::to_string(options.clientMaxWindowBits);
+		return offer;
+	}
+
+	bool ParseDeflateResponse(const std::string &value, const CWebSocketCompressionOptions &options, CWebSocketDeflateParameters &parameters)
+	{
+		parameters.clientMaxWindowBits = options.clientMaxWindowBits;
+		parameters.serverMaxWindowBits = 15; // Unless the server says otherwise, it may use any window.
+		parameters.clientNoContextTakeover = options.clientNoContextTakeover;
+		parameters.serverNoContextTakeover = false;
+		if (value.find(',') != std::string::npos) // We offered a single extension.
+			return false;
+
+		bool seenClientNoContextTakeover = false, seenServerNoContextTakeover = false, seenClientMaxWindowBits = false, seenServerMaxWindowBits = false;
+		size_t begin = 0;
+		for (bool first = true; begin <= value.size(); first = false)
+		{
+			size_t end = value.find(';', begin);
+			if (end == std::string::npos)
+				end = value.size();
+			const std::string parameter = TrimParameter(value.substr(begin, end - begin));
+			begin = end + 1;
+			if (first)
+			{
+				if (parameter != "permessage-deflate")
+					return false;
+				continue;
+			}
+			const size_t equals = parameter.find('=');
+			const std::string name = TrimParameter(parameter.substr(0, equals));
+			const std::string argument = (equals == std::string::npos) ? std::string() : TrimParameter(parameter.substr(equals + 1));
+			if (name == "client_no_context_takeover" && equals == std::string::npos && seenClientNoContextTakeover == false)
+			{
+				seenClientNoContextTakeover = true;
+				parameters.clientNoContextTakeover = true;
+			}
+			else if (name == "server_no_context_takeover" && equals == std::string::npos && seenServerNoContextTakeover == false)
+			{
+				seenServerNoContextTakeover = true;
+				parameters.serverNoContextTakeover = true;
+			}
+			else if (name == "server_max_window_bits" && seenServerMaxWindowBits == false)
+			{
+				seenServerMaxWindowBits = true;
+				parameters.serverMaxWindowBits = ParseWindowBits(argument);
+				if (parameters.serverMaxWindowBits == 0 || parameters.serverMaxWindowBits > options.serverMaxWindowBits)
+					return false;
+			}
+			else if (name == "client_max_window_bits" && seenClientMaxWindowBits == false)
+			{
+				seenClientMaxWindowBits = true;
+				parameters.clientMaxWindowBits = ParseWindowBits(argument);
+				if (parameters.clientMaxWindowBits < 9 || parameters.clientMaxWindowBits > options.clientMaxWindowBits) // See ValidateCompressionOptions about 8.
+					return false;
+			}
+			else
+				return false;
+		}
+		return true;
+	}
+
+	CWebSocketDeflater::CWebSocketDeflater() :
+		_initialized(false),
+		_windowBits(0),
+		_level(0),
+		_noContextTakeover(false)
+	{
+	}
+
+	CWebSocketDeflater::~CWebSocketDeflater()
+	{
+		if (_initialized)
+			deflateEnd(&_stream);
+	}
+
+	bool CWebSocketDeflater::Initialize(int windowBits, int level, bool noContextTakeover)
+	{
+		_noContextTakeover = noContextTakeover;
+		if (_initialized && _windowBits == windowBits && _level == level)
+			return deflateReset(&_stream) == Z_OK;
+		if (_initialized)
+		{
+			deflateEnd(&_stream);
+			_initialized = false;
+		}
+		memset(&_stream, 0, sizeof(_stream));
+		if (deflateInit2(&_stream, level, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) // Negative window bits make a raw deflate stream.
+			return false;
+		_initialized = true;
+		_windowBits = windowBits;
+		_level = level;
+		return true;
+	}
+
+	bool CWebSocketDeflater::Compress(const BYTE *message, size_t length, std::vector<BYTE> &output, size_t *compressedLength)
+	{
+		if (_initialized == false || length > UINT_MAX)
+			return false;
+		const size_t bound = deflateBound(&_stream, (uLong)length) + 16; // Room for the flush, so that a single call to deflate usually suffices.
+		if (output.size() < bound)
+			output.resize(bound);
+		_stream.next_in = (Bytef*)message;
+		_stream.avail_in = (uInt)length;
+		_stream.next_out = output.data();
+		_stream.avail_out = (uInt)std::min<size_t>(output.size(), UINT_MAX);
+		for (;;)
+		{
+			const int result = deflate(&_stream, Z_SYNC_FLUSH);
+			if (result != Z_OK && result != Z_BUF_ERROR)
+				return false;
+			if (_stream.avail_out != 0)
+				break;
+			const size_t used = output.size();
+			output.resize(used * 2);
+			_stream.next_out = output.data() + used;
+			_stream.avail_out = (uInt)std::min<size_t>(output.size() - used, UINT_MAX);
+		}
+		const size_t produced = _stream.next_out - output.data();
+		if (produced < 4 || memcmp(output.data() + produced - 4, DeflateTrailer, 4) != 0)
+			return false;
+		*compressedLength = produced - 4;
+		if (_noContextTakeover)
+			deflateReset(&_stream);
+		return true;
+	}
+
+	CWebSocketInflater::CWebSocketInflater() :
+		_initialized(false),
+		_windowBits(0),
+		_noContextTakeover(false),
+		_pendingBegin(0),
+		_messageEnd(false),
+		_trailerFed(0),
+		_busy(false)
+	{
+	}
+
+	CWebSocketInflater::~CWebSocketInflater()
+	{
+		if (_initialized)
+			inflateEnd(&_stream);
+	}
+
+	bool CWebSocketInflater::Initialize(int windowBits, bool noContextTakeover)
+	{
+		_noContextTakeover = noContextTakeover;
+		_pending.clear();
+		_pendingBegin = 0;
+		_messageEnd = false;
+		_trailerFed = 0;
+		_busy = false;
+		if (_initialized && _windowBits == windowBits)
+			return inflateReset(&_stream) == Z_OK;
+		if (_initialized)
+		{
+			inflateEnd(&_stream);
+			_initialized = false;
+		}
+		memset(&_stream, 0, sizeof(_stream));
+		if (inflateInit2(&_stream, -windowBits) != Z_OK)
+			return false;
+		_initialized = true;
+		_windowBits = windowBits;
+		return true;
+	}
+
+	bool CWebSocketInflater::Inflate(const BYTE *input, size_t length, bool messageEnd, BYTE *output, size_t outputLength, size_t *produced, bool *messageDone)
+	{
+		*produced = 0;
+		*messageDone = false;
+		if (_initialized == false || length > UINT_MAX)
+			return false;
+		const bool fromPending = _busy;
+		if (fromPending)
+		{
+			_stream.next_in = _pending.data() + _pendingBegin;
+			_stream.avail_in = (uInt)(_pending.size() - _pendingBegin);
+		}
+		else
+		{
+			_stream.next_in = (Bytef*)input;
+			_stream.avail_in = (uInt)length;
+			_messageEnd = messageEnd;
+			_trailerFed = 0;
+		}
+		_stream.next_out = output;
+		_stream.avail_out = (uInt)std::min<size_t>(outputLength, UINT_MAX);
+
+		bool feedingTrailer = false;
+		while (_stream.avail_out > 0)
+		{
+			if (_stream.avail_in == 0 && _messageEnd && _trailerFed < 4)
+			{
+				_stream.next_in = (Bytef*)DeflateTrailer + _trailerFed;
+				_stream.avail_in = (uInt)(4 - _trailerFed);
+				feedingTrailer = true;
+			}
+			const uInt availableBefore = _stream.avail_in;
+			const int result = inflate(&_stream, Z_SYNC_FLUSH);
+			if (feedingTrailer)
+				_trailerFed += availableBefore - _stream.avail_in;
+			if (result == Z_STREAM_END) // The peer ended the deflate stream with a final block. Whatever follows starts a new one.
+			{
+				if (inflateReset(&_stream) != Z_OK)
+					return false;
+				continue;
+			}
+			if (result == Z_BUF_ERROR) // No progress is possible without more input.
+				break;
+			if (result != Z_OK)
+				return false;
+		}
+
+		*produced = (size_t)(_stream.next_out - output);
+		const size_t left = _stream.avail_in;
+		if (feedingTrailer || left == 0) // The trailer is fed from DeflateTrailer, it's never kept in _pending.
+		{
+			_pending.clear();
+			_pendingBegin = 0;
+		}
+		else if (fromPending)
+			_pendingBegin = _pending.size() - left;
+		else
+		{
+			_pending.assign(_stream.next_in, _stream.next_in + left); // Keeps its capacity across messages.
+			_pendingBegin = 0;
+		}
+
+		// With output space to spare, inflate has written everything it could.
+		*messageDone = _messageEnd && _trailerFed == 4 && _stream.avail_out > 0;
+		_busy = (*messageDone == false) && (_messageEnd || left > 0 || _stream.avail_out == 0);
+		if (*messageDone)
+		{
+			_messageEnd = false;
+			if (_noContextTakeover)
+				inflateReset(&_stream);
+		}
+		return true;
+	}
+};
+
+#endif
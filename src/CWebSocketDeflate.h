@@ -0,0 +1,89 @@
+#pragma once
+
+// The permessage-deflate extension (RFC 7692), used by the transports that do their own framing.
+// Only built on Linux, where zlib is available and CWebSocketEpollTransport needs it. WinHttp doesn't support the extension.
+#ifdef __linux__
+
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "Win32Compat.h"
+#include "CWebSocketTransport.h"
+
+namespace cwebsocketinternal
+{
+	// The parameters agreed on with the server.
+	struct CWebSocketDeflateParameters
+	{
+		int clientMaxWindowBits; // The window of our compressor.
+		int serverMaxWindowBits; // The window of the server's compressor, which our decompressor must be able to handle.
+		bool clientNoContextTakeover;
+		bool serverNoContextTakeover;
+	};
+
+	// Returns true if the given options are within the ranges documented by CWebSocketCompressionOptions.
+	bool ValidateCompressionOptions(const CWebSocketCompressionOptions &options);
+
+	// Returns the value of the Sec-WebSocket-Extensions header that offers permessage-deflate with the given options.
+	std::string BuildDeflateOffer(const CWebSocketCompressionOptions &options);
+
+	// Parses the value of the Sec-WebSocket-Extensions header of the server's response to BuildDeflateOffer(options).
+	// Returns false if the server responded with anything the offer didn't allow, in which case the connection must be failed.
+	bool ParseDeflateResponse(const std::string &value, const CWebSocketCompressionOptions &options, CWebSocketDeflateParameters &parameters);
+
+	// Compresses the payloads of outgoing messages. The zlib stream is kept across messages, and reset between them only without context takeover.
+	class CWebSocketDeflater
+	{
+	private:
+		z_stream _stream;
+		bool _initialized;
+		int _windowBits;
+		int _level;
+		bool _noContextTakeover;
+	public:
+		CWebSocketDeflater();
+		CWebSocketDeflater(const CWebSocketDeflater&) = delete;
+		~CWebSocketDeflater();
+
+		// Prepares the compressor for a new connection. Reuses the zlib stream if its window and level haven't changed.
+		bool Initialize(int windowBits, int level, bool noContextTakeover);
+
+		// Compresses a whole message into the beginning of output, and stores the compressed length in compressedLength.
+		// output is only ever grown, so a vector that is reused for every message stops allocating once it's large enough.
+		bool Compress(const BYTE *message, size_t length, std::vector<BYTE> &output, size_t *compressedLength);
+	};
+
+	// Decompresses the payloads of incoming messages, a piece at a time, into buffers of the caller's choosing.
+	class CWebSocketInflater
+	{
+	private:
+		z_stream _stream;
+		bool _initialized;
+		int _windowBits;
+		bool _noContextTakeover;
+		std::vector<BYTE> _pending; // Compressed input that didn't fit into the last output buffer.
+		size_t _pendingBegin;
+		bool _messageEnd; // The input fed so far ends the message.
+		size_t _trailerFed; // The number of bytes of the 00 00 FF FF trailer fed after the end of the message.
+		bool _busy; // Inflate must be called again before feeding more input.
+	public:
+		CWebSocketInflater();
+		CWebSocketInflater(const CWebSocketInflater&) = delete;
+		~CWebSocketInflater();
+
+		// Prepares the decompressor for a new connection. Reuses the zlib stream if its window hasn't changed.
+		bool Initialize(int windowBits, bool noContextTakeover);
+
+		// Decompresses as much as fits into output. produced receives the number of bytes written, and messageDone is set once the whole message has been written.
+		// input is the next piece of the compressed payload, and messageEnd tells if it's the last one. Whatever doesn't fit is kept and decompressed by later calls.
+		// While IsBusy returns true, pass nullptr as input to continue with the kept input instead.
+		// Returns false if the payload is not valid deflate data.
+		bool Inflate(const BYTE *input, size_t length, bool messageEnd, BYTE *output, size_t outputLength, size_t *produced, bool *messageDone);
+
+		// Returns true if there is input or output left over from the last call to Inflate.
+		bool IsBusy() const { return _busy; }
+	};
+};
+
+#endif
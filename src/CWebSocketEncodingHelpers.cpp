@@ -1,63 +1,328 @@
-#include <windows.h>
+#include "CWebSocketEncodingHelpers.h"
 #include <vector>
+#include <new>
+#include <string.h>
+#include <wchar.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CWEBSOCKET_ENCODING_SSE2
+#include <emmintrin.h>
+#endif
+
+// A single pass UTF-8 <-> WCHAR transcoder. WCHAR holds UTF-16 code units on Windows, and UTF-32 code points elsewhere.
+// Runs of ASCII characters are converted 16 at a time; everything else is validated and converted one sequence at a time.
 
 namespace cwebsocketinternal
 {
-	bool UnicodeToUTF8(PCWSTR unicodeString, std::vector<BYTE> &UTF8String)
+	namespace
 	{
-		bool result = false;
-		DWORD wcResult;
-		UTF8String.resize(0);
-		DWORD bufSize = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, unicodeString, -1, nullptr, 0, nullptr, nullptr);
-		if (bufSize > 0)
+		// The maximum number of UTF-8 bytes a single WCHAR can turn into. A UTF-16 surrogate pair turns into 4 bytes, that is 2 per WCHAR.
+		const size_t MaxUTF8BytesPerWCHAR = (sizeof(WCHAR) == 2) ? 3 : 4;
+
+		// Decodes the multibyte UTF-8 sequence at the start of s, which holds available > 0 bytes.
+		// Follows the table of well-formed byte sequences of the Unicode standard, so overlong sequences, surrogates and code points above U+10FFFF are rejected.
+		// Returns the length of the sequence, or 0 if it is not valid.
+		inline size_t DecodeSequence(const BYTE *s, size_t available, uint32_t &c)
 		{
-			UTF8String.resize(bufSize);
-			wcResult = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, unicodeString, -1, (LPSTR)UTF8String.data(), bufSize, nullptr, nullptr);
-			if ((wcResult == bufSize) &&
-				(UTF8String.back() == 0)) // WCtoMB will append a null terminator to the result.
+			const BYTE b0 = s[0];
+			if (b0 >= 0xC2 && b0 <= 0xDF)
+			{
+				if (available < 2 || (s[1] & 0xC0) != 0x80)
+					return 0;
+				c = ((uint32_t)(b0 & 0x1F) << 6) | (s[1] & 0x3F);
+				return 2;
+			}
+			if (b0 >= 0xE0 && b0 <= 0xEF)
 			{
-				UTF8String.pop_back(); // Remove the trailing null-terminator.
-				result = true;
+				const BYTE low = (b0 == 0xE0) ? 0xA0 : 0x80;
+				const BYTE high = (b0 == 0xED) ? 0x9F : 0xBF;
+				if (available < 3 || s[1] < low || s[1] > high || (s[2] & 0xC0) != 0x80)
+					return 0;
+				c = ((uint32_t)(b0 & 0x0F) << 12) | ((uint32_t)(s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+				return 3;
 			}
+			if (b0 >= 0xF0 && b0 <= 0xF4)
+			{
+				const BYTE low = (b0 == 0xF0) ? 0x90 : 0x80;
+				const BYTE high = (b0 == 0xF4) ? 0x8F : 0xBF;
+				if (available < 4 || s[1] < low || s[1] > high || (s[2] & 0xC0) != 0x80 || (s[3] & 0xC0) != 0x80)
+					return 0;
+				c = ((uint32_t)(b0 & 0x07) << 18) | ((uint32_t)(s[1] & 0x3F) << 12) | ((uint32_t)(s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+				return 4;
+			}
+			return 0;
+		}
+
+		// Writes the code point c as one or two WCHARs. Returns the number of WCHARs written.
+		inline size_t PutCodePoint(WCHAR *out, uint32_t c)
+		{
+			if (sizeof(WCHAR) == 2 && c >= 0x10000)
+			{
+				c -= 0x10000;
+				out[0] = (WCHAR)(0xD800 | (c >> 10));
+				out[1] = (WCHAR)(0xDC00 | (c & 0x3FF));
+				return 2;
+			}
+			out[0] = (WCHAR)c;
+			return 1;
+		}
+
+		// Returns the number of ASCII characters at the start of s, counted 16 at a time, so the result may fall short by up to 15.
+		inline size_t SkipASCII(const BYTE *s, size_t length)
+		{
+			size_t i = 0;
+#ifdef CWEBSOCKET_ENCODING_SSE2
+			for (; i + 16 <= length; i += 16)
+				if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i))) != 0)
+					break;
+#else
+			for (; i + 8 <= length; i += 8)
+			{
+				uint64_t word;
+				memcpy(&word, s + i, 8);
+				if ((word & 0x8080808080808080ULL) != 0)
+					break;
+			}
+#endif
+			return i;
+		}
+
+		// Converts ASCII characters from in to out as long as 16 of them are available, and none of them is NUL. Returns the number of characters converted.
+		inline size_t WidenASCII(const BYTE *in, size_t length, WCHAR *out)
+		{
+			size_t i = 0;
+#ifdef CWEBSOCKET_ENCODING_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + 16 <= length; i += 16)
+			{
+				const __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+				if ((_mm_movemask_epi8(v) | _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero))) != 0) // A non-ASCII byte or a NUL.
+					break;
+				const __m128i low = _mm_unpacklo_epi8(v, zero);
+				const __m128i high = _mm_unpackhi_epi8(v, zero);
+				if (sizeof(WCHAR) == 2)
+				{
+					_mm_storeu_si128((__m128i *)(out + i), low);
+					_mm_storeu_si128((__m128i *)(out + i + 8), high);
+				}
+				else
+				{
+					_mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(low, zero));
+					_mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(low, zero));
+					_mm_storeu_si128((__m128i *)(out + i + 8), _mm_unpacklo_epi16(high, zero));
+					_mm_storeu_si128((__m128i *)(out + i + 12), _mm_unpackhi_epi16(high, zero));
+				}
+			}
+#else
+			for (; i + 8 <= length; i += 8)
+			{
+				uint64_t word;
+				memcpy(&word, in + i, 8);
+				const uint64_t hasZero = (word - 0x0101010101010101ULL) & ~word & 0x8080808080808080ULL;
+				if (((word & 0x8080808080808080ULL) | hasZero) != 0)
+					break;
+				for (size_t j = 0; j < 8; j++)
+					out[i + j] = in[i + j];
+			}
+#endif
+			return i;
+		}
+
+		// Converts ASCII characters from in to out as long as 16 of them are available. in holds no NULs. Returns the number of characters converted.
+		inline size_t NarrowASCII(const WCHAR *in, size_t length, BYTE *out)
+		{
+			size_t i = 0;
+#ifdef CWEBSOCKET_ENCODING_SSE2
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + 16 <= length; i += 16)
+			{
+				__m128i packed;
+				if (sizeof(WCHAR) == 2)
+				{
+					const __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+					const __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 8));
+					const __m128i nonASCII = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xFF80));
+					if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonASCII, zero)) != 0xFFFF)
+						break;
+					packed = _mm_packus_epi16(a, b);
+				}
+				else
+				{
+					const __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+					const __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 4));
+					const __m128i c = _mm_loadu_si128((const __m128i *)(in + i + 8));
+					const __m128i d = _mm_loadu_si128((const __m128i *)(in + i + 12));
+					const __m128i nonASCII = _mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)), _mm_set1_epi32((int)0xFFFFFF80));
+					if (_mm_movemask_epi8(_mm_cmpeq_epi32(nonASCII, zero)) != 0xFFFF)
+						break;
+					packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+				}
+				_mm_storeu_si128((__m128i *)(out + i), packed);
+			}
+#else
+			for (; i < length && (uint32_t)in[i] < 0x80; i++)
+				out[i] = (BYTE)in[i];
+#endif
+			return i;
 		}
-		return result;
 	}
 
-	bool VerifyIsNotNullTerminatedString(const BYTE *str, size_t length)
+	bool UnicodeToUTF8(PCWSTR unicodeString, std::vector<BYTE> &UTF8String)
 	{
-		size_t i;
-		for (i = 0; i < length; i++)
-			if (str[i] == '\0')
+		const size_t length = wcslen(unicodeString);
+		UTF8String.resize(length * MaxUTF8BytesPerWCHAR); // Convert into a buffer that is large enough for the worst case, and trim it afterwards.
+		BYTE *out = UTF8String.data();
+		size_t i = 0;
+		while (i < length)
+		{
+			const size_t n = NarrowASCII(unicodeString + i, length - i, out);
+			i += n;
+			out += n;
+			if (i == length)
 				break;
-		return(i == length);
+
+			uint32_t c = (uint32_t)unicodeString[i++];
+			if (c < 0x80)
+			{
+				*out++ = (BYTE)c;
+				continue;
+			}
+			if (sizeof(WCHAR) == 2 && c >= 0xD800 && c <= 0xDBFF && i < length) // A surrogate pair.
+			{
+				const uint32_t low = (uint32_t)unicodeString[i];
+				if (low >= 0xDC00 && low <= 0xDFFF)
+				{
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+					i++;
+				}
+			}
+			if ((c >= 0xD800 && c <= 0xDFFF) || c > 0x10FFFF) // Lone surrogates and out of range code points cannot be encoded.
+			{
+				UTF8String.resize(0);
+				return false;
+			}
+			if (c < 0x800)
+			{
+				out[0] = (BYTE)(0xC0 | (c >> 6));
+				out[1] = (BYTE)(0x80 | (c & 0x3F));
+				out += 2;
+			}
+			else if (c < 0x10000)
+			{
+				out[0] = (BYTE)(0xE0 | (c >> 12));
+				out[1] = (BYTE)(0x80 | ((c >> 6) & 0x3F));
+				out[2] = (BYTE)(0x80 | (c & 0x3F));
+				out += 3;
+			}
+			else
+			{
+				out[0] = (BYTE)(0xF0 | (c >> 18));
+				out[1] = (BYTE)(0x80 | ((c >> 12) & 0x3F));
+				out[2] = (BYTE)(0x80 | ((c >> 6) & 0x3F));
+				out[3] = (BYTE)(0x80 | (c & 0x3F));
+				out += 4;
+			}
+		}
+		UTF8String.resize(out - UTF8String.data());
+		return true;
 	}
 
 	PWSTR UTF8ToUnicode(const BYTE *UTF8String, size_t byteLength)
 	{
-		PWSTR result = nullptr;
-
-		if (byteLength >= 0)
+		PWSTR result = new(std::nothrow) WCHAR[byteLength + 1]; // No UTF-8 sequence turns into more WCHARs than it has bytes. +1 for the null-terminator.
+		if (result == nullptr)
+			return nullptr;
+		WCHAR *out = result;
+		size_t i = 0;
+		while (i < byteLength)
 		{
-			if (VerifyIsNotNullTerminatedString(UTF8String, byteLength))
+			const size_t n = WidenASCII(UTF8String + i, byteLength - i, out);
+			i += n;
+			out += n;
+			if (i == byteLength)
+				break;
+
+			const BYTE b = UTF8String[i];
+			if (b < 0x80)
 			{
-				int bufSize = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, (LPCCH)UTF8String, byteLength, NULL, 0);
-				if (bufSize >= 0)
-				{
-					result = new(std::nothrow) WCHAR[bufSize + 1]; // +1 for the null-terminator
-					if (result != nullptr)
-					{
-						int mbResult = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, (LPCCH)UTF8String, byteLength, result, bufSize);
-						if (mbResult != bufSize)
-						{
-							delete[] result;
-							result = nullptr;
-						}
-						else
-							result[bufSize] = L'\0'; //Append a null-terminator.
-					}
-				}
+				if (b == 0) // Null characters are rejected, since the result is null-terminated.
+					break;
+				*out++ = b;
+				i++;
+				continue;
 			}
+			uint32_t c;
+			const size_t sequenceLength = DecodeSequence(UTF8String + i, byteLength - i, c);
+			if (sequenceLength == 0)
+				break;
+			out += PutCodePoint(out, c);
+			i += sequenceLength;
+		}
+		if (i != byteLength)
+		{
+			delete[] result;
+			return nullptr;
 		}
+		*out = L'\0';
 		return result;
 	}
+
+	CWebSocketUTF8Validator::CWebSocketUTF8Validator()
+	{
+		Reset();
+	}
+
+	void CWebSocketUTF8Validator::Reset()
+	{
+		_valid = true;
+		_needed = 0;
+		_low = 0x80;
+		_high = 0xBF;
+	}
+
+	bool CWebSocketUTF8Validator::Append(const BYTE *piece, size_t length)
+	{
+		size_t i = 0;
+		while (_valid && i < length)
+		{
+			if (_needed > 0)
+			{
+				const BYTE b = piece[i++];
+				_valid = b >= _low && b <= _high;
+				_low = 0x80;
+				_high = 0xBF;
+				_needed--;
+				continue;
+			}
+			i += SkipASCII(piece + i, length - i);
+			if (i == length)
+				break;
+			const BYTE b = piece[i++];
+			if (b < 0x80)
+				continue;
+			// The same rules as DecodeSequence, applied one byte at a time.
+			if (b >= 0xC2 && b <= 0xDF)
+				_needed = 1;
+			else if (b >= 0xE0 && b <= 0xEF)
+			{
+				_needed = 2;
+				_low = (b == 0xE0) ? 0xA0 : 0x80;
+				_high = (b == 0xED) ? 0x9F : 0xBF;
+			}
+			else if (b >= 0xF0 && b <= 0xF4)
+			{
+				_needed = 3;
+				_low = (b == 0xF0) ? 0x90 : 0x80;
+				_high = (b == 0xF4) ? 0x8F : 0xBF;
+			}
+			else
+				_valid = false;
+		}
+		return _valid;
+	}
+
+	bool CWebSocketUTF8Validator::IsComplete() const
+	{
+		return _valid && _needed == 0;
+	}
 };
\ No newline at end of file
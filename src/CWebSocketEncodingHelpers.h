@@ -1,5 +1,9 @@
 #pragma once
 
+#include <vector>
+
+#include "Win32Compat.h"
+
 namespace cwebsocketinternal // Encapsulate these methods in a seperate namespace so that we don't clutter the global one.
 {
 	//Encodes unicodeString in UTF8, returns the result in UTF8String.
@@ -14,4 +18,26 @@ namespace cwebsocketinternal // Encapsulate these methods in a seperate namespac
 	// byteLength is checked to verify that the given string really is not null-terminated.
 	// Returns a null-terminated unicode string allocated using 'new[]' if successful, or NULL if not.
 	PWSTR UTF8ToUnicode(const BYTE *UTF8String, size_t byteLength);
+
+	// Validates a UTF-8 string that arrives in pieces, which may split multibyte sequences anywhere.
+	// Null characters are valid UTF-8, and are accepted.
+	class CWebSocketUTF8Validator
+	{
+	private:
+		bool _valid;
+		size_t _needed; // Continuation bytes still needed by the current sequence.
+		BYTE _low; // The range of the next continuation byte, which is narrower than usual right after some lead bytes.
+		BYTE _high;
+	public:
+		CWebSocketUTF8Validator();
+
+		// Starts validating a new string.
+		void Reset();
+
+		// Validates the next piece of the string. Returns false if the string is invalid so far, in which case it stays invalid until Reset is called.
+		bool Append(const BYTE *piece, size_t length);
+
+		// Returns true if the pieces appended so far make up a valid string, that is, they are valid and don't end in the middle of a sequence.
+		bool IsComplete() const;
+	};
 };
\ No newline at end of file
@@ -0,0 +1,1549 @@
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <random>
+
+#include "CWebSocketEpollTransport.h"
+#include "CWebSocketEncodingHelpers.h"
+#include "CWebSocketHandshakeHelpers.h"
+
+using namespace cwebsocketinternal;
+
+namespace
+{
+	std::string ToLower(std::string s)
+	{
+		for (auto &c : s)
+			if (c >= 'A' && c <= 'Z')
+				c = c - 'A' + 'a';
+		return s;
+	}
+
+	std::string Trim(const std::string &s)
+	{
+		const size_t begin = s.find_first_not_of(" \t");
+		if (begin == std::string::npos)
+			return std::string();
+		const size_t end = s.find_last_not_of(" \t");
+		return s.substr(begin, end - begin + 1);
+	}
+
+	uint64_t ElapsedMicroseconds(std::chrono::steady_clock::time_point since)
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+	}
+}
+
+// The I/O of an open connection that goes through the IoUring of the loop. Only touched on the loop thread.
+// When the transport lets go of the connection while operations are still in flight, the socket is abandoned: it shuts the connection down,
+// keeps the frames being written alive until the kernel is done with them, and closes the descriptor and deletes itself after the last completion.
+class CWebSocketEpollTransport::RingSocket final : public IoUring::Handler
+{
+public:
+	const static uint32_t OpReceive = 1;
+	const static uint32_t OpSend = 2;
+	const static uint32_t OpCancel = 3;
+	const static size_t MaxLinkedSends = 4; // The most gather writes in a chain.
+
+	CWebSocketEpollTransport *owner; // nullptr once abandoned.
+	IoUring *ring;
+	int fd;
+	size_t inFlight; // The operations whose last completion hasn't arrived yet.
+	bool completing; // OnIoCompletion is running, and deletes the socket if it gets abandoned meanwhile.
+	bool receiving; // The multishot receive is armed.
+	bool cancelling; // The receive is being cancelled, because enough data has been read ahead.
+	CWebSocketRingQueue<OutgoingFrame> sending; // The frames the chain in flight is writing.
+	size_t chainLength; // The number of gather writes in the chain in flight, 0 if none.
+	size_t chainCompleted;
+	size_t chainFrames[MaxLinkedSends]; // The number of frames each gather write of the chain takes from the front of sending.
+	size_t chainBytes[MaxLinkedSends];
+	bool chainFailed;
+	CWebSocketPooledBytes vectors; // The msghdrs and iovecs of the chain in flight.
+
+	RingSocket(CWebSocketEpollTransport *owner, IoUring *ring, int fd) :
+		owner(owner),
+		ring(ring),
+		fd(fd),
+		inFlight(0),
+		completing(false),
+		receiving(false),
+		cancelling(false),
+		chainLength(0),
+		chainCompleted(0),
+		chainFailed(false)
+	{
+	}
+
+	void OnIoCompletion(uint32_t op, int32_t result, uint32_t flags) override
+	{
+		if (IoUring::HasMore(flags) == false)
+		{
+			inFlight--;
+			if (op == OpReceive)
+				receiving = false;
+			else if (op == OpCancel)
+				cancelling = false;
+		}
+		uint16_t id = 0;
+		const bool hasBuffer = (op == OpReceive) && IoUring::HasBuffer(flags, &id);
+		completing = true;
+		const bool handled = (owner != nullptr) && owner->_OnRingCompletion(this, op, result, hasBuffer ? ring->Buffer(id) : nullptr);
+		completing = false;
+		if (handled == false && op == OpSend)
+		{
+			for (size_t retired = CompleteSend(result); retired > 0; retired--)
+				sending.PopFront();
+			EndChain();
+		}
+		if (hasBuffer)
+			ring->RecycleBuffer(id); // The data has been copied out by now.
+		if (owner == nullptr && inFlight == 0)
+		{
+			close(fd);
+			delete this;
+		}
+	}
+
+	// Accounts for the completion of the next gather write of the chain in flight, and returns the number of frames at the front of sending it wrote.
+	// Returns 0 if it or an earlier one of the chain failed, in which case the frames are dropped along with the chain.
+	size_t CompleteSend(int32_t result)
+	{
+		const size_t index = chainCompleted++;
+		if (result < 0 || (size_t)result != chainBytes[index])
+			chainFailed = true;
+		return chainFailed ? 0 : chainFrames[index];
+	}
+
+	// Frees the chain in flight once all of its gather writes have completed, and the frames they wrote have been retired.
+	void EndChain()
+	{
+		if (chainCompleted < chainLength)
+			return;
+		sending.Clear(); // Only frames of a failed chain are left.
+		vectors.Clear();
+		chainLength = 0;
+		chainCompleted = 0;
+		chainFailed = false;
+	}
+
+	// Called when the transport lets go of the connection. Shuts the connection down, so that the operations in flight complete soon.
+	void Abandon()
+	{
+		owner = nullptr;
+		if (inFlight > 0)
+			shutdown(fd, SHUT_RDWR);
+		else if (completing == false)
+		{
+			close(fd);
+			delete this;
+		}
+	}
+};
+
+CWebSocketEpollTransport::CWebSocketEpollTransport(EpollLoop *loop) :
+	_loop(loop),
+	_ring(nullptr),
+	_server(false),
+	_acceptedFd(-1),
+	_fd(-1),
+	_addresses(nullptr),
+	_nextAddress(nullptr),
+	_socket(nullptr),
+	_generation(1),
+	_readSizer(ReadChunkLength),
+	_pool(CWebSocketBufferPool::Default()),
+	_maskKeysUsed(MaskKeyBufferLength)
+{
+	_Reset();
+}
+
+CWebSocketEpollTransport::CWebSocketEpollTransport(EpollLoop *loop, int acceptedFd) :
+	_loop(loop),
+	_ring(nullptr),
+	_server(true),
+	_acceptedFd(acceptedFd),
+	_fd(-1),
+	_addresses(nullptr),
+	_nextAddress(nullptr),
+	_socket(nullptr),
+	_generation(1),
+	_readSizer(ReadChunkLength),
+	_pool(CWebSocketBufferPool::Default()),
+	_parser(true), // Frames sent by clients are masked.
+	_maskKeysUsed(MaskKeyBufferLength) // Servers don't mask, so the buffer is never filled.
+{
+	_Reset();
+}
+
+CWebSocketEpollTransport::~CWebSocketEpollTransport()
+{
+	if (_lookup != nullptr)
+	{
+		std::lock_guard<std::mutex> lock(_lookup->mutex); // Waits for a lookup that is posting its result to the loop.
+		_lookup->owner = nullptr;
+	}
+	Abort(); // Waits for the loop to run any result posted meanwhile, which finds the transport gone.
+	if (_acceptedFd != -1) // The connection was never started.
+		close(_acceptedFd);
+}
+
+// Clears the per-connection state. Called with _mutex held, after the descriptor has been closed.
+void CWebSocketEpollTransport::_Reset()
+{
+	_phase = Phase::Idle;
+	_registeredEvents = 0;
+	_dispatching = false;
+	_dispatchPosted = false;
+	_eof = false;
+	_key.clear();
+	_FreeAddresses();
+	_resolvedus = 0;
+	_connectedus = 0;
+	_in.clear();
+	_inBegin = 0;
+	_inEnd = 0;
+	_out.Clear();
+	_outOffset = 0;
+	_parser.Reset();
+	_outMessageFragmented = false;
+	_deflateNegotiated = false;
+	_parser.SetAllowRsv1(false);
+	_inflateOpcode = 0;
+	_rxBuffer = nullptr;
+	_rxLength = 0;
+	_rxPending = false;
+	_closeRequested = false;
+	_closeSent = false;
+	_closeReceived = false;
+	_closeReported = false;
+	_closeCompleted = false;
+	_closeStatus = WINHTTP_WEB_SOCKET_EMPTY_CLOSE_STATUS;
+	_closeReason.clear();
+	_events.clear();
+}
+
+bool CWebSocketEpollTransport::Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback)
+{
+	if (secure)
+		return false;
+	if (_loop == nullptr)
+		_loop = EpollLoop::Default();
+	if (_loop == nullptr)
+		return false;
+	_ring = _loop->Ring();
+
+	std::vector<BYTE> UTF8String;
+	if (_server)
+	{
+		if (path != nullptr && cwebsocketinternal::UnicodeToUTF8(path, UTF8String) == false)
+			return false;
+		if (path != nullptr)
+			_path.assign(UTF8String.begin(), UTF8String.end());
+		_callback = callback;
+		return true;
+	}
+	if (cwebsocketinternal::UnicodeToUTF8(serverName, UTF8String) == false)
+		return false;
+	_host.assign(UTF8String.begin(), UTF8String.end());
+	if (cwebsocketinternal::UnicodeToUTF8(path, UTF8String) == false)
+		return false;
+	_path.assign(UTF8String.begin(), UTF8String.end());
+	if (_path.size() == 0)
+		_path = "/";
+	_service = std::to_string(port);
+	_hostHeader = (_host.find(':') != std::string::npos) ? "[" + _host + "]" : _host; // IPv6 literals need brackets.
+	if (port != 80)
+		_hostHeader += ":" + _service;
+	_callback = callback;
+	return true;
+}
+
+bool CWebSocketEpollTransport::SetCompression(const CWebSocketCompressionOptions &options)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Idle || _server)
+		return false;
+	_compression = options;
+	if (options.enabled && ValidateCompressionOptions(options) == false)
+	{
+		_compression.enabled = false;
+		return false;
+	}
+	return true;
+}
+
+bool CWebSocketEpollTransport::SetReceiveBuffer(const CWebSocketReceiveBufferOptions &options)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_readSizer.Configure(options);
+	return true;
+}
+
+bool CWebSocketEpollTransport::SetBufferPool(CWebSocketBufferPool *pool)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_pool = pool; // Frames already queued go back to the pool they came from.
+	return true;
+}
+
+bool CWebSocketEpollTransport::SendUpgradeRequest()
+{
+	uint64_t generation;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_phase != Phase::Idle)
+			return false;
+		if (_server)
+		{
+			if (_acceptedFd == -1) // The accepted connection has already been used.
+				return false;
+			_fd = _acceptedFd;
+			_acceptedFd = -1;
+			_connectStartedAt = std::chrono::steady_clock::now();
+			_phase = Phase::ReceivingRequest;
+			_registeredEvents = EPOLLIN;
+			if (_loop->Add(_fd, _registeredEvents, this) == false)
+			{
+				close(_fd);
+				_fd = -1;
+				_Reset();
+				return false;
+			}
+			_Schedule(); // The request may have arrived along with the connection, in which case no edge will announce it.
+			return true;
+		}
+
+		_connectStartedAt = std::chrono::steady_clock::now();
+		_key = cwebsocketinternal::GenerateWebSocketKey();
+		const std::string request =
+			"GET " + _path + " HTTP/1.1\r\n"
+			"Host: " + _hostHeader + "\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: " + _key + "\r\n"
+			"Sec-WebSocket-Version: 13\r\n" +
+			(_compression.enabled ? "Sec-WebSocket-Extensions: " + BuildDeflateOffer(_compression) + "\r\n" : std::string()) +
+			"User-Agent: CWebSocket\r\n"
+			"\r\n";
+		OutgoingFrame frame;
+		if (frame.bytes.Append(_pool, (const BYTE*)request.data(), request.size()) == false)
+		{
+			_Reset();
+			return false;
+		}
+		frame.notify = false;
+		frame.isClose = false;
+		frame.urgent = false;
+		_out.PushBack(std::move(frame)); // Written once connected.
+		_phase = Phase::Resolving;
+
+		// IP literals don't need a lookup.
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICHOST;
+		addrinfo *addresses;
+		if (getaddrinfo(_host.c_str(), _service.c_str(), &hints, &addresses) == 0)
+		{
+			_resolvedus = ElapsedMicroseconds(_connectStartedAt);
+			_addresses = addresses;
+			_nextAddress = addresses;
+			if (_ConnectNext() == false)
+			{
+				_Reset();
+				return false;
+			}
+			return true;
+		}
+		if (_lookup == nullptr)
+		{
+			_lookup = std::make_shared<Lookup>();
+			_lookup->owner = this;
+		}
+		generation = _generation;
+	}
+
+	// getaddrinfo blocks, so run it on a thread of its own and post the result back to the loop. The lookup holds on to everything it uses, and only
+	// touches the transport and its loop under the lock of _lookup, while owner is set.
+	std::thread([lookup = _lookup, generation, host = _host, service = _service]() {
+		addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo *addresses;
+		if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses) != 0)
+			addresses = nullptr;
+		std::lock_guard<std::mutex> lock(lookup->mutex);
+		if (lookup->owner == nullptr)
+		{
+			if (addresses != nullptr)
+				freeaddrinfo(addresses);
+			return;
+		}
+		lookup->owner->_loop->Post([lookup, generation, addresses]() {
+			CWebSocketEpollTransport *owner;
+			{
+				std::lock_guard<std::mutex> lock(lookup->mutex);
+				owner = lookup->owner;
+			}
+			if (owner != nullptr) // Otherwise, the destructor is waiting for the loop to finish this work.
+				owner->_OnResolved(generation, addresses);
+			else if (addresses != nullptr)
+				freeaddrinfo(addresses);
+		});
+	}).detach();
+	return true;
+}
+
+// Called on the loop thread once the host name has been resolved. addresses is nullptr if the lookup failed, and is owned by the callee.
+void CWebSocketEpollTransport::_OnResolved(uint64_t generation, addrinfo *addresses)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (generation != _generation || _phase != Phase::Resolving) // The connection was aborted meanwhile.
+	{
+		if (addresses != nullptr)
+			freeaddrinfo(addresses);
+		return;
+	}
+	_resolvedus = ElapsedMicroseconds(_connectStartedAt);
+	_addresses = addresses;
+	_nextAddress = addresses;
+	if (_ConnectNext() == false)
+		_Fail(CWebSocketTransportEvent::Error);
+	_Dispatch(lock);
+}
+
+// Starts connecting to the next of the resolved addresses. Returns false if there is none left. Called with _mutex held, and without a descriptor.
+bool CWebSocketEpollTransport::_ConnectNext()
+{
+	while (_nextAddress != nullptr)
+	{
+		const addrinfo *address = _nextAddress;
+		_nextAddress = address->ai_next;
+		const int fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			continue;
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		const bool connected = (connect(fd, address->ai_addr, address->ai_addrlen) == 0);
+		if (connected == false && errno != EINPROGRESS)
+		{
+			close(fd);
+			continue;
+		}
+		_registeredEvents = EPOLLIN | EPOLLOUT;
+		if (_loop->Add(fd, _registeredEvents, this) == false)
+		{
+			close(fd);
+			_registeredEvents = 0;
+			break;
+		}
+		_fd = fd;
+		_phase = connected ? Phase::SendingRequest : Phase::Connecting;
+		if (connected)
+		{
+			_connectedus = ElapsedMicroseconds(_connectStartedAt);
+			_FreeAddresses();
+		}
+		return true;
+	}
+	_FreeAddresses();
+	return false;
+}
+
+void CWebSocketEpollTransport::_FreeAddresses()
+{
+	if (_addresses != nullptr)
+		freeaddrinfo(_addresses);
+	_addresses = nullptr;
+	_nextAddress = nullptr;
+}
+
+bool CWebSocketEpollTransport::GetConnectTimings(CWebSocketConnectTimings *timings)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	timings->resolvedus = _resolvedus;
+	timings->connectedus = _connectedus;
+	return true;
+}
+
+bool CWebSocketEpollTransport::ReceiveResponse()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::RequestSent)
+		return false;
+	if (_server)
+	{
+		const std::string response =
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: " + cwebsocketinternal::ComputeWebSocketAccept(_key) + "\r\n"
+			"\r\n";
+		OutgoingFrame frame;
+		if (frame.bytes.Append(_pool, (const BYTE*)response.data(), response.size()) == false)
+			return false;
+		frame.notify = false;
+		frame.isClose = false;
+		frame.urgent = false;
+		_out.PushBack(std::move(frame)); // The frames sent from now on are queued behind it.
+		_phase = Phase::ResponseReceived;
+		_PushEvent(CWebSocketTransportEvent::HeadersAvailable);
+		_Flush();
+		_Schedule();
+		return true;
+	}
+	_phase = Phase::ReceivingResponse;
+	_Schedule(); // The response may have already been read.
+	return true;
+}
+
+bool CWebSocketEpollTransport::CompleteUpgrade()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::ResponseReceived)
+		return false;
+	_phase = Phase::Open;
+	return true;
+}
+
+bool CWebSocketEpollTransport::Receive(BYTE *buffer, DWORD length)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _rxPending || _closeRequested)
+		return false;
+	_rxBuffer = buffer;
+	_rxLength = length;
+	_rxPending = true;
+	_Schedule();
+	return true;
+}
+
+bool CWebSocketEpollTransport::ReceivesInPlace() const
+{
+	return true;
+}
+
+bool CWebSocketEpollTransport::Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length)
+{
+	const CWebSocketTransportMessage m = { bufferType, message, length, CWebSocketSharedBuffer() };
+	return SendBatch(&m, 1);
+}
+
+bool CWebSocketEpollTransport::SendBatch(const CWebSocketTransportMessage *messages, size_t count)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || count == 0)
+		return false;
+	// Serialize the whole batch into a single buffer, which usually gets written with a single system call.
+	// In the server role, prepared frames are queued by reference between the serialized ones instead, and the whole lot is gathered into the same system call.
+	const size_t queued = _out.Size();
+	OutgoingFrame frame;
+	frame.notify = false;
+	frame.isClose = false;
+	frame.urgent = false;
+	size_t length = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (_IsSharedFrame(messages[i]) == false)
+			length += MaxFrameHeaderLength + messages[i].length;
+	}
+	if (length > 0 && frame.bytes.Reserve(_pool, length) == false)
+		return false;
+	for (size_t i = 0; i < count; i++)
+	{
+		const WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType = messages[i].bufferType;
+		if (bufferType == WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE)
+		{
+			_out.Erase(queued, _out.Size() - queued);
+			return false;
+		}
+		const bool isUTF8 = (bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) || (bufferType == WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE);
+		const bool fin = (bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) || (bufferType == WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE);
+		const BYTE opcode = _outMessageFragmented ? OpcodeContinuation : (isUTF8 ? OpcodeText : OpcodeBinary);
+		bool appended;
+		if (_IsSharedFrame(messages[i]))
+		{
+			if (frame.bytes.Size() > 0)
+			{
+				_out.PushBack(std::move(frame));
+				frame = OutgoingFrame();
+			}
+			OutgoingFrame shared;
+			shared.notify = false;
+			shared.isClose = false;
+			shared.urgent = false;
+			shared.external = messages[i].frame;
+			_out.PushBack(std::move(shared));
+			appended = true;
+		}
+		else if (_deflateNegotiated && fin && _outMessageFragmented == false && messages[i].length >= _compression.threshold)
+		{
+			size_t compressedLength;
+			appended = _deflater.Compress(messages[i].message, messages[i].length, _deflated, &compressedLength) &&
+				_AppendFrame(frame.bytes, opcode, fin, _deflated.data(), compressedLength, true);
+		}
+		else
+			appended = _AppendFrame(frame.bytes, opcode, fin, messages[i].message, messages[i].length, false);
+		if (appended == false)
+		{
+			_out.Erase(queued, _out.Size() - queued);
+			return false;
+		}
+		_outMessageFragmented = !fin;
+	}
+	if (frame.bytes.Size() > 0)
+		_out.PushBack(std::move(frame));
+	_out[_out.Size() - 1].notify = true; // A single WriteComplete, once the last of them has been written.
+	_Flush();
+	if (_socket == nullptr || _loop->IsLoopThread() == false) // Otherwise the completion of the writes dispatches.
+		_Schedule();
+	return true;
+}
+
+// Returns true if message is a prepared frame to be written as it is. Only whole messages are prepared, and only servers send unmasked frames.
+bool CWebSocketEpollTransport::_IsSharedFrame(const CWebSocketTransportMessage &message) const
+{
+	return _server && message.frame.Data() != nullptr && _outMessageFragmented == false;
+}
+
+bool CWebSocketEpollTransport::SendsInBatches() const
+{
+	return true;
+}
+
+bool CWebSocketEpollTransport::Ping(const BYTE *payload, size_t length)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || length > 125)
+		return false;
+	if (_QueueFrame(OpcodePing, true, payload, length, false) == false)
+		return false;
+	_Flush();
+	_Schedule();
+	return true;
+}
+
+bool CWebSocketEpollTransport::Close(USHORT status, const BYTE *reason, size_t reasonLength)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || reasonLength > 123)
+		return false;
+	BYTE payload[125];
+	payload[0] = (BYTE)(status >> 8);
+	payload[1] = (BYTE)status;
+	if (reasonLength > 0)
+		memcpy(payload + 2, reason, reasonLength);
+	if (_QueueFrame(OpcodeClose, true, payload, 2 + reasonLength, false) == false)
+		return false;
+	_closeRequested = true;
+	if (_rxPending) // Just like WinHttp, cancel the pending receive. The close frame of the server is reported with CloseComplete instead.
+	{
+		_rxPending = false;
+		_PushEvent(CWebSocketTransportEvent::OperationCancelled);
+	}
+	_Flush();
+	_Schedule();
+	return true;
+}
+
+bool CWebSocketEpollTransport::QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_closeReceived == false || _closeReason.size() > reasonLength)
+		return false;
+	*status = _closeStatus;
+	if (_closeReason.size() > 0)
+		memcpy(reason, _closeReason.data(), _closeReason.size());
+	*reasonLengthConsumed = (DWORD)_closeReason.size();
+	return true;
+}
+
+void CWebSocketEpollTransport::Abort()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_generation++;
+		_ReleaseSocket();
+		if (_fd != -1)
+		{
+			if (_registeredEvents != 0)
+				_loop->Remove(_fd);
+			close(_fd);
+			_fd = -1;
+		}
+		_Reset();
+	}
+	if (_loop != nullptr)
+		_loop->Synchronize(); // Wait for the loop to let go of the events and posted work of the aborted connection.
+}
+
+// Makes sure _Dispatch runs soon to act on changes made to the state. Called with _mutex held.
+void CWebSocketEpollTransport::_Schedule()
+{
+	if (_dispatching || _dispatchPosted)
+		return;
+	_dispatchPosted = true;
+	const uint64_t generation = _generation;
+	_loop->Post([this, generation]() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (generation != _generation)
+			return;
+		_dispatchPosted = false;
+		_Dispatch(lock);
+	});
+}
+
+void CWebSocketEpollTransport::OnEpollEvents(uint32_t events)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_fd == -1 || _socket != nullptr) // The connection was closed, or handed over to the ring, after the event had been retrieved.
+		return;
+
+	if (_phase == Phase::Connecting)
+	{
+		if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+		{
+			int error = 0;
+			socklen_t errorLength = sizeof(error);
+			if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0 || error != 0)
+			{
+				// Try the next address, such as the IPv4 one of a host whose IPv6 address is unreachable.
+				_loop->Remove(_fd);
+				close(_fd);
+				_fd = -1;
+				_registeredEvents = 0;
+				if (_ConnectNext() == false)
+					_Fail(CWebSocketTransportEvent::Error);
+			}
+			else
+			{
+				_phase = Phase::SendingRequest;
+				_connectedus = ElapsedMicroseconds(_connectStartedAt);
+				_FreeAddresses();
+			}
+		}
+	}
+	else if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		_Read();
+	_Dispatch(lock);
+}
+
+// Advances the connection as far as possible and reports the resulting events. Called on the loop thread, with _mutex held.
+void CWebSocketEpollTransport::_Dispatch(std::unique_lock<std::mutex> &lock)
+{
+	const uint64_t generation = _generation;
+	_dispatching = true;
+	for (;;)
+	{
+		_Process();
+		_UpdateInterest();
+		if (_events.size() == 0)
+			break;
+		std::vector<PendingEvent> events(std::move(_events));
+		_events = std::move(_spareEvents);
+		lock.unlock();
+		for (auto &e : events)
+		{
+			const bool hasStatus = (e.event == CWebSocketTransportEvent::ReadComplete) || (e.event == CWebSocketTransportEvent::PongReceived);
+			_callback(e.event, hasStatus ? &e.status : nullptr, (e.event == CWebSocketTransportEvent::PongReceived) ? e.payload.data() : e.data);
+		}
+		lock.lock();
+		events.clear();
+		_spareEvents = std::move(events);
+		if (generation != _generation) // The callback aborted the connection.
+			return;
+	}
+	_dispatching = false;
+}
+
+void CWebSocketEpollTransport::_Process()
+{
+	if (_phase == Phase::SendingRequest)
+	{
+		_Flush();
+		if (_out.Size() == 0 && _phase == Phase::SendingRequest)
+		{
+			_phase = Phase::RequestSent;
+			_PushEvent(CWebSocketTransportEvent::SendRequestComplete);
+		}
+		else if (_eof)
+			_Fail(CWebSocketTransportEvent::Error);
+	}
+	else if (_phase == Phase::ReceivingRequest)
+	{
+		_ParseRequest();
+		if (_phase == Phase::ReceivingRequest && _eof)
+			_Fail(CWebSocketTransportEvent::Error);
+	}
+	else if (_phase == Phase::ResponseReceived && _server)
+		_Flush(); // The upgrade response, and any frames queued behind it.
+	else if (_phase == Phase::ReceivingResponse)
+	{
+		_ParseResponse();
+		if (_phase == Phase::ReceivingResponse && _eof)
+			_Fail(CWebSocketTransportEvent::Error);
+	}
+	else if (_phase == Phase::Open)
+	{
+		_Flush();
+		_ParseFrames();
+		_ArmReceive();
+		if (_phase == Phase::Open && _closeRequested && _closeSent && _closeReceived && _closeCompleted == false)
+		{
+			_closeCompleted = true;
+			_PushEvent(CWebSocketTransportEvent::CloseComplete);
+		}
+		if (_phase == Phase::Open && _eof)
+			_HandleEof();
+	}
+}
+
+void CWebSocketEpollTransport::_PushEvent(CWebSocketTransportEvent event, DWORD bytesTransferred, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *data)
+{
+	_events.emplace_back();
+	PendingEvent &e = _events.back();
+	e.event = event;
+	e.status.dwBytesTransferred = bytesTransferred;
+	e.status.eBufferType = bufferType;
+	e.data = data;
+}
+
+// Reports the given event and closes the connection. Called with _mutex held.
+void CWebSocketEpollTransport::_Fail(CWebSocketTransportEvent event)
+{
+	_PushEvent(event);
+	_phase = Phase::Failed;
+	_ReleaseSocket();
+	if (_fd != -1)
+	{
+		if (_registeredEvents != 0)
+			_loop->Remove(_fd);
+		close(_fd);
+		_fd = -1;
+		_registeredEvents = 0;
+	}
+	_out.Clear();
+	_outOffset = 0;
+	_rxPending = false;
+}
+
+void CWebSocketEpollTransport::_UpdateInterest()
+{
+	if (_fd == -1 || _socket != nullptr) // The ring does the waiting.
+		return;
+	uint32_t events = 0;
+	if (_phase == Phase::Connecting)
+		events = EPOLLOUT;
+	else if (_phase != Phase::Idle && _phase != Phase::Failed)
+	{
+		if (_eof == false && _inEnd - _inBegin < ReadAheadLimit)
+			events |= EPOLLIN;
+		if (_out.Size() > 0 && _eof == false)
+			events |= EPOLLOUT;
+	}
+	if (events == _registeredEvents)
+		return;
+	// Unregister the descriptor when there is nothing to wait for. Otherwise a hung up socket would keep reporting EPOLLHUP.
+	if (events == 0)
+		_loop->Remove(_fd);
+	else if (_registeredEvents == 0)
+		_loop->Add(_fd, events, this);
+	else
+		_loop->Modify(_fd, events, this);
+	_registeredEvents = events;
+}
+
+void CWebSocketEpollTransport::_Read()
+{
+	while (_eof == false && _inEnd - _inBegin < ReadAheadLimit)
+	{
+		const size_t readLength = _readSizer.Length();
+		if (_inBegin == _inEnd)
+		{
+			_inBegin = _inEnd = 0;
+			if (_readSizer.IsAdaptive() && _in.capacity() > readLength) // Everything has been received. Free the memory the last burst needed.
+				std::vector<BYTE>(readLength).swap(_in);
+		}
+		if (_in.size() - _inEnd < readLength)
+		{
+			if (_inBegin > 0)
+			{
+				memmove(_in.data(), _in.data() + _inBegin, _inEnd - _inBegin);
+				_inEnd -= _inBegin;
+				_inBegin = 0;
+			}
+			if (_in.size() - _inEnd < readLength)
+				_in.resize(_inEnd + readLength);
+		}
+		const size_t space = _in.size() - _inEnd;
+		const ssize_t r = recv(_fd, _in.data() + _inEnd, space, 0);
+		if (r > 0)
+		{
+			_inEnd += r;
+			const bool drained = (size_t)r < space;
+			_readSizer.OnReceived(r, drained);
+			if (drained)
+				break;
+		}
+		else if (r == 0)
+			_eof = true;
+		else if (errno == EINTR)
+			continue;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			break;
+		else
+			_eof = true;
+	}
+}
+
+// Writes as much of the send queue as the socket takes, gathering up to MaxGatherFrames queued frames into each system call.
+void CWebSocketEpollTransport::_Flush()
+{
+	if (_fd == -1 || _phase == Phase::Connecting)
+		return;
+	if (_ring != nullptr && _phase == Phase::Open)
+	{
+		if (_loop->IsLoopThread() == false) // Only the loop thread may use the ring. The caller schedules a dispatch, which comes back here.
+			return;
+		if (_socket == nullptr && _eof == false)
+			_AttachSocket(); // If this fails, the connection goes on with epoll.
+		if (_socket != nullptr)
+		{
+			_SubmitSends();
+			return;
+		}
+	}
+	while (_out.Size() > 0)
+	{
+		iovec iov[MaxGatherFrames];
+		size_t iovCount = 0;
+		size_t total = 0;
+		for (size_t i = 0; i < _out.Size() && iovCount < MaxGatherFrames; i++)
+		{
+			const size_t offset = (iovCount == 0) ? _outOffset : 0;
+			iov[iovCount].iov_base = (void*)(_out[i].Data() + offset);
+			iov[iovCount].iov_len = _out[i].Size() - offset;
+			total += iov[iovCount].iov_len;
+			iovCount++;
+		}
+		msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = iovCount;
+		const ssize_t r = sendmsg(_fd, &message, MSG_NOSIGNAL); // Unlike writev, sendmsg takes MSG_NOSIGNAL.
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) // The connection is broken, nothing more can be written.
+			{
+				_eof = true;
+				_out.Clear();
+				_outOffset = 0;
+			}
+			break;
+		}
+		// Retire the frames that have been written completely.
+		size_t written = (size_t)r;
+		while (_out.Size() > 0)
+		{
+			OutgoingFrame &frame = _out.Front();
+			const size_t left = frame.Size() - _outOffset;
+			if (written < left)
+			{
+				_outOffset += written;
+				break;
+			}
+			written -= left;
+			if (frame.notify)
+				_PushEvent(CWebSocketTransportEvent::WriteComplete);
+			if (frame.isClose)
+				_closeSent = true;
+			_out.PopFront(); // Gives the buffer back to the pool.
+			_outOffset = 0;
+		}
+		if ((size_t)r < total) // The socket buffer is full.
+			break;
+	}
+}
+
+// Hands the I/O of the open connection over to the ring. Called on the loop thread, with _mutex held. Returns false if out of memory.
+bool CWebSocketEpollTransport::_AttachSocket()
+{
+	RingSocket *socket = new(std::nothrow) RingSocket(this, _ring, _fd);
+	if (socket == nullptr)
+		return false;
+	if (_registeredEvents != 0)
+	{
+		_loop->Remove(_fd);
+		_registeredEvents = 0;
+	}
+	_socket = socket;
+	_ArmReceive();
+	return true;
+}
+
+// Lets go of the ring socket, which closes _fd once its operations have completed. Called with _mutex held.
+void CWebSocketEpollTransport::_ReleaseSocket()
+{
+	if (_socket == nullptr)
+		return;
+	RingSocket *socket = _socket;
+	_socket = nullptr;
+	_fd = -1;
+	if (_loop->IsLoopThread())
+		socket->Abandon();
+	else
+		_loop->Post([socket]() { socket->Abandon(); });
+}
+
+// Arms the multishot receive of the ring socket while there is room to read ahead, and cancels it once there isn't. Called on the loop thread, with _mutex held.
+void CWebSocketEpollTransport::_ArmReceive()
+{
+	if (_socket == nullptr || _socket->cancelling)
+		return;
+	const bool wanted = _eof == false && _inEnd - _inBegin < ReadAheadLimit;
+	if (wanted && _socket->receiving == false)
+	{
+		if (_ring->Receive(_socket, RingSocket::OpReceive, _socket->fd) == false)
+		{
+			_Fail(CWebSocketTransportEvent::Error);
+			return;
+		}
+		_socket->receiving = true;
+		_socket->inFlight++;
+	}
+	else if (wanted == false && _socket->receiving && _ring->Cancel(_socket, RingSocket::OpCancel, _socket, RingSocket::OpReceive))
+	{
+		_socket->cancelling = true;
+		_socket->inFlight++;
+	}
+}
+
+// Moves the queued frames into a chain of linked gather writes on the ring, unless a chain is still in flight, in which case its completion comes back here.
+// Called on the loop thread, with _mutex held.
+void CWebSocketEpollTransport::_SubmitSends()
+{
+	if (_socket->chainLength > 0 || _out.Size() == 0)
+		return;
+	if (_out.Size() == 1) // The usual case at low rates, which needs no vectors.
+	{
+		const size_t length = _out.Front().Size() - _outOffset;
+		if (_ring->Send(_socket, RingSocket::OpSend, _socket->fd, _out.Front().Data() + _outOffset, length, false) == false)
+		{
+			_Fail(CWebSocketTransportEvent::Error);
+			return;
+		}
+		_socket->sending.PushBack(std::move(_out.Front()));
+		_out.PopFront();
+		_outOffset = 0;
+		_socket->chainFrames[0] = 1;
+		_socket->chainBytes[0] = length;
+		_socket->chainLength = 1;
+		_socket->inFlight++;
+		return;
+	}
+	const size_t frameCount = std::min(_out.Size(), RingSocket::MaxLinkedSends * MaxGatherFrames);
+	const size_t sendCount = (frameCount + MaxGatherFrames - 1) / MaxGatherFrames;
+	if (_ring->Reserve((unsigned)sendCount) == false || _socket->vectors.Reserve(_pool, sendCount * sizeof(msghdr) + frameCount * sizeof(iovec)) == false)
+	{
+		_Fail(CWebSocketTransportEvent::Error);
+		return;
+	}
+	msghdr *messages = (msghdr*)_socket->vectors.Extend(_pool, sendCount * sizeof(msghdr));
+	iovec *iov = (iovec*)_socket->vectors.Extend(_pool, frameCount * sizeof(iovec));
+	for (size_t i = 0; i < frameCount; i++)
+	{
+		const size_t offset = (i == 0) ? _outOffset : 0; // What an epoll write left of the front frame, before the ring took over.
+		iov[i].iov_base = (void*)(_out.Front().Data() + offset);
+		iov[i].iov_len = _out.Front().Size() - offset;
+		_socket->sending.PushBack(std::move(_out.Front())); // The bytes stay where they are.
+		_out.PopFront();
+	}
+	_outOffset = 0;
+	size_t first = 0;
+	for (size_t i = 0; i < sendCount; i++)
+	{
+		const size_t count = (frameCount - first < MaxGatherFrames) ? frameCount - first : MaxGatherFrames;
+		memset(&messages[i], 0, sizeof(msghdr));
+		messages[i].msg_iov = iov + first;
+		messages[i].msg_iovlen = count;
+		size_t bytes = 0;
+		for (size_t j = first; j < first + count; j++)
+			bytes += iov[j].iov_len;
+		_socket->chainFrames[i] = count;
+		_socket->chainBytes[i] = bytes;
+		_ring->SendMessage(_socket, RingSocket::OpSend, _socket->fd, &messages[i], i + 1 < sendCount); // A short write fails the rest of the chain.
+		_socket->inFlight++;
+		first += count;
+	}
+	_socket->chainLength = sendCount;
+}
+
+// Appends data received through the ring to _in, which is compacted and shrunk the way _Read does. Called with _mutex held.
+void CWebSocketEpollTransport::_AppendReceived(const BYTE *data, size_t length)
+{
+	if (_inBegin == _inEnd)
+	{
+		_inBegin = _inEnd = 0;
+		const size_t readLength = std::max(_readSizer.Length(), length);
+		if (_readSizer.IsAdaptive() && _in.capacity() > readLength) // Everything has been received. Free the memory the last burst needed.
+			std::vector<BYTE>(readLength).swap(_in);
+	}
+	if (_in.size() - _inEnd < length)
+	{
+		if (_inBegin > 0)
+		{
+			memmove(_in.data(), _in.data() + _inBegin, _inEnd - _inBegin);
+			_inEnd -= _inBegin;
+			_inBegin = 0;
+		}
+		if (_in.size() - _inEnd < length)
+			_in.resize(_inEnd + std::max(length, _readSizer.Length()));
+	}
+	memcpy(_in.data() + _inEnd, data, length);
+	_inEnd += length;
+	_readSizer.OnReceived(length, true); // Completions don't tell whether more data is waiting, so each is sized on its own.
+}
+
+// Called on the loop thread with a completion of the ring socket. data is the provided buffer a receive filled, if any.
+// Returns false if the socket has been released, in which case it accounts for the completion itself.
+bool CWebSocketEpollTransport::_OnRingCompletion(RingSocket *socket, uint32_t op, int32_t result, const BYTE *data)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (socket != _socket) // The connection was aborted from another thread, and the socket is about to be abandoned.
+		return false;
+	if (op == RingSocket::OpReceive)
+	{
+		if (result > 0 && data != nullptr)
+			_AppendReceived(data, (size_t)result);
+		else if (result == 0 || (result != -ENOBUFS && result != -ECANCELED)) // Out of buffers, or paused: rearmed by _ArmReceive.
+			_eof = true;
+	}
+	else if (op == RingSocket::OpSend)
+	{
+		for (size_t retired = socket->CompleteSend(result); retired > 0; retired--)
+		{
+			OutgoingFrame &frame = socket->sending.Front();
+			if (frame.notify)
+				_PushEvent(CWebSocketTransportEvent::WriteComplete);
+			if (frame.isClose)
+				_closeSent = true;
+			socket->sending.PopFront();
+		}
+		if (socket->chainFailed) // The connection is broken, nothing more can be written.
+		{
+			_eof = true;
+			_out.Clear();
+			_outOffset = 0;
+		}
+		socket->EndChain();
+	}
+	_Dispatch(lock);
+	return true;
+}
+
+void CWebSocketEpollTransport::_ParseResponse()
+{
+	const char *begin = (const char*)_in.data() + _inBegin;
+	const char *end = (const char*)_in.data() + _inEnd;
+	const char terminator[] = "\r\n\r\n";
+	const char *headerEnd = std::search(begin, end, terminator, terminator + 4);
+	if (headerEnd == end)
+	{
+		if ((size_t)(end - begin) > MaxResponseHeaderLength)
+			_Fail(CWebSocketTransportEvent::Error);
+		return;
+	}
+	const std::string header(begin, headerEnd);
+	_inBegin += (headerEnd - begin) + 4; // Anything after the header already belongs to the websocket.
+
+	bool statusOk = false, upgradeOk = false, connectionOk = false, acceptOk = false, extensionsOk = true, extensionsSeen = false;
+	CWebSocketDeflateParameters deflateParameters;
+	size_t lineBegin = 0;
+	while (lineBegin <= header.size())
+	{
+		size_t lineEnd = header.find("\r\n", lineBegin);
+		if (lineEnd == std::string::npos)
+			lineEnd = header.size();
+		const std::string line = header.substr(lineBegin, lineEnd - lineBegin);
+		if (lineBegin == 0)
+		{
+			const size_t space = line.find(' ');
+			statusOk = (line.compare(0, 5, "HTTP/") == 0) && (space != std::string::npos) && (line.compare(space + 1, 3, "101") == 0);
+		}
+		else
+		{
+			const size_t colon = line.find(':');
+			if (colon != std::string::npos)
+			{
+				const std::string name = ToLower(Trim(line.substr(0, colon)));
+				const std::string value = Trim(line.substr(colon + 1));
+				if (name == "upgrade")
+					upgradeOk = ToLower(value) == "websocket";
+				else if (name == "connection")
+					connectionOk = ToLower(value).find("upgrade") != std::string::npos;
+				else if (name == "sec-websocket-accept")
+					acceptOk = value == cwebsocketinternal::ComputeWebSocketAccept(_key);
+				else if (name == "sec-websocket-extensions")
+				{
+					// permessage-deflate is the only extension we may have offered, and it may only be accepted once.
+					if (_compression.enabled == false || extensionsSeen || ParseDeflateResponse(value, _compression, deflateParameters) == false)
+						extensionsOk = false;
+					extensionsSeen = true;
+				}
+				else if (name == "sec-websocket-protocol") // We didn't ask for one.
+					extensionsOk = false;
+			}
+		}
+		lineBegin = lineEnd + 2;
+	}
+
+	if (statusOk && upgradeOk && connectionOk && acceptOk && extensionsOk)
+	{
+		if (extensionsSeen) // The server accepted permessage-deflate. Reuse the zlib streams of the previous connection, if the parameters allow.
+		{
+			if (_deflater.Initialize(deflateParameters.clientMaxWindowBits, _compression.level, deflateParameters.clientNoContextTakeover) == false ||
+				_inflater.Initialize(deflateParameters.serverMaxWindowBits, deflateParameters.serverNoContextTakeover) == false)
+			{
+				_Fail(CWebSocketTransportEvent::Error);
+				return;
+			}
+			_deflateNegotiated = true;
+			_parser.SetAllowRsv1(true);
+		}
+		_phase = Phase::ResponseReceived;
+		_PushEvent(CWebSocketTransportEvent::HeadersAvailable);
+	}
+	else
+		_Fail(CWebSocketTransportEvent::Error);
+}
+
+// Parses the upgrade request of the client, in the server role. Requests that aren't valid websocket upgrades are answered with an error status.
+void CWebSocketEpollTransport::_ParseRequest()
+{
+	const char *begin = (const char*)_in.data() + _inBegin;
+	const char *end = (const char*)_in.data() + _inEnd;
+	const char terminator[] = "\r\n\r\n";
+	const char *headerEnd = std::search(begin, end, terminator, terminator + 4);
+	if (headerEnd == end)
+	{
+		if ((size_t)(end - begin) > MaxResponseHeaderLength)
+			_Reject("431 Request Header Fields Too Large");
+		return;
+	}
+	const std::string header(begin, headerEnd);
+	_inBegin += (headerEnd - begin) + 4; // Anything after the header already belongs to the websocket.
+
+	bool methodOk = false, pathOk = false, upgradeOk = false, connectionOk = false, versionOk = false;
+	std::string key;
+	size_t lineBegin = 0;
+	while (lineBegin <= header.size())
+	{
+		size_t lineEnd = header.find("\r\n", lineBegin);
+		if (lineEnd == std::string::npos)
+			lineEnd = header.size();
+		const std::string line = header.substr(lineBegin, lineEnd - lineBegin);
+		if (lineBegin == 0)
+		{
+			// GET <target> HTTP/1.1
+			const size_t space = line.find(' ');
+			const size_t secondSpace = (space != std::string::npos) ? line.find(' ', space + 1) : std::string::npos;
+			methodOk = (space == 3) && (line.compare(0, 3, "GET") == 0) && (secondSpace != std::string::npos) && (line.compare(secondSpace + 1, 5, "HTTP/") == 0);
+			if (methodOk)
+			{
+				std::string target = line.substr(space + 1, secondSpace - space - 1);
+				const size_t query = target.find('?');
+				if (query != std::string::npos)
+					target.resize(query);
+				pathOk = _path.empty() || target == _path;
+			}
+		}
+		else
+		{
+			const size_t colon = line.find(':');
+			if (colon != std::string::npos)
+			{
+				const std::string name = ToLower(Trim(line.substr(0, colon)));
+				const std::string value = Trim(line.substr(colon + 1));
+				if (name == "upgrade")
+					upgradeOk = ToLower(value).find("websocket") != std::string::npos;
+				else if (name == "connection")
+					connectionOk = ToLower(value).find("upgrade") != std::string::npos;
+				else if (name == "sec-websocket-version")
+					versionOk = value == "13";
+				else if (name == "sec-websocket-key")
+					key = value;
+				// Extensions and subprotocols aren't supported, so they are declined by leaving them out of the response.
+			}
+		}
+		lineBegin = lineEnd + 2;
+	}
+
+	if (methodOk == false || upgradeOk == false || connectionOk == false || key.empty())
+		_Reject("400 Bad Request");
+	else if (versionOk == false)
+		_Reject("426 Upgrade Required\r\nSec-WebSocket-Version: 13");
+	else if (pathOk == false)
+		_Reject("404 Not Found");
+	else
+	{
+		_key = key;
+		_phase = Phase::RequestSent;
+		_PushEvent(CWebSocketTransportEvent::SendRequestComplete);
+	}
+}
+
+// Answers the upgrade request with the given status line, and any header lines after it, and fails the connection. Called with _mutex held.
+// The response is small enough for the socket buffer of a fresh connection, so it is written right away, and the connection is closed without waiting.
+void CWebSocketEpollTransport::_Reject(const char *status)
+{
+	const std::string response = std::string("HTTP/1.1 ") + status + "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+	while (send(_fd, response.data(), response.size(), MSG_NOSIGNAL) < 0 && errno == EINTR)
+		;
+	_Fail(CWebSocketTransportEvent::Error);
+}
+
+// Parses the frames that have been read. Data is only parsed while a receive is pending, so that it is reported in order,
+// and stays in _in until then. Reported data points into _in, which is not modified until the events have been delivered.
+void CWebSocketEpollTransport::_ParseFrames()
+{
+	while (_phase == Phase::Open && (_rxPending || _closeRequested || _closeReceived))
+	{
+		const bool discard = _closeRequested || _closeReceived; // Data that arrives during the closing handshake is discarded.
+		if (_deflateNegotiated && _inflater.IsBusy() && discard == false) // Finish reporting the compressed data parsed before.
+		{
+			if (_Inflate(nullptr, 0, false) == false)
+				return;
+			continue;
+		}
+		CWebSocketFrameChunk chunk;
+		const size_t consumed = _parser.Parse(_in.data() + _inBegin, _inEnd - _inBegin, discard ? SIZE_MAX : _rxLength, chunk);
+		_inBegin += consumed;
+		if (chunk.type == CWebSocketFrameChunkType::None)
+			break;
+		if (chunk.type == CWebSocketFrameChunkType::Error)
+		{
+			_Fail(CWebSocketTransportEvent::Error);
+			return;
+		}
+		if (chunk.type == CWebSocketFrameChunkType::Control)
+		{
+			if (_HandleControlFrame(chunk.opcode, chunk.payload, chunk.length) == false)
+				return;
+			continue;
+		}
+		if (discard)
+			continue;
+		if (chunk.compressed)
+		{
+			_inflateOpcode = chunk.opcode;
+			if (_Inflate(chunk.payload, chunk.length, chunk.messageEnd) == false)
+				return;
+			continue;
+		}
+
+		WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType;
+		if (chunk.opcode == OpcodeText)
+			bufferType = chunk.messageEnd ? WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+		else
+			bufferType = chunk.messageEnd ? WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+		const BYTE *data = chunk.payload;
+		if (_rxBuffer != nullptr)
+		{
+			if (chunk.length > 0)
+				memcpy(_rxBuffer, chunk.payload, chunk.length);
+			data = _rxBuffer;
+		}
+		_rxPending = false;
+		_PushEvent(CWebSocketTransportEvent::ReadComplete, (DWORD)chunk.length, bufferType, data);
+	}
+
+	// The close frame of the server is reported through the pending receive, unless we have already sent ours.
+	if (_phase == Phase::Open && _closeReceived && _closeRequested == false && _closeReported == false && _rxPending)
+	{
+		_rxPending = false;
+		_closeReported = true;
+		_PushEvent(CWebSocketTransportEvent::ReadComplete, 0, WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE);
+	}
+}
+
+// Decompresses the next piece of a compressed message into the receive buffer, and reports it.
+// payload is the next piece of the compressed payload, or nullptr to continue with the compressed data left over from the last call.
+// Returns false if the connection has failed.
+bool CWebSocketEpollTransport::_Inflate(const BYTE *payload, size_t length, bool messageEnd)
+{
+	BYTE *output = _rxBuffer;
+	size_t outputLength = _rxLength;
+	if (output == nullptr)
+	{
+		if (_inflated.size() < InflateChunkLength)
+			_inflated.resize(InflateChunkLength);
+		output = _inflated.data();
+		outputLength = std::min<size_t>(_rxLength, _inflated.size());
+	}
+	size_t produced;
+	bool messageDone;
+	if (_inflater.Inflate(payload, length, messageEnd, output, outputLength, &produced, &messageDone) == false)
+	{
+		_Fail(CWebSocketTransportEvent::Error);
+		return false;
+	}
+	if (produced == 0 && messageDone == false)
+		return true; // The compressed data didn't make up a whole byte yet.
+
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType;
+	if (_inflateOpcode == OpcodeText)
+		bufferType = messageDone ? WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+	else
+		bufferType = messageDone ? WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE : WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+	_rxPending = false;
+	_PushEvent(CWebSocketTransportEvent::ReadComplete, (DWORD)produced, bufferType, output);
+	return true;
+}
+
+bool CWebSocketEpollTransport::_HandleControlFrame(BYTE opcode, const BYTE *payload, size_t length)
+{
+	if (opcode == OpcodePing)
+	{
+		if (_closeRequested == false && _QueueFrame(OpcodePong, true, payload, length, false) == false) // No frames may follow our close frame.
+		{
+			_Fail(CWebSocketTransportEvent::Error);
+			return false;
+		}
+	}
+	else if (opcode == OpcodePong)
+	{
+		if (_closeRequested == false && _closeReceived == false)
+		{
+			_PushEvent(CWebSocketTransportEvent::PongReceived, (DWORD)length);
+			_events.back().payload.assign(payload, payload + length);
+		}
+	}
+	else if (opcode == OpcodeClose && _closeReceived == false)
+	{
+		if (length == 1)
+		{
+			_Fail(CWebSocketTransportEvent::Error);
+			return false;
+		}
+		_closeReceived = true;
+		if (length >= 2)
+		{
+			_closeStatus = (USHORT)((payload[0] << 8) | payload[1]);
+			_closeReason.assign(payload + 2, payload + length);
+		}
+		else
+			_closeStatus = WINHTTP_WEB_SOCKET_EMPTY_CLOSE_STATUS;
+	}
+	return true;
+}
+
+void CWebSocketEpollTransport::_HandleEof()
+{
+	if (_closeReceived)
+	{
+		if (_closeRequested && _closeCompleted == false) // Our close frame could not be written, but the server is gone either way.
+		{
+			_closeCompleted = true;
+			_PushEvent(CWebSocketTransportEvent::CloseComplete);
+		}
+		return; // Otherwise, the close frame will be reported, and Close will complete as soon as it is called.
+	}
+	if (_rxPending == false && _closeRequested == false && (_inBegin != _inEnd || (_deflateNegotiated && _inflater.IsBusy())))
+		return; // Let the owner receive what has already been read first.
+	_Fail(CWebSocketTransportEvent::ConnectionError);
+}
+
+// Frames and masks the given payload and adds it to the send queue. Called with _mutex held. Returns false if out of memory.
+bool CWebSocketEpollTransport::_QueueFrame(BYTE opcode, bool fin, const BYTE *payload, size_t length, bool notify)
+{
+	OutgoingFrame frame;
+	frame.notify = notify;
+	frame.isClose = opcode == OpcodeClose;
+	frame.urgent = opcode == OpcodePing || opcode == OpcodePong;
+	if (_AppendFrame(frame.bytes, opcode, fin, payload, length, false) == false)
+		return false;
+	if (frame.urgent == false)
+	{
+		_out.PushBack(std::move(frame));
+		return true;
+	}
+	// Control frames may come between the frames of a fragmented message, so a ping or a pong only has to wait for the frame being written, and the urgent frames queued before it.
+	size_t index = (_outOffset > 0) ? 1 : 0;
+	while (index < _out.Size() && _out[index].urgent)
+		index++;
+	_out.Insert(index, std::move(frame));
+	return true;
+}
+
+// RFC 6455 section 10.3 asks for masking keys an attacker can't predict from the previous ones, so they come from the kernel's CSPRNG rather than from a
+// seeded generator. Called with _mutex held.
+void CWebSocketEpollTransport::_NextMaskKey(BYTE mask[4])
+{
+	if (_maskKeysUsed + 4 > MaskKeyBufferLength)
+	{
+		size_t filled = 0;
+		while (filled < MaskKeyBufferLength)
+		{
+			const ssize_t r = getrandom(_maskKeys + filled, MaskKeyBufferLength - filled, 0);
+			if (r > 0)
+				filled += r;
+			else if (r < 0 && errno != EINTR)
+				break;
+		}
+		if (filled < MaskKeyBufferLength) // getrandom is missing, which only happens on kernels older than 3.17. Fall back to the C++ library's source.
+		{
+			std::random_device rd;
+			for (; filled < MaskKeyBufferLength; filled++)
+				_maskKeys[filled] = (BYTE)rd();
+		}
+		_maskKeysUsed = 0;
+	}
+	memcpy(mask, _maskKeys + _maskKeysUsed, 4);
+	_maskKeysUsed += 4;
+}
+
+// Frames and masks the given payload with a fresh masking key, appending the frame to bytes. Called with _mutex held. Returns false if out of memory.
+// In the server role, the payload is copied as it is.
+bool CWebSocketEpollTransport::_AppendFrame(CWebSocketPooledBytes &bytes, BYTE opcode, bool fin, const BYTE *payload, size_t length, bool compressed)
+{
+	if (_server)
+	{
+		BYTE header[MaxFrameHeaderLength];
+		const size_t headerLength = WriteFrameHeader(header, fin, opcode, length, nullptr, compressed);
+		BYTE *frame = bytes.Extend(_pool, headerLength + length);
+		if (frame == nullptr)
+			return false;
+		memcpy(frame, header, headerLength);
+		if (length > 0)
+			memcpy(frame + headerLength, payload, length);
+		return true;
+	}
+	BYTE mask[4];
+	_NextMaskKey(mask);
+	BYTE header[MaxFrameHeaderLength];
+	const size_t headerLength = WriteFrameHeader(header, fin, opcode, length, mask, compressed); // RSV1 marks a compressed message.
+	BYTE *frame = bytes.Extend(_pool, headerLength + length);
+	if (frame == nullptr)
+		return false;
+	memcpy(frame, header, headerLength);
+	CopyMaskedPayload(frame + headerLength, payload, length, mask);
+	return true;
+}
+
+#endif
@@ -0,0 +1,214 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <chrono>
+
+#include "CWebSocketTransport.h"
+#include "CWebSocketFrameCodec.h"
+#include "CWebSocketDeflate.h"
+#include "CWebSocketReceiveSizer.h"
+#include "CWebSocketRingQueue.h"
+#include "CWebSocketBufferPool.h"
+#include "EpollLoop.h"
+
+struct addrinfo;
+
+// A transport that talks to the server over a non-blocking TCP socket driven by an epoll loop, available on Linux.
+// It performs the HTTP upgrade and websocket framing itself. Events are reported on the loop thread.
+// Secure websockets are not supported; Initialize fails if secure is true.
+// Host names are resolved on a thread of their own, so that a slow lookup doesn't hold up the loop. IP literals are parsed in SendUpgradeRequest.
+// If connecting to a resolved address fails, the next one is tried.
+// Any number of transports can share a loop.
+// Received data can be reported in place, straight from the read buffer.
+// Batches of messages are serialized into a single buffer drawn from a CWebSocketBufferPool, and queued frames are written with a single gather write.
+// Pings and pongs overtake the queued data frames that haven't started being written.
+// Reads from the socket are 64 KB at a time, or adapt to the traffic if SetReceiveBuffer asks for it, in which case the read buffer is also freed down to size once drained.
+// Supports permessage-deflate. Only whole messages are compressed; fragments passed to Send are always sent uncompressed.
+// A transport constructed with an accepted socket plays the server end of the connection instead; see the second constructor.
+// If the loop has an IoUring, open connections receive and send through it rather than with system calls of their own: a multishot receive draws
+// from the buffers of the ring, and queued frames are written with linked gather writes, one chain at a time. The opening handshake still uses epoll.
+class CWebSocketEpollTransport : public CWebSocketTransport, private EpollLoop::Handler
+{
+private:
+	const static size_t ReadChunkLength = 65536; // The size of reads from the socket, unless SetReceiveBuffer says otherwise.
+	const static size_t ReadAheadLimit = 1048576; // Stop reading from the socket if this many bytes are waiting to be received by the owner.
+	const static size_t MaxResponseHeaderLength = 16384; // Also the limit for upgrade requests, in the server role.
+	const static size_t InflateChunkLength = 65536; // The most decompressed data reported in place at a time.
+	const static size_t MaxGatherFrames = 64; // The most queued frames written with a single system call.
+	const static size_t MaskKeyBufferLength = 256; // Masking keys are drawn from getrandom this many bytes at a time.
+
+private:
+	enum class Phase
+	{
+		Idle, // There is no connection.
+		Resolving, // Waiting for the host name to be resolved.
+		ReceivingRequest, // In the server role, waiting for the upgrade request.
+		Connecting, // Waiting for the TCP connection to be established.
+		SendingRequest, // Writing the upgrade request.
+		RequestSent, // Waiting for ReceiveResponse to be called. In the server role, the upgrade request has been received and accepted.
+		ReceivingResponse, // Waiting for the upgrade response.
+		ResponseReceived, // Waiting for CompleteUpgrade to be called. In the server role, the upgrade response has been queued.
+		Open, // Exchanging websocket frames.
+		Failed // An error has been reported. Waiting for Abort to be called.
+	};
+
+	struct OutgoingFrame
+	{
+		cwebsocketinternal::CWebSocketPooledBytes bytes; // One or more serialized frames. A batch of messages is serialized into a single OutgoingFrame.
+		bool notify; // Report WriteComplete once the frame has been written.
+		bool isClose;
+		bool urgent; // A ping or a pong, which goes ahead of the data frames that haven't started being written.
+		CWebSocketSharedBuffer external; // A prepared frame passed to SendBatch, written instead of bytes, without being copied.
+
+		const BYTE *Data() const { return (external.Data() != nullptr) ? external.Data() : bytes.Data(); }
+		size_t Size() const { return (external.Data() != nullptr) ? external.Length() : bytes.Size(); }
+	};
+
+	class RingSocket; // The I/O of an open connection that goes through the IoUring of the loop.
+
+	// Shared with the threads resolving the host name, which may outlive the transport. owner is cleared by the destructor.
+	struct Lookup
+	{
+		std::mutex mutex;
+		CWebSocketEpollTransport *owner;
+	};
+
+	struct PendingEvent
+	{
+		CWebSocketTransportEvent event;
+		WINHTTP_WEB_SOCKET_STATUS status;
+		const BYTE *data;
+		std::vector<BYTE> payload; // A copy of the payload of a pong, which may be in the parser's buffer. Reported instead of data.
+	};
+
+private:
+	EpollLoop *_loop;
+	IoUring *_ring; // The ring of the loop, nullptr if it has none.
+	const bool _server; // The transport plays the server end of an accepted connection: it receives the upgrade request, and doesn't mask its frames.
+	int _acceptedFd; // The accepted socket, until SendUpgradeRequest takes it over. -1 in the client role.
+	std::string _host;
+	std::string _service;
+	std::string _hostHeader;
+	std::string _path;
+	CWebSocketTransportCallback _callback;
+	CWebSocketCompressionOptions _compression;
+	std::shared_ptr<Lookup> _lookup; // Created by the first lookup.
+	// Protects everything below. Never held while calling _callback.
+	// Without a reactor, the owner calls in from thread pool threads while the events are handled on the loop thread. A websocket pinned to a reactor loop
+	// calls in from the loop thread as well, so the lock is never contended there and only costs an atomic exchange, but it is still needed: the websocket
+	// may be destroyed on any thread, and its destructor aborts the transport.
+	std::mutex _mutex;
+	int _fd;
+	addrinfo *_addresses; // The resolved addresses of the host, until the connection is established.
+	addrinfo *_nextAddress; // The address of _addresses to try next if connecting fails.
+	RingSocket *_socket; // Takes over the I/O of _fd once the connection is open, if the loop has a ring. Only touched on the loop thread, past this pointer.
+	uint64_t _generation; // Incremented by Abort, so that work posted for an aborted connection can be recognized.
+	Phase _phase;
+	uint32_t _registeredEvents;
+	bool _dispatching; // The loop thread is running _Dispatch, and will notice any changes made to the state.
+	bool _dispatchPosted; // A call to _Dispatch has been posted to the loop.
+	bool _eof; // The server closed its end of the connection, or the connection failed.
+	std::string _key;
+	std::chrono::steady_clock::time_point _connectStartedAt; // When SendUpgradeRequest was called. See GetConnectTimings.
+	uint64_t _resolvedus; // 0 until the phase has ended.
+	uint64_t _connectedus;
+	std::vector<BYTE> _in;
+	size_t _inBegin;
+	size_t _inEnd;
+	cwebsocketinternal::CWebSocketReceiveSizer _readSizer; // Sizes the reads from the socket. Survives reconnects.
+	cwebsocketinternal::CWebSocketRingQueue<OutgoingFrame> _out;
+	size_t _outOffset; // Number of bytes of the front frame that have been written.
+	CWebSocketBufferPool *_pool; // The pool frames are serialized into, so that sending doesn't allocate in steady state.
+	cwebsocketinternal::CWebSocketFrameParser _parser;
+	bool _outMessageFragmented; // The last frame sent was a non-final fragment.
+	bool _deflateNegotiated; // The server accepted permessage-deflate for this connection.
+	cwebsocketinternal::CWebSocketDeflater _deflater; // The zlib streams live as long as the transport, and are reset for every connection.
+	cwebsocketinternal::CWebSocketInflater _inflater;
+	std::vector<BYTE> _deflated; // The compressed payload of the message being sent.
+	std::vector<BYTE> _inflated; // Decompressed data reported in place.
+	BYTE _inflateOpcode; // The opcode of the compressed message being decompressed.
+	BYTE *_rxBuffer; // nullptr if the data is to be reported in place.
+	DWORD _rxLength;
+	bool _rxPending;
+	bool _closeRequested; // Close has been called.
+	bool _closeSent; // Our close frame has been written.
+	bool _closeReceived; // The close frame of the server has been received.
+	bool _closeReported; // The close frame of the server has been reported with a ReadComplete of type WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE.
+	bool _closeCompleted; // CloseComplete has been reported.
+	USHORT _closeStatus;
+	std::vector<BYTE> _closeReason;
+	std::vector<PendingEvent> _events; // Events waiting to be reported by _Dispatch.
+	std::vector<PendingEvent> _spareEvents; // Empty, with the capacity of the events reported last, so that reporting events doesn't allocate in steady state.
+	BYTE _maskKeys[MaskKeyBufferLength]; // Random bytes for the masking keys of the frames to come, so that masking a frame rarely costs a system call.
+	size_t _maskKeysUsed; // The number of bytes of _maskKeys already used.
+
+private:
+	void OnEpollEvents(uint32_t events) override;
+	void _Dispatch(std::unique_lock<std::mutex> &lock);
+	void _Schedule();
+	void _Reset();
+	void _OnResolved(uint64_t generation, addrinfo *addresses);
+	bool _ConnectNext();
+	void _FreeAddresses();
+	void _Fail(CWebSocketTransportEvent event);
+	void _PushEvent(CWebSocketTransportEvent event, DWORD bytesTransferred = 0, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType = WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, const BYTE *data = nullptr);
+	void _UpdateInterest();
+	void _Read();
+	void _Flush();
+	void _Process();
+	void _ParseResponse();
+	void _ParseRequest();
+	void _Reject(const char *status);
+	void _ParseFrames();
+	bool _HandleControlFrame(BYTE opcode, const BYTE *payload, size_t length);
+	bool _Inflate(const BYTE *payload, size_t length, bool messageEnd);
+	void _HandleEof();
+	bool _QueueFrame(BYTE opcode, bool fin, const BYTE *payload, size_t length, bool notify);
+	void _NextMaskKey(BYTE mask[4]);
+	bool _AppendFrame(cwebsocketinternal::CWebSocketPooledBytes &bytes, BYTE opcode, bool fin, const BYTE *payload, size_t length, bool compressed);
+	bool _IsSharedFrame(const CWebSocketTransportMessage &message) const;
+	bool _AttachSocket();
+	void _ReleaseSocket();
+	void _ArmReceive();
+	void _SubmitSends();
+	void _AppendReceived(const BYTE *data, size_t length);
+	bool _OnRingCompletion(RingSocket *socket, uint32_t op, int32_t result, const BYTE *data);
+
+public:
+	// Events are handled on loop, which must outlive the transport. If loop is nullptr, the transport uses EpollLoop::Default.
+	explicit CWebSocketEpollTransport(EpollLoop *loop = nullptr);
+
+	// Makes a transport for the server end of the connection accepted on the non-blocking socket acceptedFd, which it takes ownership of.
+	// The transport events keep their client-side names: SendUpgradeRequest starts receiving the upgrade request of the client, and reports SendRequestComplete
+	// once a valid one has arrived; ReceiveResponse queues the response that accepts it, and reports HeadersAvailable. The connection can't be reopened
+	// once aborted. In Initialize, only path is used: if it isn't empty, requests for other paths are answered with 404 Not Found.
+	// Frames are sent unmasked, and the frames of the client must be masked. permessage-deflate offers are declined, and SetCompression fails.
+	CWebSocketEpollTransport(EpollLoop *loop, int acceptedFd);
+	CWebSocketEpollTransport(const CWebSocketEpollTransport&) = delete;
+	~CWebSocketEpollTransport();
+
+	bool Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback) override;
+	bool SetCompression(const CWebSocketCompressionOptions &options) override;
+	bool SetReceiveBuffer(const CWebSocketReceiveBufferOptions &options) override;
+	bool SetBufferPool(CWebSocketBufferPool *pool) override;
+	bool SendUpgradeRequest() override;
+	bool GetConnectTimings(CWebSocketConnectTimings *timings) override;
+	bool ReceiveResponse() override;
+	bool CompleteUpgrade() override;
+	bool Receive(BYTE *buffer, DWORD length) override;
+	bool ReceivesInPlace() const override;
+	bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) override;
+	bool SendBatch(const CWebSocketTransportMessage *messages, size_t count) override;
+	bool SendsInBatches() const override;
+	bool Ping(const BYTE *payload, size_t length) override;
+	bool Close(USHORT status, const BYTE *reason, size_t reasonLength) override;
+	bool QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed) override;
+	void Abort() override;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include <string.h>
+#include <algorithm>
+
+#include "CWebSocketFrameCodec.h"
+
+namespace cwebsocketinternal
+{
+	CWebSocketFrameParser::CWebSocketFrameParser(bool expectMasked) :
+		_expectMasked(expectMasked),
+		_allowRsv1(false)
+	{
+		Reset();
+	}
+
+	void CWebSocketFrameParser::Reset()
+	{
+		_headerFilled = 0;
+		_inFrame = false;
+		_fin = false;
+		_opcode = 0;
+		_masked = false;
+		_remaining = 0;
+		_maskOffset = 0;
+		_inMessage = false;
+		_messageStarted = false;
+		_messageOpcode = 0;
+		_messageCompressed = false;
+		_controlFilled = 0;
+	}
+
+	void CWebSocketFrameParser::SetAllowRsv1(bool allow)
+	{
+		_allowRsv1 = allow;
+	}
+
+	bool CWebSocketFrameParser::InMessage() const
+	{
+		return _inMessage;
+	}
+
+	// Returns the length of the header being gathered, as far as it can be told from the bytes gathered so far.
+	size_t CWebSocketFrameParser::_HeaderLength() const
+	{
+		if (_headerFilled < 2)
+			return 2;
+		const BYTE length7 = _header[1] & 0x7F;
+		const size_t extendedLength = (length7 == 126) ? 2 : ((length7 == 127) ? 8 : 0);
+		const size_t maskLength = (_header[1] & 0x80) ? 4 : 0;
+		return 2 + extendedLength + maskLength;
+	}
+
+	// Decodes the gathered header into the current frame. Returns false if the frame violates the protocol.
+	bool CWebSocketFrameParser::_ValidateHeader()
+	{
+		_fin = (_header[0] & 0x80) != 0;
+		const bool rsv1 = (_header[0] & 0x40) != 0;
+		const bool rsv23 = (_header[0] & 0x30) != 0;
+		_opcode = _header[0] & 0x0F;
+		_masked = (_header[1] & 0x80) != 0;
+		const BYTE length7 = _header[1] & 0x7F;
+		size_t offset = 2;
+		if (length7 == 126)
+		{
+			_remaining = ((uint64_t)_header[2] << 8) | _header[3];
+			offset = 4;
+		}
+		else if (length7 == 127)
+		{
+			_remaining = 0;
+			for (int i = 0; i < 8; i++)
+				_remaining = (_remaining << 8) | _header[2 + i];
+			offset = 10;
+			if (_remaining >> 63) // The most significant bit must be 0.
+				return false;
+		}
+		else
+			_remaining = length7;
+		if (_masked)
+			memcpy(_mask, _header + offset, 4);
+
+		if (rsv23 || _masked != _expectMasked)
+			return false;
+		if (_opcode >= OpcodeClose)
+			return _fin && rsv1 == false && _remaining <= MaxControlPayloadLength && (_opcode == OpcodeClose || _opcode == OpcodePing || _opcode == OpcodePong);
+		if (_opcode == OpcodeContinuation)
+			return _inMessage && rsv1 == false; // RSV1 marks a compressed message, and only the first frame carries it.
+		if (_opcode == OpcodeText || _opcode == OpcodeBinary)
+			return _inMessage == false && (rsv1 == false || _allowRsv1);
+		return false;
+	}
+
+	size_t CWebSocketFrameParser::Parse(BYTE *data, size_t length, size_t maxPayload, CWebSocketFrameChunk &chunk)
+	{
+		size_t consumed = 0;
+		chunk.type = CWebSocketFrameChunkType::None;
+		chunk.opcode = 0;
+		chunk.payload = nullptr;
+		chunk.length = 0;
+		chunk.messageStart = false;
+		chunk.messageEnd = false;
+		chunk.compressed = false;
+
+		for (;;)
+		{
+			if (_inFrame == false)
+			{
+				while (consumed < length && _headerFilled < _HeaderLength())
+					_header[_headerFilled++] = data[consumed++];
+				if (_headerFilled < _HeaderLength())
+					return consumed;
+				_headerFilled = 0;
+				if (_ValidateHeader() == false)
+				{
+					chunk.type = CWebSocketFrameChunkType::Error;
+					return consumed;
+				}
+				_inFrame = true;
+				_maskOffset = 0;
+				_controlFilled = 0;
+				if (_opcode == OpcodeText || _opcode == OpcodeBinary)
+				{
+					_inMessage = true;
+					_messageStarted = false;
+					_messageOpcode = _opcode;
+					_messageCompressed = (_header[0] & 0x40) != 0;
+				}
+			}
+
+			const size_t available = length - consumed;
+			if (_opcode >= OpcodeClose)
+			{
+				BYTE *payload;
+				size_t payloadLength;
+				if (_controlFilled == 0 && available >= _remaining) // The whole payload is in data.
+				{
+					payload = data + consumed;
+					payloadLength = (size_t)_remaining;
+					consumed += payloadLength;
+				}
+				else // Gather the payload in the parser, since it must be returned in one piece.
+				{
+					const size_t n = (size_t)std::min<uint64_t>(available, _remaining);
+					memcpy(_control + _controlFilled, data + consumed, n);
+					_controlFilled += n;
+					consumed += n;
+					if (_controlFilled < _remaining)
+						return consumed;
+					payload = _control;
+					payloadLength = _controlFilled;
+				}
+				if (_masked)
+					MaskPayload(payload, payloadLength, _mask);
+				_inFrame = false;
+				_remaining = 0;
+				chunk.type = CWebSocketFrameChunkType::Control;
+				chunk.opcode = _opcode;
+				chunk.payload = payload;
+				chunk.length = payloadLength;
+				return consumed;
+			}
+
+			const size_t n = (size_t)std::min<uint64_t>(_remaining, std::min(available, maxPayload));
+			const bool frameEnd = (_remaining == n);
+			if (n == 0 && frameEnd == false)
+				return consumed;
+			BYTE *payload = data + consumed;
+			if (_masked)
+			{
+				MaskPayload(payload, n, _mask, _maskOffset);
+				_maskOffset += n;
+			}
+			consumed += n;
+			_remaining -= n;
+			const bool messageEnd = frameEnd && _fin;
+			if (frameEnd)
+				_inFrame = false;
+			if (n == 0 && messageEnd == false) // An empty frame in the middle of a message, nothing to return.
+				continue;
+			chunk.type = CWebSocketFrameChunkType::Data;
+			chunk.opcode = _messageOpcode;
+			chunk.payload = payload;
+			chunk.length = n;
+			chunk.messageStart = _messageStarted == false;
+			chunk.messageEnd = messageEnd;
+			chunk.compressed = _messageCompressed;
+			_messageStarted = true;
+			if (messageEnd)
+				_inMessage = false;
+			return consumed;
+		}
+	}
+
+	size_t WriteFrameHeader(BYTE *header, bool fin, BYTE opcode, uint64_t payloadLength, const BYTE *mask, bool rsv1)
+	{
+		size_t length = 0;
+		header[length++] = (BYTE)((fin ? 0x80 : 0x00) | (rsv1 ? 0x40 : 0x00) | opcode);
+		const BYTE maskBit = (mask != nullptr) ? 0x80 : 0x00;
+		if (payloadLength < 126)
+			header[length++] = (BYTE)(maskBit | payloadLength);
+		else if (payloadLength <= 0xFFFF)
+		{
+			header[length++] = maskBit | 126;
+			header[length++] = (BYTE)(payloadLength >> 8);
+			header[length++] = (BYTE)payloadLength;
+		}
+		else
+		{
+			header[length++] = maskBit | 127;
+			for (int i = 7; i >= 0; i--)
+				header[length++] = (BYTE)(payloadLength >> (i * 8));
+		}
+		if (mask != nullptr)
+		{
+			memcpy(header + length, mask, 4);
+			length += 4;
+		}
+		return length;
+	}
+
+	void AppendFrame(std::vector<BYTE> &frame, bool fin, BYTE opcode, const BYTE *payload, size_t length, const BYTE *mask, bool rsv1)
+	{
+		BYTE header[MaxFrameHeaderLength];
+		const size_t headerLength = WriteFrameHeader(header, fin, opcode, length, mask, rsv1);
+		const size_t offset = frame.size();
+		frame.resize(offset + headerLength + length);
+		memcpy(frame.data() + offset, header, headerLength);
+		if (length == 0)
+			return;
+		if (mask != nullptr)
+			CopyMaskedPayload(frame.data() + offset + headerLength, payload, length, mask); // Mask while copying, to touch the payload only once.
+		else
+			memcpy(frame.data() + offset + headerLength, payload, length);
+	}
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+
+#include "Win32Compat.h"
+
+// An RFC 6455 frame parser and serializer, used by the transports that do their own framing.
+namespace cwebsocketinternal
+{
+	const BYTE OpcodeContinuation = 0x0;
+	const BYTE OpcodeText = 0x1;
+	const BYTE OpcodeBinary = 0x2;
+	const BYTE OpcodeClose = 0x8;
+	const BYTE OpcodePing = 0x9;
+	const BYTE OpcodePong = 0xA;
+
+	const size_t MaxFrameHeaderLength = 14;
+	const size_t MaxControlPayloadLength = 125;
+
+	enum class CWebSocketFrameChunkType
+	{
+		None, // More data is needed to make progress.
+		Data, // A piece of the payload of a text or binary message.
+		Control, // The complete payload of a control frame.
+		Error // The peer violated the protocol. The parser must be reset before it can be used again.
+	};
+
+	// A piece of parsed input, returned by CWebSocketFrameParser::Parse.
+	struct CWebSocketFrameChunk
+	{
+		CWebSocketFrameChunkType type;
+		BYTE opcode; // For data, the opcode of the first frame of the message (OpcodeText or OpcodeBinary). For control frames, the opcode of the frame.
+		BYTE *payload; // Points into the buffer passed to Parse, or into the parser itself for control frames that arrived in pieces. Valid until the next call to Parse.
+		size_t length;
+		bool messageStart; // This is the first chunk of a message.
+		bool messageEnd; // This is the last chunk of a message.
+		bool compressed; // The first frame of the message had the RSV1 bit set. Only possible if SetAllowRsv1 was called.
+	};
+
+	// CWebSocketFrameParser parses a stream of frames incrementally, regardless of how the stream is split into reads.
+	// Headers may arrive one byte at a time. The payload of data frames is never copied: Parse returns spans of the input buffer,
+	// unmasking them in place if needed. Continuation frames are attributed to the message they continue.
+	class CWebSocketFrameParser
+	{
+	private:
+		bool _expectMasked; // Frames sent by clients are masked, frames sent by servers are not.
+		bool _allowRsv1;
+		BYTE _header[MaxFrameHeaderLength];
+		size_t _headerFilled;
+		bool _inFrame; // The header of the current frame has been parsed.
+		bool _fin;
+		BYTE _opcode;
+		BYTE _mask[4];
+		bool _masked;
+		uint64_t _remaining; // Payload bytes of the current frame that haven't been returned yet.
+		size_t _maskOffset;
+		bool _inMessage; // A data message has started but hasn't ended yet.
+		bool _messageStarted; // At least one chunk of the current message has been returned.
+		BYTE _messageOpcode;
+		bool _messageCompressed;
+		BYTE _control[MaxControlPayloadLength];
+		size_t _controlFilled;
+	private:
+		size_t _HeaderLength() const;
+		bool _ValidateHeader();
+	public:
+		CWebSocketFrameParser(bool expectMasked = false);
+		void Reset();
+
+		// Allows the RSV1 bit on the first frame of data messages, as used by permessage-deflate.
+		void SetAllowRsv1(bool allow);
+
+		// Parses data, which holds length bytes of the stream following the ones consumed by earlier calls.
+		// At most maxPayload bytes of payload are returned in one chunk.
+		// Returns the number of bytes consumed and fills chunk. Masked payloads are unmasked in place, hence the non-const buffer.
+		// Returns a chunk of type None when all of data has been consumed without completing a chunk.
+		size_t Parse(BYTE *data, size_t length, size_t maxPayload, CWebSocketFrameChunk &chunk);
+
+		// Returns true if a data message has started but hasn't ended yet.
+		bool InMessage() const;
+	};
+
+	// Writes the header of a frame into header, which must have room for MaxFrameHeaderLength bytes.
+	// If mask is not nullptr, the frame is marked as masked and mask is written as the masking key; the payload must be masked separately.
+	// Returns the length of the header.
+	size_t WriteFrameHeader(BYTE *header, bool fin, BYTE opcode, uint64_t payloadLength, const BYTE *mask, bool rsv1 = false);
+
+	// The implementations of MaskPayload, fastest last. See CWebSocketMasking.cpp.
+	enum class CWebSocketMaskingKernel
+	{
+		Scalar,
+		SSE2,
+		AVX2,
+		AVX512
+	};
+
+	// XORs data with mask, as if data started maskOffset bytes into the payload.
+	// Uses the fastest kernel the CPU supports, picked on first use.
+	void MaskPayload(BYTE *data, size_t length, const BYTE mask[4], size_t maskOffset = 0);
+
+	// Same as MaskPayload, but writes the masked bytes to dst instead of masking src in place.
+	void CopyMaskedPayload(BYTE *dst, const BYTE *src, size_t length, const BYTE mask[4], size_t maskOffset = 0);
+
+	// Returns the kernel used by MaskPayload.
+	CWebSocketMaskingKernel GetMaskingKernel();
+
+	// Makes MaskPayload use the given kernel. Returns false if the CPU doesn't support it.
+	// Meant for tests and benchmarks; it must not be called while frames are being masked on other threads.
+	bool SetMaskingKernel(CWebSocketMaskingKernel kernel);
+
+	const char *MaskingKernelName(CWebSocketMaskingKernel kernel);
+
+	// Appends a complete frame to frame. If mask is not nullptr, the payload is masked on the way.
+	void AppendFrame(std::vector<BYTE> &frame, bool fin, BYTE opcode, const BYTE *payload, size_t length, const BYTE *mask, bool rsv1 = false);
+};
@@ -0,0 +1,65 @@
+#include "CWebSocketGroup.h"
+
+CWebSocketGroup::CWebSocketGroup(CWebSocketBufferPool *pool) :
+	_pool(pool)
+{
+}
+
+bool CWebSocketGroup::Add(CWebSocket *ws)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_indices.emplace(ws, _members.size()).second == false)
+		return false;
+	_members.push_back(ws);
+	return true;
+}
+
+bool CWebSocketGroup::Remove(CWebSocket *ws)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	const auto found = _indices.find(ws);
+	if (found == _indices.end())
+		return false;
+	// Move the last member into the hole, so that removing doesn't shift the others.
+	const size_t index = found->second;
+	_indices.erase(found);
+	if (index != _members.size() - 1)
+	{
+		_members[index] = _members.back();
+		_indices[_members[index]] = index;
+	}
+	_members.pop_back();
+	return true;
+}
+
+size_t CWebSocketGroup::Size()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _members.size();
+}
+
+size_t CWebSocketGroup::Broadcast(const CWebSocketPreparedMessage &message, CWebSocketSendPriority priority, CWebSocket *except)
+{
+	if (message.IsEmpty())
+		return 0;
+	// SendPrepared only queues a work on the websocket, without waiting for its mutex, so holding the lock of the group while calling it can't deadlock
+	// with a callback of a member that removes itself.
+	std::lock_guard<std::mutex> lock(_mutex);
+	size_t sent = 0;
+	for (auto ws : _members)
+	{
+		if (ws != except && ws->SendPrepared(message, priority))
+			sent++;
+	}
+	return sent;
+}
+
+size_t CWebSocketGroup::BroadcastBinary(const BYTE *message, size_t length, CWebSocketSendPriority priority, CWebSocket *except)
+{
+	return Broadcast(CWebSocketPreparedMessage(WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, message, length, _pool), priority, except);
+}
+
+size_t CWebSocketGroup::BroadcastUTF8String(const BYTE *message, size_t length, CWebSocketSendPriority priority, CWebSocket *except)
+{
+	return Broadcast(CWebSocketPreparedMessage(WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, message, length, _pool), priority, except);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+#include "CWebSocket.h"
+#include "CWebSocketPreparedMessage.h"
+
+// A set of websockets that messages are broadcast to, such as the subscribers of a topic. A broadcast message is framed once, in a single block of
+// the buffer pool (see CWebSocketPreparedMessage), and every member queues a reference to it, so the cost per member doesn't grow with the length of the message.
+// The block goes back to the pool once the last member has sent or dropped the message.
+// Broadcast messages are never compressed: sharing one permessage-deflate frame between members is not implemented.
+// A group may be used from any number of threads, including from within the callbacks of its members. It doesn't own its members:
+// remove a websocket before destructing it, for instance in its onClosed and onError callbacks.
+class CWebSocketGroup
+{
+private:
+	std::mutex _mutex; // Protects everything below.
+	std::vector<CWebSocket*> _members;
+	std::unordered_map<CWebSocket*, size_t> _indices; // The index of every member in _members, so that removing one doesn't search.
+	CWebSocketBufferPool *_pool; // The pool messages are prepared in.
+
+public:
+	// Messages passed to BroadcastBinary and BroadcastUTF8String are prepared in pool, or in the default pool if pool is nullptr.
+	explicit CWebSocketGroup(CWebSocketBufferPool *pool = nullptr);
+	CWebSocketGroup(const CWebSocketGroup&) = delete;
+
+	// Adds ws to the group. Returns false if it is a member already.
+	bool Add(CWebSocket *ws);
+
+	// Removes ws from the group. Once this function returns, no broadcast touches ws anymore. Returns false if it wasn't a member.
+	bool Remove(CWebSocket *ws);
+
+	// The number of members.
+	size_t Size();
+
+	// Sends message to every member with CWebSocket::SendPrepared, except for except, if not nullptr.
+	// Returns the number of members that took the message; the others refused it because their send buffer was full, see CWebSocket::SetSendBufferOptions.
+	size_t Broadcast(const CWebSocketPreparedMessage &message, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal, CWebSocket *except = nullptr);
+
+	// Prepares a binary message from a copy of length bytes at message, and broadcasts it. Returns 0 if out of memory.
+	size_t BroadcastBinary(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal, CWebSocket *except = nullptr);
+
+	// Prepares a UTF8 message from a copy of length bytes of UTF8 encoded unicode at message, and broadcasts it. Returns 0 if out of memory.
+	size_t BroadcastUTF8String(const BYTE *message, size_t length, CWebSocketSendPriority priority = CWebSocketSendPriority::Normal, CWebSocket *except = nullptr);
+};
@@ -0,0 +1,136 @@
+#include <random>
+#include <string.h>
+
+#include "CWebSocketHandshakeHelpers.h"
+
+namespace cwebsocketinternal
+{
+	static uint32_t RotateLeft(uint32_t value, int bits)
+	{
+		return (value << bits) | (value >> (32 - bits));
+	}
+
+	static void Sha1Block(uint32_t state[5], const BYTE block[64])
+	{
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++)
+			w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+		for (int i = 16; i < 80; i++)
+			w[i] = RotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else
+			{
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			const uint32_t temp = RotateLeft(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = RotateLeft(b, 30);
+			b = a;
+			a = temp;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+
+	void Sha1(const BYTE *data, size_t length, BYTE digest[20])
+	{
+		uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+		size_t i;
+		for (i = 0; i + 64 <= length; i += 64)
+			Sha1Block(state, data + i);
+
+		// Pad the last block with a 1 bit, zeroes and the message length in bits.
+		BYTE tail[128] = { 0 };
+		const size_t remaining = length - i;
+		memcpy(tail, data + i, remaining);
+		tail[remaining] = 0x80;
+		const size_t tailLength = (remaining < 56) ? 64 : 128;
+		const uint64_t bitLength = (uint64_t)length * 8;
+		for (int j = 0; j < 8; j++)
+			tail[tailLength - 1 - j] = (BYTE)(bitLength >> (j * 8));
+		Sha1Block(state, tail);
+		if (tailLength == 128)
+			Sha1Block(state, tail + 64);
+
+		for (int j = 0; j < 5; j++)
+		{
+			digest[j * 4] = (BYTE)(state[j] >> 24);
+			digest[j * 4 + 1] = (BYTE)(state[j] >> 16);
+			digest[j * 4 + 2] = (BYTE)(state[j] >> 8);
+			digest[j * 4 + 3] = (BYTE)state[j];
+		}
+	}
+
+	std::string Base64Encode(const BYTE *data, size_t length)
+	{
+		static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		std::string result;
+		result.reserve((length + 2) / 3 * 4);
+		size_t i;
+		for (i = 0; i + 3 <= length; i += 3)
+		{
+			const uint32_t n = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8) | data[i + 2];
+			result.push_back(alphabet[(n >> 18) & 0x3F]);
+			result.push_back(alphabet[(n >> 12) & 0x3F]);
+			result.push_back(alphabet[(n >> 6) & 0x3F]);
+			result.push_back(alphabet[n & 0x3F]);
+		}
+		if (length - i == 1)
+		{
+			const uint32_t n = (uint32_t)data[i] << 16;
+			result.push_back(alphabet[(n >> 18) & 0x3F]);
+			result.push_back(alphabet[(n >> 12) & 0x3F]);
+			result.append("==");
+		}
+		else if (length - i == 2)
+		{
+			const uint32_t n = ((uint32_t)data[i] << 16) | ((uint32_t)data[i + 1] << 8);
+			result.push_back(alphabet[(n >> 18) & 0x3F]);
+			result.push_back(alphabet[(n >> 12) & 0x3F]);
+			result.push_back(alphabet[(n >> 6) & 0x3F]);
+			result.push_back('=');
+		}
+		return result;
+	}
+
+	std::string GenerateWebSocketKey()
+	{
+		std::random_device rd;
+		BYTE nonce[16];
+		for (size_t i = 0; i < sizeof(nonce); i++)
+			nonce[i] = (BYTE)rd();
+		return Base64Encode(nonce, sizeof(nonce));
+	}
+
+	std::string ComputeWebSocketAccept(const std::string &key)
+	{
+		const std::string concatenated = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"; // The GUID defined by RFC 6455.
+		BYTE digest[20];
+		Sha1((const BYTE*)concatenated.data(), concatenated.size(), digest);
+		return Base64Encode(digest, sizeof(digest));
+	}
+};
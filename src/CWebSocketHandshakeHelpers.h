@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+
+#include "Win32Compat.h"
+
+namespace cwebsocketinternal
+{
+	// Computes the SHA-1 digest of the given data into digest.
+	void Sha1(const BYTE *data, size_t length, BYTE digest[20]);
+
+	// Encodes the given data in base64, with padding.
+	std::string Base64Encode(const BYTE *data, size_t length);
+
+	// Returns a new random Sec-WebSocket-Key header value.
+	std::string GenerateWebSocketKey();
+
+	// Computes the Sec-WebSocket-Accept header value the server must respond with for the given Sec-WebSocket-Key.
+	std::string ComputeWebSocketAccept(const std::string &key);
+};
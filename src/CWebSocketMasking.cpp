@@ -0,0 +1,258 @@
+#include <string.h>
+
+#include "CWebSocketFrameCodec.h"
+
+// Masking kernels for client frames. Every kernel XORs length bytes of src with a repeating 4-byte key and writes them to dst,
+// which may be the same as src. The kernel is picked at runtime, based on the instruction sets the CPU supports.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CWEBSOCKET_MASKING_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CWEBSOCKET_TARGET(isa)
+#else
+#include <cpuid.h>
+#define CWEBSOCKET_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace cwebsocketinternal
+{
+	namespace
+	{
+		typedef void (*MaskingKernelFunction)(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4]);
+
+		// Masks the few bytes the vector kernels leave over. key is the key of the first byte.
+		void MaskTail(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4])
+		{
+			for (size_t i = 0; i < length; i++)
+				dst[i] = src[i] ^ key[i & 3];
+		}
+
+		void MaskScalar(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4])
+		{
+			uint64_t key64;
+			memcpy(&key64, key, 4);
+			memcpy((BYTE *)&key64 + 4, key, 4);
+			size_t i = 0;
+			for (; i + 8 <= length; i += 8) // 8 is a multiple of 4, so the key lines up with every word.
+			{
+				uint64_t word;
+				memcpy(&word, src + i, 8);
+				word ^= key64;
+				memcpy(dst + i, &word, 8);
+			}
+			MaskTail(dst + i, src + i, length - i, key);
+		}
+
+#ifdef CWEBSOCKET_MASKING_X86
+		CWEBSOCKET_TARGET("sse2") void MaskSSE2(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4])
+		{
+			int32_t key32;
+			memcpy(&key32, key, 4);
+			const __m128i k = _mm_set1_epi32(key32);
+			size_t i = 0;
+			for (; i + 64 <= length; i += 64)
+			{
+				const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+				const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+				const __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+				const __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+				_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, k));
+				_mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(b, k));
+				_mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(c, k));
+				_mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(d, k));
+			}
+			for (; i + 16 <= length; i += 16)
+				_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), k));
+			MaskTail(dst + i, src + i, length - i, key);
+		}
+
+		CWEBSOCKET_TARGET("avx2") void MaskAVX2(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4])
+		{
+			int32_t key32;
+			memcpy(&key32, key, 4);
+			const __m256i k = _mm256_set1_epi32(key32);
+			size_t i = 0;
+			for (; i + 128 <= length; i += 128)
+			{
+				const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+				const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+				const __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+				const __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+				_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, k));
+				_mm256_storeu_si256((__m256i *)(dst + i + 32), _mm256_xor_si256(b, k));
+				_mm256_storeu_si256((__m256i *)(dst + i + 64), _mm256_xor_si256(c, k));
+				_mm256_storeu_si256((__m256i *)(dst + i + 96), _mm256_xor_si256(d, k));
+			}
+			for (; i + 32 <= length; i += 32)
+				_mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src + i)), k));
+			if (i + 16 <= length)
+			{
+				_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), _mm256_castsi256_si128(k)));
+				i += 16;
+			}
+			MaskTail(dst + i, src + i, length - i, key);
+		}
+
+		CWEBSOCKET_TARGET("avx512f") void MaskAVX512(BYTE *dst, const BYTE *src, size_t length, const BYTE key[4])
+		{
+			int32_t key32;
+			memcpy(&key32, key, 4);
+			const __m512i k = _mm512_set1_epi32(key32);
+			size_t i = 0;
+			for (; i + 256 <= length; i += 256)
+			{
+				const __m512i a = _mm512_loadu_si512((const void *)(src + i));
+				const __m512i b = _mm512_loadu_si512((const void *)(src + i + 64));
+				const __m512i c = _mm512_loadu_si512((const void *)(src + i + 128));
+				const __m512i d = _mm512_loadu_si512((const void *)(src + i + 192));
+				_mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(a, k));
+				_mm512_storeu_si512((void *)(dst + i + 64), _mm512_xor_si512(b, k));
+				_mm512_storeu_si512((void *)(dst + i + 128), _mm512_xor_si512(c, k));
+				_mm512_storeu_si512((void *)(dst + i + 192), _mm512_xor_si512(d, k));
+			}
+			for (; i + 64 <= length; i += 64)
+				_mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(_mm512_loadu_si512((const void *)(src + i)), k));
+			for (; i + 16 <= length; i += 16)
+				_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(src + i)), _mm_set1_epi32(key32)));
+			MaskTail(dst + i, src + i, length - i, key);
+		}
+
+		void CpuId(int leaf, int subleaf, int registers[4])
+		{
+#ifdef _MSC_VER
+			__cpuidex(registers, leaf, subleaf);
+#else
+			unsigned int eax, ebx, ecx, edx;
+			__cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+			registers[0] = (int)eax;
+			registers[1] = (int)ebx;
+			registers[2] = (int)ecx;
+			registers[3] = (int)edx;
+#endif
+		}
+
+		// Returns the extended control register that tells which register states the OS saves on context switches.
+		uint64_t XGetBV()
+		{
+#ifdef _MSC_VER
+			return _xgetbv(0);
+#else
+			uint32_t eax, edx;
+			__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return ((uint64_t)edx << 32) | eax;
+#endif
+		}
+#endif
+
+		bool IsKernelSupported(CWebSocketMaskingKernel kernel)
+		{
+			if (kernel == CWebSocketMaskingKernel::Scalar)
+				return true;
+#ifdef CWEBSOCKET_MASKING_X86
+			int registers[4];
+			CpuId(0, 0, registers);
+			const int maxLeaf = registers[0];
+			CpuId(1, 0, registers);
+			const bool sse2 = (registers[3] & (1 << 26)) != 0;
+			if (kernel == CWebSocketMaskingKernel::SSE2)
+				return sse2;
+			const bool osxsave = (registers[2] & (1 << 27)) != 0;
+			if (osxsave == false || maxLeaf < 7)
+				return false;
+			const uint64_t xcr0 = XGetBV();
+			CpuId(7, 0, registers);
+			if (kernel == CWebSocketMaskingKernel::AVX2)
+				return (xcr0 & 0x6) == 0x6 && (registers[1] & (1 << 5)) != 0; // The OS saves XMM and YMM registers, and the CPU has AVX2.
+			if (kernel == CWebSocketMaskingKernel::AVX512)
+				return (xcr0 & 0xE6) == 0xE6 && (registers[1] & (1 << 16)) != 0; // The OS also saves the opmask and ZMM registers, and the CPU has AVX-512F.
+#endif
+			return false;
+		}
+
+		MaskingKernelFunction KernelFunction(CWebSocketMaskingKernel kernel)
+		{
+#ifdef CWEBSOCKET_MASKING_X86
+			if (kernel == CWebSocketMaskingKernel::AVX512)
+				return MaskAVX512;
+			if (kernel == CWebSocketMaskingKernel::AVX2)
+				return MaskAVX2;
+			if (kernel == CWebSocketMaskingKernel::SSE2)
+				return MaskSSE2;
+#endif
+			return MaskScalar;
+		}
+
+		CWebSocketMaskingKernel BestKernel()
+		{
+			const CWebSocketMaskingKernel kernels[] = { CWebSocketMaskingKernel::AVX512, CWebSocketMaskingKernel::AVX2, CWebSocketMaskingKernel::SSE2 };
+			for (auto kernel : kernels)
+				if (IsKernelSupported(kernel))
+					return kernel;
+			return CWebSocketMaskingKernel::Scalar;
+		}
+
+		// The kernel in use. Picked once, the first time a payload is masked.
+		struct MaskingDispatch
+		{
+			CWebSocketMaskingKernel kernel;
+			MaskingKernelFunction function;
+			MaskingDispatch() : kernel(BestKernel()), function(KernelFunction(kernel)) {}
+		};
+
+		MaskingDispatch &Dispatch()
+		{
+			static MaskingDispatch dispatch;
+			return dispatch;
+		}
+
+		// Returns the key of the byte maskOffset bytes into the payload, so that kernels can always start with mask[0].
+		void RotateMask(const BYTE mask[4], size_t maskOffset, BYTE key[4])
+		{
+			for (size_t i = 0; i < 4; i++)
+				key[i] = mask[(maskOffset + i) & 3];
+		}
+	}
+
+	void MaskPayload(BYTE *data, size_t length, const BYTE mask[4], size_t maskOffset)
+	{
+		BYTE key[4];
+		RotateMask(mask, maskOffset, key);
+		Dispatch().function(data, data, length, key);
+	}
+
+	void CopyMaskedPayload(BYTE *dst, const BYTE *src, size_t length, const BYTE mask[4], size_t maskOffset)
+	{
+		BYTE key[4];
+		RotateMask(mask, maskOffset, key);
+		Dispatch().function(dst, src, length, key);
+	}
+
+	CWebSocketMaskingKernel GetMaskingKernel()
+	{
+		return Dispatch().kernel;
+	}
+
+	bool SetMaskingKernel(CWebSocketMaskingKernel kernel)
+	{
+		if (IsKernelSupported(kernel) == false)
+			return false;
+		Dispatch().function = KernelFunction(kernel);
+		Dispatch().kernel = kernel;
+		return true;
+	}
+
+	const char *MaskingKernelName(CWebSocketMaskingKernel kernel)
+	{
+		switch (kernel)
+		{
+		case CWebSocketMaskingKernel::Scalar: return "scalar";
+		case CWebSocketMaskingKernel::SSE2: return "sse2";
+		case CWebSocketMaskingKernel::AVX2: return "avx2";
+		case CWebSocketMaskingKernel::AVX512: return "avx512";
+		}
+		return "unknown";
+	}
+};
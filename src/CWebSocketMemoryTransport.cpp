@@ -0,0 +1,392 @@
+#include <string.h>
+#include <algorithm>
+
+#include "CWebSocketMemoryTransport.h"
+
+using namespace cwebsocketinternal;
+
+CWebSocketMemoryTransport::CWebSocketMemoryTransport(CWebSocketMemoryPeer *peer) :
+	_peer(peer),
+	_pool(CWebSocketBufferPool::Default()),
+	_generation(1),
+	_delivering(false),
+	_inCallback(false)
+{
+	_Reset();
+}
+
+CWebSocketMemoryTransport::~CWebSocketMemoryTransport()
+{
+	Abort();
+}
+
+// Clears the per-connection state. Called with _mutex held. A delivery in progress carries on, and finds nothing left to deliver.
+void CWebSocketMemoryTransport::_Reset()
+{
+	_phase = Phase::Idle;
+	_work.Clear();
+	_incoming.Clear();
+	_rxBuffer = nullptr;
+	_rxLength = 0;
+	_rxPending = false;
+	_closeRequested = false;
+	_peerClosed = false;
+	_closeReceived = false;
+	_closeStatus = WINHTTP_WEB_SOCKET_EMPTY_CLOSE_STATUS;
+	_closeReason.clear();
+}
+
+bool CWebSocketMemoryTransport::Initialize(const WCHAR * /*serverName*/, INTERNET_PORT /*port*/, const WCHAR * /*path*/, bool /*secure*/, CWebSocketTransportCallback callback)
+{
+	if (_peer == nullptr)
+		return false;
+	_callback = callback;
+	return true;
+}
+
+bool CWebSocketMemoryTransport::SetBufferPool(CWebSocketBufferPool *pool)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_pool = pool;
+	return true;
+}
+
+bool CWebSocketMemoryTransport::SendUpgradeRequest()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Idle)
+		return false;
+	_phase = Phase::Connecting;
+	Work work;
+	work.kind = WorkKind::Connect;
+	_PushWork(std::move(work));
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::ReceiveResponse()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Connecting)
+		return false;
+	_PushEvent(CWebSocketTransportEvent::HeadersAvailable);
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::CompleteUpgrade()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_phase != Phase::Connecting)
+		return false;
+	_phase = Phase::Open;
+	return true;
+}
+
+bool CWebSocketMemoryTransport::Receive(BYTE *buffer, DWORD length)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _rxPending || _closeRequested)
+		return false;
+	_rxBuffer = buffer;
+	_rxLength = length;
+	_rxPending = true;
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested)
+		return false;
+	Work work;
+	work.kind = WorkKind::Messages;
+	work.payload.assign(message, message + length); // message need not outlive the call.
+	work.message.bufferType = bufferType;
+	work.message.length = length;
+	work.messages = nullptr; // _Do points it at message once the work has stopped moving.
+	work.count = 1;
+	_PushWork(std::move(work));
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::SendBatch(const CWebSocketTransportMessage *messages, size_t count)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested)
+		return false;
+	Work work;
+	work.kind = WorkKind::Messages;
+	work.messages = messages;
+	work.count = count;
+	_PushWork(std::move(work));
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::Ping(const BYTE *payload, size_t length)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || length > 125)
+		return false;
+	Work work;
+	work.kind = WorkKind::Event;
+	work.event = CWebSocketTransportEvent::PongReceived;
+	work.payload.assign(payload, payload + length);
+	_PushWork(std::move(work));
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::Close(USHORT status, const BYTE *reason, size_t reasonLength)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || reasonLength > 123)
+		return false;
+	_closeRequested = true;
+	if (_rxPending) // Just like WinHttp, cancel the pending receive.
+	{
+		_rxPending = false;
+		_PushEvent(CWebSocketTransportEvent::OperationCancelled);
+	}
+	Work work;
+	work.kind = WorkKind::Close;
+	work.closeStatus = status;
+	work.payload.assign(reason, reason + reasonLength);
+	_PushWork(std::move(work));
+	_Deliver(lock);
+	return true;
+}
+
+bool CWebSocketMemoryTransport::QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_closeReceived == false || _closeReason.size() > reasonLength)
+		return false;
+	*status = _closeStatus;
+	if (_closeReason.size() > 0)
+		memcpy(reason, _closeReason.data(), _closeReason.size());
+	*reasonLengthConsumed = (DWORD)_closeReason.size();
+	return true;
+}
+
+void CWebSocketMemoryTransport::Abort()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_generation++;
+	_Reset();
+	if (_deliveringThread != std::this_thread::get_id()) // Unless Abort is called from within a callback, wait for the callback being called to return.
+		_callbackReturned.wait(lock, [this]() { return _inCallback == false; });
+}
+
+bool CWebSocketMemoryTransport::PeerSend(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || _peerClosed)
+		return false;
+	Incoming incoming;
+	incoming.bufferType = bufferType;
+	incoming.data = message;
+	incoming.length = length;
+	incoming.offset = 0;
+	incoming.closeStatus = 0;
+	incoming.borrowed = (_delivering == false); // This thread delivers it before returning, so the websocket can receive it in place.
+	if (incoming.borrowed == false && length > 0 && incoming.copy.Append(_pool, message, length) == false)
+		return false;
+	_incoming.PushBack(std::move(incoming));
+	if (_delivering)
+		return true;
+	_Deliver(lock);
+
+	// Copy whatever the websocket didn't receive yet, since message is only valid until we return.
+	for (size_t i = 0; i < _incoming.Size(); i++)
+	{
+		Incoming &left = _incoming[i];
+		if (left.borrowed == false)
+			continue;
+		left.borrowed = false;
+		if (left.length > 0 && left.copy.Append(_pool, left.data, left.length) == false)
+		{
+			_incoming.Erase(i, 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool CWebSocketMemoryTransport::PeerClose(USHORT status, const BYTE *reason, size_t reasonLength)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_phase != Phase::Open || _closeRequested || _peerClosed || reasonLength > 123)
+		return false;
+	Incoming incoming;
+	incoming.bufferType = WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE;
+	incoming.data = nullptr;
+	incoming.length = reasonLength;
+	incoming.offset = 0;
+	incoming.closeStatus = status;
+	incoming.borrowed = false;
+	if (reasonLength > 0 && incoming.copy.Append(_pool, reason, reasonLength) == false)
+		return false;
+	_peerClosed = true;
+	_incoming.PushBack(std::move(incoming));
+	_Deliver(lock);
+	return true;
+}
+
+// Called with _mutex held.
+void CWebSocketMemoryTransport::_PushEvent(CWebSocketTransportEvent event)
+{
+	Work work;
+	work.kind = WorkKind::Event;
+	work.event = event;
+	_PushWork(std::move(work));
+}
+
+// Called with _mutex held.
+void CWebSocketMemoryTransport::_PushWork(Work &&work)
+{
+	_work.PushBack(std::move(work));
+}
+
+// Calls f, which calls _callback or the peer, with _mutex released.
+template <typename F>
+void CWebSocketMemoryTransport::_CallUnlocked(std::unique_lock<std::mutex> &lock, F f)
+{
+	_inCallback = true;
+	lock.unlock();
+	f();
+	lock.lock();
+	_inCallback = false;
+	_callbackReturned.notify_all();
+}
+
+// Does the queued work and delivers the messages of the peer while the websocket is receiving, until there is nothing left to do,
+// unless another call is already doing so. Work queued from within the callbacks is done by the same loop, rather than recursively.
+// Called with _mutex held.
+void CWebSocketMemoryTransport::_Deliver(std::unique_lock<std::mutex> &lock)
+{
+	if (_delivering)
+		return;
+	_delivering = true;
+	_deliveringThread = std::this_thread::get_id();
+	for (;;)
+	{
+		if (_work.Size() > 0)
+		{
+			Work work(std::move(_work.Front()));
+			_work.PopFront();
+			_Do(lock, work);
+		}
+		else if (_DeliverIncoming(lock) == false)
+			break;
+	}
+	_deliveringThread = std::thread::id();
+	_delivering = false;
+}
+
+void CWebSocketMemoryTransport::_Do(std::unique_lock<std::mutex> &lock, Work &work)
+{
+	const uint64_t generation = _generation;
+	switch (work.kind)
+	{
+	case WorkKind::Event:
+		if (work.event == CWebSocketTransportEvent::PongReceived)
+		{
+			WINHTTP_WEB_SOCKET_STATUS status;
+			status.dwBytesTransferred = (DWORD)work.payload.size();
+			status.eBufferType = WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE;
+			_CallUnlocked(lock, [&]() { _callback(work.event, &status, work.payload.data()); });
+		}
+		else
+			_CallUnlocked(lock, [&]() { _callback(work.event, nullptr, nullptr); });
+		break;
+	case WorkKind::Connect:
+	{
+		bool accepted = false;
+		_CallUnlocked(lock, [&]() { accepted = _peer->OnConnect(); });
+		if (generation == _generation)
+			_PushEvent(accepted ? CWebSocketTransportEvent::SendRequestComplete : CWebSocketTransportEvent::Error);
+		break;
+	}
+	case WorkKind::Messages:
+		if (work.messages == nullptr)
+		{
+			work.message.message = work.payload.data();
+			work.messages = &work.message;
+		}
+		_CallUnlocked(lock, [&]() {
+			for (size_t i = 0; i < work.count; i++)
+				_peer->OnMessage(work.messages[i].bufferType, work.messages[i].message, work.messages[i].length);
+		});
+		if (generation == _generation)
+			_PushEvent(CWebSocketTransportEvent::WriteComplete);
+		break;
+	case WorkKind::Close:
+		_CallUnlocked(lock, [&]() { _peer->OnClose(work.closeStatus, work.payload.data(), work.payload.size()); });
+		if (generation != _generation)
+			break;
+		if (_closeReceived == false) // The websocket started the closing handshake, so the peer echoes its close frame.
+		{
+			_closeReceived = true;
+			_closeStatus = work.closeStatus;
+			_closeReason.swap(work.payload);
+		}
+		_phase = Phase::Closed;
+		_incoming.Clear();
+		_PushEvent(CWebSocketTransportEvent::CloseComplete);
+		break;
+	}
+}
+
+// Reports the first message of the peer, or as much of it as the pending Receive takes. Returns false if there is nothing to report. Called with _mutex held.
+bool CWebSocketMemoryTransport::_DeliverIncoming(std::unique_lock<std::mutex> &lock)
+{
+	if (_rxPending == false || _incoming.Size() == 0)
+		return false;
+	_rxPending = false;
+	const Incoming &incoming = _incoming.Front();
+	WINHTTP_WEB_SOCKET_STATUS status;
+	const BYTE *data = nullptr;
+	size_t length = incoming.length;
+	if (incoming.bufferType == WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE)
+	{
+		_closeReceived = true;
+		_closeStatus = incoming.closeStatus;
+		_closeReason.assign(incoming.Bytes(), incoming.Bytes() + incoming.length);
+		status.dwBytesTransferred = 0;
+		status.eBufferType = WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE;
+	}
+	else
+	{
+		length = std::min(incoming.length - incoming.offset, (size_t)_rxLength);
+		data = incoming.Bytes() + incoming.offset;
+		if (_rxBuffer != nullptr)
+		{
+			if (length > 0)
+				memcpy(_rxBuffer, data, length);
+			data = _rxBuffer;
+		}
+		status.dwBytesTransferred = (DWORD)length;
+		status.eBufferType = incoming.bufferType;
+		if (incoming.offset + length < incoming.length) // The rest follows with the next Receive.
+		{
+			if (incoming.bufferType == WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)
+				status.eBufferType = WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+			else if (incoming.bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)
+				status.eBufferType = WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE;
+		}
+	}
+	const uint64_t generation = _generation;
+	_CallUnlocked(lock, [&]() { _callback(CWebSocketTransportEvent::ReadComplete, &status, data); });
+	if (generation != _generation || _incoming.Size() == 0) // Aborted or closed from within the callback.
+		return true;
+	// Only now, since data reported in place stays valid until the callback returns.
+	Incoming &front = _incoming.Front();
+	front.offset += length;
+	if (front.offset >= front.length)
+		_incoming.PopFront();
+	return true;
+}
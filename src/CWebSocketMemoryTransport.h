@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "CWebSocketTransport.h"
+#include "CWebSocketRingQueue.h"
+#include "CWebSocketBufferPool.h"
+
+// The other end of a CWebSocketMemoryTransport, which plays the server within the same process.
+// Its functions are called one at a time, on whichever thread is delivering the events of the transport at the time, and never with a lock of the transport held,
+// so they may call CWebSocketMemoryTransport::PeerSend and PeerClose.
+class CWebSocketMemoryPeer
+{
+public:
+	virtual ~CWebSocketMemoryPeer() {}
+
+	// Called when the websocket sends its upgrade request. Return false to fail the handshake.
+	virtual bool OnConnect() { return true; }
+
+	// Called with every message, or fragment of a message, the websocket sends. message is only valid until the function returns.
+	virtual void OnMessage(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) = 0;
+
+	// Called when the websocket sends its close frame, either to start the closing handshake or to answer PeerClose.
+	// The transport answers a close frame that starts the handshake with the same status and reason, as servers usually do.
+	virtual void OnClose(USHORT /*status*/, const BYTE * /*reason*/, size_t /*reasonLength*/) {}
+};
+
+// A transport that connects the websocket to a CWebSocketMemoryPeer in the same process, without any networking or system calls,
+// so that the overhead of the websocket itself can be measured and tested on its own. There is no framing, masking or compression;
+// messages are handed over as they are, and received data is reported in place.
+// Operations complete synchronously: the thread that starts one while no events are being delivered delivers the resulting events itself,
+// including those of any operations started from within the callbacks, one after the other rather than recursively. The serverName, port, path and secure
+// parameters of Initialize are ignored. Pings are answered by the transport.
+class CWebSocketMemoryTransport : public CWebSocketTransport
+{
+private:
+	enum class Phase
+	{
+		Idle, // There is no connection.
+		Connecting, // The upgrade request has been sent, and the connection hasn't opened yet.
+		Open,
+		Closed // The closing handshake has completed. Waiting for Abort to be called.
+	};
+
+	enum class WorkKind
+	{
+		Event, // Report event to the owner.
+		Connect, // Call OnConnect of the peer.
+		Messages, // Hand messages to the peer, and then report WriteComplete.
+		Close // Hand our close frame to the peer, and then complete the closing handshake.
+	};
+
+	// Only the members the kind uses are set, so the others start out with harmless values rather than whatever was on the stack.
+	struct Work
+	{
+		WorkKind kind = WorkKind::Event;
+		CWebSocketTransportEvent event = CWebSocketTransportEvent::Error;
+		const CWebSocketTransportMessage *messages = nullptr;
+		size_t count = 0;
+		CWebSocketTransportMessage message = {}; // The copy of the message passed to Send, in payload.
+		USHORT closeStatus = 0;
+		std::vector<BYTE> payload; // The payload of a pong, the reason of a close frame, or the message passed to Send.
+	};
+
+	// A message, or a close frame, sent by the peer.
+	struct Incoming
+	{
+		WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType;
+		const BYTE *data; // The bytes passed to PeerSend, while it is delivering them itself.
+		size_t length;
+		size_t offset; // The number of bytes already reported.
+		USHORT closeStatus;
+		bool borrowed; // data points to the bytes passed to PeerSend rather than to copy.
+		cwebsocketinternal::CWebSocketPooledBytes copy;
+
+		const BYTE *Bytes() const { return borrowed ? data : copy.Data(); }
+	};
+
+private:
+	CWebSocketMemoryPeer *_peer;
+	CWebSocketTransportCallback _callback;
+	std::mutex _mutex; // Protects everything below. Never held while calling _callback or the peer.
+	std::condition_variable _callbackReturned;
+	CWebSocketBufferPool *_pool; // Holds the copies of the messages the peer sends while they can't be reported in place.
+	uint64_t _generation; // Incremented by Abort, so that work done for an aborted connection can be recognized.
+	Phase _phase;
+	cwebsocketinternal::CWebSocketRingQueue<Work> _work;
+	cwebsocketinternal::CWebSocketRingQueue<Incoming> _incoming;
+	bool _delivering; // A thread is running _Deliver, and will get to any work queued in the meantime.
+	bool _inCallback; // The delivering thread is calling _callback or the peer.
+	std::thread::id _deliveringThread;
+	BYTE *_rxBuffer; // The buffer of the pending Receive, or nullptr to report in place.
+	DWORD _rxLength;
+	bool _rxPending;
+	bool _closeRequested;
+	bool _peerClosed; // PeerClose has been called.
+	bool _closeReceived;
+	USHORT _closeStatus;
+	std::vector<BYTE> _closeReason;
+
+private:
+	void _Reset();
+	void _PushEvent(CWebSocketTransportEvent event);
+	void _PushWork(Work &&work);
+	void _Deliver(std::unique_lock<std::mutex> &lock);
+	bool _DeliverIncoming(std::unique_lock<std::mutex> &lock);
+	template <typename F> void _CallUnlocked(std::unique_lock<std::mutex> &lock, F f);
+	void _Do(std::unique_lock<std::mutex> &lock, Work &work);
+
+public:
+	// peer must outlive the transport.
+	explicit CWebSocketMemoryTransport(CWebSocketMemoryPeer *peer);
+	CWebSocketMemoryTransport(const CWebSocketMemoryTransport&) = delete;
+	~CWebSocketMemoryTransport();
+
+	bool Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback) override;
+	bool SetBufferPool(CWebSocketBufferPool *pool) override;
+	bool SendUpgradeRequest() override;
+	bool ReceiveResponse() override;
+	bool CompleteUpgrade() override;
+	bool Receive(BYTE *buffer, DWORD length) override;
+	bool ReceivesInPlace() const override { return true; }
+	bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) override;
+	bool SendBatch(const CWebSocketTransportMessage *messages, size_t count) override;
+	bool SendsInBatches() const override { return true; }
+	bool Ping(const BYTE *payload, size_t length) override;
+	bool Close(USHORT status, const BYTE *reason, size_t reasonLength) override;
+	bool QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed) override;
+	void Abort() override;
+
+	// Sends a message, or a fragment of a message, from the peer to the websocket. May be called from any thread, including from the functions of the peer.
+	// If no events are being delivered, the message is reported in place on the calling thread before the function returns; otherwise it's copied,
+	// and reported by the delivering thread once the websocket is receiving. Returns false if the connection isn't open, or if out of memory.
+	bool PeerSend(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length);
+
+	// Sends a close frame from the peer to the websocket, which starts the closing handshake. The websocket's answer is passed to CWebSocketMemoryPeer::OnClose.
+	// Messages sent after it are dropped. Returns false if the connection isn't open.
+	bool PeerClose(USHORT status, const BYTE *reason, size_t reasonLength);
+};
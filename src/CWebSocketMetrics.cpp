@@ -0,0 +1,371 @@
+#include <new>
+#include <mutex>
+#include <chrono>
+#include <stdio.h>
+
+#include "CWebSocketMetrics.h"
+
+namespace
+{
+	// The names of the values of CWebSocketState, in order.
+	const char *const StateNames[CWebSocketStateCount] =
+	{
+		"NoTcpConnection",
+		"ConnectPending",
+		"SendingUpgradeRequest",
+		"ReceivingUpgradeResponse",
+		"WaitingForActivity",
+		"SendingSendBuffer1",
+		"SendingCloseFrame1",
+		"ReceivedCloseFrame2",
+		"SendingSendBuffer2",
+		"SendingCloseFrame2",
+		"Done",
+		"Error"
+	};
+
+	// The names of the values of CWebSocketConnectPhase, in order.
+	const char *const ConnectPhaseNames[CWebSocketConnectPhaseCount] =
+	{
+		"resolve",
+		"tcp_connect",
+		"tls_handshake",
+		"send_upgrade_request",
+		"receive_upgrade_response"
+	};
+
+	// The names of the values of CWebSocketErrorCause, in order.
+	const char *const ErrorCauseNames[CWebSocketErrorCauseCount] =
+	{
+		"transport",
+		"handshake",
+		"invalid_utf8",
+		"invalid_operation",
+		"out_of_memory"
+	};
+
+	// All instances of CWebSocketMetrics, and the counters of the destructed ones.
+	struct Registry
+	{
+		std::mutex mutex; // Protects everything below.
+		cwebsocketinternal::CWebSocketMetrics *first;
+		CWebSocketMetricsSnapshot retired;
+
+		Registry() : first(nullptr), retired() {}
+
+		// Constructed in static storage and never destructed, since websockets may be destructed during static destruction.
+		static Registry &Get()
+		{
+			alignas(Registry) static unsigned char storage[sizeof(Registry)];
+			static Registry *registry = new (storage) Registry();
+			return *registry;
+		}
+	};
+
+	void AddHistogram(CWebSocketLatencyHistogram &sum, const CWebSocketLatencyHistogram &histogram)
+	{
+		for (size_t i = 0; i < CWebSocketLatencyHistogram::BucketCount; i++)
+			sum.buckets[i] += histogram.buckets[i];
+		sum.count += histogram.count;
+		sum.sumus += histogram.sumus;
+	}
+
+	void AddSnapshot(CWebSocketMetricsSnapshot &sum, const CWebSocketMetricsSnapshot &snapshot)
+	{
+		sum.binaryMessagesSent += snapshot.binaryMessagesSent;
+		sum.binaryBytesSent += snapshot.binaryBytesSent;
+		sum.utf8MessagesSent += snapshot.utf8MessagesSent;
+		sum.utf8BytesSent += snapshot.utf8BytesSent;
+		sum.binaryMessagesReceived += snapshot.binaryMessagesReceived;
+		sum.binaryBytesReceived += snapshot.binaryBytesReceived;
+		sum.utf8MessagesReceived += snapshot.utf8MessagesReceived;
+		sum.utf8BytesReceived += snapshot.utf8BytesReceived;
+		sum.pingsSent += snapshot.pingsSent;
+		sum.pongsReceived += snapshot.pongsReceived;
+		sum.sendBufferHighWatermarkBytes += snapshot.sendBufferHighWatermarkBytes;
+		sum.sendBufferHighWatermarkMessages += snapshot.sendBufferHighWatermarkMessages;
+		sum.connects += snapshot.connects;
+		sum.reconnects += snapshot.reconnects;
+		sum.opens += snapshot.opens;
+		sum.connectionResets += snapshot.connectionResets;
+		for (size_t i = 0; i < CWebSocketErrorCauseCount; i++)
+			sum.errors[i] += snapshot.errors[i];
+		for (size_t i = 0; i < CWebSocketStateCount; i++)
+			sum.stateTimeus[i] += snapshot.stateTimeus[i];
+		AddHistogram(sum.dispatchLatency, snapshot.dispatchLatency);
+		AddHistogram(sum.writeLatency, snapshot.writeLatency);
+		AddHistogram(sum.connectLatency, snapshot.connectLatency);
+		for (size_t i = 0; i < CWebSocketConnectPhaseCount; i++)
+			AddHistogram(sum.connectPhaseLatency[i], snapshot.connectPhaseLatency[i]);
+		sum.websockets += snapshot.websockets;
+	}
+
+	void AppendPrometheusMetric(std::string &text, const char *name, const char *type, const char *help)
+	{
+		text += std::string("# HELP cwebsocket_") + name + " " + help + "\n";
+		text += std::string("# TYPE cwebsocket_") + name + " " + type + "\n";
+	}
+
+	// Appends a sample. label is a label of the sample itself, such as type="binary", and labels are the labels passed to FormatCWebSocketMetricsAsPrometheus.
+	void AppendPrometheusSample(std::string &text, const char *name, const std::string &label, const std::string &labels, const std::string &value)
+	{
+		text += std::string("cwebsocket_") + name;
+		if (label.size() > 0 || labels.size() > 0)
+			text += "{" + label + ((label.size() > 0 && labels.size() > 0) ? "," : "") + labels + "}";
+		text += " " + value + "\n";
+	}
+
+	std::string FormatSeconds(uint64_t us)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.6f", us / 1e6);
+		return buffer;
+	}
+
+	// Appends the samples of a histogram. label is a label of the histogram itself, or empty. See AppendPrometheusSample.
+	void AppendPrometheusHistogramSamples(std::string &text, const char *name, const std::string &label, const CWebSocketLatencyHistogram &histogram, const std::string &labels)
+	{
+		const std::string bucketName = std::string(name) + "_bucket";
+		const std::string bucketLabel = (label.size() > 0) ? label + "," : std::string();
+		uint64_t cumulative = 0;
+		for (size_t i = 0; i + 1 < CWebSocketLatencyHistogram::BucketCount; i++)
+		{
+			cumulative += histogram.buckets[i];
+			AppendPrometheusSample(text, bucketName.c_str(), bucketLabel + "le=\"" + FormatSeconds(CWebSocketLatencyHistogram::BucketBoundus(i)) + "\"", labels, std::to_string(cumulative));
+		}
+		AppendPrometheusSample(text, bucketName.c_str(), bucketLabel + "le=\"+Inf\"", labels, std::to_string(histogram.count));
+		AppendPrometheusSample(text, (std::string(name) + "_sum").c_str(), label, labels, FormatSeconds(histogram.sumus));
+		AppendPrometheusSample(text, (std::string(name) + "_count").c_str(), label, labels, std::to_string(histogram.count));
+	}
+
+	void AppendPrometheusHistogram(std::string &text, const char *name, const char *help, const CWebSocketLatencyHistogram &histogram, const std::string &labels)
+	{
+		AppendPrometheusMetric(text, name, "histogram", help);
+		AppendPrometheusHistogramSamples(text, name, std::string(), histogram, labels);
+	}
+
+	std::string FormatJSONHistogram(const CWebSocketLatencyHistogram &histogram)
+	{
+		std::string json = "{\"count\":" + std::to_string(histogram.count) + ",\"sumus\":" + std::to_string(histogram.sumus) +
+			",\"p50us\":" + std::to_string(histogram.Percentile(50)) + ",\"p99us\":" + std::to_string(histogram.Percentile(99)) + ",\"buckets\":[";
+		for (size_t i = 0; i < CWebSocketLatencyHistogram::BucketCount; i++)
+			json += (i > 0 ? "," : "") + std::to_string(histogram.buckets[i]);
+		return json + "]}";
+	}
+}
+
+uint64_t CWebSocketLatencyHistogram::Percentile(double percentile) const
+{
+	if (count == 0)
+		return 0;
+	const double rank = count * percentile / 100;
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < BucketCount; i++)
+	{
+		cumulative += buckets[i];
+		if (cumulative >= rank && cumulative > 0)
+			return BucketBoundus(i);
+	}
+	return BucketBoundus(BucketCount - 1);
+}
+
+CWebSocketMetricsSnapshot GetGlobalCWebSocketMetrics()
+{
+	Registry &registry = Registry::Get();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	CWebSocketMetricsSnapshot snapshot = registry.retired;
+	for (const cwebsocketinternal::CWebSocketMetrics *metrics = registry.first; metrics != nullptr; metrics = metrics->Next())
+		metrics->AddTo(snapshot);
+	return snapshot;
+}
+
+std::string FormatCWebSocketMetricsAsPrometheus(const CWebSocketMetricsSnapshot &metrics, const std::string &labels)
+{
+	std::string text;
+	AppendPrometheusMetric(text, "messages_sent_total", "counter", "Messages sent, by type.");
+	AppendPrometheusSample(text, "messages_sent_total", "type=\"binary\"", labels, std::to_string(metrics.binaryMessagesSent));
+	AppendPrometheusSample(text, "messages_sent_total", "type=\"utf8\"", labels, std::to_string(metrics.utf8MessagesSent));
+	AppendPrometheusMetric(text, "bytes_sent_total", "counter", "Payload bytes of the messages sent, by type.");
+	AppendPrometheusSample(text, "bytes_sent_total", "type=\"binary\"", labels, std::to_string(metrics.binaryBytesSent));
+	AppendPrometheusSample(text, "bytes_sent_total", "type=\"utf8\"", labels, std::to_string(metrics.utf8BytesSent));
+	AppendPrometheusMetric(text, "messages_received_total", "counter", "Messages received, by type.");
+	AppendPrometheusSample(text, "messages_received_total", "type=\"binary\"", labels, std::to_string(metrics.binaryMessagesReceived));
+	AppendPrometheusSample(text, "messages_received_total", "type=\"utf8\"", labels, std::to_string(metrics.utf8MessagesReceived));
+	AppendPrometheusMetric(text, "bytes_received_total", "counter", "Payload bytes of the messages received, by type.");
+	AppendPrometheusSample(text, "bytes_received_total", "type=\"binary\"", labels, std::to_string(metrics.binaryBytesReceived));
+	AppendPrometheusSample(text, "bytes_received_total", "type=\"utf8\"", labels, std::to_string(metrics.utf8BytesReceived));
+	AppendPrometheusMetric(text, "pings_sent_total", "counter", "Keepalive pings sent.");
+	AppendPrometheusSample(text, "pings_sent_total", std::string(), labels, std::to_string(metrics.pingsSent));
+	AppendPrometheusMetric(text, "pongs_received_total", "counter", "Pongs received.");
+	AppendPrometheusSample(text, "pongs_received_total", std::string(), labels, std::to_string(metrics.pongsReceived));
+	AppendPrometheusMetric(text, "send_buffer_high_watermark_bytes", "gauge", "The most bytes the send buffer has held.");
+	AppendPrometheusSample(text, "send_buffer_high_watermark_bytes", std::string(), labels, std::to_string(metrics.sendBufferHighWatermarkBytes));
+	AppendPrometheusMetric(text, "send_buffer_high_watermark_messages", "gauge", "The most messages the send buffer has held.");
+	AppendPrometheusSample(text, "send_buffer_high_watermark_messages", std::string(), labels, std::to_string(metrics.sendBufferHighWatermarkMessages));
+	AppendPrometheusMetric(text, "connects_total", "counter", "Calls to Connect.");
+	AppendPrometheusSample(text, "connects_total", std::string(), labels, std::to_string(metrics.connects));
+	AppendPrometheusMetric(text, "reconnects_total", "counter", "Calls to Connect after the first.");
+	AppendPrometheusSample(text, "reconnects_total", std::string(), labels, std::to_string(metrics.reconnects));
+	AppendPrometheusMetric(text, "opens_total", "counter", "Connections that opened.");
+	AppendPrometheusSample(text, "opens_total", std::string(), labels, std::to_string(metrics.opens));
+	AppendPrometheusMetric(text, "connection_resets_total", "counter", "Connections lost without a closing handshake.");
+	AppendPrometheusSample(text, "connection_resets_total", std::string(), labels, std::to_string(metrics.connectionResets));
+	AppendPrometheusMetric(text, "errors_total", "counter", "Calls to onError, by cause.");
+	for (size_t i = 0; i < CWebSocketErrorCauseCount; i++)
+		AppendPrometheusSample(text, "errors_total", std::string("cause=\"") + ErrorCauseNames[i] + "\"", labels, std::to_string(metrics.errors[i]));
+	AppendPrometheusMetric(text, "state_seconds_total", "counter", "Time spent in each state.");
+	for (size_t i = 0; i < CWebSocketStateCount; i++)
+		AppendPrometheusSample(text, "state_seconds_total", std::string("state=\"") + StateNames[i] + "\"", labels, FormatSeconds(metrics.stateTimeus[i]));
+	AppendPrometheusHistogram(text, "dispatch_latency_seconds", "From the transport reporting an event until it has been handled, callbacks included.", metrics.dispatchLatency, labels);
+	AppendPrometheusHistogram(text, "write_latency_seconds", "From handing messages to the transport until they have been written.", metrics.writeLatency, labels);
+	AppendPrometheusHistogram(text, "connect_seconds", "From the start of a connection until it opened.", metrics.connectLatency, labels);
+	AppendPrometheusMetric(text, "connect_phase_seconds", "histogram", "How long each phase of opening a connection took.");
+	for (size_t i = 0; i < CWebSocketConnectPhaseCount; i++)
+		AppendPrometheusHistogramSamples(text, "connect_phase_seconds", std::string("phase=\"") + ConnectPhaseNames[i] + "\"", metrics.connectPhaseLatency[i], labels);
+	AppendPrometheusMetric(text, "websockets", "gauge", "Websockets whose counters are included.");
+	AppendPrometheusSample(text, "websockets", std::string(), labels, std::to_string(metrics.websockets));
+	return text;
+}
+
+std::string FormatCWebSocketMetricsAsJSON(const CWebSocketMetricsSnapshot &metrics)
+{
+	std::string json = "{";
+	json += "\"sent\":{\"binary\":{\"messages\":" + std::to_string(metrics.binaryMessagesSent) + ",\"bytes\":" + std::to_string(metrics.binaryBytesSent) + "}";
+	json += ",\"utf8\":{\"messages\":" + std::to_string(metrics.utf8MessagesSent) + ",\"bytes\":" + std::to_string(metrics.utf8BytesSent) + "}}";
+	json += ",\"received\":{\"binary\":{\"messages\":" + std::to_string(metrics.binaryMessagesReceived) + ",\"bytes\":" + std::to_string(metrics.binaryBytesReceived) + "}";
+	json += ",\"utf8\":{\"messages\":" + std::to_string(metrics.utf8MessagesReceived) + ",\"bytes\":" + std::to_string(metrics.utf8BytesReceived) + "}}";
+	json += ",\"pingsSent\":" + std::to_string(metrics.pingsSent);
+	json += ",\"pongsReceived\":" + std::to_string(metrics.pongsReceived);
+	json += ",\"sendBufferHighWatermark\":{\"bytes\":" + std::to_string(metrics.sendBufferHighWatermarkBytes) + ",\"messages\":" + std::to_string(metrics.sendBufferHighWatermarkMessages) + "}";
+	json += ",\"connects\":" + std::to_string(metrics.connects);
+	json += ",\"reconnects\":" + std::to_string(metrics.reconnects);
+	json += ",\"opens\":" + std::to_string(metrics.opens);
+	json += ",\"connectionResets\":" + std::to_string(metrics.connectionResets);
+	json += ",\"errors\":{";
+	for (size_t i = 0; i < CWebSocketErrorCauseCount; i++)
+		json += std::string(i > 0 ? "," : "") + "\"" + ErrorCauseNames[i] + "\":" + std::to_string(metrics.errors[i]);
+	json += "},\"stateTimeus\":{";
+	for (size_t i = 0; i < CWebSocketStateCount; i++)
+		json += std::string(i > 0 ? "," : "") + "\"" + StateNames[i] + "\":" + std::to_string(metrics.stateTimeus[i]);
+	json += "},\"dispatchLatency\":" + FormatJSONHistogram(metrics.dispatchLatency);
+	json += ",\"writeLatency\":" + FormatJSONHistogram(metrics.writeLatency);
+	json += ",\"connectLatency\":" + FormatJSONHistogram(metrics.connectLatency);
+	json += ",\"connectPhaseLatency\":{";
+	for (size_t i = 0; i < CWebSocketConnectPhaseCount; i++)
+		json += std::string(i > 0 ? "," : "") + "\"" + ConnectPhaseNames[i] + "\":" + FormatJSONHistogram(metrics.connectPhaseLatency[i]);
+	json += "}";
+	json += ",\"websockets\":" + std::to_string(metrics.websockets);
+	return json + "}";
+}
+
+namespace cwebsocketinternal
+{
+	void CWebSocketMetrics::Histogram::Record(uint64_t us)
+	{
+		size_t bucket = 0;
+		for (uint64_t bound = 1; bucket + 1 < CWebSocketLatencyHistogram::BucketCount && us >= bound; bound <<= 1)
+			bucket++;
+		buckets[bucket].Add(1);
+		count.Add(1);
+		sumus.Add(us);
+	}
+
+	void CWebSocketMetrics::Histogram::AddTo(CWebSocketLatencyHistogram &histogram) const
+	{
+		for (size_t i = 0; i < CWebSocketLatencyHistogram::BucketCount; i++)
+			histogram.buckets[i] += buckets[i].Get();
+		histogram.count += count.Get();
+		histogram.sumus += sumus.Get();
+	}
+
+	CWebSocketMetrics::CWebSocketMetrics() :
+		_state(0),
+		_stateSinceus(Nowus()),
+		_prev(nullptr)
+	{
+		Registry &registry = Registry::Get();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		_next = registry.first;
+		if (_next != nullptr)
+			_next->_prev = this;
+		registry.first = this;
+	}
+
+	CWebSocketMetrics::~CWebSocketMetrics()
+	{
+		Registry &registry = Registry::Get();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		AddTo(registry.retired);
+		if (_prev != nullptr)
+			_prev->_next = _next;
+		else
+			registry.first = _next;
+		if (_next != nullptr)
+			_next->_prev = _prev;
+	}
+
+	void CWebSocketMetrics::SetState(size_t state)
+	{
+		const uint64_t now = Nowus();
+		_stateTimeus[_state.load(std::memory_order_relaxed)].Add(now - _stateSinceus.load(std::memory_order_relaxed));
+		_stateSinceus.store(now, std::memory_order_relaxed);
+		_state.store(state, std::memory_order_relaxed);
+	}
+
+	void CWebSocketMetrics::RecordConnect(const CWebSocketConnectTimings &timings)
+	{
+		// Each phase ends at its own timestamp, and starts where the last phase that was gone through ended.
+		const uint64_t ends[CWebSocketConnectPhaseCount] = { timings.resolvedus, timings.connectedus, timings.securedus, timings.requestSentus, timings.openedus };
+		uint64_t previous = 0;
+		for (size_t i = 0; i < CWebSocketConnectPhaseCount; i++)
+		{
+			if (ends[i] == 0 || ends[i] < previous)
+				continue;
+			connectPhaseLatency[i].Record(ends[i] - previous);
+			previous = ends[i];
+		}
+		connectLatency.Record(timings.openedus);
+	}
+
+	void CWebSocketMetrics::AddTo(CWebSocketMetricsSnapshot &snapshot) const
+	{
+		CWebSocketMetricsSnapshot own = CWebSocketMetricsSnapshot();
+		own.binaryMessagesSent = binaryMessagesSent.Get();
+		own.binaryBytesSent = binaryBytesSent.Get();
+		own.utf8MessagesSent = utf8MessagesSent.Get();
+		own.utf8BytesSent = utf8BytesSent.Get();
+		own.binaryMessagesReceived = binaryMessagesReceived.Get();
+		own.binaryBytesReceived = binaryBytesReceived.Get();
+		own.utf8MessagesReceived = utf8MessagesReceived.Get();
+		own.utf8BytesReceived = utf8BytesReceived.Get();
+		own.pingsSent = pingsSent.Get();
+		own.pongsReceived = pongsReceived.Get();
+		own.sendBufferHighWatermarkBytes = sendBufferHighWatermarkBytes.Get();
+		own.sendBufferHighWatermarkMessages = sendBufferHighWatermarkMessages.Get();
+		own.connects = connects.Get();
+		own.reconnects = reconnects.Get();
+		own.opens = opens.Get();
+		own.connectionResets = connectionResets.Get();
+		for (size_t i = 0; i < CWebSocketErrorCauseCount; i++)
+			own.errors[i] = errors[i].Get();
+		for (size_t i = 0; i < CWebSocketStateCount; i++)
+			own.stateTimeus[i] = _stateTimeus[i].Get();
+		// The time spent in the current state so far. The state may change while the snapshot is taken, so this is only approximate.
+		const uint64_t since = _stateSinceus.load(std::memory_order_relaxed);
+		const uint64_t now = Nowus();
+		if (now > since)
+			own.stateTimeus[_state.load(std::memory_order_relaxed)] += now - since;
+		dispatchLatency.AddTo(own.dispatchLatency);
+		writeLatency.AddTo(own.writeLatency);
+		connectLatency.AddTo(own.connectLatency);
+		for (size_t i = 0; i < CWebSocketConnectPhaseCount; i++)
+			connectPhaseLatency[i].AddTo(own.connectPhaseLatency[i]);
+		own.websockets = 1;
+		AddSnapshot(snapshot, own);
+	}
+
+	uint64_t CWebSocketMetrics::Nowus()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+#include "Win32Compat.h"
+#include "CWebSocketTransport.h"
+
+// Why onError was called. See CWebSocketMetricsSnapshot::errors.
+enum class CWebSocketErrorCause
+{
+	Transport, // A transport operation failed on an open connection, or the transport reported an error.
+	Handshake, // The connection failed before it opened, including upgrade requests the server rejected.
+	InvalidUTF8, // A received text message or close reason wasn't valid UTF8, or a string passed to a member function couldn't be converted to UTF8.
+	InvalidOperation, // A member function was called in a state that doesn't allow it, such as a Send inside onClose.
+	OutOfMemory
+};
+const size_t CWebSocketErrorCauseCount = 5;
+
+// The phases of opening a connection. See CWebSocketConnectTimings.
+enum class CWebSocketConnectPhase
+{
+	Resolve,
+	TcpConnect,
+	TlsHandshake,
+	SendUpgradeRequest,
+	ReceiveUpgradeResponse
+};
+const size_t CWebSocketConnectPhaseCount = 5;
+
+// The number of values of CWebSocketState.
+const size_t CWebSocketStateCount = 12;
+
+// A histogram of durations, in buckets that double in width. Bucket 0 counts the durations shorter than a microsecond,
+// and bucket i counts those from 2^(i-1) up to 2^i microseconds. The last bucket also counts everything longer.
+struct CWebSocketLatencyHistogram
+{
+	const static size_t BucketCount = 32;
+	uint64_t buckets[BucketCount];
+	uint64_t count;
+	uint64_t sumus; // The sum of the durations, in microseconds.
+
+	// Returns the upper bound, in microseconds, of the bucket that holds the given percentile, between 0 and 100. Returns 0 if the histogram is empty.
+	uint64_t Percentile(double percentile) const;
+
+	// Returns the upper bound of bucket i, in microseconds.
+	static uint64_t BucketBoundus(size_t i) { return (uint64_t)1 << i; }
+};
+
+// The counters of a websocket, or the sum of the counters of all websockets in the process. See CWebSocket::GetMetrics and GetGlobalCWebSocketMetrics.
+// Messages are counted once they have been sent or received completely, and their bytes are the bytes of their payloads.
+struct CWebSocketMetricsSnapshot
+{
+	uint64_t binaryMessagesSent;
+	uint64_t binaryBytesSent;
+	uint64_t utf8MessagesSent;
+	uint64_t utf8BytesSent;
+	uint64_t binaryMessagesReceived;
+	uint64_t binaryBytesReceived;
+	uint64_t utf8MessagesReceived;
+	uint64_t utf8BytesReceived;
+	uint64_t pingsSent; // Keepalive pings. See CWebSocket::KeepAlive.
+	uint64_t pongsReceived;
+	uint64_t sendBufferHighWatermarkBytes; // The most bytes the send buffer has held. Summed over websockets in the global metrics.
+	uint64_t sendBufferHighWatermarkMessages;
+	uint64_t connects; // Calls to Connect.
+	uint64_t reconnects; // Calls to Connect after the first.
+	uint64_t opens; // Connections that opened.
+	uint64_t connectionResets; // Connections lost without a closing handshake, including keepalive timeouts.
+	uint64_t errors[CWebSocketErrorCauseCount]; // The number of calls to onError, by cause, indexed by CWebSocketErrorCause.
+	uint64_t stateTimeus[CWebSocketStateCount]; // The time spent in each state, in microseconds, indexed by CWebSocketState.
+	CWebSocketLatencyHistogram dispatchLatency; // From the transport reporting an event until CWebSocket has handled it, including waiting for its turn and the callbacks it calls.
+	CWebSocketLatencyHistogram writeLatency; // From handing messages to the transport until the transport reports them written.
+	CWebSocketLatencyHistogram connectLatency; // From the start of a connection until it opened. Connections that failed aren't counted.
+	CWebSocketLatencyHistogram connectPhaseLatency[CWebSocketConnectPhaseCount]; // How long each phase of opening a connection took, indexed by CWebSocketConnectPhase.
+	                                                                             // A phase that wasn't gone through, or couldn't be observed, isn't counted.
+	uint64_t websockets; // The number of websockets whose counters are included, both live and destructed ones.
+};
+
+// Returns the sum of the counters of all websockets the process has created, including those that have been destructed. May be called from any thread.
+CWebSocketMetricsSnapshot GetGlobalCWebSocketMetrics();
+
+// Formats metrics in the Prometheus text exposition format. Every metric is named cwebsocket_*, and labels, if not empty, are added to all of them,
+// e.g. "server=\"feed\"".
+std::string FormatCWebSocketMetricsAsPrometheus(const CWebSocketMetricsSnapshot &metrics, const std::string &labels = std::string());
+
+// Formats metrics as a JSON object.
+std::string FormatCWebSocketMetricsAsJSON(const CWebSocketMetricsSnapshot &metrics);
+
+namespace cwebsocketinternal
+{
+	// The counters of a websocket. Only the websocket updates them, and never from two threads at once, so a counter is updated with a plain load and store
+	// rather than an atomic read-modify-write. Snapshots may be taken from any thread.
+	// Every instance is registered in a process-wide list, which GetGlobalCWebSocketMetrics sums, and adds its counters to the totals of the list when destructed.
+	class CWebSocketMetrics
+	{
+	private:
+		class Counter
+		{
+		private:
+			std::atomic<uint64_t> _value;
+		public:
+			Counter() : _value(0) {}
+			void Add(uint64_t n) { _value.store(_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+			void Max(uint64_t n) { if (n > _value.load(std::memory_order_relaxed)) _value.store(n, std::memory_order_relaxed); }
+			uint64_t Get() const { return _value.load(std::memory_order_relaxed); }
+		};
+
+		struct Histogram
+		{
+			Counter buckets[CWebSocketLatencyHistogram::BucketCount];
+			Counter count;
+			Counter sumus;
+			void Record(uint64_t us);
+			void AddTo(CWebSocketLatencyHistogram &histogram) const;
+		};
+
+	public:
+		Counter binaryMessagesSent;
+		Counter binaryBytesSent;
+		Counter utf8MessagesSent;
+		Counter utf8BytesSent;
+		Counter binaryMessagesReceived;
+		Counter binaryBytesReceived;
+		Counter utf8MessagesReceived;
+		Counter utf8BytesReceived;
+		Counter pingsSent;
+		Counter pongsReceived;
+		Counter sendBufferHighWatermarkBytes;
+		Counter sendBufferHighWatermarkMessages;
+		Counter connects;
+		Counter reconnects;
+		Counter opens;
+		Counter connectionResets;
+		Counter errors[CWebSocketErrorCauseCount];
+		Histogram dispatchLatency;
+		Histogram writeLatency;
+		Histogram connectLatency;
+		Histogram connectPhaseLatency[CWebSocketConnectPhaseCount];
+	private:
+		Counter _stateTimeus[CWebSocketStateCount];
+		std::atomic<size_t> _state; // The current state, and when it was entered, in microseconds of the steady clock.
+		std::atomic<uint64_t> _stateSinceus;
+		CWebSocketMetrics *_prev; // The list of all instances, protected by the mutex of the list.
+		CWebSocketMetrics *_next;
+	public:
+		CWebSocketMetrics();
+		CWebSocketMetrics(const CWebSocketMetrics&) = delete;
+		~CWebSocketMetrics();
+
+		// Accounts the time spent in the current state, and starts timing state.
+		void SetState(size_t state);
+
+		// Records the durations of the phases of a connection that opened.
+		void RecordConnect(const CWebSocketConnectTimings &timings);
+
+		// Adds the counters to snapshot. The time spent in the current state so far is included.
+		void AddTo(CWebSocketMetricsSnapshot &snapshot) const;
+
+		// The next instance in the list of all instances. Only valid while the mutex of the list is held.
+		const CWebSocketMetrics *Next() const { return _next; }
+
+		// Microseconds of the steady clock, for timing the histograms.
+		static uint64_t Nowus();
+	};
+};
@@ -0,0 +1,26 @@
+#include "CWebSocketPreparedMessage.h"
+#include "CWebSocketFrameCodec.h"
+
+CWebSocketPreparedMessage::CWebSocketPreparedMessage() :
+	_headerLength(0),
+	_bufferType(WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)
+{
+}
+
+CWebSocketPreparedMessage::CWebSocketPreparedMessage(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length, CWebSocketBufferPool *pool) :
+	_headerLength(0),
+	_bufferType(bufferType)
+{
+	if (bufferType != WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE && bufferType != WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)
+		return;
+	if (pool == nullptr)
+		pool = CWebSocketBufferPool::Default();
+	BYTE header[cwebsocketinternal::MaxFrameHeaderLength];
+	const BYTE opcode = (bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ? cwebsocketinternal::OpcodeText : cwebsocketinternal::OpcodeBinary;
+	const size_t headerLength = cwebsocketinternal::WriteFrameHeader(header, true, opcode, length, nullptr);
+	const CWebSocketSharedBuffer frame = pool->Copy(header, headerLength, message, length);
+	if (frame.Data() == nullptr)
+		return;
+	_payload = CWebSocketSharedBuffer(frame, frame.Data() + headerLength, length);
+	_headerLength = headerLength;
+}
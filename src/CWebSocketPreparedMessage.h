@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Win32Compat.h"
+#include "CWebSocketSharedBuffer.h"
+#include "CWebSocketBufferPool.h"
+
+// A message framed once, to be sent over any number of websockets without being copied or framed again for each of them.
+// See CWebSocket::SendPrepared and CWebSocketGroup. Copying a prepared message only copies a reference.
+// The message is held as a single unmasked frame in a block of a buffer pool. The server end of a connection writes the frame as it is.
+// Clients must mask every frame with a key of its own, so their transports frame the shared payload themselves, as for SendBinary(const CWebSocketSharedBuffer&).
+class CWebSocketPreparedMessage
+{
+private:
+	CWebSocketSharedBuffer _payload; // The payload within the frame. Keeps the whole frame alive.
+	size_t _headerLength;
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE _bufferType;
+public:
+	// An empty prepared message, which can't be sent.
+	CWebSocketPreparedMessage();
+
+	// Frames a copy of length bytes at message in a block of pool, or of the default pool if pool is nullptr.
+	// bufferType is WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE or WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE; UTF8 messages must be valid UTF8.
+	// If bufferType is neither, or out of memory, the prepared message is empty.
+	CWebSocketPreparedMessage(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length, CWebSocketBufferPool *pool = nullptr);
+
+	bool IsEmpty() const { return _payload.Data() == nullptr; }
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE BufferType() const { return _bufferType; }
+
+	// The payload of the message, which shares the block of the frame.
+	const CWebSocketSharedBuffer &Payload() const { return _payload; }
+
+	// The whole frame, which ends with the payload.
+	const BYTE *Frame() const { return _payload.Data() - _headerLength; }
+	size_t FrameLength() const { return _headerLength + _payload.Length(); }
+	size_t HeaderLength() const { return _headerLength; }
+};
@@ -0,0 +1,158 @@
+#include <new>
+#include <thread>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "CWebSocketReactor.h"
+#include "CWebSocketEpollTransport.h"
+
+#ifdef __linux__
+
+class CWebSocketReactor::Loop final : public SeqAsyncExecutor
+{
+public:
+	EpollLoop epoll;
+
+	void Post(std::function<void()> work) override
+	{
+		epoll.Post(std::move(work));
+	}
+
+	bool IsExecutorThread() const override
+	{
+		return epoll.IsLoopThread();
+	}
+};
+
+#else
+
+class CWebSocketReactor::Loop
+{
+};
+
+#endif
+
+CWebSocketReactor::CWebSocketReactor() :
+	_nextLoop(0)
+{
+}
+
+CWebSocketReactor::~CWebSocketReactor()
+{
+	for (auto loop : _loops)
+		delete loop;
+}
+
+bool CWebSocketReactor::Initialize(size_t loopCount)
+{
+	CWebSocketReactorOptions options;
+	options.loopCount = loopCount;
+	return Initialize(options);
+}
+
+bool CWebSocketReactor::Initialize(const CWebSocketReactorOptions &options)
+{
+#ifdef __linux__
+	if (_loops.size() > 0)
+		return false;
+	size_t loopCount = options.loopCount;
+	if (loopCount == 0)
+		loopCount = std::thread::hardware_concurrency();
+	if (loopCount == 0) // The number of hardware threads is not known.
+		loopCount = 1;
+	for (size_t i = 0; i < loopCount; i++)
+	{
+		Loop *loop = new(std::nothrow) Loop();
+		if (loop == nullptr)
+			return false;
+		_loops.push_back(loop);
+		IoUring::Options ringOptions;
+		ringOptions.sqpoll = options.sqpoll;
+		ringOptions.bufferCount = options.receiveBufferCount;
+		ringOptions.bufferLength = options.receiveBufferLength;
+		if (loop->epoll.Initialize((options.backend == CWebSocketReactorBackend::IoUring) ? &ringOptions : nullptr) == false)
+			return false;
+	}
+	return true;
+#else
+	(void)options;
+	return false;
+#endif
+}
+
+CWebSocketReactorBackend CWebSocketReactor::Backend() const
+{
+#ifdef __linux__
+	for (auto loop : _loops)
+	{
+		if (loop->epoll.Ring() == nullptr)
+			return CWebSocketReactorBackend::Epoll;
+	}
+	return (_loops.size() > 0) ? CWebSocketReactorBackend::IoUring : CWebSocketReactorBackend::Epoll;
+#else
+	return CWebSocketReactorBackend::Epoll;
+#endif
+}
+
+size_t CWebSocketReactor::LoopCount() const
+{
+	return _loops.size();
+}
+
+bool CWebSocketReactor::_Attach(CWebSocketTransport **transport, SeqAsyncExecutor **executor, AsyncTimerQueue **timerQueue)
+{
+#ifdef __linux__
+	if (_loops.size() == 0)
+		return false;
+	Loop *loop = _loops[_nextLoop.fetch_add(1, std::memory_order_relaxed) % _loops.size()];
+	*transport = new(std::nothrow) CWebSocketEpollTransport(&loop->epoll);
+	*executor = loop;
+	*timerQueue = &loop->epoll;
+	return *transport != nullptr;
+#else
+	(void)transport;
+	(void)executor;
+	(void)timerQueue;
+	return false;
+#endif
+}
+
+bool CWebSocketReactor::_AttachAccepted(size_t loopIndex, int acceptedFd, CWebSocketTransport **transport, SeqAsyncExecutor **executor, AsyncTimerQueue **timerQueue)
+{
+#ifdef __linux__
+	if (loopIndex >= _loops.size())
+	{
+		close(acceptedFd);
+		return false;
+	}
+	Loop *loop = _loops[loopIndex];
+	*transport = new(std::nothrow) CWebSocketEpollTransport(&loop->epoll, acceptedFd);
+	*executor = loop;
+	*timerQueue = &loop->epoll;
+	if (*transport == nullptr)
+	{
+		close(acceptedFd);
+		return false;
+	}
+	return true;
+#else
+	(void)loopIndex;
+	(void)acceptedFd;
+	(void)transport;
+	(void)executor;
+	(void)timerQueue;
+	return false;
+#endif
+}
+
+EpollLoop *CWebSocketReactor::_EpollLoop(size_t loopIndex)
+{
+#ifdef __linux__
+	return (loopIndex < _loops.size()) ? &_loops[loopIndex]->epoll : nullptr;
+#else
+	(void)loopIndex;
+	return nullptr;
+#endif
+}
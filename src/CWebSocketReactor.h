@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+#include "Win32Compat.h"
+#include "CWebSocketTransport.h"
+#include "SeqAsyncQueue.h"
+#include "AsyncTimer.h"
+
+class EpollLoop;
+
+// How the loops of a CWebSocketReactor do their I/O.
+enum class CWebSocketReactorBackend
+{
+	Epoll, // The loops wait for readiness with epoll, and every read and write of a connection is a system call of its own.
+	// The reads and writes of open connections go through an io_uring per loop: a multishot receive per connection draws from a group of buffers
+	// shared by the loop, queued frames are written with linked gather writes, and everything a loop iteration submits takes a single system call,
+	// or none with sqpoll. Opening handshakes still use epoll. Needs Linux 6.0 or later; elsewhere the reactor falls back to Epoll.
+	IoUring
+};
+
+// Options of a CWebSocketReactor.
+struct CWebSocketReactorOptions
+{
+	size_t loopCount = 0; // 0 starts one loop per hardware thread.
+	CWebSocketReactorBackend backend = CWebSocketReactorBackend::Epoll;
+	bool sqpoll = false; // IoUring only: a kernel thread per loop polls for submissions, trading a busy CPU for the system calls.
+	unsigned receiveBufferCount = 256; // IoUring only: the number of receive buffers of each loop, at most 65536, and their length.
+	unsigned receiveBufferLength = 16384;
+};
+
+// CWebSocketReactor multiplexes many websockets over a fixed number of event loop threads.
+// Every websocket initialized with a reactor is pinned to one of its loops, picked round-robin. The transport events, the queued calls
+// to public member functions and the timer of the websocket are all handled on that loop thread, so the websocket needs no mutex or events,
+// and callbacks are called in the same order as with a websocket of its own.
+// Websockets never migrate between loops, so a slow callback delays the other websockets of the same loop.
+// The reactor is backed by epoll loops and is available on Linux. On other platforms Initialize fails; WinHttp already multiplexes websockets on Windows.
+class CWebSocketReactor
+{
+	friend class CWebSocket;
+	friend class CWebSocketServer;
+private:
+	class Loop; // A loop thread, along with the executor interface SeqAsyncQueue uses.
+	std::vector<Loop*> _loops;
+	std::atomic<size_t> _nextLoop;
+
+private:
+	// Picks the loop for a new websocket. Creates a transport bound to that loop and returns the executor and the timer queue of the loop.
+	// Returns false if the transport could not be created.
+	bool _Attach(CWebSocketTransport **transport, SeqAsyncExecutor **executor, AsyncTimerQueue **timerQueue);
+
+	// Same as _Attach, but for the server end of a connection accepted on the loopIndex-th loop, which the websocket stays on.
+	// The transport takes ownership of acceptedFd, and so does this function if it fails.
+	bool _AttachAccepted(size_t loopIndex, int acceptedFd, CWebSocketTransport **transport, SeqAsyncExecutor **executor, AsyncTimerQueue **timerQueue);
+
+	// The epoll loop of the loopIndex-th loop thread, or nullptr on platforms without one.
+	EpollLoop *_EpollLoop(size_t loopIndex);
+
+public:
+	CWebSocketReactor();
+	CWebSocketReactor(const CWebSocketReactor&) = delete;
+
+	// Stops the loop threads. Destruct every websocket attached to the reactor first.
+	~CWebSocketReactor();
+
+	// Starts loopCount loop threads. If loopCount is 0, starts one per hardware thread.
+	// Returns true for success. If this function returns false, destruct the object without calling any member functions.
+	bool Initialize(size_t loopCount = 0);
+
+	// Same as above, with the given options.
+	bool Initialize(const CWebSocketReactorOptions &options);
+
+	// The backend the loops actually use, which is Epoll if the IoUring backend was asked for but is unavailable.
+	CWebSocketReactorBackend Backend() const;
+
+	// Returns the number of loop threads.
+	size_t LoopCount() const;
+};
@@ -0,0 +1,44 @@
+#include <algorithm>
+
+#include "CWebSocketReceiveSizer.h"
+
+namespace cwebsocketinternal
+{
+	CWebSocketReceiveSizer::CWebSocketReceiveSizer(size_t defaultLength) :
+		_defaultLength(defaultLength),
+		_length(defaultLength),
+		_minLength(defaultLength),
+		_maxLength(defaultLength),
+		_adaptive(false),
+		_burstLength(0)
+	{
+	}
+
+	void CWebSocketReceiveSizer::Configure(const CWebSocketReceiveBufferOptions &options)
+	{
+		_minLength = (options.length != 0) ? options.length : _defaultLength;
+		_maxLength = options.adaptive ? std::max<size_t>(options.maxLength, _minLength) : _minLength;
+		_adaptive = options.adaptive;
+		_length = _minLength;
+		_burstLength = 0;
+	}
+
+	void CWebSocketReceiveSizer::OnReceived(size_t length, bool burstEnd)
+	{
+		if (_adaptive == false)
+			return;
+		_burstLength += length;
+		if (burstEnd == false)
+		{
+			if (length >= _length) // More is on its way, and didn't fit.
+				_length = std::min(_length * 2, _maxLength);
+			return;
+		}
+		size_t fit = _minLength;
+		while (fit < _burstLength && fit < _maxLength)
+			fit *= 2;
+		fit = std::min(fit, _maxLength);
+		_length = std::max(fit, std::max(_length / 2, _minLength));
+		_burstLength = 0;
+	}
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "Win32Compat.h"
+#include "CWebSocketTransport.h"
+
+namespace cwebsocketinternal
+{
+	// Decides how many bytes to receive at a time, as configured by CWebSocketReceiveBufferOptions.
+	// In adaptive mode, the length doubles whenever a receive fills it in the middle of a burst of data, so that a large message takes a few receives instead of one per buffer length.
+	// At the end of each burst, the length is set to fit the whole burst, but shrinks by at most half at a time, so that bursts of alternating sizes don't cause a reallocation each.
+	class CWebSocketReceiveSizer
+	{
+	private:
+		size_t _defaultLength; // Used if the options don't give a length.
+		size_t _length;
+		size_t _minLength;
+		size_t _maxLength;
+		bool _adaptive;
+		size_t _burstLength; // The number of bytes received since the end of the last burst.
+	public:
+		explicit CWebSocketReceiveSizer(size_t defaultLength);
+
+		// Starts over with the given options.
+		void Configure(const CWebSocketReceiveBufferOptions &options);
+
+		// The number of bytes to receive next.
+		size_t Length() const { return _length; }
+
+		bool IsAdaptive() const { return _adaptive; }
+
+		// Reports that a receive of up to Length() bytes got length bytes. burstEnd is true if no more data is expected right away, such as at the end of a message.
+		void OnReceived(size_t length, bool burstEnd);
+	};
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+namespace cwebsocketinternal
+{
+	// A FIFO queue in a circular buffer, which unlike std::deque keeps its memory as items come and go, so that a queue in steady state doesn't allocate.
+	// The buffer doubles whenever it's full. T must be default constructible and movable. Popped items are replaced with T(), so that they let go of what they hold.
+	template <typename T>
+	class CWebSocketRingQueue
+	{
+	private:
+		std::vector<T> _items; // Its size is 0 or a power of 2.
+		size_t _head;
+		size_t _count;
+	public:
+		CWebSocketRingQueue() : _head(0), _count(0) {}
+
+		size_t Size() const { return _count; }
+
+		// The index-th item from the front.
+		T &operator[](size_t index) { return _items[(_head + index) & (_items.size() - 1)]; }
+		const T &operator[](size_t index) const { return _items[(_head + index) & (_items.size() - 1)]; }
+
+		T &Front() { return (*this)[0]; }
+
+		void PushBack(T &&item)
+		{
+			if (_count == _items.size())
+			{
+				std::vector<T> items(_items.size() > 0 ? _items.size() * 2 : 16);
+				for (size_t i = 0; i < _count; i++)
+					items[i] = std::move((*this)[i]);
+				_items.swap(items);
+				_head = 0;
+			}
+			_items[(_head + _count) & (_items.size() - 1)] = std::move(item);
+			_count++;
+		}
+
+		// Inserts item before the index-th item from the front. The items behind it move back.
+		void Insert(size_t index, T &&item)
+		{
+			PushBack(std::move(item));
+			for (size_t i = _count - 1; i > index; i--)
+				std::swap((*this)[i], (*this)[i - 1]);
+		}
+
+		// Removes count items from the front.
+		void PopFront(size_t count = 1)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				Front() = T();
+				_head = (_head + 1) & (_items.size() - 1);
+				_count--;
+			}
+		}
+
+		// Removes count items, starting with the index-th item from the front. The items behind them move forward.
+		void Erase(size_t index, size_t count)
+		{
+			for (size_t i = index; i + count < _count; i++)
+				(*this)[i] = std::move((*this)[i + count]);
+			for (size_t i = _count - count; i < _count; i++)
+				(*this)[i] = T();
+			_count -= count;
+		}
+
+		void Clear()
+		{
+			PopFront(_count);
+			_head = 0;
+		}
+	};
+};
@@ -0,0 +1,209 @@
+#include <new>
+
+#include "CWebSocketServer.h"
+
+#ifdef __linux__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "EpollLoop.h"
+
+class CWebSocketServer::Listener final : public EpollLoop::Handler
+{
+private:
+	const static size_t MaxAcceptsPerEvent = 64; // Give the other descriptors of the loop a turn during a flood of connections.
+public:
+	CWebSocketServer *server;
+	size_t loopIndex;
+	EpollLoop *loop;
+	int fd;
+
+	Listener() : server(nullptr), loopIndex(0), loop(nullptr), fd(-1) {}
+
+	~Listener()
+	{
+		if (fd != -1)
+			close(fd);
+	}
+
+	// Creates a socket listening on port, sharing the port with the other listeners of the server. Tries dual-stack IPv6 first, then IPv4.
+	bool Listen(INTERNET_PORT port, int backlog)
+	{
+		int one = 1;
+		fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd != -1)
+		{
+			int zero = 0;
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+			sockaddr_in6 address;
+			memset(&address, 0, sizeof(address));
+			address.sin6_family = AF_INET6;
+			address.sin6_addr = in6addr_any;
+			address.sin6_port = htons(port);
+			if (bind(fd, (const sockaddr*)&address, sizeof(address)) == 0 && listen(fd, backlog) == 0)
+				return true;
+			close(fd);
+		}
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1)
+			return false;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+		return bind(fd, (const sockaddr*)&address, sizeof(address)) == 0 && listen(fd, backlog) == 0;
+	}
+
+	// The port the socket is bound to.
+	INTERNET_PORT Port() const
+	{
+		sockaddr_storage address;
+		socklen_t length = sizeof(address);
+		if (getsockname(fd, (sockaddr*)&address, &length) != 0)
+			return 0;
+		if (address.ss_family == AF_INET6)
+			return ntohs(((const sockaddr_in6*)&address)->sin6_port);
+		return ntohs(((const sockaddr_in*)&address)->sin_port);
+	}
+
+	void OnEpollEvents(uint32_t /*events*/) override
+	{
+		for (size_t i = 0; i < MaxAcceptsPerEvent; i++)
+		{
+			const int accepted = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (accepted == -1)
+			{
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				return; // EAGAIN, or out of descriptors, in which case the connections wait in the backlog until some are closed.
+			}
+			int one = 1;
+			setsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			server->_OnAccepted(loopIndex, accepted);
+		}
+	}
+};
+
+#else
+
+class CWebSocketServer::Listener
+{
+};
+
+#endif
+
+CWebSocketServer::CWebSocketServer() :
+	_reactor(nullptr),
+	_port(0)
+{
+}
+
+CWebSocketServer::~CWebSocketServer()
+{
+#ifdef __linux__
+	for (auto listener : _listeners)
+	{
+		if (listener->loop != nullptr && listener->fd != -1)
+		{
+			listener->loop->Remove(listener->fd);
+			listener->loop->Synchronize(); // Wait for the loop to let go of the listener.
+		}
+		delete listener;
+	}
+#endif
+}
+
+bool CWebSocketServer::Initialize(INTERNET_PORT port, CWebSocketReactor *reactor, CWebSocketServerOnConnectionCallback onConnection, const CWebSocketServerOptions &options)
+{
+#ifdef __linux__
+	if (_reactor != nullptr || reactor == nullptr || reactor->LoopCount() == 0 || !onConnection)
+		return false;
+	_reactor = reactor;
+	_options = options;
+	if (options.path != nullptr)
+	{
+		_path = options.path;
+		_options.path = _path.c_str();
+	}
+	_onConnection = onConnection;
+	for (size_t i = 0; i < reactor->LoopCount(); i++)
+	{
+		Listener *listener = new(std::nothrow) Listener();
+		if (listener == nullptr)
+			return false;
+		_listeners.push_back(listener);
+		listener->server = this;
+		listener->loopIndex = i;
+		if (listener->Listen(port, options.backlog) == false)
+			return false;
+		if (port == 0) // The others share the port picked for the first one.
+			port = listener->Port();
+	}
+	_port = port;
+	// Only start accepting once all listeners are there, so that no connection is accepted for a server that fails to initialize.
+	for (auto listener : _listeners)
+	{
+		EpollLoop *loop = reactor->_EpollLoop(listener->loopIndex);
+		if (loop == nullptr || loop->Add(listener->fd, EPOLLIN, listener) == false)
+			return false;
+		listener->loop = loop;
+	}
+	return true;
+#else
+	(void)port;
+	(void)reactor;
+	(void)onConnection;
+	(void)options;
+	return false;
+#endif
+}
+
+INTERNET_PORT CWebSocketServer::Port() const
+{
+	return _port;
+}
+
+// Called on the loopIndex-th loop thread with a connection it accepted.
+void CWebSocketServer::_OnAccepted(size_t loopIndex, int fd)
+{
+#ifdef __linux__
+	CWebSocket *ws = new(std::nothrow) CWebSocket();
+	if (ws == nullptr)
+	{
+		close(fd);
+		return;
+	}
+	if (ws->_InitializeAccepted(_reactor, loopIndex, fd, _options.path) == false)
+	{
+		delete ws;
+		return;
+	}
+	ws->SetReceiveBuffer(_options.receiveBuffer);
+	if (_onConnection(ws) == false)
+	{
+		delete ws;
+		return;
+	}
+	ws->Connect();
+#else
+	(void)loopIndex;
+	(void)fd;
+#endif
+}
+
+void CWebSocketServer::Release(CWebSocket *ws)
+{
+	ws->_executor->Post([ws]() { delete ws; });
+}
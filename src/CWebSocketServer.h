@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "CWebSocket.h"
+
+// Options of a CWebSocketServer.
+struct CWebSocketServerOptions
+{
+	const WCHAR *path = nullptr; // Only upgrade requests for this path are accepted, and others are answered with 404 Not Found. nullptr accepts any path.
+	int backlog = 4096; // How many connections each listening socket holds until they are accepted. The kernel caps it at net.core.somaxconn.
+	// How the websockets receive, see CWebSocket::SetReceiveBuffer. Receiving adaptively, starting small, keeps the memory of idle connections low,
+	// which adds up over tens of thousands of them.
+	CWebSocketReceiveBufferOptions receiveBuffer = { 4096, true, 1048576 };
+};
+
+// Called on a loop thread of the reactor for every accepted connection, with a websocket for it that has been initialized but not connected.
+// Set the callbacks of the websocket here. Return true to take ownership of the websocket, after which the server calls Connect, which performs the server side
+// of the opening handshake; onOpen or onError follows. Return false to refuse the connection, in which case the server destructs the websocket.
+typedef std::function<bool(CWebSocket *ws)> CWebSocketServerOnConnectionCallback;
+
+// CWebSocketServer accepts websocket connections, and hands each of them to a CWebSocket, which works like any other websocket: the same callbacks,
+// send queue and closing handshake, except that Connect can't reopen the connection once it's gone. Frames are sent unmasked, as servers do.
+// Every loop of the reactor gets a listening socket of its own, bound to the same port with SO_REUSEPORT, so that the kernel spreads incoming connections
+// over the loops, and each connection is handled by the loop that accepted it for its whole life, without passing it between threads.
+// Every connection takes a file descriptor, so raise RLIMIT_NOFILE to serve many of them.
+// Extensions and subprotocols are declined. Available on Linux; on other platforms Initialize fails.
+class CWebSocketServer
+{
+private:
+	class Listener; // A listening socket, registered with one of the loops.
+	CWebSocketReactor *_reactor;
+	CWebSocketServerOptions _options;
+	std::wstring _path; // The copy of options.path.
+	CWebSocketServerOnConnectionCallback _onConnection;
+	std::vector<Listener*> _listeners;
+	INTERNET_PORT _port;
+
+private:
+	void _OnAccepted(size_t loopIndex, int fd);
+
+public:
+	CWebSocketServer();
+	CWebSocketServer(const CWebSocketServer&) = delete;
+
+	// Stops accepting connections. The websockets handed out live on; destruct them before the reactor.
+	~CWebSocketServer();
+
+	// Starts accepting connections on port, on every address, with every loop of reactor, which must outlive the server. If port is 0, a free port is picked.
+	// Returns true for success. If this function returns false, destruct the object without calling any other member functions.
+	bool Initialize(INTERNET_PORT port, CWebSocketReactor *reactor, CWebSocketServerOnConnectionCallback onConnection, const CWebSocketServerOptions &options = CWebSocketServerOptions());
+
+	// The port the server listens on.
+	INTERNET_PORT Port() const;
+
+	// Destructs ws, a websocket handed out by a server, on its loop thread once the callback running there has returned. Unlike deleting it,
+	// may be called from within the callbacks of ws, such as onClosed and onError. Call it once per websocket.
+	static void Release(CWebSocket *ws);
+};
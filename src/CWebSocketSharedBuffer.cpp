@@ -0,0 +1,35 @@
+#include "CWebSocketSharedBuffer.h"
+
+CWebSocketSharedBuffer::CWebSocketSharedBuffer() :
+	_length(0)
+{
+}
+
+CWebSocketSharedBuffer::CWebSocketSharedBuffer(const BYTE *data, size_t length, CWebSocketBufferReleaseCallback release) :
+	_data(data, [release](const BYTE*) {
+		if (release)
+			release();
+	}),
+	_length(length)
+{
+}
+
+CWebSocketSharedBuffer::CWebSocketSharedBuffer(std::vector<BYTE> &&data) :
+	_length(data.size())
+{
+	// The vector and the reference count share a single allocation, and the bytes are moved, not copied.
+	std::shared_ptr<std::vector<BYTE>> owner = std::make_shared<std::vector<BYTE>>(std::move(data));
+	_data = std::shared_ptr<const BYTE>(owner, owner->data());
+}
+
+CWebSocketSharedBuffer::CWebSocketSharedBuffer(std::shared_ptr<const BYTE> &&data, size_t length) :
+	_data(std::move(data)),
+	_length(length)
+{
+}
+
+CWebSocketSharedBuffer::CWebSocketSharedBuffer(const CWebSocketSharedBuffer &owner, const BYTE *data, size_t length) :
+	_data(owner._data, data), // Shares the reference count of owner.
+	_length(length)
+{
+}
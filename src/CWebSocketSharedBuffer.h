@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "Win32Compat.h"
+
+// A callback function to be called when the memory wrapped by a CWebSocketSharedBuffer is no longer needed.
+// It is called on whichever thread destroys the last reference to the buffer.
+typedef std::function<void()> CWebSocketBufferReleaseCallback;
+
+// A reference counted, immutable span of bytes, which can be passed to CWebSocket::SendBinary without being copied.
+// Copying a CWebSocketSharedBuffer only copies a reference, so the same bytes can be queued on any number of websockets at once.
+// The bytes must not be modified until they are released.
+class CWebSocketSharedBuffer
+{
+private:
+	std::shared_ptr<const BYTE> _data;
+	size_t _length;
+public:
+	// An empty buffer.
+	CWebSocketSharedBuffer();
+
+	// Wraps length bytes at data, which stay owned by the caller. release, if not empty, is called once the last reference to the buffer is gone.
+	CWebSocketSharedBuffer(const BYTE *data, size_t length, CWebSocketBufferReleaseCallback release);
+
+	// Takes over the bytes of data, without copying them.
+	explicit CWebSocketSharedBuffer(std::vector<BYTE> &&data);
+
+	// Shares the ownership of length bytes at data, whose deleter is called once the last reference to the buffer is gone. Used by CWebSocketBufferPool::Copy.
+	CWebSocketSharedBuffer(std::shared_ptr<const BYTE> &&data, size_t length);
+
+	// Shares length bytes at data, which lie within the memory owner keeps alive, and keep all of it alive. Only copies a reference.
+	CWebSocketSharedBuffer(const CWebSocketSharedBuffer &owner, const BYTE *data, size_t length);
+
+	const BYTE *Data() const { return _data.get(); }
+	size_t Length() const { return _length; }
+};
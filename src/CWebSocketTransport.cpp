@@ -0,0 +1,16 @@
+#include <new>
+
+#include "CWebSocketTransport.h"
+#include "CWebSocketWinHttpTransport.h"
+#include "CWebSocketEpollTransport.h"
+
+CWebSocketTransport* CreateDefaultCWebSocketTransport()
+{
+#if defined(_WIN32)
+	return new(std::nothrow) CWebSocketWinHttpTransport();
+#elif defined(__linux__)
+	return new(std::nothrow) CWebSocketEpollTransport();
+#else
+	return nullptr;
+#endif
+}
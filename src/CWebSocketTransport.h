@@ -0,0 +1,151 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+
+#include "Win32Compat.h"
+#include "CWebSocketSharedBuffer.h"
+
+class CWebSocketBufferPool;
+
+// Events a transport reports to its owner.
+// They mirror the WinHttp status callbacks the CWebSocket state machine was originally written against.
+enum class CWebSocketTransportEvent
+{
+	SendRequestComplete, // The upgrade request has been sent. The owner is expected to call ReceiveResponse.
+	HeadersAvailable, // The upgrade response has been received. The owner is expected to call CompleteUpgrade.
+	ReadComplete, // A call to Receive has completed. The status parameter of the callback describes the received data.
+	WriteComplete, // A call to Send has completed.
+	CloseComplete, // A call to Close has completed. The close frame of the server can be queried using QueryCloseStatus.
+	OperationCancelled, // A pending call to Receive has been cancelled because Close was called.
+	PongReceived, // A pong frame has been received. The status parameter of the callback gives the length of its payload. Pongs are only reported while a Receive is pending.
+	ConnectionError, // The underlying connection has been reset.
+	Error // Any other error, including TLS and handshake failures.
+};
+
+// Options for the permessage-deflate extension (RFC 7692), which compresses the payload of data messages.
+// The extension is offered in the upgrade request, and only used if the server accepts it.
+struct CWebSocketCompressionOptions
+{
+	bool enabled = false;
+	int clientMaxWindowBits = 15; // The window size of our compressor, as a power of 2, between 9 and 15. Smaller windows use less memory and compress worse.
+	int serverMaxWindowBits = 15; // The largest window the server may compress with, between 8 and 15.
+	bool clientNoContextTakeover = false; // Compress every message on its own, instead of using the previous messages as a dictionary. Saves memory between messages.
+	bool serverNoContextTakeover = false; // Ask the server to do the same.
+	size_t threshold = 64; // Messages shorter than this many bytes are sent uncompressed, since compressing them gains little.
+	int level = 6; // The zlib compression level, from 1 (fastest) to 9 (smallest).
+};
+
+// How many bytes are received at a time. See CWebSocket::SetReceiveBuffer.
+struct CWebSocketReceiveBufferOptions
+{
+	DWORD length = 0; // The number of bytes to receive at a time, or 0 for the default. In adaptive mode, the smallest number of bytes to receive at a time.
+	bool adaptive = false; // Grow the receive length toward the size of the data that arrives, up to maxLength, and shrink it back toward length as the traffic gets lighter.
+	DWORD maxLength = 1048576; // Only used in adaptive mode.
+};
+
+// When each phase of opening a connection ended, in microseconds since the connection was started. Phases that weren't gone through,
+// or that the transport can't observe, are 0; e.g. only secure connections do a TLS handshake.
+// See CWebSocketOpenDetails.
+struct CWebSocketConnectTimings
+{
+	uint64_t resolvedus = 0; // The server name has been resolved.
+	uint64_t connectedus = 0; // The TCP handshake has completed.
+	uint64_t securedus = 0; // The TLS handshake has completed.
+	uint64_t requestSentus = 0; // The upgrade request has been sent.
+	uint64_t openedus = 0; // The upgrade response has been received and accepted. The time it took to open the connection.
+};
+
+// A message, or a fragment of a message, to be sent with CWebSocketTransport::SendBatch.
+struct CWebSocketTransportMessage
+{
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType;
+	const BYTE *message;
+	size_t length;
+	// If not empty, the whole message serialized as a single unmasked, uncompressed frame, which ends with the length bytes at message.
+	// Prepared messages carry one, see CWebSocketPreparedMessage. Transports that send unmasked frames, as servers do, may write it as it is instead of framing
+	// message, and may hold on to it past WriteComplete, for as long as the system still uses it.
+	CWebSocketSharedBuffer frame;
+};
+
+// A callback function to be called by a transport when an event happens.
+// status and data are only valid for ReadComplete and PongReceived, and nullptr otherwise. data points to the received bytes.
+// Transports may call this callback on any thread, and may even call it from within one of their member functions if an operation completes synchronously.
+typedef std::function<void(CWebSocketTransportEvent event, const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data)> CWebSocketTransportCallback;
+
+// CWebSocketTransport is the layer below CWebSocket that actually moves bytes.
+// It owns the network connection, performs the HTTP upgrade and does websocket framing.
+// All functions except Abort are asynchronous. They return false if the operation could not be started, in which case no event is reported for it.
+// CWebSocket does not call a transport concurrently from multiple threads, and has at most one Receive and one Send or Close pending at any time.
+class CWebSocketTransport
+{
+public:
+	virtual ~CWebSocketTransport() {}
+
+	// Called once, by CWebSocket::Initialize. callback will be called for all subsequent events.
+	virtual bool Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback) = 0;
+
+	// Makes the transport offer permessage-deflate with the given options in the upgrade requests it sends from now on, or stop offering it if options.enabled is false.
+	// Operates synchronously, and must not be called while there is a connection. Returns false if the transport doesn't support compression or the options are invalid.
+	virtual bool SetCompression(const CWebSocketCompressionOptions & /*options*/) { return false; }
+
+	// Makes the transport size the reads from its connection as given, for transports that receive in place and so choose the size of their reads themselves.
+	// Operates synchronously, and may be called at any time. Returns false if the transport receives into the buffers passed to Receive instead.
+	virtual bool SetReceiveBuffer(const CWebSocketReceiveBufferOptions & /*options*/) { return false; }
+
+	// Makes the transport draw the buffers of the frames it serializes from pool, for transports that do their own framing. pool is never nullptr.
+	// Operates synchronously, and may be called at any time. Returns false if the transport doesn't serialize frames itself.
+	virtual bool SetBufferPool(CWebSocketBufferPool * /*pool*/) { return false; }
+
+	// Opens a new connection to the server and sends the upgrade request over it. Reports SendRequestComplete.
+	virtual bool SendUpgradeRequest() = 0;
+
+	// Fills in resolvedus, connectedus and securedus of timings for the connection opened by the last call to SendUpgradeRequest, relative to that call,
+	// and leaves the phases the transport can't observe alone. Operates synchronously. Returns false if the transport doesn't time the phases of a connection.
+	virtual bool GetConnectTimings(CWebSocketConnectTimings * /*timings*/) { return false; }
+
+	// Starts receiving the response to the upgrade request. Reports HeadersAvailable.
+	virtual bool ReceiveResponse() = 0;
+
+	// Verifies the upgrade response and switches the connection to the websocket protocol. Operates synchronously.
+	virtual bool CompleteUpgrade() = 0;
+
+	// Receives data into buffer. Reports ReadComplete. buffer must stay valid until then.
+	// If buffer is nullptr, the transport reports up to length bytes straight from its own buffers instead. Only allowed if ReceivesInPlace returns true.
+	// Data reported in place stays valid until the callback returns, even if Receive is called again from within the callback.
+	virtual bool Receive(BYTE *buffer, DWORD length) = 0;
+
+	// Returns true if the transport can report received data in place, without copying it. See Receive.
+	virtual bool ReceivesInPlace() const { return false; }
+
+	// Sends a message, or a fragment of a message, depending on bufferType. Reports WriteComplete.
+	// The transport makes a copy of message if it needs one, so message need not outlive the call.
+	virtual bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) = 0;
+
+	// Sends count messages in order, as if Send was called for each of them, and reports a single WriteComplete once all of them have been sent.
+	// Lets a transport write many queued messages with a single system call. Only allowed if SendsInBatches returns true.
+	// The messages must stay valid until WriteComplete is reported.
+	virtual bool SendBatch(const CWebSocketTransportMessage * /*messages*/, size_t /*count*/) { return false; }
+
+	// Returns true if the transport can send messages in batches. See SendBatch.
+	virtual bool SendsInBatches() const { return false; }
+
+	// Sends a ping frame with the given payload, which may be up to 125 bytes long. No event is reported for the ping itself; pongs are reported with PongReceived.
+	// May be called while a Send is pending. Returns false if the transport can't send pings.
+	virtual bool Ping(const BYTE * /*payload*/, size_t /*length*/) { return false; }
+
+	// Sends a close frame and waits for the close frame of the server. Reports CloseComplete.
+	virtual bool Close(USHORT status, const BYTE *reason, size_t reasonLength) = 0;
+
+	// Retrieves the close status and the UTF8 encoded reason sent by the server. Operates synchronously.
+	virtual bool QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed) = 0;
+
+	// Closes the connection, if there is one. Operates synchronously.
+	// Once this function returns, no further events will be reported for the aborted connection.
+	// It may wait for an event that is being reported at the time of the call, so the owner must make sure its callback returns promptly.
+	virtual void Abort() = 0;
+};
+
+// Creates the default transport for the platform: CWebSocketWinHttpTransport on Windows and CWebSocketEpollTransport on Linux.
+// Returns nullptr on failure.
+CWebSocketTransport* CreateDefaultCWebSocketTransport();
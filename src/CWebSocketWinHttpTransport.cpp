@@ -0,0 +1,255 @@
+#ifdef _WIN32
+
+#include <shlwapi.h>
+
+#include "CWebSocketWinHttpTransport.h"
+
+CWebSocketWinHttpTransport::CWebSocketWinHttpTransport() :
+	_hSession(nullptr),
+	_hConnection(nullptr),
+	_hWebSocket(nullptr),
+	_hRequest(nullptr),
+	_serverName(nullptr),
+	_path(nullptr),
+	_secure(false),
+	_eRequestHandleClosed(nullptr),
+	_eWebSocketHandleClosed(nullptr),
+	_receiveBuffer(nullptr),
+	_resolvedus(0),
+	_connectedus(0),
+	_securedus(0)
+{
+}
+
+CWebSocketWinHttpTransport::~CWebSocketWinHttpTransport()
+{
+	Abort();
+	if (_hConnection != nullptr)
+		WinHttpCloseHandle(_hConnection);
+	if (_hSession != nullptr)
+		WinHttpCloseHandle(_hSession);
+	CloseHandle(_eWebSocketHandleClosed);
+	CloseHandle(_eRequestHandleClosed);
+	CoTaskMemFree(_serverName);
+	CoTaskMemFree(_path);
+}
+
+HRESULT CWebSocketWinHttpTransport::_CreateSessionConnectionHandles()
+{
+	_hSession = WinHttpOpen(L"CWebSocket",
+		WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
+		NULL,
+		NULL,
+		WINHTTP_FLAG_ASYNC);
+	if (_hSession != NULL)
+	{
+		_hConnection = WinHttpConnect(_hSession,
+			_serverName,
+			_port,
+			0);
+		if (_hConnection != NULL)
+			return S_OK;
+	}
+	return E_FAIL;
+}
+
+bool CWebSocketWinHttpTransport::Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback)
+{
+	HRESULT hr = E_FAIL;
+
+	_secure = secure;
+	_port = port;
+	_callback = callback;
+	_eWebSocketHandleClosed = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (_eWebSocketHandleClosed != nullptr)
+		_eRequestHandleClosed = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (_eRequestHandleClosed != nullptr)
+		hr = SHStrDupW(serverName, &_serverName);
+	if (SUCCEEDED(hr))
+		hr = SHStrDupW(path, &_path);
+	if (SUCCEEDED(hr))
+		hr = _CreateSessionConnectionHandles();
+	return(SUCCEEDED(hr));
+}
+
+bool CWebSocketWinHttpTransport::SendUpgradeRequest()
+{
+	_requestStartedAt = std::chrono::steady_clock::now();
+	_resolvedus = 0;
+	_connectedus = 0;
+	_securedus = 0;
+	_hRequest = WinHttpOpenRequest(_hConnection,
+		L"GET",
+		_path,
+		NULL,
+		NULL,
+		NULL,
+		_secure ? WINHTTP_FLAG_SECURE : 0);
+	if (_hRequest != NULL)
+	{
+		if (WINHTTP_INVALID_STATUS_CALLBACK != WinHttpSetStatusCallback(_hRequest, WinHttpCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, NULL)) // This callback will be inherited by _hWebSocket, as per the documentation of WinHttpSetStatusCallback.
+		{
+			BOOL fStatus = WinHttpSetOption(_hRequest,
+				WINHTTP_OPTION_UPGRADE_TO_WEB_SOCKET,
+				NULL,
+				0);
+			if (fStatus)
+			{
+				fStatus = WinHttpSendRequest(_hRequest,
+					WINHTTP_NO_ADDITIONAL_HEADERS,
+					0,
+					NULL,
+					0,
+					0,
+					(DWORD_PTR)this);
+				if (fStatus)
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+// WinHttp may reuse a connection, or resolve the name ahead of time, in which case the phases it skipped stay 0.
+bool CWebSocketWinHttpTransport::GetConnectTimings(CWebSocketConnectTimings *timings)
+{
+	timings->resolvedus = _resolvedus;
+	timings->connectedus = _connectedus;
+	timings->securedus = _securedus;
+	return true;
+}
+
+bool CWebSocketWinHttpTransport::ReceiveResponse()
+{
+	return WinHttpReceiveResponse(_hRequest, 0) != FALSE;
+}
+
+bool CWebSocketWinHttpTransport::CompleteUpgrade()
+{
+	_hWebSocket = WinHttpWebSocketCompleteUpgrade(_hRequest, (DWORD_PTR)this);
+	return _hWebSocket != NULL;
+}
+
+bool CWebSocketWinHttpTransport::Receive(BYTE *buffer, DWORD length)
+{
+	_receiveBuffer = buffer;
+	DWORD dwError = WinHttpWebSocketReceive(_hWebSocket,
+		buffer,
+		length,
+		NULL,
+		NULL);
+	return dwError == ERROR_SUCCESS;
+}
+
+bool CWebSocketWinHttpTransport::Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length)
+{
+	DWORD dwError = WinHttpWebSocketSend(_hWebSocket,
+		bufferType,
+		(PVOID)message,
+		length);
+	return dwError == ERROR_SUCCESS;
+}
+
+bool CWebSocketWinHttpTransport::Close(USHORT status, const BYTE *reason, size_t reasonLength)
+{
+	const PVOID pvReason = reasonLength == 0 ? nullptr : (PVOID)reason; // WinHttpWebSocketClose fails when pvReason != nullptr and dwReasonLength == 0
+	DWORD dwError = WinHttpWebSocketClose(_hWebSocket,
+		status,
+		pvReason,
+		reasonLength);
+	return dwError == ERROR_SUCCESS;
+}
+
+bool CWebSocketWinHttpTransport::QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed)
+{
+	DWORD dwError = WinHttpWebSocketQueryCloseStatus(_hWebSocket,
+		status,
+		reason,
+		reasonLength,
+		reasonLengthConsumed);
+	return dwError == ERROR_SUCCESS;
+}
+
+void CWebSocketWinHttpTransport::Abort()
+{
+	if (_hWebSocket != nullptr)
+	{
+		WinHttpCloseHandle(_hWebSocket);
+		WaitForSingleObject(_eWebSocketHandleClosed, INFINITE); //Wait for WinHTTP handles to get HANDLE_CLOSING.
+		_hWebSocket = nullptr;
+	}
+	if (_hRequest != nullptr)
+	{
+		WinHttpCloseHandle(_hRequest);
+		WaitForSingleObject(_eRequestHandleClosed, INFINITE);
+		_hRequest = nullptr;
+	}
+	ResetEvent(_eWebSocketHandleClosed);
+	ResetEvent(_eRequestHandleClosed);
+}
+
+// A callback to be called by WinHttp when a pertinent event happens.
+void CALLBACK CWebSocketWinHttpTransport::WinHttpCallback(
+	HINTERNET hInternet,
+	DWORD_PTR dwContext,
+	DWORD     dwInternetStatus,
+	LPVOID    lpvStatusInformation,
+	DWORD     dwStatusInformationLength)
+{
+	CWebSocketWinHttpTransport *transport = (CWebSocketWinHttpTransport *)dwContext;
+	if (transport == nullptr)
+		return;
+
+	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING)
+	{
+		if (hInternet == transport->_hRequest)
+			SetEvent(transport->_eRequestHandleClosed);
+		else if (hInternet == transport->_hWebSocket)
+			SetEvent(transport->_eWebSocketHandleClosed);
+		return;
+	}
+
+	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_NAME_RESOLVED ||
+		dwInternetStatus == WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER ||
+		dwInternetStatus == WINHTTP_CALLBACK_STATUS_SENDING_REQUEST)
+	{
+		const uint64_t elapsedus = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - transport->_requestStartedAt).count();
+		if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_NAME_RESOLVED)
+			transport->_resolvedus = elapsedus;
+		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_CONNECTED_TO_SERVER)
+			transport->_connectedus = elapsedus;
+		else if (transport->_secure && transport->_connectedus != 0 && transport->_securedus == 0) // The TLS handshake is done once the request starts going out over a new connection.
+			transport->_securedus = elapsedus;
+		return;
+	}
+
+	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_CLOSE_COMPLETE)
+		transport->_callback(CWebSocketTransportEvent::CloseComplete, nullptr, nullptr);
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_READ_COMPLETE)
+	{
+		auto status = (WINHTTP_WEB_SOCKET_STATUS *)lpvStatusInformation;
+		transport->_callback(CWebSocketTransportEvent::ReadComplete, status, transport->_receiveBuffer);
+	}
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE)
+		transport->_callback(CWebSocketTransportEvent::WriteComplete, nullptr, nullptr);
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE)
+		transport->_callback(CWebSocketTransportEvent::SendRequestComplete, nullptr, nullptr);
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE)
+		transport->_callback(CWebSocketTransportEvent::HeadersAvailable, nullptr, nullptr);
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR)
+	{
+		auto asyncResult = (WINHTTP_ASYNC_RESULT *)lpvStatusInformation;
+		if (asyncResult->dwError == ERROR_WINHTTP_OPERATION_CANCELLED)
+			transport->_callback(CWebSocketTransportEvent::OperationCancelled, nullptr, nullptr);
+		else if (asyncResult->dwError == ERROR_WINHTTP_CONNECTION_ERROR)
+			transport->_callback(CWebSocketTransportEvent::ConnectionError, nullptr, nullptr);
+		else
+			transport->_callback(CWebSocketTransportEvent::Error, nullptr, nullptr);
+	}
+	else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SECURE_FAILURE)
+		transport->_callback(CWebSocketTransportEvent::Error, nullptr, nullptr);
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifdef _WIN32
+
+#include <atomic>
+#include <chrono>
+
+#include "CWebSocketTransport.h"
+
+#pragma comment (lib, "winhttp.lib")
+#pragma comment (lib, "Shlwapi.lib")
+
+// A transport that wraps the websocket support of WinHttp, available on Windows 8 and above.
+class CWebSocketWinHttpTransport : public CWebSocketTransport
+{
+private:
+	HINTERNET _hSession;
+	HINTERNET _hConnection;
+	HINTERNET _hWebSocket;
+	HINTERNET _hRequest;
+	LPWSTR _serverName;
+	INTERNET_PORT _port;
+	LPWSTR _path;
+	bool _secure;
+	CWebSocketTransportCallback _callback;
+	HANDLE _eRequestHandleClosed;
+	HANDLE _eWebSocketHandleClosed;
+	BYTE *_receiveBuffer; // The buffer passed to the pending call to Receive.
+	std::chrono::steady_clock::time_point _requestStartedAt; // When SendUpgradeRequest was called. See GetConnectTimings.
+	std::atomic<uint64_t> _resolvedus; // Set from the status callback. 0 until the phase has ended.
+	std::atomic<uint64_t> _connectedus;
+	std::atomic<uint64_t> _securedus;
+
+private:
+	HRESULT _CreateSessionConnectionHandles();
+
+	void static CALLBACK WinHttpCallback(
+		HINTERNET hInternet,
+		DWORD_PTR dwContext,
+		DWORD     dwInternetStatus,
+		LPVOID    lpvStatusInformation,
+		DWORD     dwStatusInformationLength);
+
+public:
+	CWebSocketWinHttpTransport();
+	CWebSocketWinHttpTransport(const CWebSocketWinHttpTransport&) = delete;
+	~CWebSocketWinHttpTransport();
+
+	bool Initialize(const WCHAR *serverName, INTERNET_PORT port, const WCHAR *path, bool secure, CWebSocketTransportCallback callback) override;
+	bool SendUpgradeRequest() override;
+	bool GetConnectTimings(CWebSocketConnectTimings *timings) override;
+	bool ReceiveResponse() override;
+	bool CompleteUpgrade() override;
+	bool Receive(BYTE *buffer, DWORD length) override;
+	bool Send(WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, const BYTE *message, size_t length) override;
+	bool Close(USHORT status, const BYTE *reason, size_t reasonLength) override;
+	bool QueryCloseStatus(USHORT *status, BYTE *reason, DWORD reasonLength, DWORD *reasonLengthConsumed) override;
+	void Abort() override;
+};
+
+#endif
@@ -1,94 +1,178 @@
-#include <shlwapi.h>
 #include <utility>
+#include <string>
 
 #include "MutexHelper.h"
 #include "CWebSocket.h"
 #include "CWebSocketEncodingHelpers.h"
 
 CWebSocket::CWebSocket() :
-	_hSession(nullptr),
-	_hConnection(nullptr),
-	_hWebSocket(nullptr),
-	_hRequest(nullptr),
-	_serverName(nullptr),
-	_path(nullptr),
+	_transport(nullptr),
+	_receiveSizer(DefaultReceiveBufferLength),
+	_bufferPool(CWebSocketBufferPool::Default()),
+	_receivingMessage(false),
+	_receivedMessageLength(0),
+	_maxMessageSize(0),
+	_sendsInFlight(0),
+	_urgentsInFlight(0),
+	_sendOffset(0),
+	_sendPending(false),
+	_fragmentLength(0),
+	_bufferedAmount(0),
+	_bufferedMessages(0),
+	_refusedMessages(0),
+	_droppedMessages(0),
+	_sendBufferLimit(0),
+	_sendLimitPolicy(CWebSocketSendLimitPolicy::Fail),
+	_highWatermark(0),
+	_lowWatermark(0),
+	_aboveHighWatermark(false),
 	_initialized(false),
 	_state(CWebSocketState::NoTcpConnection),
 	_mMutex(nullptr),
-	_eDrainWinHttpCallbacks(nullptr),
+	_eDrainTransportCallbacks(nullptr),
 	_eDrainSaqAtCallbacks(nullptr),
-	_eRequestHandleClosed(nullptr),
-	_eWebSocketHandleClosed(nullptr),
-	_reconnectCount(0)
+	_drainTransportCallbacks(false),
+	_drainSaqAtCallbacks(false),
+	_executor(nullptr),
+	_reconnectCount(0),
+	_pingIntervalms(0),
+	_pongTimeoutms(0),
+	_keepAliveGeneration(0),
+	_pongPending(false),
+	_pingSequence(0),
+	_rtt(),
+	_sendStartedus(0),
+	_connectStartedus(0),
+	_connectCalls(0),
+	_connectsResolved(0),
+	_connectGeneration(0),
+	_connectsCompleted(0),
+	_connectOpened(false),
+	_connectWaiter(nullptr),
+	_receiveWaiter(nullptr),
+	_pullMode(false),
+	_messageCallbacks(0),
+	_receiveParked(false),
+	_messageParked(false),
+	_parkedMessageIsUTF8(false),
+	_receiveClosed(false),
+	_resuming(false),
+	_completedSends(nullptr),
+	_lastCompletedSend(nullptr)
 {
 }
 
 CWebSocket::~CWebSocket()
 {
+	if (_executor != nullptr)
+	{
+		// Pinned to a reactor loop. Callbacks check the flag instead of waiting for a mutex.
+		_drainSaqAtCallbacks = true;
+		if (_transport != nullptr)
+			_AbortTransport(); // Also waits for the loop to finish the callback that may be running right now, which may have set the timer.
+		_at.Cancel(); // The timers only queue work, which will be ignored from now on.
+		_kt.Cancel();
+		_saq.WaitTheQueue(); // Nothing can queue works anymore.
+		delete _transport;
+		return;
+	}
+
 	WaitForSingleObject(_mMutex, INFINITE); // If there is an asynchronous callback running right now, wait for it to finish.
 
 	SetEvent(_eDrainSaqAtCallbacks); // Signal pending asynchronous callbacks to return without waiting for the mutex.
 
+	_at.Cancel(); // Cancel the timers. Their callbacks only queue work, so they don't need the mutex.
+	_kt.Cancel();
 	_saq.WaitTheQueue(); // Wait for asynchronous method calls to get drained.
-	_at.Cancel(); // Cancel the timer.
-	_Abort(); // Close WinHttp handles and wait for them to get WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING.
+	if (_transport != nullptr)
+		_AbortTransport(); // Close the connection and wait for the transport to stop reporting events for it.
+	delete _transport;
 
 	CloseHandle(_mMutex);
-	CloseHandle(_eDrainWinHttpCallbacks);
+	CloseHandle(_eDrainTransportCallbacks);
 	CloseHandle(_eDrainSaqAtCallbacks);
-	CloseHandle(_eWebSocketHandleClosed);
-	CloseHandle(_eRequestHandleClosed);
-	CoTaskMemFree(_serverName);
-	CoTaskMemFree(_path);
 }
 
-bool CWebSocket::_WinHttpReceive()
+bool CWebSocket::_Receive()
 {
-	DWORD dwError = WinHttpWebSocketReceive(_hWebSocket,
-		_winHttpBuffer,
-		WinHttpBufferLength,
-		NULL,
-		NULL);
-	if (dwError != ERROR_SUCCESS)
-		return false;
-	else
-		return true;
+	if (_transport->ReceivesInPlace())
+		return _transport->Receive(nullptr, MAXDWORD);
+	const size_t length = _receiveSizer.Length();
+	if (_transportBuffer.size() != length)
+		_transportBuffer = std::vector<BYTE>(length); // Also frees the memory when the buffer shrinks.
+	return _transport->Receive(_transportBuffer.data(), (DWORD)length);
 }
 
 void CWebSocket::CWebSocketOnOpen()
 {
-	if (_WinHttpReceive() == false)
-		CWebSocketOnError();
+	_receiveBuffer.Clear(); // Drop any partial message left over from a previous connection.
+	_receivingMessage = false;
+	_receivedMessageLength = 0;
+	_CompleteSends(_sendBuffer, 0, _sendBuffer.Size(), false); // Likewise for messages that were queued on the previous connection but never sent.
+	_CompleteSends(_urgentBuffer, 0, _urgentBuffer.Size(), false);
+	_ReleaseSent(_sendBuffer, _sendBuffer.Size());
+	_ReleaseSent(_urgentBuffer, _urgentBuffer.Size());
+	_sendsInFlight = 0;
+	_urgentsInFlight = 0;
+	_sendOffset = 0;
+	_sendPending = false;
+	_UTF8Validator.Reset();
+	{
+		std::lock_guard<std::mutex> lock(_rttMutex);
+		_rtt = CWebSocketRoundTripTime();
+	}
+	_ResumeCompletedSends();
+	if (_StartReceiving() == false)
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
 	else
 	{
-		_state = CWebSocketState::WaitingForActivity;
-		_callbackList.onOpen();
+		_SetState(CWebSocketState::WaitingForActivity);
+		CWebSocketOpenDetails details;
+		details.timings = _connectTimings;
+		details.reconnected = _metrics.opens.Get() > 0;
+		_metrics.opens.Add(1);
+		_metrics.RecordConnect(_connectTimings);
+		if (_pingIntervalms != 0)
+			_SetKeepAliveTimer(_pingIntervalms);
+		_UpdateWatermarks(); // Producers waiting for the unsent messages of the previous connection get onDrain.
+		if (_callbackList.onOpenDetails)
+			_callbackList.onOpenDetails(details);
+		else
+			_callbackList.onOpen();
+		_CompleteConnect(true);
 	}
 }
 
-void CWebSocket::CWebSocketOnError()
+void CWebSocket::CWebSocketOnError(CWebSocketErrorCause cause)
 {
 	if (_state != CWebSocketState::Error) // One call to onError callback should be enough.
 	{
-		_state = CWebSocketState::Error;
+		if (cause == CWebSocketErrorCause::Transport &&
+			((_state == CWebSocketState::SendingUpgradeRequest) || (_state == CWebSocketState::ReceivingUpgradeResponse)))
+			cause = CWebSocketErrorCause::Handshake;
+		_metrics.errors[(size_t)cause].Add(1);
+		_SetState(CWebSocketState::Error);
 		_callbackList.onError();
+		_EndAwaiters();
 	}
 }
 
+void CWebSocket::_SetState(CWebSocketState state)
+{
+	_state = state;
+	_metrics.SetState((size_t)state);
+}
+
 bool CWebSocket::_QueryCloseStatus(PWSTR *reason, USHORT *status)
 {
 	bool result = false;
+	CWebSocketBufferPool *pool = _bufferPool.load(std::memory_order_acquire);
 	BYTE* UTF8Reason;
-	UTF8Reason = new(std::nothrow) BYTE[CloseReasonBufferLength];
+	UTF8Reason = pool->Acquire(CloseReasonBufferLength);
 	DWORD reasonLengthConsumed;
 	if (UTF8Reason != nullptr)
 	{
-		DWORD dwError = WinHttpWebSocketQueryCloseStatus(_hWebSocket,
-			status,
-			UTF8Reason,
-			CloseReasonBufferLength,
-			&reasonLengthConsumed);
-		if (dwError == ERROR_SUCCESS)
+		if (_transport->QueryCloseStatus(status, UTF8Reason, CloseReasonBufferLength, &reasonLengthConsumed))
 		{
 			(*reason) = cwebsocketinternal::UTF8ToUnicode(UTF8Reason, reasonLengthConsumed);
 			if ((*reason) != nullptr)
@@ -96,30 +180,30 @@ bool CWebSocket::_QueryCloseStatus(PWSTR *reason, USHORT *status)
 				result = true;
 			}
 		}
-		delete[] UTF8Reason;
+		pool->Release(UTF8Reason, CloseReasonBufferLength);
 	}
 	return result;
 }
 
 void CWebSocket::_Abort()
 {
-	SetEvent(_eDrainWinHttpCallbacks);
+	_StopKeepAlive();
+	_AbortTransport();
+}
 
-	if (_hWebSocket != nullptr)
-	{
-		WinHttpCloseHandle(_hWebSocket);
-		WaitForSingleObject(_eWebSocketHandleClosed, INFINITE); //Wait for WinHTTP handles to get HANDLE_CLOSING.
-		_hWebSocket = nullptr;
-	}
-	if (_hRequest != nullptr)
+// Same as _Abort, but leaves the keepalive state alone. Used by the destructor, which may run on any thread and cancels the timers itself.
+void CWebSocket::_AbortTransport()
+{
+	if (_executor != nullptr)
 	{
-		WinHttpCloseHandle(_hRequest);
-		WaitForSingleObject(_eRequestHandleClosed, INFINITE);
-		_hRequest = nullptr;
+		_drainTransportCallbacks = true;
+		_transport->Abort();
+		_drainTransportCallbacks = false;
+		return;
 	}
-	ResetEvent(_eDrainWinHttpCallbacks);
-	ResetEvent(_eWebSocketHandleClosed);
-	ResetEvent(_eRequestHandleClosed);
+	SetEvent(_eDrainTransportCallbacks);
+	_transport->Abort();
+	ResetEvent(_eDrainTransportCallbacks);
 }
 
 // Called from state SendingCloseFrame1, when CLOSE_COMPLETE callback is received from WinHTTP.
@@ -131,10 +215,10 @@ void CWebSocket::CWebSocketOnClose()
 	if (_QueryCloseStatus(&reason, &usStatus) == true)
 	{
 		const size_t oldReconCnt = _reconnectCount;
-		_state = CWebSocketState::Done;
+		_SetState(CWebSocketState::Done);
 		_callbackList.onClose(usStatus, reason, true);
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 			if (_state == CWebSocketState::Done && _reconnectCount == oldReconCnt) // Make sure the onClose callback didn't call Connect.
 				CWebSocketOnClosed();
@@ -142,13 +226,14 @@ void CWebSocket::CWebSocketOnClose()
 		delete[] reason;
 	}
 	else
-		CWebSocketOnError();
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
 }
 
 void CWebSocket::CWebSocketOnClosed()
 {
-	_state = CWebSocketState::Done;
+	_SetState(CWebSocketState::Done);
 	_callbackList.onClosed();
+	_EndAwaiters();
 }
 
 void CWebSocket::CWebSocketOnSendBufferSent()
@@ -158,20 +243,15 @@ void CWebSocket::CWebSocketOnSendBufferSent()
 	{
 		if (_state == CWebSocketState::SendingSendBuffer1)
 		{
-			_state = CWebSocketState::SendingCloseFrame1;
+			_SetState(CWebSocketState::SendingCloseFrame1);
 		}
 		else if (_state == CWebSocketState::SendingSendBuffer2)
 		{
-			_state = CWebSocketState::SendingCloseFrame2;
+			_SetState(CWebSocketState::SendingCloseFrame2);
 		}
-		const PVOID reason = _UTF8CloseReason.size() == 0 ? nullptr : _UTF8CloseReason.data(); // WinHttpWebSocketClose fails when pvReason != nullptr and dwReasonLength == 0
-		DWORD dwError = WinHttpWebSocketClose(_hWebSocket,
-			_closeStatus,
-			reason,
-			_UTF8CloseReason.size());
-		if (dwError != ERROR_SUCCESS)
+		if (_transport->Close(_closeStatus, _UTF8CloseReason.data(), _UTF8CloseReason.size()) == false)
 		{
-			CWebSocketOnError();
+			CWebSocketOnError(CWebSocketErrorCause::Transport);
 		}
 	}
 }
@@ -183,25 +263,26 @@ void CWebSocket::CWebSocketOnClosing()
 	if (_QueryCloseStatus(&reason, &usStatus) == true)
 	{
 		const size_t oldReconCnt = _reconnectCount;
-		_state = CWebSocketState::ReceivedCloseFrame2;
+		_SetState(CWebSocketState::ReceivedCloseFrame2);
 		_callbackList.onClosing(usStatus, reason, true);
 		delete[] reason;
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 			if (_state == CWebSocketState::ReceivedCloseFrame2 && _reconnectCount == oldReconCnt) // If the onClosing handler didn't call Close, echo back the close status sent by the server.
 				Close(usStatus);
 		});
 	}
 	else
-		CWebSocketOnError();
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
 }
 
 void CWebSocket::CWebSocketOnConnectionReset()
 {
 	const size_t oldReconCnt = _reconnectCount;
 	CWebSocketState oldState = _state;
-	_state = CWebSocketState::Done;
+	_SetState(CWebSocketState::Done);
+	_metrics.connectionResets.Add(1);
 	if ((oldState == CWebSocketState::WaitingForActivity) ||
 		(oldState == CWebSocketState::SendingSendBuffer1) ||
 		(oldState == CWebSocketState::SendingSendBuffer2))
@@ -220,304 +301,674 @@ void CWebSocket::CWebSocketOnConnectionReset()
 		CWebSocketOnError();
 	}*/
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 		if (_state == CWebSocketState::Done && _reconnectCount == oldReconCnt) // Make sure the callback didn't call Connect.
 			CWebSocketOnClosed();
 	});
 }
 
-void CWebSocket::CWebSocketOnMessage(WINHTTP_WEB_SOCKET_STATUS* status)
+void CWebSocket::CWebSocketOnMessage(const WINHTTP_WEB_SOCKET_STATUS* status, const BYTE *data)
 {
-	if (_WinHttpReceive() == false)
+	const bool lastFragment = (status->eBufferType == WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) ||
+		(status->eBufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE);
+	const bool isUTF8 = (status->eBufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ||
+		(status->eBufferType == WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE);
+	if (isUTF8 && (_UTF8Validator.Append(data, status->dwBytesTransferred) == false || (lastFragment && _UTF8Validator.IsComplete() == false)))
 	{
-		CWebSocketOnError();
+		CWebSocketOnError(CWebSocketErrorCause::InvalidUTF8); // Fail as soon as the text turns out to be invalid, instead of buffering the rest of the message first.
 		return;
 	}
-	_receiveBuffer.insert(_receiveBuffer.end(), _winHttpBuffer, _winHttpBuffer + status->dwBytesTransferred);
-	if ((status->eBufferType == WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE) || // If this fragment is the last one
-		(status->eBufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE))
+	if (_transport->ReceivesInPlace() == false)
+		_receiveSizer.OnReceived(status->dwBytesTransferred, lastFragment);
+	const bool firstFragment = (_receivingMessage == false);
+	_receivingMessage = (lastFragment == false);
+	_receivedMessageLength += status->dwBytesTransferred;
+	if (_maxMessageSize != 0 && _receivedMessageLength > _maxMessageSize)
+	{
+		// Stop receiving, so that the rest of the message is never buffered, and close with 1009.
+		_receiveBuffer.Clear();
+		_UTF8Validator.Reset();
+		_receivingMessage = false;
+		_receivedMessageLength = 0;
+		if (_state == CWebSocketState::WaitingForActivity)
+			_StartClosingHandshake(WINHTTP_WEB_SOCKET_MESSAGE_TOO_BIG_CLOSE_STATUS, std::vector<BYTE>());
+		// Otherwise Close was called already, and its closing handshake goes on.
+		return;
+	}
+	if (lastFragment && isUTF8)
+	{
+		_metrics.utf8MessagesReceived.Add(1);
+		_metrics.utf8BytesReceived.Add(_receivedMessageLength);
+	}
+	else if (lastFragment)
+	{
+		_metrics.binaryMessagesReceived.Add(1);
+		_metrics.binaryBytesReceived.Add(_receivedMessageLength);
+	}
+	if (_pullMode.load(std::memory_order_acquire))
+	{
+		// Awaited with Receive. Assemble the message, and hand it to the coroutine before receiving more.
+		const bool inPlace = lastFragment && _receiveBuffer.Size() == 0 && _transport->ReceivesInPlace();
+		if (inPlace == false && _receiveBuffer.Append(_bufferPool.load(std::memory_order_acquire), data, status->dwBytesTransferred) == false)
+		{
+			CWebSocketOnError(CWebSocketErrorCause::OutOfMemory);
+			return;
+		}
+		if (lastFragment == false)
+		{
+			if (_Receive() == false)
+				CWebSocketOnError(CWebSocketErrorCause::Transport);
+			return;
+		}
+		_receivedMessageLength = 0;
+		_UTF8Validator.Reset();
+		if (inPlace)
+			_DeliverMessage(data, status->dwBytesTransferred, isUTF8, true);
+		else
+			_DeliverMessage(_receiveBuffer.Data(), _receiveBuffer.Size(), isUTF8, false);
+		return;
+	}
+	if (_callbackList.onMessageChunk)
+	{
+		// Streamed. Report the data before receiving more, which may overwrite it.
+		if (firstFragment)
+			_callbackList.onMessageBegin(isUTF8);
+		if (status->dwBytesTransferred > 0)
+			_callbackList.onMessageChunk(data, status->dwBytesTransferred);
+		if (lastFragment)
+		{
+			_callbackList.onMessageEnd();
+			_receivedMessageLength = 0;
+			_UTF8Validator.Reset();
+		}
+		if (_Receive() == false)
+			CWebSocketOnError(CWebSocketErrorCause::Transport);
+		return;
+	}
+	const BYTE *message;
+	size_t length;
+	if (lastFragment && _receiveBuffer.Size() == 0 && _transport->ReceivesInPlace())
+	{
+		// The whole message arrived at once, and the transport keeps it intact until we return. Pass it on without copying.
+		message = data;
+		length = status->dwBytesTransferred;
+	}
+	else
+	{
+		// Copy the data before receiving more into the same buffer.
+		if (_receiveBuffer.Append(_bufferPool.load(std::memory_order_acquire), data, status->dwBytesTransferred) == false)
+		{
+			CWebSocketOnError(CWebSocketErrorCause::OutOfMemory);
+			return;
+		}
+		message = _receiveBuffer.Data();
+		length = _receiveBuffer.Size();
+	}
+	if (_Receive() == false)
+	{
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
+		return;
+	}
+	if (lastFragment)
 	{
 		if (status->eBufferType == WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE)
 		{
-			_callbackList.onBinaryMessage(_receiveBuffer.data(), _receiveBuffer.size());
+			_callbackList.onBinaryMessage(message, length);
+		}
+		else if (_callbackList.onUTF8MessageView)
+		{
+			_callbackList.onUTF8MessageView(message, length);
 		}
 		else if (status->eBufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)
 		{
-			PWSTR unicodeString = cwebsocketinternal::UTF8ToUnicode(_receiveBuffer.data(), _receiveBuffer.size());
+			PWSTR unicodeString = cwebsocketinternal::UTF8ToUnicode(message, length);
 			if (unicodeString != nullptr)
 			{
 				_callbackList.onUTF8Message(unicodeString);
 				delete[] unicodeString;
 			}
 			else
-				CWebSocketOnError();
+				CWebSocketOnError(CWebSocketErrorCause::OutOfMemory); // The message has been validated already.
 		}
 		//TODO: Use a secure vector class to handle confidential data, using SecureZeroMemory.
-		_receiveBuffer.clear();
+		_receiveBuffer.Clear();
+		_receivedMessageLength = 0;
+		_UTF8Validator.Reset();
 	}
 }
 
 void CWebSocket::CWebSocketOnWriteComplete()
 {
 	/*
-		assert(_sendBuffer.size() > 0);
+		assert(_sendBuffer.Size() > 0);
 	*/
-	_sendBuffer.pop();
-	if (_sendBuffer.size())
-	{
-		std::pair<std::vector<BYTE>, WINHTTP_WEB_SOCKET_BUFFER_TYPE> message = _sendBuffer.front(); //TODO: As an optimization, we can use move semantics here.
-		DWORD dwError = WinHttpWebSocketSend(_hWebSocket,
-			message.second,
-			(PVOID)message.first.data(),
-			message.first.size());
-		if (dwError != ERROR_SUCCESS)
-			CWebSocketOnError();
+	_metrics.writeLatency.Record(cwebsocketinternal::CWebSocketMetrics::Nowus() - _sendStartedus);
+	_CountSent(_sendBuffer, _sendsInFlight);
+	_CountSent(_urgentBuffer, _urgentsInFlight);
+	_CompleteSends(_sendBuffer, 0, _sendsInFlight, true);
+	_CompleteSends(_urgentBuffer, 0, _urgentsInFlight, true);
+	_ReleaseSent(_sendBuffer, _sendsInFlight);
+	_ReleaseSent(_urgentBuffer, _urgentsInFlight);
+	_sendsInFlight = 0;
+	_urgentsInFlight = 0;
+	_sendPending = false;
+	if (_sendBuffer.Size() > 0 || _urgentBuffer.Size() > 0)
+	{
+		if (_SendQueued() == false)
+		{
+			CWebSocketOnError(CWebSocketErrorCause::Transport);
+			return;
+		}
 	}
 	else
 	{
 		CWebSocketOnSendBufferSent();
 	}
+	_UpdateWatermarks();
+	_ResumeCompletedSends();
 }
 
-void CWebSocket::CWebSocketOnSendRequestComplete()
+// Sets the keepalive timer. When it fires, CWebSocketOnKeepAliveTimer is called, unless the timer has been set again or stopped in the meantime.
+void CWebSocket::_SetKeepAliveTimer(DWORD delayms)
 {
-	_state = CWebSocketState::ReceivingUpgradeResponse; //WinHttpReceiveResponse can operate synchronously.
-	BOOL fStatus = WinHttpReceiveResponse(_hRequest, 0);
-	if (fStatus == FALSE)
-		CWebSocketOnError();
+	const size_t generation = ++_keepAliveGeneration;
+	_kt.Set(delayms, [=]() {
+		assert(_executor == nullptr || _executor->IsExecutorThread()); // A pinned websocket's timers fire on its loop.
+		_saq.QueueAsyncWork([=]() {
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+			if (_keepAliveGeneration == generation)
+				CWebSocketOnKeepAliveTimer();
+		});
+	});
 }
 
-void CWebSocket::CWebSocketOnReceiveResponseComplete()
+void CWebSocket::_StopKeepAlive()
 {
-	_hWebSocket = WinHttpWebSocketCompleteUpgrade(_hRequest, (DWORD_PTR)this);
-	if (_hWebSocket != NULL)
-		CWebSocketOnOpen();
-	else
-		CWebSocketOnError();
+	_keepAliveGeneration++;
+	_pongPending = false;
+	_kt.Cancel();
 }
 
-HRESULT CWebSocket::_CreateSessionConnectionHandles()
+void CWebSocket::CWebSocketOnKeepAliveTimer()
 {
-	_hSession = WinHttpOpen(L"CWebSocket",
-		WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
-		NULL,
-		NULL,
-		WINHTTP_FLAG_ASYNC);
-	if (_hSession != NULL)
+	if (_state != CWebSocketState::WaitingForActivity) // Pings stop with the closing handshake, which has its own way of noticing a dead connection.
+		return;
+	if (_pongPending)
 	{
-		_hConnection = WinHttpConnect(_hSession,
-			_serverName,
-			_port,
-			0);
-		if (_hConnection != NULL)
-			return S_OK;
+		// The pong is late. The connection is probably dead, without the TCP stack having noticed yet.
+		_Abort();
+		CWebSocketOnConnectionReset();
+		return;
 	}
-	return E_FAIL;
+	_pingSequence++;
+	const BYTE payload[4] = { (BYTE)(_pingSequence >> 24), (BYTE)(_pingSequence >> 16), (BYTE)(_pingSequence >> 8), (BYTE)_pingSequence };
+	_pingSentAt = std::chrono::steady_clock::now(); // The transport may write the ping right away.
+	if (_transport->Ping(payload, sizeof(payload)) == false)
+		return; // The transport can't send pings.
+	_metrics.pingsSent.Add(1);
+	_pongPending = true;
+	_SetKeepAliveTimer(_pongTimeoutms);
 }
 
-bool CWebSocket::_SendUpgradeRequest()
+void CWebSocket::CWebSocketOnPong(const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data)
 {
-	_hRequest = WinHttpOpenRequest(_hConnection,
-		L"GET",
-		_path,
-		NULL,
-		NULL,
-		NULL,
-		_secure ? WINHTTP_FLAG_SECURE : 0);
-	if (_hRequest != NULL)
-	{
-		if (WINHTTP_INVALID_STATUS_CALLBACK != WinHttpSetStatusCallback(_hRequest, CWebSocketCallback, WINHTTP_CALLBACK_FLAG_ALL_NOTIFICATIONS, NULL)) // This callback will be inherited by _hWebSocket, as per the documentation of WinHttpSetStatusCallback.
-		{
-			BOOL fStatus = WinHttpSetOption(_hRequest,
-				WINHTTP_OPTION_UPGRADE_TO_WEB_SOCKET,
-				NULL,
-				0);
-			if (fStatus)
-			{
-				_state = CWebSocketState::SendingUpgradeRequest; //WinHttpSendRequest can operate synchronously.
-				BOOL fStatus = WinHttpSendRequest(_hRequest,
-					WINHTTP_NO_ADDITIONAL_HEADERS,
-					0,
-					NULL,
-					0,
-					0,
-					(DWORD_PTR)this);
-				if (fStatus)
-				{
-					return true;
-				}
-			}
+	_metrics.pongsReceived.Add(1);
+	if (_pongPending == false || status->dwBytesTransferred != 4)
+		return; // Unsolicited pongs are allowed, and ignored.
+	const uint32_t sequence = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+	if (sequence != _pingSequence)
+		return;
+	_pongPending = false;
+	const std::chrono::duration<double, std::milli> rtt = std::chrono::steady_clock::now() - _pingSentAt;
+	{
+		std::lock_guard<std::mutex> lock(_rttMutex);
+		_rtt.lastms = rtt.count();
+		if (_rtt.sampleCount == 0)
+		{
+			_rtt.smoothedms = rtt.count();
+			_rtt.minms = rtt.count();
 		}
+		else
+		{
+			_rtt.smoothedms += (rtt.count() - _rtt.smoothedms) / 8;
+			if (rtt.count() < _rtt.minms)
+				_rtt.minms = rtt.count();
+		}
+		_rtt.sampleCount++;
+	}
+	if (_state == CWebSocketState::WaitingForActivity && _pingIntervalms != 0)
+	{
+		const DWORD elapsedms = (DWORD)rtt.count();
+		_SetKeepAliveTimer(elapsedms < _pingIntervalms ? _pingIntervalms - elapsedms : 0); // Keep the pings pingIntervalms apart.
 	}
-	return false;
 }
 
-// A callback to be called by WinHttp when a pertinent event happens.
-void CALLBACK CWebSocket::CWebSocketCallback(
-	HINTERNET hInternet,
-	DWORD_PTR dwContext,
-	DWORD     dwInternetStatus,
-	LPVOID    lpvStatusInformation,
-	DWORD     dwStatusInformationLength)
+void CWebSocket::CWebSocketOnSendRequestComplete()
 {
-	CWebSocket *cws = (CWebSocket *)dwContext;
-	if (cws == nullptr)
-		return;
+	_connectTimings.requestSentus = cwebsocketinternal::CWebSocketMetrics::Nowus() - _connectStartedus;
+	_SetState(CWebSocketState::ReceivingUpgradeResponse); //ReceiveResponse can operate synchronously.
+	if (_transport->ReceiveResponse() == false)
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
+}
 
-	if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING)
+void CWebSocket::CWebSocketOnReceiveResponseComplete()
+{
+	if (_transport->CompleteUpgrade())
 	{
-		if (hInternet == cws->_hRequest)
-			SetEvent(cws->_eRequestHandleClosed);
-		else if (hInternet == cws->_hWebSocket)
-			SetEvent(cws->_eWebSocketHandleClosed);
-		return;
+		_connectTimings.openedus = cwebsocketinternal::CWebSocketMetrics::Nowus() - _connectStartedus;
+		_transport->GetConnectTimings(&_connectTimings);
+		CWebSocketOnOpen();
 	}
+	else
+		CWebSocketOnError(CWebSocketErrorCause::Handshake);
+}
+
+bool CWebSocket::_SendUpgradeRequest()
+{
+	_SetState(CWebSocketState::SendingUpgradeRequest); //SendUpgradeRequest can operate synchronously.
+	_connectStartedus = cwebsocketinternal::CWebSocketMetrics::Nowus();
+	_connectTimings = CWebSocketConnectTimings();
+	_transport->SetCompression(_compression); // If the transport doesn't support compression, connect without it, just like when the server declines it.
+	return _transport->SendUpgradeRequest();
+}
 
-	WAIT_FOR_MUTEX_OR_EVENT(cws->_mMutex, cws->_eDrainWinHttpCallbacks);
-	
-	if (cws->_state != CWebSocketState::Error)
+// A callback to be called by the transport when a pertinent event happens.
+void CWebSocket::CWebSocketOnTransportEvent(CWebSocketTransportEvent event, const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data)
+{
+	const uint64_t reportedus = cwebsocketinternal::CWebSocketMetrics::Nowus(); // Before waiting for the mutex, which is part of the dispatch latency.
+	WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainTransportCallbacks, _drainTransportCallbacks);
+
+
+	if (_state != CWebSocketState::Error)
 	{
-		if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_CLOSE_COMPLETE)
+		if (event == CWebSocketTransportEvent::CloseComplete)
 		{
-			if (cws->_state == CWebSocketState::SendingCloseFrame1)
-				cws->CWebSocketOnClose();
-			else if (cws->_state == CWebSocketState::SendingCloseFrame2)
-				cws->CWebSocketOnClosed();
+			if (_state == CWebSocketState::SendingCloseFrame1)
+				CWebSocketOnClose();
+			else if (_state == CWebSocketState::SendingCloseFrame2)
+				CWebSocketOnClosed();
 			/*
 			else
-			cws->CWebSocketOnError();
+			CWebSocketOnError();
 			*/
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_READ_COMPLETE)
+		else if (event == CWebSocketTransportEvent::ReadComplete)
 		{
-			WINHTTP_WEB_SOCKET_STATUS* statusInfo = (WINHTTP_WEB_SOCKET_STATUS *)lpvStatusInformation;
-			if (statusInfo->eBufferType == WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE)
-				cws->CWebSocketOnClosing();
+			if (status->eBufferType == WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE)
+				CWebSocketOnClosing();
 			else
-				cws->CWebSocketOnMessage(statusInfo);
+				CWebSocketOnMessage(status, data);
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_WRITE_COMPLETE)
+		else if (event == CWebSocketTransportEvent::WriteComplete)
 		{
-			cws->CWebSocketOnWriteComplete();
+			CWebSocketOnWriteComplete();
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE)
+		else if (event == CWebSocketTransportEvent::SendRequestComplete)
 		{
-			cws->CWebSocketOnSendRequestComplete();
+			CWebSocketOnSendRequestComplete();
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE)
+		else if (event == CWebSocketTransportEvent::HeadersAvailable)
 		{
-			cws->CWebSocketOnReceiveResponseComplete();
+			CWebSocketOnReceiveResponseComplete();
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_REQUEST_ERROR)
+		else if (event == CWebSocketTransportEvent::PongReceived)
 		{
-			auto asyncResult = (WINHTTP_ASYNC_RESULT *)lpvStatusInformation;
-			if (asyncResult->dwError == ERROR_WINHTTP_OPERATION_CANCELLED)
-			{
-				; // Do nothing. WinHttp notifies us that our last receive call failed because WinHttpWebSocketClose is called on the websocket.
-			}
-			else if (asyncResult->dwError == ERROR_WINHTTP_CONNECTION_ERROR)
-				cws->CWebSocketOnConnectionReset();
-			else
-			{
-				cws->CWebSocketOnError();
-			}
+			CWebSocketOnPong(status, data);
+		}
+		else if (event == CWebSocketTransportEvent::OperationCancelled)
+		{
+			; // Do nothing. The transport notifies us that our last receive call failed because Close is called on the websocket.
 		}
-		else if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SECURE_FAILURE)
-			cws->CWebSocketOnError();
+		else if (event == CWebSocketTransportEvent::ConnectionError)
+			CWebSocketOnConnectionReset();
+		else
+			CWebSocketOnError(CWebSocketErrorCause::Transport);
 	}
+	_metrics.dispatchLatency.Record(cwebsocketinternal::CWebSocketMetrics::Nowus() - reportedus);
 }
 
 bool CWebSocket::Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool __secure)
+{
+	return Initialize(__serverName, __port, __path, __secure, CreateDefaultCWebSocketTransport());
+}
+
+bool CWebSocket::Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool __secure, CWebSocketTransport *transport)
 {
 	if (_initialized)
+	{
+		delete transport;
 		return false;
+	}
 	_initialized = true;
 
-	HRESULT hr = E_FAIL;
+	bool result = false;
 
-	_secure = __secure;
-	_port = __port;
-	if (_saq.Initialize())
+	_transport = transport;
+	if (_transport != nullptr && _saq.Initialize())
 		_mMutex = CreateMutex(NULL, FALSE, NULL);
 	if (_mMutex != nullptr)
-		_eDrainWinHttpCallbacks = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (_eDrainWinHttpCallbacks != nullptr)
+		_eDrainTransportCallbacks = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (_eDrainTransportCallbacks != nullptr)
 		_eDrainSaqAtCallbacks = CreateEvent(NULL, TRUE, FALSE, NULL);
 	if (_eDrainSaqAtCallbacks != nullptr)
-		_eWebSocketHandleClosed = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (_eWebSocketHandleClosed != nullptr)
-		_eRequestHandleClosed = CreateEvent(NULL, TRUE, FALSE, NULL);
-	if (_eRequestHandleClosed != nullptr)
-		hr = SHStrDupW(__serverName, &_serverName);
-	if (SUCCEEDED(hr))
-		hr = SHStrDupW(__path, &_path);
-	if (SUCCEEDED(hr))
-		hr = _CreateSessionConnectionHandles();
-	return(SUCCEEDED(hr));
-}
-void CWebSocket::_ClientSendBinaryOrUTF8(const BYTE *message, size_t length, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType)
+		result = _InitializeTransport(__serverName, __port, __path, __secure);
+	return result;
+}
+
+bool CWebSocket::Initialize(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool __secure, CWebSocketReactor *reactor)
+{
+	if (_initialized)
+		return false;
+	_initialized = true;
+
+	SeqAsyncExecutor *executor;
+	AsyncTimerQueue *timerQueue;
+	if (reactor == nullptr || reactor->_Attach(&_transport, &executor, &timerQueue) == false)
+		return false;
+	if (_saq.Initialize(executor) == false)
+		return false;
+	_executor = executor; // From now on, _mMutex and the events stay nullptr.
+	_at.Attach(timerQueue);
+	_kt.Attach(timerQueue);
+	return _InitializeTransport(__serverName, __port, __path, __secure);
+}
+
+// Initializes the websocket for the server end of a connection accepted by CWebSocketServer on the loopIndex-th loop of reactor. Connect then performs the
+// server side of the opening handshake. Takes ownership of acceptedFd, even if this function fails.
+bool CWebSocket::_InitializeAccepted(CWebSocketReactor *reactor, size_t loopIndex, int acceptedFd, const WCHAR *path)
+{
+	_initialized = true;
+
+	SeqAsyncExecutor *executor;
+	AsyncTimerQueue *timerQueue;
+	if (reactor->_AttachAccepted(loopIndex, acceptedFd, &_transport, &executor, &timerQueue) == false)
+		return false;
+	if (_saq.Initialize(executor) == false)
+		return false;
+	_executor = executor;
+	_at.Attach(timerQueue);
+	_kt.Attach(timerQueue);
+	return _InitializeTransport(L"", 0, path, false);
+}
+
+bool CWebSocket::_InitializeTransport(const WCHAR *__serverName, INTERNET_PORT __port, const WCHAR *__path, bool __secure)
+{
+	_transport->SetBufferPool(_bufferPool.load(std::memory_order_acquire));
+	return _transport->Initialize(__serverName, __port, __path, __secure, [this](CWebSocketTransportEvent event, const WINHTTP_WEB_SOCKET_STATUS *status, const BYTE *data) {
+		CWebSocketOnTransportEvent(event, status, data);
+	});
+}
+void CWebSocket::_ClientSendBinaryOrUTF8(const QueuedMessage &message, CWebSocketSendPriority priority)
 {
 	if ((_state != CWebSocketState::WaitingForActivity) &&
 		(_state != CWebSocketState::ReceivedCloseFrame2))
 	{
-		CWebSocketOnError();
+		_ReleaseSendBuffer(1, message.payload.Length());
+		if (message.waiter != nullptr)
+			_CompleteSend(message.waiter, false);
+		CWebSocketOnError(CWebSocketErrorCause::InvalidOperation);
+		_ResumeCompletedSends(); // In case the websocket had failed already, and onError wasn't called again.
 		return;
 	}
-	_sendBuffer.push(std::make_pair(std::vector<BYTE>(message, message + length), bufferType));
-	if (_sendBuffer.size() == 1)
+	SendQueue &queue = (priority == CWebSocketSendPriority::Urgent) ? _urgentBuffer : _sendBuffer;
+	queue.PushBack(QueuedMessage(message)); // Only a reference is copied.
+	_metrics.sendBufferHighWatermarkBytes.Max(_bufferedAmount.load(std::memory_order_relaxed));
+	_metrics.sendBufferHighWatermarkMessages.Max(_bufferedMessages.load(std::memory_order_relaxed));
+	if (_sendPending == false)
 	{
-		DWORD dwError = WinHttpWebSocketSend(_hWebSocket,
-			bufferType,
-			(PVOID)message,
-			length);
-		if (dwError != ERROR_SUCCESS)
-			CWebSocketOnError();
+		if (_SendQueued() == false)
+		{
+			CWebSocketOnError(CWebSocketErrorCause::Transport);
+			return;
+		}
+	}
+	_DropOldestQueued();
+	_UpdateWatermarks();
+	_ResumeCompletedSends();
+}
+// Counts a message of the given length into the send buffer, unless the send buffer is full and the policy says to refuse it. Called on the caller's thread.
+bool CWebSocket::_ReserveSendBuffer(size_t length)
+{
+	const size_t limit = _sendBufferLimit.load(std::memory_order_relaxed);
+	if (limit == 0 || _sendLimitPolicy.load(std::memory_order_relaxed) == CWebSocketSendLimitPolicy::DropOldest)
+		_bufferedAmount.fetch_add(length, std::memory_order_relaxed); // The send buffer makes room when the message gets queued, see _DropOldestQueued.
+	else
+	{
+		size_t buffered = _bufferedAmount.load(std::memory_order_relaxed);
+		do
+		{
+			if (length > limit || buffered > limit - length)
+			{
+				_refusedMessages.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		} while (_bufferedAmount.compare_exchange_weak(buffered, buffered + length, std::memory_order_relaxed) == false);
+	}
+	_bufferedMessages.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+// Removes the first count messages of queue, which have been sent or dropped, and takes them out of the count of the send buffer.
+void CWebSocket::_ReleaseSent(SendQueue &queue, size_t count)
+{
+	size_t length = 0;
+	for (size_t i = 0; i < count; i++)
+		length += queue[i].payload.Length();
+	_ReleaseSendBuffer(count, length);
+	queue.PopFront(count);
+}
+// Counts the first count messages of queue, which have been sent, into the metrics.
+void CWebSocket::_CountSent(const SendQueue &queue, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (queue[i].bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE)
+		{
+			_metrics.utf8MessagesSent.Add(1);
+			_metrics.utf8BytesSent.Add(queue[i].payload.Length());
+		}
+		else
+		{
+			_metrics.binaryMessagesSent.Add(1);
+			_metrics.binaryBytesSent.Add(queue[i].payload.Length());
+		}
+	}
+}
+// Takes messages that have been sent or dropped out of the count of the send buffer.
+void CWebSocket::_ReleaseSendBuffer(size_t messageCount, size_t length)
+{
+	_bufferedAmount.fetch_sub(length, std::memory_order_relaxed);
+	_bufferedMessages.fetch_sub(messageCount, std::memory_order_relaxed);
+}
+// With the DropOldest policy, drops the oldest messages that haven't been handed to the transport until the send buffer is within its limit.
+// Messages that are still on their way to the send queue count toward the limit, so they get room made for them in advance.
+void CWebSocket::_DropOldestQueued()
+{
+	const size_t limit = _sendBufferLimit.load(std::memory_order_relaxed);
+	if (limit == 0 || _sendLimitPolicy.load(std::memory_order_relaxed) != CWebSocketSendLimitPolicy::DropOldest)
+		return;
+	// Normal messages go first. The messages in flight, and a message that has been partly sent as fragments, stay at the front of their queues.
+	_DropQueued(_sendBuffer, _sendsInFlight + ((_sendOffset > 0) ? 1 : 0), _bufferedAmount.load(std::memory_order_relaxed), limit);
+	_DropQueued(_urgentBuffer, _urgentsInFlight, _bufferedAmount.load(std::memory_order_relaxed), limit);
+}
+// Drops the messages of queue from the first-th on, oldest first, until the send buffer holds no more than limit bytes.
+void CWebSocket::_DropQueued(SendQueue &queue, size_t first, size_t buffered, size_t limit)
+{
+	size_t dropCount = 0;
+	size_t dropLength = 0;
+	while (first + dropCount < queue.Size() && buffered - dropLength > limit)
+	{
+		dropLength += queue[first + dropCount].payload.Length();
+		dropCount++;
+	}
+	if (dropCount == 0)
+		return;
+	_CompleteSends(queue, first, dropCount, false);
+	queue.Erase(first, dropCount);
+	_ReleaseSendBuffer(dropCount, dropLength);
+	_droppedMessages.fetch_add(dropCount, std::memory_order_relaxed);
+}
+// Calls onHighWatermark or onDrain if the send buffer has crossed a watermark since the last call.
+void CWebSocket::_UpdateWatermarks()
+{
+	if (_state == CWebSocketState::Error) // No callbacks follow onError.
+		return;
+	const size_t buffered = _bufferedAmount.load(std::memory_order_relaxed);
+	if (_aboveHighWatermark == false)
+	{
+		if (_highWatermark != 0 && buffered >= _highWatermark)
+		{
+			_aboveHighWatermark = true;
+			_callbackList.onHighWatermark(buffered);
+		}
 	}
+	else if (buffered <= _lowWatermark)
+	{
+		_aboveHighWatermark = false;
+		_callbackList.onDrain();
+	}
+}
+// Hands the transport the messages at the front of the send queues: as many as fit into SendBatchBudget if the transport sends in batches, otherwise just one.
+// Messages queued while a batch is being sent go out together in the next one, so bursts of small messages take few writes.
+// Urgent messages go first, unless a normal message has been partly sent as fragments, since no other message may come between its fragments.
+// A normal message longer than _fragmentLength goes out a fragment per batch, and ends the batch.
+bool CWebSocket::_SendQueued()
+{
+	const size_t maxPieces = _transport->SendsInBatches() ? SIZE_MAX : 1;
+	_sendBatch.clear();
+	size_t length = 0;
+	if (_sendOffset == 0)
+	{
+		for (; _urgentsInFlight < _urgentBuffer.Size() && _sendBatch.size() < maxPieces; _urgentsInFlight++)
+		{
+			const CWebSocketTransportMessage message = _TransportMessage(_urgentBuffer[_urgentsInFlight]);
+			if (_sendBatch.size() > 0 && length + message.length > SendBatchBudget)
+				break;
+			_sendBatch.push_back(message);
+			length += message.length;
+		}
+	}
+	size_t nextSendOffset = 0;
+	while (_sendsInFlight < _sendBuffer.Size() && _sendBatch.size() < maxPieces)
+	{
+		const size_t offset = (_sendsInFlight == 0) ? _sendOffset : 0;
+		CWebSocketTransportMessage message = _TransportMessage(_sendBuffer[_sendsInFlight]);
+		message.message += offset;
+		message.length -= offset;
+		const bool fragment = _fragmentLength != 0 && message.length > _fragmentLength;
+		if (fragment || offset > 0) // The frame of a prepared message only fits the message as a whole.
+		{
+			message.frame = CWebSocketSharedBuffer();
+		}
+		if (fragment)
+		{
+			if (offset == 0 && _sendBatch.size() > 0) // Start the message with a batch of its own, so that urgent messages queued in the meantime can still overtake it.
+				break;
+			message.bufferType = (message.bufferType == WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE) ? WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE : WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE;
+			message.length = _fragmentLength;
+		}
+		if (_sendBatch.size() > 0 && length + message.length > SendBatchBudget)
+			break;
+		_sendBatch.push_back(message);
+		length += message.length;
+		if (fragment)
+		{
+			nextSendOffset = offset + message.length;
+			break;
+		}
+		_sendsInFlight++;
+	}
+	_sendOffset = nextSendOffset;
+	_sendPending = true;
+	_sendStartedus = cwebsocketinternal::CWebSocketMetrics::Nowus();
+	if (maxPieces == 1)
+	{
+		// Keeps a reference to the bytes, in case the send completes synchronously and pops the queue.
+		const CWebSocketSharedBuffer sending = (_urgentsInFlight > 0) ? _urgentBuffer.Front().payload : _sendBuffer.Front().payload;
+		return _transport->Send(_sendBatch[0].bufferType, _sendBatch[0].message, _sendBatch[0].length);
+	}
+	return _transport->SendBatch(_sendBatch.data(), _sendBatch.size());
+}
+// Describes a queued message to the transport, along with its frame if it is prepared.
+CWebSocketTransportMessage CWebSocket::_TransportMessage(const QueuedMessage &queued)
+{
+	CWebSocketTransportMessage message = { queued.bufferType, queued.payload.Data(), queued.payload.Length(), CWebSocketSharedBuffer() };
+	if (queued.headerLength > 0)
+		message.frame = CWebSocketSharedBuffer(queued.payload, queued.payload.Data() - queued.headerLength, queued.headerLength + queued.payload.Length());
+	return message;
 }
-void CWebSocket::SendBinary(const BYTE *message, size_t length)
+// Queues the sending of message. The work holds a reference to message rather than a copy of its bytes.
+bool CWebSocket::_QueueSend(const QueuedMessage &message, CWebSocketSendPriority priority)
 {
-	std::vector<BYTE> msgc(message, message + length);
+	if (_ReserveSendBuffer(message.payload.Length()) == false)
+		return false;
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
-		_ClientSendBinaryOrUTF8(msgc.data(), length, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE);
+		_ClientSendBinaryOrUTF8(message, priority);
 	});
+	return true;
 }
-void CWebSocket::SendWString(const WCHAR *message)
+bool CWebSocket::_QueueSendCopy(const BYTE *message, size_t length, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, CWebSocketSendPriority priority)
 {
-	std::vector<BYTE> UTF8Message;
-	if (cwebsocketinternal::UnicodeToUTF8(message, UTF8Message))
+	if (_ReserveSendBuffer(length) == false) // Refuse before copying.
+		return false;
+	const CWebSocketSharedBuffer copy = _bufferPool.load(std::memory_order_acquire)->Copy(message, length); // The only copy.
+	if (copy.Data() != nullptr)
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
-			_ClientSendBinaryOrUTF8(UTF8Message.data(), UTF8Message.size(), WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE);
+			_ClientSendBinaryOrUTF8({ copy, bufferType, 0, nullptr }, priority);
 		});
 	else
+	{
+		_ReleaseSendBuffer(1, length);
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
-			CWebSocketOnError();
+			CWebSocketOnError(CWebSocketErrorCause::OutOfMemory);
 		});
+	}
+	return copy.Data() != nullptr;
 }
-void CWebSocket::SendUTF8String(const BYTE *message, size_t length)
+bool CWebSocket::SendBinary(const BYTE *message, size_t length, CWebSocketSendPriority priority)
 {
-	std::vector<BYTE> msgc(message, message+length);
-	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
-		
-		_ClientSendBinaryOrUTF8(msgc.data(), length, WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE);
-	});
+	return _QueueSendCopy(message, length, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, priority);
+}
+bool CWebSocket::SendBinary(std::vector<BYTE> &&message, CWebSocketSendPriority priority)
+{
+	return _QueueSend({ CWebSocketSharedBuffer(std::move(message)), WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, 0, nullptr }, priority);
+}
+bool CWebSocket::SendBinary(const CWebSocketSharedBuffer &message, CWebSocketSendPriority priority)
+{
+	return _QueueSend({ message, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, 0, nullptr }, priority);
 }
-void CWebSocket::SendWStringAsBinary(const WCHAR *message)
+bool CWebSocket::SendWString(const WCHAR *message, CWebSocketSendPriority priority)
 {
-	std::wstring msgc(message);
+	std::vector<BYTE> UTF8Message;
+	if (cwebsocketinternal::UnicodeToUTF8(message, UTF8Message))
+		return _QueueSend({ CWebSocketSharedBuffer(std::move(UTF8Message)), WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, 0, nullptr }, priority);
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
-		const size_t length = msgc.length() * sizeof(WCHAR);
-		_ClientSendBinaryOrUTF8((const BYTE*)msgc.c_str(), length, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE);
+		CWebSocketOnError(CWebSocketErrorCause::InvalidUTF8);
 	});
+	return false;
+}
+bool CWebSocket::SendUTF8String(const BYTE *message, size_t length, CWebSocketSendPriority priority)
+{
+	return _QueueSendCopy(message, length, WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, priority);
+}
+bool CWebSocket::SendWStringAsBinary(const WCHAR *message, CWebSocketSendPriority priority)
+{
+	const BYTE *bytes = (const BYTE*)message;
+	return _QueueSendCopy(bytes, wcslen(message) * sizeof(WCHAR), WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, priority);
+}
+bool CWebSocket::SendPrepared(const CWebSocketPreparedMessage &message, CWebSocketSendPriority priority)
+{
+	if (message.IsEmpty())
+		return false;
+	return _QueueSend({ message.Payload(), message.BufferType(), message.HeaderLength(), nullptr }, priority);
 }
 
 void CWebSocket::Close(USHORT usStatus, const WCHAR *reason)
@@ -525,46 +976,60 @@ void CWebSocket::Close(USHORT usStatus, const WCHAR *reason)
 	std::vector<BYTE> UTF8Reason;
 	if (cwebsocketinternal::UnicodeToUTF8(reason, UTF8Reason) == false)
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
-			CWebSocketOnError();
+			CWebSocketOnError(CWebSocketErrorCause::InvalidUTF8);
 		});
 	else
 		_saq.QueueAsyncWork([=]() {
-			WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+			WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 			if ((_state != CWebSocketState::WaitingForActivity) &&
 				(_state != CWebSocketState::ReceivedCloseFrame2))
-				CWebSocketOnError();
+				CWebSocketOnError(CWebSocketErrorCause::InvalidOperation);
 			else
-			{
-				if (_state == CWebSocketState::ReceivedCloseFrame2)
-					_state = CWebSocketState::SendingSendBuffer2; // Closing handshake is initiated by the server.
-				else // _state == CWebSocketState::WaitingForActivity
-					_state = CWebSocketState::SendingSendBuffer1; // Closing handshake is initiated by us.
-				_closeStatus = usStatus;
-				_UTF8CloseReason = UTF8Reason;
-				if (_sendBuffer.size() == 0)
-				{
-					CWebSocketOnSendBufferSent();
-				}
-			}
+				_StartClosingHandshake(usStatus, UTF8Reason);
 		});
 }
 
+void CWebSocket::_StartClosingHandshake(USHORT usStatus, const std::vector<BYTE> &UTF8Reason)
+{
+	if (_state == CWebSocketState::ReceivedCloseFrame2)
+		_SetState(CWebSocketState::SendingSendBuffer2); // Closing handshake is initiated by the server.
+	else // _state == CWebSocketState::WaitingForActivity
+		_SetState(CWebSocketState::SendingSendBuffer1); // Closing handshake is initiated by us.
+	_closeStatus = usStatus;
+	_UTF8CloseReason = UTF8Reason;
+	if (_sendBuffer.Size() == 0 && _urgentBuffer.Size() == 0)
+	{
+		CWebSocketOnSendBufferSent();
+	}
+}
+
 CWebSocket& CWebSocket::onOpen(CWebSocketOnOpenCallback cb)
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onOpen = cb;
 	});
 	return *this;
 }
 
+CWebSocket& CWebSocket::onOpenDetails(CWebSocketOnOpenDetailsCallback cb)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onOpenDetails = cb;
+	});
+	return *this;
+}
+
 CWebSocket& CWebSocket::onBinaryMessage(CWebSocketOnBinaryMessageCallback cb)
 {
+	if (_SetMessageCallback(BinaryMessageCallback, cb != nullptr) == false)
+		return *this;
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onBinaryMessage = cb;
 	});
 	return *this;
@@ -572,17 +1037,63 @@ CWebSocket& CWebSocket::onBinaryMessage(CWebSocketOnBinaryMessageCallback cb)
 
 CWebSocket& CWebSocket::onUTF8Message(CWebSocketOnUTF8MessageCallback cb)
 {
+	if (_SetMessageCallback(UTF8MessageCallback, cb != nullptr) == false)
+		return *this;
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onUTF8Message = cb;
 	});
 	return *this;
 }
 
+CWebSocket& CWebSocket::onUTF8MessageView(CWebSocketOnUTF8MessageViewCallback cb)
+{
+	if (_SetMessageCallback(UTF8MessageViewCallback, cb != nullptr) == false)
+		return *this;
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onUTF8MessageView = cb;
+	});
+	return *this;
+}
+
+CWebSocket& CWebSocket::onMessageBegin(CWebSocketOnMessageBeginCallback cb)
+{
+	if (_SetMessageCallback(MessageBeginCallback, cb != nullptr) == false)
+		return *this;
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onMessageBegin = cb;
+	});
+	return *this;
+}
+
+CWebSocket& CWebSocket::onMessageChunk(CWebSocketOnMessageChunkCallback cb)
+{
+	if (_SetMessageCallback(MessageChunkCallback, cb != nullptr) == false)
+		return *this;
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onMessageChunk = cb;
+	});
+	return *this;
+}
+
+CWebSocket& CWebSocket::onMessageEnd(CWebSocketOnMessageEndCallback cb)
+{
+	if (_SetMessageCallback(MessageEndCallback, cb != nullptr) == false)
+		return *this;
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onMessageEnd = cb;
+	});
+	return *this;
+}
+
 CWebSocket& CWebSocket::onClose(CWebSocketOnCloseCallback cb)
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onClose = cb;
 	});
 	return *this;
@@ -591,7 +1102,7 @@ CWebSocket& CWebSocket::onClose(CWebSocketOnCloseCallback cb)
 CWebSocket& CWebSocket::onClosing(CWebSocketOnClosingCallback cb)
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onClosing = cb;
 	});
 	return *this;
@@ -600,7 +1111,7 @@ CWebSocket& CWebSocket::onClosing(CWebSocketOnClosingCallback cb)
 CWebSocket& CWebSocket::onClosed(CWebSocketOnClosedCallback cb)
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onClosed = cb;
 	});
 	return *this;
@@ -609,58 +1120,562 @@ CWebSocket& CWebSocket::onClosed(CWebSocketOnClosedCallback cb)
 CWebSocket& CWebSocket::onError(CWebSocketOnErrorCallback cb)
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 		_callbackList.onError = cb;
 	});
 	return *this;
 }
 
-void CWebSocket::Connect(DWORD delayms)
+CWebSocket& CWebSocket::onHighWatermark(CWebSocketOnHighWatermarkCallback cb)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onHighWatermark = cb;
+	});
+	return *this;
+}
+
+CWebSocket& CWebSocket::onDrain(CWebSocketOnDrainCallback cb)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+		_callbackList.onDrain = cb;
+	});
+	return *this;
+}
+
+CWebSocketConnectOperation CWebSocket::Connect(DWORD delayms)
 {
+	size_t generation;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		generation = ++_connectCalls;
+		_receiveClosed = false; // Receive waits for the messages of the new connection.
+	}
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 		_reconnectCount++;
+		{
+			std::lock_guard<std::mutex> lock(_awaitMutex);
+			_connectGeneration = generation;
+			_receiveParked = false; // Whatever was due on the previous connection, which is aborted below.
+			_messageParked = false;
+		}
 
 		if (_state == CWebSocketState::ConnectPending)
 		{
-			CWebSocketOnError();
+			CWebSocketOnError(CWebSocketErrorCause::InvalidOperation);
 			return;
 		}
+		if (_metrics.connects.Get() > 0)
+			_metrics.reconnects.Add(1);
+		_metrics.connects.Add(1);
 
 		_Abort();
 		if (delayms == 0)
 		{
 			if (_SendUpgradeRequest() == false)
-				CWebSocketOnError();
+				CWebSocketOnError(CWebSocketErrorCause::Transport);
 		}
 		else
 		{
-			_state = CWebSocketState::ConnectPending;
+			_SetState(CWebSocketState::ConnectPending);
 			_at.Set(delayms, [=]() {
-				WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
-				if (_SendUpgradeRequest() == false)
-					CWebSocketOnError();
+				_saq.QueueAsyncWork([=]() { // Run on the same thread as everything else, in case the websocket is pinned to a reactor loop.
+					WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+					if (_SendUpgradeRequest() == false)
+						CWebSocketOnError(CWebSocketErrorCause::Transport);
+				});
 			});
 		}
 	});
+	return CWebSocketConnectOperation(this, generation);
+}
+
+void CWebSocket::SetMaxMessageSize(size_t maxMessageSize)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_maxMessageSize = maxMessageSize;
+	});
+}
+
+void CWebSocket::SetReceiveBuffer(const CWebSocketReceiveBufferOptions &options)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_receiveSizer.Configure(options); // Takes effect with the next receive.
+		if (_transport != nullptr)
+			_transport->SetReceiveBuffer(options);
+	});
+}
+
+void CWebSocket::SetBufferPool(CWebSocketBufferPool *pool)
+{
+	if (pool == nullptr)
+		pool = CWebSocketBufferPool::Default();
+	_bufferPool.store(pool, std::memory_order_release);
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		if (_transport != nullptr)
+			_transport->SetBufferPool(pool);
+	});
+}
+
+void CWebSocket::SetSendFragmentLength(size_t fragmentLength)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_fragmentLength = fragmentLength;
+	});
+}
+
+void CWebSocket::SetSendBufferOptions(const CWebSocketSendBufferOptions &options)
+{
+	_sendBufferLimit.store(options.limit, std::memory_order_relaxed);
+	_sendLimitPolicy.store(options.policy, std::memory_order_relaxed);
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_highWatermark = options.highWatermark;
+		_lowWatermark = options.lowWatermark;
+	});
+}
+
+size_t CWebSocket::GetBufferedAmount() const
+{
+	return _bufferedAmount.load(std::memory_order_relaxed);
+}
+
+CWebSocketSendBufferStats CWebSocket::GetSendBufferStats() const
+{
+	CWebSocketSendBufferStats stats;
+	stats.bufferedAmount = _bufferedAmount.load(std::memory_order_relaxed);
+	stats.bufferedMessages = _bufferedMessages.load(std::memory_order_relaxed);
+	stats.refusedMessages = _refusedMessages.load(std::memory_order_relaxed);
+	stats.droppedMessages = _droppedMessages.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void CWebSocket::SetCompression(const CWebSocketCompressionOptions &options)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_compression = options;
+	});
+}
+
+void CWebSocket::KeepAlive(DWORD pingIntervalms, DWORD pongTimeoutms)
+{
+	_saq.QueueAsyncWork([=]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_pingIntervalms = pingIntervalms;
+		_pongTimeoutms = pongTimeoutms;
+		if (_state != CWebSocketState::WaitingForActivity)
+			return; // Keepalive starts when the connection opens.
+		if (pingIntervalms == 0)
+			_StopKeepAlive();
+		else if (_pongPending == false)
+			_SetKeepAliveTimer(pingIntervalms);
+	});
+}
+
+bool CWebSocket::GetRoundTripTime(CWebSocketRoundTripTime *rtt) const
+{
+	std::lock_guard<std::mutex> lock(_rttMutex);
+	if (_rtt.sampleCount == 0)
+		return false;
+	*rtt = _rtt;
+	return true;
+}
+
+CWebSocketMetricsSnapshot CWebSocket::GetMetrics() const
+{
+	CWebSocketMetricsSnapshot snapshot = CWebSocketMetricsSnapshot();
+	_metrics.AddTo(snapshot);
+	return snapshot;
 }
 
 void CWebSocket::Abort()
 {
 	_saq.QueueAsyncWork([=]() {
-		WAIT_FOR_MUTEX_OR_EVENT(_mMutex, _eDrainSaqAtCallbacks);
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
 
 		if ((_state == CWebSocketState::NoTcpConnection) ||
 			(_state == CWebSocketState::ConnectPending) ||
 			(_state == CWebSocketState::Done) ||
 			(_state == CWebSocketState::Error))
 		{
-			CWebSocketOnError();
+			CWebSocketOnError(CWebSocketErrorCause::InvalidOperation);
 			return;
 		}
 
-		_state = CWebSocketState::NoTcpConnection;
+		_SetState(CWebSocketState::NoTcpConnection);
 		_Abort();
+		_EndAwaiters();
+	});
+}
+
+CWebSocketReceiveOperation CWebSocket::Receive()
+{
+	return CWebSocketReceiveOperation(this);
+}
+
+CWebSocketSendOperation CWebSocket::Send(const CWebSocketSharedBuffer &message, CWebSocketSendPriority priority)
+{
+	return CWebSocketSendOperation(this, message, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, priority, false);
+}
+
+CWebSocketSendOperation CWebSocket::Send(const BYTE *message, size_t length, CWebSocketSendPriority priority)
+{
+	const CWebSocketSharedBuffer copy = _bufferPool.load(std::memory_order_acquire)->Copy(message, length);
+	return CWebSocketSendOperation(this, copy, WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE, priority, copy.Data() == nullptr);
+}
+
+CWebSocketSendOperation CWebSocket::SendUTF8(const BYTE *message, size_t length, CWebSocketSendPriority priority)
+{
+	const CWebSocketSharedBuffer copy = _bufferPool.load(std::memory_order_acquire)->Copy(message, length);
+	return CWebSocketSendOperation(this, copy, WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE, priority, copy.Data() == nullptr);
+}
+
+// Records whether the message callback is set, on the caller's thread. Returns false if it may not be set, since the websocket is in pull mode,
+// in which case the websocket fails with InvalidOperation.
+bool CWebSocket::_SetMessageCallback(unsigned callback, bool set)
+{
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		if (set == false)
+		{
+			_messageCallbacks &= ~callback;
+			return true;
+		}
+		if (_pullMode.load(std::memory_order_relaxed) == false)
+		{
+			_messageCallbacks |= callback;
+			return true;
+		}
+	}
+	_QueueInvalidOperation();
+	return false;
+}
+
+void CWebSocket::_QueueInvalidOperation()
+{
+	_saq.QueueAsyncWork([this]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		CWebSocketOnError(CWebSocketErrorCause::InvalidOperation);
+	});
+}
+
+// The functions below are called by the operations when a coroutine awaits them, on the thread of the coroutine, which may be any thread.
+// They return true if the coroutine has been suspended. They must not touch the operation once they have registered it and released _awaitMutex,
+// since the coroutine may be resumed right away, and destruct the operation.
+
+bool CWebSocket::_AwaitConnect(CWebSocketConnectOperation *operation)
+{
+	bool suspended = false;
+	bool unpark;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		if (_messageCallbacks == 0)
+			_pullMode.store(true, std::memory_order_release);
+		if (_connectsResolved < operation->_generation)
+			_connectsResolved = operation->_generation;
+		if (_connectsCompleted >= operation->_generation)
+			operation->_opened = (_connectsCompleted == operation->_generation) && _connectOpened;
+		else
+		{
+			_connectWaiter = operation;
+			suspended = true;
+		}
+		unpark = (_resuming == false) && _ShouldUnparkReceive();
+	}
+	if (unpark)
+		_QueueUnparkReceive();
+	return suspended;
+}
+
+// Called when the operation of a call to Connect is destructed without having been awaited.
+void CWebSocket::_DiscardConnect(size_t generation)
+{
+	bool unpark;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		if (_connectsResolved < generation)
+			_connectsResolved = generation;
+		unpark = (_resuming == false) && _ShouldUnparkReceive();
+	}
+	if (unpark)
+		_QueueUnparkReceive();
+}
+
+bool CWebSocket::_AwaitReceive(CWebSocketReceiveOperation *operation)
+{
+	bool suspended = false;
+	bool refused;
+	bool unpark = false;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		refused = _messageCallbacks != 0; // The messages go to the callbacks.
+		if (refused == false)
+			_pullMode.store(true, std::memory_order_release);
+		if (_messageParked)
+		{
+			// Stays in _receiveBuffer until the next message is awaited, which unparks receiving.
+			operation->_message = { _receiveBuffer.Data(), _receiveBuffer.Size(), _parkedMessageIsUTF8, false };
+			_messageParked = false;
+			return false;
+		}
+		if (refused || _receiveClosed)
+			operation->_message = { nullptr, 0, false, true };
+		else
+		{
+			_receiveWaiter = operation;
+			suspended = true;
+			unpark = (_resuming == false) && _ShouldUnparkReceive();
+		}
+	}
+	if (refused)
+		_QueueInvalidOperation();
+	if (unpark)
+		_QueueUnparkReceive();
+	return suspended;
+}
+
+bool CWebSocket::_AwaitSend(CWebSocketSendOperation *operation)
+{
+	if (operation->_refused || _ReserveSendBuffer(operation->_message.Length()) == false)
+		return false;
+	_saq.QueueAsyncWork([this, operation]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_ClientSendBinaryOrUTF8({ operation->_message, operation->_bufferType, 0, operation }, operation->_priority);
+	});
+	return true;
+}
+
+// The functions below run on the thread that reports events, with _mMutex held if the websocket isn't pinned to a reactor loop.
+
+// Asks the transport for the first receive of a connection, unless receiving has to be parked: in pull mode, until a coroutine awaits a message,
+// and until the operation of the call to Connect that opened the connection has been awaited or discarded, since awaiting it turns pull mode on.
+bool CWebSocket::_StartReceiving()
+{
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		_messageParked = false;
+		_receiveParked = true;
+		if (_ShouldUnparkReceive() == false)
+			return true;
+		_receiveParked = false;
+	}
+	return _Receive();
+}
+
+// Called with _awaitMutex held.
+bool CWebSocket::_ShouldUnparkReceive() const
+{
+	return _receiveParked && (_messageParked == false) && (_connectsResolved >= _connectGeneration) &&
+		(_pullMode.load(std::memory_order_relaxed) == false || _receiveWaiter != nullptr);
+}
+
+void CWebSocket::_QueueUnparkReceive()
+{
+	_saq.QueueAsyncWork([this]() {
+		WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(_mMutex, _eDrainSaqAtCallbacks, _drainSaqAtCallbacks);
+
+		_UnparkReceive();
 	});
+}
+
+// Asks the transport for the receive that is due, if it may be made now. Does nothing otherwise, so it may be called any number of times.
+void CWebSocket::_UnparkReceive()
+{
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		if (_ShouldUnparkReceive() == false)
+			return;
+		_receiveParked = false;
+	}
+	_receiveBuffer.Clear(); // Drops the last message, which the coroutine has been done with since it awaited the next one.
+	if (_Receive() == false)
+		CWebSocketOnError(CWebSocketErrorCause::Transport);
+}
+
+// Hands a message that arrived in pull mode to the coroutine awaiting it, or keeps it until one does. Either way, receiving is parked until the next
+// message is awaited. message is in _receiveBuffer, unless inPlace is true, in which case it is only valid until this function returns.
+void CWebSocket::_DeliverMessage(const BYTE *message, size_t length, bool isUTF8, bool inPlace)
+{
+	CWebSocketReceiveOperation *waiter;
+	bool copied = true;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		waiter = _receiveWaiter;
+		_receiveWaiter = nullptr;
+		_receiveParked = true;
+		if (waiter == nullptr)
+		{
+			// The coroutine hasn't come back for the message yet. Only happens when it awaits Receive on a thread of its own.
+			copied = (inPlace == false) || _receiveBuffer.Append(_bufferPool.load(std::memory_order_acquire), message, length);
+			_messageParked = copied;
+			_parkedMessageIsUTF8 = isUTF8;
+		}
+	}
+	if (waiter != nullptr)
+	{
+		waiter->_message = { message, length, isUTF8, false };
+		_Resume(waiter);
+	}
+	else if (copied == false)
+		CWebSocketOnError(CWebSocketErrorCause::OutOfMemory);
+}
+
+// Resumes the awaiting coroutine, if any, with the outcome of the current connection attempt, unless it is known already.
+void CWebSocket::_CompleteConnect(bool opened)
+{
+	CWebSocketConnectOperation *waiter = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		if (_connectsCompleted >= _connectGeneration)
+			return;
+		_connectsCompleted = _connectGeneration;
+		_connectOpened = opened;
+		if (_connectWaiter != nullptr && _connectWaiter->_generation <= _connectGeneration)
+		{
+			waiter = _connectWaiter;
+			_connectWaiter = nullptr;
+			waiter->_opened = opened && (waiter->_generation == _connectGeneration);
+		}
+	}
+	if (waiter != nullptr)
+		_Resume(waiter);
+}
+
+// Takes the send operations awaiting count messages of queue from the first-th on, which have been written, or dropped if written is false,
+// to be resumed by _ResumeCompletedSends once the send queues are consistent again.
+void CWebSocket::_CompleteSends(SendQueue &queue, size_t first, size_t count, bool written)
+{
+	for (size_t i = first; i < first + count; i++)
+	{
+		if (queue[i].waiter != nullptr)
+		{
+			_CompleteSend(queue[i].waiter, written);
+			queue[i].waiter = nullptr;
+		}
+	}
+}
+
+void CWebSocket::_CompleteSend(CWebSocketSendOperation *operation, bool written)
+{
+	operation->_written = written;
+	operation->_next = nullptr;
+	if (_lastCompletedSend != nullptr)
+		_lastCompletedSend->_next = operation;
+	else
+		_completedSends = operation;
+	_lastCompletedSend = operation;
+}
+
+void CWebSocket::_ResumeCompletedSends()
+{
+	while (_completedSends != nullptr)
+	{
+		CWebSocketSendOperation *operation = _completedSends;
+		_completedSends = operation->_next;
+		if (_completedSends == nullptr)
+			_lastCompletedSend = nullptr;
+		_Resume(operation);
+	}
+}
+
+// Resumes the coroutine of awaiter on this thread. If the coroutine awaits a message before it suspends again or returns, receiving resumes afterwards.
+void CWebSocket::_Resume(cwebsocketinternal::CWebSocketAwaiter *awaiter)
+{
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		_resuming = true;
+	}
+	awaiter->Resume();
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		_resuming = false;
+	}
+	_UnparkReceive();
+}
+
+// Resumes the coroutines awaiting the websocket once the connection has ended or failed: Connect with false if its outcome isn't known yet,
+// Receive with a closed view, and Send with false for the messages that haven't been written.
+void CWebSocket::_EndAwaiters()
+{
+	CWebSocketReceiveOperation *receiveWaiter;
+	{
+		std::lock_guard<std::mutex> lock(_awaitMutex);
+		_receiveParked = false;
+		_receiveClosed = true;
+		receiveWaiter = _receiveWaiter;
+		_receiveWaiter = nullptr;
+	}
+	_CompleteConnect(false);
+	if (receiveWaiter != nullptr)
+	{
+		receiveWaiter->_message = { nullptr, 0, false, true };
+		_Resume(receiveWaiter);
+	}
+	_CompleteSends(_sendBuffer, 0, _sendBuffer.Size(), false);
+	_CompleteSends(_urgentBuffer, 0, _urgentBuffer.Size(), false);
+	_ResumeCompletedSends();
+}
+
+CWebSocketConnectOperation::CWebSocketConnectOperation(CWebSocket *webSocket, size_t generation) :
+	_webSocket(webSocket),
+	_generation(generation),
+	_awaited(false),
+	_opened(false)
+{
+}
+
+CWebSocketConnectOperation::~CWebSocketConnectOperation()
+{
+	if (_awaited == false)
+		_webSocket->_DiscardConnect(_generation);
+}
+
+bool CWebSocketConnectOperation::_Suspend()
+{
+	_awaited = true;
+	return _webSocket->_AwaitConnect(this);
+}
+
+CWebSocketReceiveOperation::CWebSocketReceiveOperation(CWebSocket *webSocket) :
+	_webSocket(webSocket),
+	_message()
+{
+}
+
+bool CWebSocketReceiveOperation::_Suspend()
+{
+	return _webSocket->_AwaitReceive(this);
+}
+
+CWebSocketSendOperation::CWebSocketSendOperation(CWebSocket *webSocket, const CWebSocketSharedBuffer &message, WINHTTP_WEB_SOCKET_BUFFER_TYPE bufferType, CWebSocketSendPriority priority, bool refused) :
+	_webSocket(webSocket),
+	_message(message),
+	_bufferType(bufferType),
+	_priority(priority),
+	_refused(refused),
+	_written(false),
+	_next(nullptr)
+{
+}
+
+bool CWebSocketSendOperation::_Suspend()
+{
+	return _webSocket->_AwaitSend(this);
 }
\ No newline at end of file
@@ -0,0 +1,240 @@
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <new>
+#include <algorithm>
+
+#include "EpollLoop.h"
+
+EpollLoop::EpollLoop() :
+	_epfd(-1),
+	_wakefd(-1),
+	_timers(AsyncTimerQueue::Now()),
+	_ring(nullptr),
+	_iterationCount(0),
+	_syncWaiterCount(0),
+	_stop(false)
+{
+}
+
+EpollLoop::~EpollLoop()
+{
+	if (_thread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_Wake();
+		_thread.join();
+	}
+	delete _ring;
+	if (_wakefd != -1)
+		close(_wakefd);
+	if (_epfd != -1)
+		close(_epfd);
+}
+
+bool EpollLoop::Initialize(const IoUring::Options *ioUring)
+{
+	_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (_epfd == -1)
+		return false;
+	_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_wakefd == -1)
+		return false;
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr; // The wake-up descriptor is the only one without a handler.
+	if (epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakefd, &ev) == -1)
+		return false;
+	if (ioUring != nullptr)
+	{
+		_ring = new(std::nothrow) IoUring();
+		ev.events = EPOLLIN;
+		ev.data.ptr = _ring; // Completions are reaped every iteration; the descriptor only wakes the loop up for them.
+		if (_ring != nullptr && (_ring->Initialize(*ioUring) == false || epoll_ctl(_epfd, EPOLL_CTL_ADD, _ring->Fd(), &ev) == -1))
+		{
+			delete _ring;
+			_ring = nullptr;
+		}
+	}
+	_thread = std::thread(&EpollLoop::_Run, this);
+	return true;
+}
+
+void EpollLoop::_Wake()
+{
+	const uint64_t one = 1;
+	ssize_t r = write(_wakefd, &one, sizeof(one));
+	(void)r; // The counter can only overflow if the loop thread is stuck, in which case waking it up again is pointless anyway.
+}
+
+void EpollLoop::_Run()
+{
+	const int MaxEvents = 64;
+	epoll_event events[MaxEvents];
+	std::vector<std::function<void()>> posted;
+
+	for (;;)
+	{
+		int timeout;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_stop)
+				break;
+			timeout = (_posted.size() > 0 || _syncWaiterCount > 0) ? 0 : -1; // Don't block if someone is waiting for the iteration to end.
+		}
+		if (_ring != nullptr)
+		{
+			_ring->Submit(); // Everything the last iteration prepared, with a single system call.
+			if (_ring->HasCompletions())
+				timeout = 0;
+		}
+		const uint64_t wakeup = _timers.NextWakeup();
+		if (timeout != 0 && wakeup != UINT64_MAX)
+		{
+			const uint64_t now = AsyncTimerQueue::Now();
+			timeout = (wakeup <= now) ? 0 : (int)std::min<uint64_t>(wakeup - now, INT32_MAX);
+		}
+
+		int n = epoll_wait(_epfd, events, MaxEvents, timeout);
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.ptr == nullptr)
+			{
+				uint64_t count;
+				ssize_t r = read(_wakefd, &count, sizeof(count));
+				(void)r;
+			}
+			else if (events[i].data.ptr != _ring)
+				((Handler*)events[i].data.ptr)->OnEpollEvents(events[i].events);
+		}
+		if (_ring != nullptr)
+			_ring->Reap();
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			posted.swap(_posted);
+		}
+		for (auto &work : posted)
+			work();
+		posted.clear();
+
+		_timers.Advance(AsyncTimerQueue::Now());
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_iterationCount++;
+		}
+		_cvIteration.notify_all();
+	}
+	if (_ring != nullptr)
+		_ring->Drain(1000); // Let the kernel finish with the buffers of connections aborted while operations were in flight.
+}
+
+IoUring *EpollLoop::Ring() const
+{
+	return _ring;
+}
+
+bool EpollLoop::Add(int fd, uint32_t events, Handler *handler)
+{
+	epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = handler;
+	return epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool EpollLoop::Modify(int fd, uint32_t events, Handler *handler)
+{
+	epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = handler;
+	return epoll_ctl(_epfd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EpollLoop::Remove(int fd)
+{
+	epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EpollLoop::Post(std::function<void()> work)
+{
+	bool wasEmpty;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		wasEmpty = _posted.size() == 0;
+		_posted.push_back(std::move(work));
+	}
+	if (wasEmpty)
+		_Wake();
+}
+
+void EpollLoop::Synchronize()
+{
+	if (IsLoopThread())
+		return;
+	std::unique_lock<std::mutex> lock(_mutex);
+	// The iteration that is running right now may have started before the call, so wait for the one after it to end as well.
+	const uint64_t target = _iterationCount + 2;
+	_syncWaiterCount++;
+	lock.unlock();
+	_Wake();
+	lock.lock();
+	_cvIteration.wait(lock, [=]() { return _iterationCount >= target || _stop; });
+	_syncWaiterCount--;
+}
+
+bool EpollLoop::IsLoopThread() const
+{
+	return std::this_thread::get_id() == _thread.get_id();
+}
+
+void EpollLoop::Set(TimingWheel::Timer *timer, DWORD delayms, std::function<void()> callback)
+{
+	const uint64_t expiry = AsyncTimerQueue::Now() + delayms;
+	if (IsLoopThread())
+	{
+		timer->callback = std::move(callback);
+		_timers.Schedule(timer, expiry);
+		return;
+	}
+	Post([=]() {
+		timer->callback = callback;
+		_timers.Schedule(timer, expiry);
+	});
+}
+
+void EpollLoop::Cancel(TimingWheel::Timer *timer)
+{
+	if (IsLoopThread())
+	{
+		_timers.Cancel(timer);
+		return;
+	}
+	Post([=]() {
+		_timers.Cancel(timer);
+	});
+	Synchronize();
+}
+
+EpollLoop* EpollLoop::Default()
+{
+	// The default loop is never destructed, so that its thread can safely outlive static destructors.
+	static EpollLoop *loop = []() {
+		EpollLoop *l = new(std::nothrow) EpollLoop();
+		if (l != nullptr && l->Initialize() == false)
+		{
+			delete l;
+			l = nullptr;
+		}
+		return l;
+	}();
+	return loop;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "AsyncTimer.h"
+#include "IoUring.h"
+
+// EpollLoop runs an epoll event loop on a dedicated thread.
+// File descriptors are registered along with a handler, which gets called on the loop thread whenever the descriptor becomes ready.
+// Work can also be posted to the loop thread from any thread, similar to SeqAsyncQueue.
+// The loop is also an AsyncTimerQueue: timers attached to it fire on the loop thread, and cost no locking when set or cancelled from there.
+// A loop may also drive an IoUring, whose entries it submits once per iteration, before it waits, and whose completions it reaps on the loop thread.
+class EpollLoop final : public AsyncTimerQueue
+{
+public:
+	// Implemented by objects that own a file descriptor registered with the loop.
+	class Handler
+	{
+	public:
+		virtual void OnEpollEvents(uint32_t events) = 0;
+	protected:
+		~Handler() {}
+	};
+
+private:
+	int _epfd;
+	int _wakefd; // An eventfd used to wake the loop thread up when work is posted.
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _cvIteration;
+	std::vector<std::function<void()>> _posted;
+	TimingWheel _timers; // Only touched on the loop thread.
+	IoUring *_ring; // nullptr if the loop only uses epoll.
+	uint64_t _iterationCount; // Incremented at the end of every loop iteration.
+	size_t _syncWaiterCount; // The number of threads blocked in Synchronize.
+	bool _stop;
+
+private:
+	void _Run();
+	void _Wake();
+
+public:
+	EpollLoop();
+	EpollLoop(const EpollLoop&) = delete;
+	~EpollLoop();
+
+	// Creates the epoll instance and starts the loop thread. Returns true for success.
+	// If ioUring is not nullptr, the loop also sets up an IoUring with those options, unless io_uring is unavailable, in which case the loop goes on without one.
+	bool Initialize(const IoUring::Options *ioUring = nullptr);
+
+	// The IoUring of the loop, or nullptr if it has none. Only the loop thread may use it.
+	IoUring *Ring() const;
+
+	// Registers, re-registers or unregisters fd. events is a combination of EPOLL* flags.
+	bool Add(int fd, uint32_t events, Handler *handler);
+	bool Modify(int fd, uint32_t events, Handler *handler);
+	void Remove(int fd);
+
+	// Queues work to be executed on the loop thread.
+	void Post(std::function<void()> work);
+
+	// Waits until the loop has finished handling every event and posted work that was pending at the time of the call.
+	// After a handler's descriptor is removed, call this before destructing the handler.
+	// Returns immediately if called from the loop thread.
+	void Synchronize();
+
+	// Returns true if the calling thread is the loop thread.
+	bool IsLoopThread() const;
+
+	// AsyncTimerQueue. When called from another thread, Set posts the work of setting the timer to the loop, and Cancel synchronizes with the loop.
+	void Set(TimingWheel::Timer *timer, DWORD delayms, std::function<void()> callback) override;
+	void Cancel(TimingWheel::Timer *timer) override;
+
+	// Returns the loop shared by all transports of the process. The loop is created on first use.
+	// Returns nullptr if the loop could not be created.
+	static EpollLoop* Default();
+};
+
+#endif
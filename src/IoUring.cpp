@@ -0,0 +1,442 @@
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#include "IoUring.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IORING_RECV_MULTISHOT // The headers know about multishot receives, and so about everything else used here.
+
+namespace
+{
+	const uint16_t BufferGroupId = 0;
+
+	int SetUp(unsigned entries, io_uring_params *params)
+	{
+		return (int)syscall(__NR_io_uring_setup, entries, params);
+	}
+
+	int Register(int fd, unsigned opcode, void *arg, unsigned count)
+	{
+		return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+	}
+
+	// Returns true if the kernel supports every op IoUring users submit. SEND_ZC came with the same kernel as multishot receives, which can't be probed for.
+	bool ProbeOps(int fd)
+	{
+		const size_t opCount = 256;
+		std::vector<BYTE> memory(sizeof(io_uring_probe) + opCount * sizeof(io_uring_probe_op));
+		io_uring_probe *probe = (io_uring_probe*)memory.data();
+		if (Register(fd, IORING_REGISTER_PROBE, probe, opCount) != 0)
+			return false;
+		const int required[] = { IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_PROVIDE_BUFFERS, IORING_OP_SEND_ZC };
+		for (const int op : required)
+		{
+			if (op > probe->last_op || (probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+				return false;
+		}
+		return true;
+	}
+}
+
+IoUring::IoUring() :
+	_fd(-1),
+	_sqpoll(false),
+	_ringMemory(MAP_FAILED),
+	_ringMemoryLength(0),
+	_sqes((io_uring_sqe*)MAP_FAILED),
+	_sqesLength(0),
+	_sqHead(nullptr),
+	_sqTail(nullptr),
+	_sqFlags(nullptr),
+	_sqMask(0),
+	_sqEntries(0),
+	_sqLocalTail(0),
+	_cqHead(nullptr),
+	_cqTail(nullptr),
+	_cqMask(0),
+	_cqes(nullptr),
+	_buffers((BYTE*)MAP_FAILED),
+	_bufferCount(0),
+	_bufferLength(0),
+	_inFlight(0)
+{
+}
+
+IoUring::~IoUring()
+{
+	if (_fd != -1)
+		close(_fd);
+	if (_sqes != MAP_FAILED)
+		munmap(_sqes, _sqesLength);
+	if (_ringMemory != MAP_FAILED)
+		munmap(_ringMemory, _ringMemoryLength);
+	if (_buffers != MAP_FAILED)
+		munmap(_buffers, (size_t)_bufferCount * _bufferLength);
+}
+
+bool IoUring::Initialize(const Options &options)
+{
+	if (_fd != -1 || options.bufferCount == 0 || options.bufferCount > 65536 || options.bufferLength == 0)
+		return false;
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	params.cq_entries = options.entries * 4;
+	if (options.sqpoll)
+	{
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = options.sqpollIdlems;
+	}
+	else
+		params.flags |= IORING_SETUP_COOP_TASKRUN; // The loop thread enters the kernel every iteration anyway, so completions needn't interrupt it.
+	_fd = SetUp(options.entries, &params);
+	if (_fd == -1)
+		return false;
+	_sqpoll = options.sqpoll;
+	const unsigned requiredFeatures = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+	if ((params.features & requiredFeatures) != requiredFeatures || ProbeOps(_fd) == false)
+		return false;
+
+	// The submission and completion rings share a single mapping.
+	const size_t sqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	const size_t cqLength = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	_ringMemoryLength = (sqLength > cqLength) ? sqLength : cqLength;
+	_ringMemory = mmap(nullptr, _ringMemoryLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (_ringMemory == MAP_FAILED)
+		return false;
+	_sqesLength = params.sq_entries * sizeof(io_uring_sqe);
+	_sqes = (io_uring_sqe*)mmap(nullptr, _sqesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+	if (_sqes == MAP_FAILED)
+		return false;
+	BYTE *ring = (BYTE*)_ringMemory;
+	_sqHead = (unsigned*)(ring + params.sq_off.head);
+	_sqTail = (unsigned*)(ring + params.sq_off.tail);
+	_sqFlags = (unsigned*)(ring + params.sq_off.flags);
+	_sqMask = *(unsigned*)(ring + params.sq_off.ring_mask);
+	_sqEntries = params.sq_entries;
+	_sqLocalTail = *_sqTail;
+	unsigned *array = (unsigned*)(ring + params.sq_off.array);
+	for (unsigned i = 0; i < _sqEntries; i++) // Entry i always goes in slot i, so the array never changes.
+		array[i] = i;
+	_cqHead = (unsigned*)(ring + params.cq_off.head);
+	_cqTail = (unsigned*)(ring + params.cq_off.tail);
+	_cqMask = *(unsigned*)(ring + params.cq_off.ring_mask);
+	_cqes = ring + params.cq_off.cqes;
+
+	// The provided buffers. Their pages are only backed by memory once a receive has used them.
+	// They are handed to the kernel with IORING_OP_PROVIDE_BUFFERS rather than through a registered buffer ring, which some kernels never draw from.
+	_bufferCount = options.bufferCount;
+	_bufferLength = options.bufferLength;
+	_buffers = (BYTE*)mmap(nullptr, (size_t)_bufferCount * _bufferLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (_buffers == MAP_FAILED)
+		return false;
+	_recycled.reserve(_bufferCount);
+	return _ProvideBuffers(0, _bufferCount);
+}
+
+int IoUring::Fd() const
+{
+	return _fd;
+}
+
+int IoUring::_Enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	int r;
+	do
+	{
+		r = (int)syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags, nullptr, 0);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+io_uring_sqe *IoUring::_Prepare(Handler *handler, uint32_t op)
+{
+	if (Reserve(1) == false)
+		return nullptr;
+	io_uring_sqe *sqe = &_sqes[_sqLocalTail & _sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)handler | op;
+	_sqLocalTail++;
+	_inFlight++;
+	return sqe;
+}
+
+// Prepares giving count buffers, starting with id, to the kernel. Their completions have no handler.
+bool IoUring::_ProvideBuffers(uint16_t id, unsigned count)
+{
+	io_uring_sqe *sqe = _Prepare(nullptr, 0);
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = (int)count;
+	sqe->addr = (uint64_t)(uintptr_t)(_buffers + (size_t)id * _bufferLength);
+	sqe->len = _bufferLength;
+	sqe->off = id;
+	sqe->buf_group = BufferGroupId;
+	return true;
+}
+
+bool IoUring::Receive(Handler *handler, uint32_t op, int fd)
+{
+	io_uring_sqe *sqe = _Prepare(handler, op);
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BufferGroupId;
+	return true;
+}
+
+bool IoUring::SendMessage(Handler *handler, uint32_t op, int fd, const msghdr *message, bool linked)
+{
+	io_uring_sqe *sqe = _Prepare(handler, op);
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)message;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; // Stream sockets retry short writes until all of it is written.
+	if (linked)
+		sqe->flags = IOSQE_IO_LINK;
+	return true;
+}
+
+bool IoUring::Send(Handler *handler, uint32_t op, int fd, const BYTE *data, size_t length, bool linked)
+{
+	io_uring_sqe *sqe = _Prepare(handler, op);
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (uint32_t)length;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	if (linked)
+		sqe->flags = IOSQE_IO_LINK;
+	return true;
+}
+
+bool IoUring::Cancel(Handler *handler, uint32_t op, Handler *target, uint32_t targetOp)
+{
+	io_uring_sqe *sqe = _Prepare(handler, op);
+	if (sqe == nullptr)
+		return false;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)target | targetOp;
+	return true;
+}
+
+bool IoUring::Reserve(unsigned count)
+{
+	if (_sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) + count <= _sqEntries)
+		return true;
+	Submit();
+	return _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) + count <= _sqEntries;
+}
+
+void IoUring::Submit()
+{
+	// Buffers recycled in a row usually have consecutive ids, since the kernel hands them out in the order they were provided.
+	size_t begin = 0;
+	while (begin < _recycled.size())
+	{
+		size_t end = begin + 1;
+		while (end < _recycled.size() && _recycled[end] == _recycled[end - 1] + 1)
+			end++;
+		if (_ProvideBuffers(_recycled[begin], (unsigned)(end - begin)) == false)
+			break;
+		begin = end;
+	}
+	_recycled.erase(_recycled.begin(), _recycled.begin() + begin);
+	__atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+	if (_sqpoll)
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); // The kernel thread checks the tail after setting the flag, so one of the two sides sees the other.
+		if (__atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+			_Enter(0, 0, IORING_ENTER_SQ_WAKEUP);
+		return;
+	}
+	const unsigned toSubmit = _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	if (toSubmit > 0)
+		_Enter(toSubmit, 0, 0); // Entries the kernel couldn't take right now, when the completion queue overflowed, are submitted next time.
+}
+
+bool IoUring::HasCompletions() const
+{
+	return __atomic_load_n(_cqHead, __ATOMIC_RELAXED) != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+}
+
+void IoUring::Reap()
+{
+	// Completions that didn't fit into the queue wait in the kernel until it is asked for them.
+	if (__atomic_load_n(_sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+		_Enter(0, 0, IORING_ENTER_GETEVENTS);
+	unsigned head = __atomic_load_n(_cqHead, __ATOMIC_RELAXED);
+	const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		const io_uring_cqe cqe = ((const io_uring_cqe*)_cqes)[head & _cqMask];
+		head++;
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE); // Before calling the handler, which may destruct itself.
+		if ((cqe.flags & IORING_CQE_F_MORE) == 0)
+			_inFlight--;
+		Handler *handler = (Handler*)(uintptr_t)(cqe.user_data & ~(uint64_t)MaxOp);
+		if (handler != nullptr) // Provided buffers have none.
+			handler->OnIoCompletion((uint32_t)(cqe.user_data & MaxOp), cqe.res, cqe.flags);
+	}
+}
+
+void IoUring::Drain(unsigned timeoutms)
+{
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+	for (;;)
+	{
+		Submit();
+		Reap();
+		if (_inFlight == 0)
+			return;
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			return;
+		pollfd p;
+		p.fd = _fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		poll(&p, 1, (int)left);
+	}
+}
+
+size_t IoUring::InFlight() const
+{
+	return _inFlight;
+}
+
+const BYTE *IoUring::Buffer(uint16_t id) const
+{
+	return _buffers + (size_t)id * _bufferLength;
+}
+
+void IoUring::RecycleBuffer(uint16_t id)
+{
+	_recycled.push_back(id);
+}
+
+bool IoUring::HasMore(uint32_t flags)
+{
+	return (flags & IORING_CQE_F_MORE) != 0;
+}
+
+bool IoUring::HasBuffer(uint32_t flags, uint16_t *id)
+{
+	if ((flags & IORING_CQE_F_BUFFER) == 0)
+		return false;
+	*id = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+	return true;
+}
+
+#else // Headers too old for io_uring: Initialize always fails, and the loops fall back to epoll.
+
+IoUring::IoUring() :
+	_fd(-1)
+{
+}
+
+IoUring::~IoUring()
+{
+}
+
+bool IoUring::Initialize(const Options &/*options*/)
+{
+	return false;
+}
+
+int IoUring::Fd() const
+{
+	return _fd;
+}
+
+bool IoUring::Receive(Handler * /*handler*/, uint32_t /*op*/, int /*fd*/)
+{
+	return false;
+}
+
+bool IoUring::SendMessage(Handler * /*handler*/, uint32_t /*op*/, int /*fd*/, const msghdr * /*message*/, bool /*linked*/)
+{
+	return false;
+}
+
+bool IoUring::Send(Handler * /*handler*/, uint32_t /*op*/, int /*fd*/, const BYTE * /*data*/, size_t /*length*/, bool /*linked*/)
+{
+	return false;
+}
+
+bool IoUring::Cancel(Handler * /*handler*/, uint32_t /*op*/, Handler * /*target*/, uint32_t /*targetOp*/)
+{
+	return false;
+}
+
+bool IoUring::Reserve(unsigned /*count*/)
+{
+	return false;
+}
+
+void IoUring::Submit()
+{
+}
+
+bool IoUring::HasCompletions() const
+{
+	return false;
+}
+
+void IoUring::Reap()
+{
+}
+
+void IoUring::Drain(unsigned /*timeoutms*/)
+{
+}
+
+size_t IoUring::InFlight() const
+{
+	return 0;
+}
+
+const BYTE *IoUring::Buffer(uint16_t /*id*/) const
+{
+	return nullptr;
+}
+
+void IoUring::RecycleBuffer(uint16_t /*id*/)
+{
+}
+
+bool IoUring::HasMore(uint32_t /*flags*/)
+{
+	return false;
+}
+
+bool IoUring::HasBuffer(uint32_t /*flags*/, uint16_t * /*id*/)
+{
+	return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "Win32Compat.h"
+
+struct io_uring_sqe;
+struct msghdr;
+
+// IoUring wraps an io_uring instance, set up with the raw system calls, along with a group of provided buffers that multishot receives draw from.
+// It belongs to an EpollLoop: the loop submits the entries prepared during an iteration with a single system call before it waits, polls the descriptor
+// of the ring along with its other descriptors, and calls the handlers of the completions on the loop thread. Only the loop thread may use it.
+// Needs Linux 6.0 or later, for multishot receives; Initialize fails on older kernels, and where io_uring is disabled, such as by seccomp.
+class IoUring
+{
+public:
+	// Implemented by objects that submit operations. The object must outlive the operations it submitted.
+	class Handler
+	{
+	public:
+		// op is the number passed to Prepare. flags are the IORING_CQE_F_* flags of the completion.
+		virtual void OnIoCompletion(uint32_t op, int32_t result, uint32_t flags) = 0;
+	protected:
+		~Handler() {}
+	};
+
+	struct Options
+	{
+		unsigned entries = 4096; // The size of the submission queue. The completion queue is four times as large, since every receive may complete many times.
+		bool sqpoll = false; // A kernel thread polls the submission queue, so that submitting takes no system call while it is busy.
+		unsigned sqpollIdlems = 1000; // How long the kernel thread keeps polling an idle queue before it goes to sleep.
+		unsigned bufferCount = 256; // The number of provided buffers, at most 65536. They are shared by all receives of the ring.
+		unsigned bufferLength = 16384;
+	};
+
+	const static uint32_t MaxOp = 7; // Ops are kept in the low bits of the user data, next to the handler.
+
+private:
+	int _fd;
+	bool _sqpoll;
+	void *_ringMemory;
+	size_t _ringMemoryLength;
+	io_uring_sqe *_sqes;
+	size_t _sqesLength;
+	unsigned *_sqHead;
+	unsigned *_sqTail;
+	unsigned *_sqFlags;
+	unsigned _sqMask;
+	unsigned _sqEntries;
+	unsigned _sqLocalTail; // Entries up to here have been prepared; the kernel sees them once Submit publishes the tail.
+	unsigned *_cqHead;
+	unsigned *_cqTail;
+	unsigned _cqMask;
+	void *_cqes;
+	BYTE *_buffers;
+	unsigned _bufferCount;
+	unsigned _bufferLength;
+	std::vector<uint16_t> _recycled; // Buffers to give back to the kernel with the next submission.
+	size_t _inFlight;
+
+private:
+	int _Enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+	io_uring_sqe *_Prepare(Handler *handler, uint32_t op);
+	bool _ProvideBuffers(uint16_t id, unsigned count);
+
+public:
+	IoUring();
+	IoUring(const IoUring&) = delete;
+
+	// Tears the ring down. The kernel cancels the operations that are still in flight, without calling their handlers.
+	~IoUring();
+
+	// Sets the ring up. Returns false if io_uring, or one of the features used, is unavailable.
+	bool Initialize(const Options &options);
+
+	// The descriptor of the ring, which is readable while completions are waiting.
+	int Fd() const;
+
+	// The functions below prepare an operation of handler, tagged with op, which is at most MaxOp. The operation is submitted with the next call to Submit.
+	// They return false if the submission queue is full even after submitting what it holds.
+
+	// A multishot receive on fd into the provided buffers, which completes once for every buffer filled, until the connection ends or fails,
+	// or the buffers run out, in which case the result is -ENOBUFS.
+	bool Receive(Handler *handler, uint32_t op, int fd);
+
+	// A sendmsg on fd that doesn't complete until all of message has been written or the connection fails. message must stay valid until it completes.
+	// If linked is true, the next operation prepared only starts once this one has succeeded, and fails with -ECANCELED otherwise.
+	bool SendMessage(Handler *handler, uint32_t op, int fd, const msghdr *message, bool linked);
+
+	// Like SendMessage, for a single buffer, which saves the kernel from importing a message header.
+	bool Send(Handler *handler, uint32_t op, int fd, const BYTE *data, size_t length, bool linked);
+
+	// Cancels the operation of target tagged with targetOp.
+	bool Cancel(Handler *handler, uint32_t op, Handler *target, uint32_t targetOp);
+
+	// Returns true if count operations can be prepared, submitting the queue first if needed.
+	bool Reserve(unsigned count);
+
+	// Hands the prepared entries to the kernel. With sqpoll, only makes a system call if the kernel thread has gone to sleep.
+	void Submit();
+
+	// Returns true if completions are waiting to be reaped.
+	bool HasCompletions() const;
+
+	// Calls the handlers of the completions that are waiting. Handlers may prepare new entries, and may destruct themselves.
+	void Reap();
+
+	// Submits and reaps until every operation has completed, or timeoutms has passed. Used when the loop stops.
+	void Drain(unsigned timeoutms);
+
+	// The number of operations whose last completion hasn't been reaped yet.
+	size_t InFlight() const;
+
+	// The provided buffer with the given id, as reported in the flags of a completion.
+	const BYTE *Buffer(uint16_t id) const;
+
+	// Gives a provided buffer back to the kernel, once its data has been consumed. The buffers recycled during an iteration are provided again with the next Submit.
+	void RecycleBuffer(uint16_t id);
+
+	// Returns true if the operation that completed with flags will complete again.
+	static bool HasMore(uint32_t flags);
+
+	// Returns true if the completion with flags filled a provided buffer, and stores its id in id.
+	static bool HasBuffer(uint32_t flags, uint16_t *id);
+};
+
+#endif
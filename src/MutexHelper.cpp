@@ -1,7 +1,21 @@
 #include "MutexHelper.h"
-#include <windows.h>
+#include "Win32Compat.h"
 
 MutexHelper::MutexHelper(HANDLE _mMutex, HANDLE _eEvent)
+{
+	wait(_mMutex, _eEvent);
+}
+MutexHelper::MutexHelper(HANDLE _mMutex, HANDLE _eEvent, const std::atomic<bool> &_fFlag)
+{
+	if (_mMutex != nullptr)
+		wait(_mMutex, _eEvent);
+	else
+	{
+		mutexIsAcquired = _fFlag.load(std::memory_order_acquire) == false;
+		mMutex = nullptr;
+	}
+}
+void MutexHelper::wait(HANDLE _mMutex, HANDLE _eEvent)
 {
 	const HANDLE objects[2] = {_mMutex, _eEvent};
 	DWORD r = WaitForMultipleObjects(2, objects, FALSE, INFINITE);
@@ -18,7 +32,7 @@ MutexHelper::MutexHelper(HANDLE _mMutex, HANDLE _eEvent)
 }
 MutexHelper::~MutexHelper()
 {
-	if (mutexIsAcquired)
+	if (mutexIsAcquired && mMutex != nullptr)
 		ReleaseMutex(mMutex);
 }
 bool MutexHelper::isMutexAcquired()
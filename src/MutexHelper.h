@@ -1,21 +1,30 @@
 #pragma once
 
-#include <windows.h>
+#include "Win32Compat.h"
+#include <atomic>
 
 #define WAIT_FOR_MUTEX_OR_EVENT(mutex, event) MutexHelper __local_mutex_holder(mutex, event); \
 		if (__local_mutex_holder.isMutexAcquired()==false) \
 			return;
 
+// Same as above, but if mutex is nullptr, only checks flag. Used by objects whose callbacks all run on one thread, and thus need no mutex.
+#define WAIT_FOR_MUTEX_OR_EVENT_OR_FLAG(mutex, event, flag) MutexHelper __local_mutex_holder(mutex, event, flag); \
+		if (__local_mutex_holder.isMutexAcquired()==false) \
+			return;
+
 //Acquires a specified mutex and waits on an event during construction. If the event is set, doesn't wait on the mutex.
 //If the mutex was acquired (i.e., the event was not set), releases it during destruction.
 class MutexHelper
 {
 public:
 	MutexHelper(HANDLE _mMutex, HANDLE _eEvent);
+	//If _mMutex is nullptr, counts as acquired unless _fFlag is set. Otherwise same as above.
+	MutexHelper(HANDLE _mMutex, HANDLE _eEvent, const std::atomic<bool> &_fFlag);
 	~MutexHelper();
 	bool isMutexAcquired();
 
 private:
+	void wait(HANDLE _mMutex, HANDLE _eEvent);
 	bool mutexIsAcquired;
 	HANDLE mMutex;
 };
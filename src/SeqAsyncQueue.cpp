@@ -1,58 +1,181 @@
+#include <thread>
+
 #include "SeqAsyncQueue.h"
 
+// Executes up to MaxWorksPerCallback works. Returns true if there are works left, in which case the caller must submit the queue again.
+bool SeqAsyncQueue::_ExecuteWorks(SeqAsyncQueue *self)
+{
+	for (size_t count = 1; ; count++)
+	{
+		Work *work = self->_Pop();
+		work->invoke(work);
+		work->destroy(work);
+		self->_FreeWork(work);
+		if (self->_pending.load(std::memory_order_acquire) == 1)
+		{
+			// This may be the last work. Only the consumer decrements _pending, so it is at least 2 otherwise and needs no lock.
+			std::unique_lock<std::mutex> lock(self->_drainedLock);
+			if (self->_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				self->_drained.notify_all();
+				return false; // The queue is empty. The owner may destroy the queue once the lock is released, so don't touch self anymore.
+			}
+		}
+		else
+			self->_pending.fetch_sub(1, std::memory_order_acq_rel);
+		if (count == MaxWorksPerCallback)
+			return true; // Let other queues use this thread for a while.
+	}
+}
 VOID CALLBACK SeqAsyncQueue::WorkCallback(PTP_CALLBACK_INSTANCE /*inst*/, PVOID context, PTP_WORK /*work*/)
 {
 	SeqAsyncQueue* self = (SeqAsyncQueue*)context;
-	WaitForSingleObject(self->_mMutex, INFINITE);
-	std::function<void()> callback = self->_q.front();
-	ReleaseMutex(self->_mMutex);
-	callback();
-	WaitForSingleObject(self->_mMutex, INFINITE);
-	self->_q.pop();
-	if (self->_q.size() == 0)
-		SetEvent(self->_eQueueEmpty);
-	else
-		SubmitThreadpoolWork(self->_work);
-	ReleaseMutex(self->_mMutex);
+	if (_ExecuteWorks(self))
+		self->_Submit();
 }
 SeqAsyncQueue::SeqAsyncQueue() :
-	_mMutex(nullptr),
-	_eQueueEmpty(nullptr),
-	_work(nullptr)
+	_tail(&_stub),
+	_head(&_stub),
+	_pending(0),
+	_work(nullptr),
+	_executor(nullptr),
+	_self(nullptr),
+	_freeWorks(nullptr)
 {
+	_stub.next.store(nullptr, std::memory_order_relaxed);
 }
 bool SeqAsyncQueue::Initialize()
 {
-	_mMutex = CreateMutex(NULL, FALSE, NULL);
-	if (_mMutex != nullptr)
-		_eQueueEmpty = CreateEvent(NULL, TRUE, TRUE, NULL);
-	if (_eQueueEmpty != nullptr)
-		_work = CreateThreadpoolWork(WorkCallback, this, NULL); // Use the default environment.
-	if (_work != nullptr)
-		return true;
-	return false;
+	_work = CreateThreadpoolWork(WorkCallback, this, NULL); // Use the default environment.
+	return _work != nullptr;
+}
+bool SeqAsyncQueue::Initialize(SeqAsyncExecutor *executor)
+{
+	_self = new(std::nothrow) ExecutorLink;
+	if (_self == nullptr)
+		return false;
+	_self->references.store(1, std::memory_order_relaxed);
+	_self->queue = this;
+	_executor = executor;
+	return _executor != nullptr;
 }
 SeqAsyncQueue::~SeqAsyncQueue()
 {
-	if (_mMutex != nullptr && _eQueueEmpty != nullptr) // If either of these handles are NULL, this means Initialize had failed so we don't need to wait for anything.
+	WaitTheQueue();
+	if (_work != nullptr)
+		CloseThreadpoolWork(_work);
+	Work *work = _freeWorks.exchange(nullptr, std::memory_order_acquire);
+	while (work != nullptr)
 	{
-		const HANDLE objects[2] = { _mMutex, _eQueueEmpty };
-		WaitForMultipleObjects(2, objects, TRUE, INFINITE);
+		Work *next = static_cast<Work*>(work->next.load(std::memory_order_relaxed));
+		delete work;
+		work = next;
 	}
-	CloseHandle(_mMutex);
-	CloseHandle(_eQueueEmpty);
-	CloseThreadpoolWork(_work);
+	if (_self != nullptr)
+		_Release(_self);
 }
-void SeqAsyncQueue::QueueAsyncWork(std::function<void()> callback)
+void SeqAsyncQueue::_Submit()
 {
-	WaitForSingleObject(_mMutex, INFINITE);
-	_q.push(callback);
-	ResetEvent(_eQueueEmpty);
-	if (_q.size() == 1)
+	if (_executor == nullptr)
+	{
 		SubmitThreadpoolWork(_work);
-	ReleaseMutex(_mMutex);
+		return;
+	}
+	ExecutorLink *self = _self;
+	self->references.fetch_add(1, std::memory_order_relaxed);
+	_executor->Post([self]() {
+		if (self->queue != nullptr && _ExecuteWorks(self->queue))
+			self->queue->_Submit();
+		_Release(self);
+	});
+}
+void SeqAsyncQueue::_Release(ExecutorLink *link)
+{
+	if (link->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete link;
+}
+void SeqAsyncQueue::_Push(Node *node)
+{
+	node->next.store(nullptr, std::memory_order_relaxed);
+	Node *prev = _tail.exchange(node, std::memory_order_acq_rel);
+	prev->next.store(node, std::memory_order_release); // Until this store, the consumer sees the list end at prev.
+}
+// Removes the oldest work from the queue. Must only be called by the consumer, after _pending says there is a work.
+SeqAsyncQueue::Work *SeqAsyncQueue::_Pop()
+{
+	for (;;)
+	{
+		Node *head = _head;
+		Node *next = head->next.load(std::memory_order_acquire);
+		if (head == &_stub)
+		{
+			if (next != nullptr)
+			{
+				_head = next; // Skip the stub.
+				continue;
+			}
+		}
+		else if (next != nullptr)
+		{
+			_head = next;
+			return static_cast<Work*>(head);
+		}
+		else if (head == _tail.load(std::memory_order_acquire))
+		{
+			// head is the last node. Put the stub behind it so that it can be removed without racing with producers.
+			_Push(&_stub);
+			continue;
+		}
+		// A producer has swapped _tail but hasn't linked its node yet. It will in a moment.
+		std::this_thread::yield();
+	}
+}
+thread_local SeqAsyncQueue::WorkCache SeqAsyncQueue::_threadWorks;
+
+SeqAsyncQueue::WorkCache::~WorkCache()
+{
+	while (works != nullptr)
+	{
+		Work *next = static_cast<Work*>(works->next.load(std::memory_order_relaxed));
+		delete works;
+		works = next;
+	}
+}
+SeqAsyncQueue::Work *SeqAsyncQueue::_AllocateWork()
+{
+	WorkCache &cache = _threadWorks;
+	if (cache.works == nullptr)
+		cache.works = _freeWorks.exchange(nullptr, std::memory_order_acquire);
+	Work *work = cache.works;
+	if (work == nullptr)
+		return new Work;
+	cache.works = static_cast<Work*>(work->next.load(std::memory_order_relaxed));
+	return work;
+}
+void SeqAsyncQueue::_FreeWork(Work *work)
+{
+	// Only called by the consumer. A producer may take the list in the meantime, in which case the compare-exchange fails and retries on the empty list.
+	Work *head = _freeWorks.load(std::memory_order_relaxed);
+	do
+		work->next.store(head, std::memory_order_relaxed);
+	while (!_freeWorks.compare_exchange_weak(head, work, std::memory_order_release, std::memory_order_relaxed));
+}
+void SeqAsyncQueue::_Enqueue(Work *work)
+{
+	_Push(work);
+	if (_pending.fetch_add(1, std::memory_order_acq_rel) == 0)
+		_Submit();
 }
 void SeqAsyncQueue::WaitTheQueue()
 {
-	WaitForSingleObject(_eQueueEmpty, INFINITE);
+	if (_executor != nullptr && _executor->IsExecutorThread())
+	{
+		// The posted work can't run until we return, so execute the works here. No other thread executes them, since works only run on this thread.
+		_self->queue = nullptr;
+		while (_pending.load(std::memory_order_acquire) != 0)
+			_ExecuteWorks(this);
+		return;
+	}
+	std::unique_lock<std::mutex> lock(_drainedLock);
+	_drained.wait(lock, [this]() { return _pending.load(std::memory_order_acquire) == 0; });
 }
\ No newline at end of file
@@ -1,24 +1,141 @@
 #pragma once
 
-#include <windows.h>
+#include "Win32Compat.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <cstddef>
 #include <functional>
-#include <queue>
+#include <memory>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Runs the works of SeqAsyncQueues on a thread of its own, instead of the thread pool. See SeqAsyncQueue::Initialize.
+class SeqAsyncExecutor
+{
+public:
+	// Queues work to be executed on the executor thread.
+	virtual void Post(std::function<void()> work) = 0;
+
+	// Returns true if the calling thread is the executor thread.
+	virtual bool IsExecutorThread() const = 0;
+protected:
+	~SeqAsyncExecutor() {}
+};
 
 // SeqAsyncQueue stands for sequential asynchronous queue.
 // It's a queue of works which are scheduled to be executed by a worker thread according to the FIFO principle.
+// Any number of threads may queue works concurrently without taking a lock.
+// Works are still executed one at a time, in the order they were queued.
 class SeqAsyncQueue
 {
 private:
-	HANDLE _mMutex;
-	HANDLE _eQueueEmpty;
-	std::queue<std::function<void()>> _q;
+	const static size_t InlineWorkSize = 64; // Callables up to this size are stored in the queue node itself, instead of being allocated separately.
+	const static size_t MaxWorksPerCallback = 64; // After executing this many works in a row, give the thread pool worker back and resubmit.
+
+	struct Node
+	{
+		std::atomic<Node*> next;
+	};
+
+	// A queued callable, along with the functions to call and destroy it.
+	struct Work : Node
+	{
+		void (*invoke)(Work *work);
+		void (*destroy)(Work *work);
+		alignas(std::max_align_t) unsigned char storage[InlineWorkSize];
+	};
+
+	// What the works posted to the executor capture instead of the queue, so that a stale post finds queue cleared. Counted by hand rather than held by a
+	// std::shared_ptr, so that the posted lambda only captures a pointer and std::function stores it without allocating.
+	struct ExecutorLink
+	{
+		std::atomic<size_t> references; // The queue holds one, and every post that hasn't run yet another.
+		SeqAsyncQueue *queue; // Cleared once the queue is drained on the executor thread. Only touched on the executor thread.
+	};
+
+	template <typename F>
+	struct InlineWork
+	{
+		static F *Get(Work *work) { return reinterpret_cast<F*>(work->storage); }
+		static void Invoke(Work *work) { (*Get(work))(); }
+		static void Destroy(Work *work) { Get(work)->~F(); }
+	};
+
+	template <typename F>
+	struct HeapWork
+	{
+		static F *Get(Work *work) { return *reinterpret_cast<F**>(work->storage); }
+		static void Invoke(Work *work) { (*Get(work))(); }
+		static void Destroy(Work *work) { delete Get(work); }
+	};
+
+private:
+	// The queue is an intrusive multi-producer single-consumer list. Producers only swap _tail, and the single consumer owns _head.
+	// _stub keeps the list non-empty, so that producers never have to touch _head.
+	Node _stub;
+	alignas(64) std::atomic<Node*> _tail;
+	alignas(64) Node *_head; // Only touched by the consumer.
+	alignas(64) std::atomic<size_t> _pending; // Works queued but not finished yet. Whoever takes it from 0 to 1 submits the thread pool work.
 	PTP_WORK _work;
+	SeqAsyncExecutor *_executor; // If not nullptr, works are executed by the executor instead of the thread pool.
+	ExecutorLink *_self; // Captured by the works posted to _executor. nullptr without an executor.
+	// Executed works are pushed to _freeWorks by the consumer, and taken all at once by the next producer whose thread cache is empty. Only the consumer
+	// pushes and producers only exchange the whole list, so neither needs a lock and there is no ABA. The caches grow to the deepest burst of works
+	// queued, so that queueing a work doesn't allocate in steady state, however deep the bursts are.
+	alignas(64) std::atomic<Work*> _freeWorks;
+	std::mutex _drainedLock; // Taken by the consumer when it may take _pending to 0, so that WaitTheQueue can't miss the notification.
+	std::condition_variable _drained;
+
+	// Works a thread has taken from the free lists of the queues, for the next works it queues to any queue. Freed when the thread exits.
+	struct WorkCache
+	{
+		Work *works = nullptr;
+		~WorkCache();
+	};
+	static thread_local WorkCache _threadWorks;
 private:
 	static VOID CALLBACK WorkCallback(PTP_CALLBACK_INSTANCE /*inst*/, PVOID context, PTP_WORK /*work*/);
+	static bool _ExecuteWorks(SeqAsyncQueue *self);
+	void _Submit();
+	static void _Release(ExecutorLink *link);
+	void _Push(Node *node);
+	Work *_Pop();
+	void _Enqueue(Work *work);
+	Work *_AllocateWork();
+	void _FreeWork(Work *work);
 public:
 	SeqAsyncQueue();
+	SeqAsyncQueue(const SeqAsyncQueue&) = delete;
 	~SeqAsyncQueue();
 	bool Initialize();
-	void QueueAsyncWork(std::function<void()> callback);
+
+	// Same as above, but works are executed on the thread of executor, which must outlive the queue.
+	bool Initialize(SeqAsyncExecutor *executor);
+
+	// Queues callback to be executed after all previously queued works. callback can be any callable that takes no arguments.
+	template <typename F>
+	void QueueAsyncWork(F &&callback)
+	{
+		typedef typename std::decay<F>::type Callable;
+		Work *work = _AllocateWork();
+		if (sizeof(Callable) <= InlineWorkSize && alignof(Callable) <= alignof(std::max_align_t))
+		{
+			new (work->storage) Callable(std::forward<F>(callback));
+			work->invoke = InlineWork<Callable>::Invoke;
+			work->destroy = InlineWork<Callable>::Destroy;
+		}
+		else
+		{
+			*reinterpret_cast<Callable**>(work->storage) = new Callable(std::forward<F>(callback));
+			work->invoke = HeapWork<Callable>::Invoke;
+			work->destroy = HeapWork<Callable>::Destroy;
+		}
+		_Enqueue(work);
+	}
+
+	// Waits until all queued works have been executed.
+	// If called on the thread of the executor, executes the remaining works itself. The queue must not be used afterwards.
 	void WaitTheQueue();
 };
\ No newline at end of file
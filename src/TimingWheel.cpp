@@ -0,0 +1,160 @@
+#include "TimingWheel.h"
+
+TimingWheel::TimingWheel(uint64_t now) :
+	_now(now),
+	_count(0)
+{
+}
+
+TimingWheel::~TimingWheel()
+{
+	auto clear = [](Slot &slot) {
+		while (slot.head._next != &slot.head)
+			_Unlink(slot.head._next);
+	};
+	for (auto &level : _slots)
+		for (auto &slot : level)
+			clear(slot);
+	clear(_overflow);
+}
+
+void TimingWheel::_Link(Slot &slot, Timer *timer)
+{
+	timer->_prev = slot.head._prev;
+	timer->_next = &slot.head;
+	slot.head._prev->_next = timer;
+	slot.head._prev = timer;
+}
+
+void TimingWheel::_Unlink(Timer *timer)
+{
+	timer->_prev->_next = timer->_next;
+	timer->_next->_prev = timer->_prev;
+	timer->_prev = nullptr;
+	timer->_next = nullptr;
+}
+
+// Puts timer into the slot of the lowest level that reaches its expiry. timer->_expiry must not be before _now.
+void TimingWheel::_Insert(Timer *timer)
+{
+	const uint64_t delta = timer->_expiry - _now;
+	for (size_t level = 0; level < LevelCount; level++)
+	{
+		const size_t shift = SlotBits * level;
+		if (delta < ((uint64_t)1 << (shift + SlotBits)))
+		{
+			_Link(_slots[level][(timer->_expiry >> shift) & (SlotCount - 1)], timer);
+			return;
+		}
+	}
+	_Link(_overflow, timer);
+}
+
+// Moves the timers of slot down to the levels that now reach their expiries.
+void TimingWheel::_Cascade(Slot &slot)
+{
+	if (slot.head._next == &slot.head)
+		return;
+	Slot moving;
+	// Move the whole list to a local head, since _Insert may link timers back into slot.
+	moving.head._next = slot.head._next;
+	moving.head._prev = slot.head._prev;
+	moving.head._next->_prev = &moving.head;
+	moving.head._prev->_next = &moving.head;
+	slot.head._prev = slot.head._next = &slot.head;
+	while (moving.head._next != &moving.head)
+	{
+		Timer *timer = moving.head._next;
+		_Unlink(timer);
+		_Insert(timer);
+	}
+}
+
+void TimingWheel::Schedule(Timer *timer, uint64_t expiry)
+{
+	if (timer->IsScheduled())
+		_Unlink(timer);
+	else
+		_count++;
+	timer->_expiry = (expiry > _now) ? expiry : _now + 1; // The slot of _now has already been processed.
+	_Insert(timer);
+}
+
+void TimingWheel::Cancel(Timer *timer)
+{
+	if (timer->IsScheduled() == false)
+		return;
+	_Unlink(timer);
+	_count--;
+}
+
+TimingWheel::Timer *TimingWheel::PopExpired(uint64_t now)
+{
+	for (;;)
+	{
+		Slot &slot = _slots[0][_now & (SlotCount - 1)];
+		if (slot.head._next != &slot.head)
+		{
+			Timer *timer = slot.head._next;
+			_Unlink(timer);
+			_count--;
+			return timer;
+		}
+		if (_now >= now)
+			return nullptr;
+		const uint64_t next = NextWakeup(); // Skip the ticks on which nothing happens.
+		if (next > now)
+		{
+			_now = now;
+			return nullptr;
+		}
+		_now = next;
+		for (size_t level = 1; level < LevelCount; level++)
+		{
+			const size_t shift = SlotBits * level;
+			if ((_now & (((uint64_t)1 << shift) - 1)) != 0)
+				break;
+			_Cascade(_slots[level][(_now >> shift) & (SlotCount - 1)]);
+			if (level == LevelCount - 1 && ((_now >> shift) & (SlotCount - 1)) == 0)
+				_Cascade(_overflow); // The top level has wrapped around.
+		}
+	}
+}
+
+size_t TimingWheel::Advance(uint64_t now)
+{
+	size_t fired = 0;
+	for (Timer *timer = PopExpired(now); timer != nullptr; timer = PopExpired(now))
+	{
+		const std::function<void()> callback = timer->callback; // The callback may reschedule the timer with another callback.
+		callback();
+		fired++;
+	}
+	return fired;
+}
+
+uint64_t TimingWheel::NextWakeup() const
+{
+	if (_count == 0)
+		return UINT64_MAX;
+	// The first level holds every timer expiring within the next SlotCount ticks.
+	for (uint64_t tick = _now + 1; tick <= _now + SlotCount; tick++)
+	{
+		if (_slots[0][tick & (SlotCount - 1)].head._next != &_slots[0][tick & (SlotCount - 1)].head)
+			return tick;
+		if ((tick & (SlotCount - 1)) == 0)
+		{
+			const size_t index = (tick >> SlotBits) & (SlotCount - 1);
+			if (index == 0 || _slots[1][index].head._next != &_slots[1][index].head)
+				return tick; // Timers are cascaded on this tick, some of which may expire right away.
+		}
+	}
+	// The rest expire after a cascade from the second level or above. Wake up for the first cascade that moves any timers.
+	uint64_t tick = ((_now + SlotCount) | (SlotCount - 1)) + 1;
+	for (;; tick += SlotCount)
+	{
+		const size_t index = (tick >> SlotBits) & (SlotCount - 1);
+		if (index == 0 || _slots[1][index].head._next != &_slots[1][index].head)
+			return tick;
+	}
+}
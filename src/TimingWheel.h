@@ -0,0 +1,81 @@
+#pragma once
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// TimingWheel keeps track of a large number of timers with O(1) scheduling and cancellation.
+// Time is measured in ticks of the caller's choosing; AsyncTimerQueue uses milliseconds.
+// Timers are kept in 4 levels of 256 slots each. The first level has a slot for each of the next 256 ticks, and every level above it has
+// a slot for 256 times as many ticks as the level below. When time reaches a slot of a higher level, its timers are moved down a level.
+// Timers are intrusive: the wheel never allocates memory, and a timer must outlive its scheduling.
+// TimingWheel does not synchronize calls made to its member functions.
+class TimingWheel
+{
+public:
+	class Timer
+	{
+		friend class TimingWheel;
+	private:
+		Timer *_prev;
+		Timer *_next;
+		uint64_t _expiry;
+	public:
+		std::function<void()> callback; // Called by Advance when the timer expires.
+
+		Timer() : _prev(nullptr), _next(nullptr), _expiry(0) {}
+		Timer(const Timer&) = delete;
+
+		// Returns true if the timer is scheduled and hasn't expired yet.
+		bool IsScheduled() const { return _prev != nullptr; }
+	};
+
+private:
+	const static size_t LevelCount = 4;
+	const static size_t SlotBits = 8;
+	const static size_t SlotCount = 1 << SlotBits;
+
+	// A circular list of timers. The head is a dummy timer, so that linking and unlinking need no special cases.
+	struct Slot
+	{
+		Timer head;
+		Slot() { head._prev = head._next = &head; }
+	};
+
+private:
+	Slot _slots[LevelCount][SlotCount];
+	Slot _overflow; // Timers that are too far in the future for the top level.
+	uint64_t _now; // The last tick Advance has processed.
+	size_t _count;
+
+private:
+	void _Insert(Timer *timer);
+	void _Cascade(Slot &slot);
+	static void _Link(Slot &slot, Timer *timer);
+	static void _Unlink(Timer *timer);
+
+public:
+	explicit TimingWheel(uint64_t now = 0);
+	TimingWheel(const TimingWheel&) = delete;
+	~TimingWheel(); // Cancels all timers.
+
+	// Schedules timer to expire at tick expiry. If timer is already scheduled, reschedules it. If expiry has already passed, the timer expires on the next tick.
+	void Schedule(Timer *timer, uint64_t expiry);
+
+	// Cancels timer. Does nothing if timer is not scheduled.
+	void Cancel(Timer *timer);
+
+	// Moves time forward to now, calling the callbacks of the timers that expire on the way, in order of expiry.
+	// Callbacks may schedule and cancel timers, including their own. Returns the number of callbacks called.
+	size_t Advance(uint64_t now);
+
+	// Same as Advance, but instead of calling the callback of the next timer to expire, unschedules the timer and returns it.
+	// Returns nullptr once time has reached now. Lets the caller decide how to call the callback, e.g. without holding a lock.
+	Timer *PopExpired(uint64_t now);
+
+	// Returns a tick at or before the earliest expiry, to be used as a wake-up time. Returns UINT64_MAX if no timer is scheduled.
+	uint64_t NextWakeup() const;
+
+	uint64_t Now() const { return _now; }
+	size_t Count() const { return _count; }
+};
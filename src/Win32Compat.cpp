@@ -0,0 +1,342 @@
+#ifndef _WIN32
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <utility>
+#include <new>
+
+#include "Win32Compat.h"
+
+namespace
+{
+	// A thread blocked in WaitForMultipleObjects. It is linked into every object it waits on, and woken by whichever of them gets signaled first.
+	struct WaitBlock
+	{
+		std::mutex lock;
+		std::condition_variable woken;
+		bool signaled;
+	};
+
+	struct WaitLink
+	{
+		WaitBlock *block;
+		WaitLink *prev;
+		WaitLink *next;
+	};
+
+	// Every mutex and event has a lock and condition variable of its own, so that signaling it only wakes up the threads waiting on it.
+	struct CompatObject
+	{
+		std::mutex lock;
+		std::condition_variable signaled; // Wakes up threads in WaitForSingleObject.
+		WaitLink *waiters; // Threads in WaitForMultipleObjects.
+		bool isMutex;
+		bool manualReset;
+		bool isSignaled; // Only meaningful for events.
+		std::thread::id owner; // Only meaningful for mutexes.
+		unsigned recursionCount; // Only meaningful for mutexes.
+	};
+
+	bool IsAvailable(const CompatObject *object)
+	{
+		if (object->isMutex)
+			return (object->recursionCount == 0) || (object->owner == std::this_thread::get_id());
+		else
+			return object->isSignaled;
+	}
+
+	void Acquire(CompatObject *object)
+	{
+		if (object->isMutex)
+		{
+			object->owner = std::this_thread::get_id();
+			object->recursionCount++;
+		}
+		else if (object->manualReset == false)
+			object->isSignaled = false;
+	}
+
+	// Wakes up the threads waiting on object. Called with object->lock held.
+	// Only one thread can take a released mutex or an auto-reset event, so only one thread in WaitForSingleObject is woken up for those.
+	void Signal(CompatObject *object)
+	{
+		if (object->isMutex || object->manualReset == false)
+			object->signaled.notify_one();
+		else
+			object->signaled.notify_all();
+		for (WaitLink *link = object->waiters; link != nullptr; link = link->next)
+		{
+			std::lock_guard<std::mutex> lock(link->block->lock);
+			link->block->signaled = true;
+			link->block->woken.notify_one();
+		}
+	}
+
+	void Unlink(CompatObject *object, WaitLink *link)
+	{
+		std::lock_guard<std::mutex> lock(object->lock);
+		if (link->prev != nullptr)
+			link->prev->next = link->next;
+		else
+			object->waiters = link->next;
+		if (link->next != nullptr)
+			link->next->prev = link->prev;
+	}
+
+	// A process-wide pool of worker threads backing the thread pool work objects.
+	// Like the Windows thread pool, it spawns a new thread whenever work is submitted while all threads are busy.
+	class CompatThreadPool
+	{
+	private:
+		const static size_t MaxThreadCount = 256;
+	private:
+		std::mutex _lock;
+		std::condition_variable _workAvailable;
+		std::deque<PTP_WORK> _q;
+		size_t _threadCount;
+		size_t _idleThreadCount;
+	private:
+		void _WorkerThread();
+	public:
+		CompatThreadPool() :
+			_threadCount(0),
+			_idleThreadCount(0)
+		{
+		}
+		void Submit(PTP_WORK work);
+		void Close(PTP_WORK work);
+	};
+
+	// The pool is never destroyed, so that its threads can safely outlive static destructors.
+	CompatThreadPool& ThreadPool()
+	{
+		static CompatThreadPool *pool = new CompatThreadPool();
+		return *pool;
+	}
+}
+
+struct _TP_WORK
+{
+	PTP_WORK_CALLBACK callback;
+	PVOID context;
+	size_t pendingCount;
+	bool closed;
+};
+
+void CompatThreadPool::_WorkerThread()
+{
+	std::unique_lock<std::mutex> lock(_lock);
+	for (;;)
+	{
+		_idleThreadCount++;
+		_workAvailable.wait(lock, [this]() { return _q.size() > 0; });
+		_idleThreadCount--;
+		PTP_WORK work = _q.front();
+		_q.pop_front();
+		lock.unlock();
+		work->callback(nullptr, work->context, work);
+		lock.lock();
+		work->pendingCount--;
+		if (work->closed && work->pendingCount == 0)
+			delete work;
+	}
+}
+
+void CompatThreadPool::Submit(PTP_WORK work)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	work->pendingCount++;
+	_q.push_back(work);
+	if (_idleThreadCount < _q.size() && _threadCount < MaxThreadCount)
+	{
+		std::thread(&CompatThreadPool::_WorkerThread, this).detach();
+		_threadCount++;
+	}
+	_workAvailable.notify_one();
+}
+
+void CompatThreadPool::Close(PTP_WORK work)
+{
+	std::lock_guard<std::mutex> lock(_lock);
+	work->closed = true;
+	if (work->pendingCount == 0)
+		delete work;
+}
+
+HANDLE CreateMutex(void * /*lpMutexAttributes*/, BOOL bInitialOwner, const char * /*lpName*/)
+{
+	CompatObject *object = new(std::nothrow) CompatObject();
+	if (object != nullptr)
+	{
+		object->waiters = nullptr;
+		object->isMutex = true;
+		object->manualReset = false;
+		object->isSignaled = false;
+		object->recursionCount = 0;
+		if (bInitialOwner)
+			Acquire(object);
+	}
+	return object;
+}
+
+HANDLE CreateEvent(void * /*lpEventAttributes*/, BOOL bManualReset, BOOL bInitialState, const char * /*lpName*/)
+{
+	CompatObject *object = new(std::nothrow) CompatObject();
+	if (object != nullptr)
+	{
+		object->waiters = nullptr;
+		object->isMutex = false;
+		object->manualReset = bManualReset != FALSE;
+		object->isSignaled = bInitialState != FALSE;
+		object->recursionCount = 0;
+	}
+	return object;
+}
+
+BOOL ReleaseMutex(HANDLE hMutex)
+{
+	CompatObject *object = (CompatObject*)hMutex;
+	if (object == nullptr || object->isMutex == false)
+		return FALSE;
+	std::lock_guard<std::mutex> lock(object->lock);
+	if (object->recursionCount == 0 || object->owner != std::this_thread::get_id())
+		return FALSE;
+	object->recursionCount--;
+	if (object->recursionCount == 0)
+	{
+		object->owner = std::thread::id();
+		Signal(object);
+	}
+	return TRUE;
+}
+
+BOOL SetEvent(HANDLE hEvent)
+{
+	CompatObject *object = (CompatObject*)hEvent;
+	if (object == nullptr || object->isMutex)
+		return FALSE;
+	std::lock_guard<std::mutex> lock(object->lock);
+	object->isSignaled = true;
+	Signal(object);
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE hEvent)
+{
+	CompatObject *object = (CompatObject*)hEvent;
+	if (object == nullptr || object->isMutex)
+		return FALSE;
+	std::lock_guard<std::mutex> lock(object->lock);
+	object->isSignaled = false;
+	return TRUE;
+}
+
+BOOL CloseHandle(HANDLE hObject)
+{
+	if (hObject == nullptr)
+		return FALSE;
+	delete (CompatObject*)hObject;
+	return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds)
+{
+	CompatObject *object = (CompatObject*)hHandle;
+	if (object == nullptr)
+		return WAIT_FAILED;
+
+	std::unique_lock<std::mutex> lock(object->lock);
+	if (dwMilliseconds == INFINITE)
+		object->signaled.wait(lock, [object]() { return IsAvailable(object); });
+	else if (object->signaled.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), [object]() { return IsAvailable(object); }) == false)
+		return WAIT_TIMEOUT;
+	Acquire(object);
+	return WAIT_OBJECT_0;
+}
+
+// Waiting for all of several objects at once is not supported, as nothing in this library needs it.
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAll, DWORD dwMilliseconds)
+{
+	if (nCount == 1)
+		return WaitForSingleObject(lpHandles[0], dwMilliseconds);
+	if (nCount == 0 || nCount > MAXIMUM_WAIT_OBJECTS || bWaitAll)
+		return WAIT_FAILED;
+	for (DWORD i = 0; i < nCount; i++)
+		if (lpHandles[i] == nullptr)
+			return WAIT_FAILED;
+
+	const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMilliseconds);
+	WaitBlock block;
+	WaitLink links[MAXIMUM_WAIT_OBJECTS];
+	for (;;)
+	{
+		// Links the block into each object and checks the object under the same lock, so that a signal can't be missed between the check and the wait.
+		block.signaled = false;
+		for (DWORD i = 0; i < nCount; i++)
+		{
+			CompatObject *object = (CompatObject*)lpHandles[i];
+			std::unique_lock<std::mutex> lock(object->lock);
+			if (IsAvailable(object))
+			{
+				Acquire(object);
+				lock.unlock();
+				for (DWORD j = 0; j < i; j++)
+					Unlink((CompatObject*)lpHandles[j], &links[j]);
+				return WAIT_OBJECT_0 + i;
+			}
+			links[i].block = &block;
+			links[i].prev = nullptr;
+			links[i].next = object->waiters;
+			if (object->waiters != nullptr)
+				object->waiters->prev = &links[i];
+			object->waiters = &links[i];
+		}
+
+		bool timedOut = false;
+		{
+			std::unique_lock<std::mutex> lock(block.lock);
+			if (dwMilliseconds == INFINITE)
+				block.woken.wait(lock, [&block]() { return block.signaled; });
+			else
+				timedOut = block.woken.wait_until(lock, deadline, [&block]() { return block.signaled; }) == false;
+		}
+		for (DWORD i = 0; i < nCount; i++)
+			Unlink((CompatObject*)lpHandles[i], &links[i]);
+		if (timedOut)
+			return WAIT_TIMEOUT;
+	}
+}
+
+VOID Sleep(DWORD dwMilliseconds)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(dwMilliseconds));
+}
+
+PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLBACK_ENVIRON /*pcbe*/)
+{
+	PTP_WORK work = new(std::nothrow) _TP_WORK();
+	if (work != nullptr)
+	{
+		work->callback = pfnwk;
+		work->context = pv;
+		work->pendingCount = 0;
+		work->closed = false;
+	}
+	return work;
+}
+
+VOID SubmitThreadpoolWork(PTP_WORK pwk)
+{
+	ThreadPool().Submit(pwk);
+}
+
+VOID CloseThreadpoolWork(PTP_WORK pwk)
+{
+	if (pwk != nullptr)
+		ThreadPool().Close(pwk);
+}
+
+#endif
@@ -0,0 +1,108 @@
+#pragma once
+
+// CWebSocket is written against the Win32 API. On Windows, this header simply pulls in the system headers.
+// On other platforms, it provides the subset of the Win32 types, WinHttp websocket definitions and synchronization functions CWebSocket uses,
+// so that the rest of the library can stay platform-agnostic.
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <WinHttp.h>
+
+#else
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t BYTE;
+typedef uint16_t USHORT;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef int BOOL;
+typedef BYTE BOOLEAN;
+typedef int32_t HRESULT;
+typedef uintptr_t DWORD_PTR;
+typedef void VOID;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef void *HANDLE;
+typedef wchar_t WCHAR;
+typedef WCHAR *PWSTR;
+typedef WCHAR *LPWSTR;
+typedef const WCHAR *PCWSTR;
+typedef const WCHAR *LPCWSTR;
+typedef USHORT INTERNET_PORT;
+
+#define CALLBACK
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xFFFFFFFF
+#define MAXDWORD 0xFFFFFFFF
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define ERROR_SUCCESS 0
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+#define WAIT_OBJECT_0 0x00000000
+#define WAIT_ABANDONED_0 0x00000080
+#define WAIT_TIMEOUT 0x00000102
+#define WAIT_FAILED 0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS 64
+
+typedef enum _WINHTTP_WEB_SOCKET_BUFFER_TYPE
+{
+	WINHTTP_WEB_SOCKET_BINARY_MESSAGE_BUFFER_TYPE = 0,
+	WINHTTP_WEB_SOCKET_BINARY_FRAGMENT_BUFFER_TYPE = 1,
+	WINHTTP_WEB_SOCKET_UTF8_MESSAGE_BUFFER_TYPE = 2,
+	WINHTTP_WEB_SOCKET_UTF8_FRAGMENT_BUFFER_TYPE = 3,
+	WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE = 4
+} WINHTTP_WEB_SOCKET_BUFFER_TYPE;
+
+typedef enum _WINHTTP_WEB_SOCKET_CLOSE_STATUS
+{
+	WINHTTP_WEB_SOCKET_SUCCESS_CLOSE_STATUS = 1000,
+	WINHTTP_WEB_SOCKET_ENDPOINT_TERMINATED_CLOSE_STATUS = 1001,
+	WINHTTP_WEB_SOCKET_PROTOCOL_ERROR_CLOSE_STATUS = 1002,
+	WINHTTP_WEB_SOCKET_INVALID_DATA_TYPE_CLOSE_STATUS = 1003,
+	WINHTTP_WEB_SOCKET_EMPTY_CLOSE_STATUS = 1005,
+	WINHTTP_WEB_SOCKET_ABORTED_CLOSE_STATUS = 1006,
+	WINHTTP_WEB_SOCKET_INVALID_PAYLOAD_CLOSE_STATUS = 1007,
+	WINHTTP_WEB_SOCKET_POLICY_VIOLATION_CLOSE_STATUS = 1008,
+	WINHTTP_WEB_SOCKET_MESSAGE_TOO_BIG_CLOSE_STATUS = 1009,
+	WINHTTP_WEB_SOCKET_UNSUPPORTED_EXTENSIONS_CLOSE_STATUS = 1010,
+	WINHTTP_WEB_SOCKET_SERVER_ERROR_CLOSE_STATUS = 1011,
+	WINHTTP_WEB_SOCKET_SECURE_HANDSHAKE_ERROR_CLOSE_STATUS = 1015
+} WINHTTP_WEB_SOCKET_CLOSE_STATUS;
+
+typedef struct _WINHTTP_WEB_SOCKET_STATUS
+{
+	DWORD dwBytesTransferred;
+	WINHTTP_WEB_SOCKET_BUFFER_TYPE eBufferType;
+} WINHTTP_WEB_SOCKET_STATUS;
+
+// Mutexes and events.
+// Mutexes are recursive and events are either manual-reset or auto-reset, just like their Win32 counterparts.
+// The security attribute and name parameters are ignored; pass NULL.
+// WaitForMultipleObjects only supports bWaitAll == TRUE for a single object, and fails with WAIT_FAILED otherwise.
+HANDLE CreateMutex(void *lpMutexAttributes, BOOL bInitialOwner, const char *lpName);
+HANDLE CreateEvent(void *lpEventAttributes, BOOL bManualReset, BOOL bInitialState, const char *lpName);
+BOOL ReleaseMutex(HANDLE hMutex);
+BOOL SetEvent(HANDLE hEvent);
+BOOL ResetEvent(HANDLE hEvent);
+BOOL CloseHandle(HANDLE hObject);
+DWORD WaitForSingleObject(HANDLE hHandle, DWORD dwMilliseconds);
+DWORD WaitForMultipleObjects(DWORD nCount, const HANDLE *lpHandles, BOOL bWaitAll, DWORD dwMilliseconds);
+VOID Sleep(DWORD dwMilliseconds);
+
+// Thread pool work objects.
+// Every call to SubmitThreadpoolWork causes the callback to be called once, from one of the threads of a process-wide pool.
+typedef struct _TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_WORK *PTP_WORK;
+typedef struct _TP_CALLBACK_ENVIRON *PTP_CALLBACK_ENVIRON;
+typedef VOID (CALLBACK *PTP_WORK_CALLBACK)(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PTP_WORK Work);
+PTP_WORK CreateThreadpoolWork(PTP_WORK_CALLBACK pfnwk, PVOID pv, PTP_CALLBACK_ENVIRON pcbe);
+VOID SubmitThreadpoolWork(PTP_WORK pwk);
+VOID CloseThreadpoolWork(PTP_WORK pwk);
+
+#endif